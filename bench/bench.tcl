@@ -0,0 +1,162 @@
+# bench.tcl --
+#
+#	End to end benchmark of the compiler: generates the synthetic corpora
+#	of corpus.tcl, compiles each of them a few times with compiler::compile
+#	and reports, for the best run, the throughput in MB/s of source and
+#	in procedures per second, the size of the output and the peak memory
+#	use reported by compiler::stats. The compiled files are then loaded
+#	with compiler::decode, the reference decoder, for the load time and
+#	throughput of the output.
+#
+#	Usage (normally through "make bench", with BENCHFLAGS):
+#
+#	  tclsh bench.tcl ?-procs counts? ?-scale n? ?-repeat n? ?-dir dir?
+#	                  ?-keep? ?-save file? ?-compare file?
+#
+#	-save writes the results to a file, and -compare reads such a file
+#	and adds the ratio of each time to the saved one, so that two commits
+#	can be compared on the same machine.
+#
+# Released under the BSD-3 license. See LICENSE file for details.
+
+package require Tcl 8.6
+package require tclcompiler
+
+source [file join [file dirname [info script]] corpus.tcl]
+
+namespace eval ::bench {
+    variable options [dict create \
+            -procs {10 1000 50000} \
+            -scale 1 \
+            -repeat 3 \
+            -dir bench-corpus \
+            -keep 0 \
+            -save {} \
+            -compare {}]
+}
+
+# bench::ParseOptions --
+#
+#	Parses the command line into the options dict.
+
+proc ::bench::ParseOptions {argv} {
+    variable options
+    while {[llength $argv]} {
+        set argv [lassign $argv option]
+        if {![dict exists $options $option]} {
+            return -code error "unknown option \"$option\": must be\
+                    [join [dict keys $options] {, }]"
+        }
+        if {$option eq "-keep"} {
+            dict set options -keep 1
+            continue
+        }
+        if {![llength $argv]} {
+            return -code error "missing value for $option"
+        }
+        set argv [lassign $argv value]
+        dict set options $option $value
+    }
+}
+
+# bench::Measure --
+#
+#	Compiles a file repeat times.
+#
+# Results:
+#	A dict with the best time in microseconds and the size of the input,
+#	of the output, the number of procedures, the peak memory use and the
+#	best time to decode the output.
+
+proc ::bench::Measure {inFile outFile repeat} {
+    set best {}
+    for {set i 0} {$i < $repeat} {incr i} {
+        compiler::stats -reset
+        set start [clock microseconds]
+        compiler::compile $inFile $outFile
+        set time [expr {[clock microseconds] - $start}]
+        if {$best eq {} || $time < $best} {
+            set best $time
+        }
+        set stats [compiler::stats -top 1]
+    }
+    return [dict create \
+            time [expr {max($best, 1)}] \
+            inBytes [file size $inFile] \
+            outBytes [file size $outFile] \
+            procs [dict get $stats procs] \
+            peak [dict get $stats memory peak] \
+            loadTime [expr {max([dict get \
+                    [compiler::decode -repeat $repeat $outFile] time], 1)}]]
+}
+
+# bench::Main --
+#
+#	Generates the corpora, measures them and prints one row per corpus.
+
+proc ::bench::Main {argv} {
+    variable options
+    ParseOptions $argv
+    set dir [file normalize [dict get $options -dir]]
+    set scale [dict get $options -scale]
+
+    set baseline {}
+    if {[dict get $options -compare] ne {}} {
+        set f [open [dict get $options -compare]]
+        set baseline [read $f]
+        close $f
+    }
+
+    set corpora [corpus::generate $dir [dict get $options -procs] $scale]
+
+    set format "%-12s %9s %9s %8s %10s %9s %9s %9s %9s"
+    set header [format $format corpus "in KB" "time ms" MB/s procs/s \
+            "out KB" "peak KB" "load ms" "load MB/s"]
+    if {$baseline ne {}} {
+        append format " %7s"
+        append header [format " %7s" ratio]
+    }
+    puts $header
+    puts [string repeat - [string length $header]]
+
+    set results [dict create]
+    dict for {name file} $corpora {
+        set r [Measure $file [file rootname $file].tbc \
+                [dict get $options -repeat]]
+        dict set results $name $r
+        set time [dict get $r time]
+        set row [list $name \
+                [expr {[dict get $r inBytes] / 1024}] \
+                [format %.1f [expr {$time / 1000.0}]] \
+                [format %.2f [expr {[dict get $r inBytes] / double($time)}]] \
+                [expr {round([dict get $r procs] * 1e6 / $time)}] \
+                [expr {[dict get $r outBytes] / 1024}] \
+                [expr {[dict get $r peak] / 1024}] \
+                [format %.1f [expr {[dict get $r loadTime] / 1000.0}]] \
+                [format %.2f [expr {[dict get $r outBytes] \
+                        / double([dict get $r loadTime])}]]]
+        if {$baseline ne {}} {
+            if {[dict exists $baseline $name time]} {
+                lappend row [format %.2f \
+                        [expr {$time / double([dict get $baseline $name time])}]]
+            } else {
+                lappend row -
+            }
+        }
+        puts [format $format {*}$row]
+    }
+
+    if {[dict get $options -save] ne {}} {
+        set f [open [dict get $options -save] w]
+        puts $f $results
+        close $f
+    }
+    if {![dict get $options -keep]} {
+        file delete -force $dir
+    }
+}
+
+if {[catch {::bench::Main $argv} message]} {
+    puts stderr $message
+    exit 1
+}
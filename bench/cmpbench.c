@@ -0,0 +1,417 @@
+/*
+ * cmpbench.c --
+ *
+ *  Microbenchmarks of the encoders and emitters of the compiler.
+ *  The file includes cmpWrite.c so that its static procedures can be
+ *  timed directly, without going through compiler::compile and the noise
+ *  of Tcl level timing. The output channel is the null device, so that
+ *  only the encoding and the channel buffering are measured.
+ *
+ *  Usage: cmpbench ?-seed n? ?-time ms? ?pattern?
+ *  Only the benchmarks whose name matches the glob pattern are run; each
+ *  one is repeated until it has run for at least the -time budget, and
+ *  reports the cost per call and per input byte.
+ *
+ *  Released under the BSD-3 license. See LICENSE file for details.
+ */
+
+#include "cmpWrite.c"
+
+#ifdef _WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+/*
+ * The state shared by all benchmarks: the interp, the output channel and
+ * the inputs, generated once from the seed.
+ */
+
+#define BENCH_NUM_SIZES 3
+#define BENCH_NUM_VALUES 1024
+#define BENCH_NUM_LITERALS 1024
+#define BENCH_NUM_COMMANDS 4096
+
+typedef struct BenchState
+{
+    Tcl_Interp* interp;
+    Tcl_Channel chan;
+    unsigned int seed;             /* state of the pseudo random generator */
+    Tcl_WideInt minTime;           /* minimum run time of each benchmark, in microseconds */
+    unsigned char* bytesPtr;       /* random bytes, for the encoders */
+    Tcl_Size values[BENCH_NUM_VALUES]; /* integers of mixed magnitudes */
+    Tcl_Size valueBytes;           /* total length of their decimal representations */
+    Tcl_Obj* literals[BENCH_NUM_LITERALS]; /* mix of literal types */
+    Tcl_Size literalBytes;         /* total length of the literals' strings */
+    unsigned char* locPtr;         /* a location array of BENCH_NUM_COMMANDS entries */
+    Tcl_Size locBytes;             /* its length in bytes */
+} BenchState;
+
+typedef int(BenchProc)(BenchState* statePtr, Tcl_Size size);
+
+typedef struct Benchmark
+{
+    const char* name;
+    BenchProc* proc;
+    Tcl_Size sizes[BENCH_NUM_SIZES]; /* input sizes, in bytes; 0 ends the list */
+} Benchmark;
+
+static int BenchA85Encode(BenchState* statePtr, Tcl_Size size);
+static int BenchEmitByteSequence(BenchState* statePtr, Tcl_Size size);
+static int BenchEmitObject(BenchState* statePtr, Tcl_Size size);
+static int BenchEmitTclSize(BenchState* statePtr, Tcl_Size size);
+static int BenchLocArrayLength(BenchState* statePtr, Tcl_Size size);
+static void InitInputs(BenchState* statePtr);
+static unsigned int NextRandom(BenchState* statePtr);
+static int RunBenchmark(BenchState* statePtr, const Benchmark* benchPtr, Tcl_Size size);
+
+/*
+ * The benchmarks. The sizes of EmitTclSize, EmitObject and
+ * CalculateLocArrayLength are numbers of calls per iteration; their
+ * per-byte cost is computed from the digits written, the bytes of the
+ * literals' strings and the bytes of the location array, respectively.
+ */
+
+static const Benchmark benchmarks[] = {{"A85EncodeBytes", BenchA85Encode, {16, 256, 65536}},
+                                       {"EmitByteSequence", BenchEmitByteSequence, {16, 256, 65536}},
+                                       {"EmitTclSize", BenchEmitTclSize, {BENCH_NUM_VALUES, 0, 0}},
+                                       {"EmitObject", BenchEmitObject, {BENCH_NUM_LITERALS, 0, 0}},
+                                       {"CalculateLocArrayLength", BenchLocArrayLength, {1, 0, 0}},
+                                       {NULL, NULL, {0, 0, 0}}};
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * NextRandom --
+ *
+ *  A xorshift generator, so that the inputs only depend on the seed.
+ *
+ * Results:
+ *  Returns the next pseudo random number.
+ *
+ * Side effects:
+ *  Updates the seed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned int NextRandom(BenchState* statePtr)
+{
+    unsigned int x = statePtr->seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    statePtr->seed = x;
+    return x;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InitInputs --
+ *
+ *  Generates the inputs of the benchmarks: random bytes, integers of
+ *  every magnitude, literals that are one quarter each integers, doubles,
+ *  strings and lists, and a location array where one entry in eight
+ *  takes 5 bytes.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Allocates the inputs, freed in main.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void InitInputs(BenchState* statePtr)
+{
+    char buf[64];
+    Tcl_Size i, j, length;
+    unsigned char* p;
+
+    statePtr->bytesPtr = (unsigned char*)Tcl_Alloc(65536);
+    for (i = 0; i < 65536; i++)
+    {
+        statePtr->bytesPtr[i] = (unsigned char)NextRandom(statePtr);
+    }
+
+    statePtr->valueBytes = 0;
+    for (i = 0; i < BENCH_NUM_VALUES; i++)
+    {
+        statePtr->values[i] = (Tcl_Size)(NextRandom(statePtr) >> (NextRandom(statePtr) % 31));
+        statePtr->valueBytes += snprintf(buf, sizeof(buf), "%" TCL_SIZE_MODIFIER "d", statePtr->values[i]);
+    }
+
+    statePtr->literalBytes = 0;
+    for (i = 0; i < BENCH_NUM_LITERALS; i++)
+    {
+        switch (i % 4)
+        {
+            case 0:
+                statePtr->literals[i] = Tcl_NewIntObj((int)(NextRandom(statePtr) >> (i % 31)));
+                break;
+            case 1:
+                statePtr->literals[i] = Tcl_NewDoubleObj(NextRandom(statePtr) / 7.0);
+                break;
+            case 2:
+                length = 1 + NextRandom(statePtr) % 40;
+                for (j = 0; j < length; j++)
+                {
+                    buf[j] = 'a' + NextRandom(statePtr) % 26;
+                }
+                statePtr->literals[i] = Tcl_NewStringObj(buf, length);
+                break;
+            default:
+                statePtr->literals[i] = Tcl_NewListObj(0, NULL);
+                length = 1 + NextRandom(statePtr) % 8;
+                for (j = 0; j < length; j++)
+                {
+                    Tcl_ListObjAppendElement(NULL, statePtr->literals[i], Tcl_NewIntObj((int)NextRandom(statePtr)));
+                }
+                break;
+        }
+        Tcl_IncrRefCount(statePtr->literals[i]);
+        Tcl_GetStringFromObj(statePtr->literals[i], &length);
+        statePtr->literalBytes += length;
+    }
+
+    statePtr->locPtr = p = (unsigned char*)Tcl_Alloc(5 * BENCH_NUM_COMMANDS);
+    for (i = 0; i < BENCH_NUM_COMMANDS; i++)
+    {
+        if (NextRandom(statePtr) % 8 == 0)
+        {
+            *p++ = 0xff;
+            TclStoreInt4AtPtr(NextRandom(statePtr), p);
+            p += 4;
+        }
+        else
+        {
+            *p++ = (unsigned char)(NextRandom(statePtr) % 0xff);
+        }
+    }
+    statePtr->locBytes = p - statePtr->locPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BenchA85Encode, BenchEmitByteSequence, BenchEmitTclSize,
+ * BenchEmitObject, BenchLocArrayLength --
+ *
+ *  One iteration of each benchmark over an input of the given size.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *
+ * Side effects:
+ *  Writes to the null device.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int BenchA85Encode(BenchState* statePtr, Tcl_Size size)
+{
+    A85EncodeContext encodeCtx;
+    Tcl_Size i;
+
+    A85InitEncodeContext(statePtr->chan, '\n', &encodeCtx);
+    for (i = 0; i < size; i += 4)
+    {
+        if (A85EncodeBytes(statePtr->interp, statePtr->bytesPtr + i, 4, &encodeCtx) != TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+    }
+    return A85Flush(statePtr->interp, &encodeCtx);
+}
+
+static int BenchEmitByteSequence(BenchState* statePtr, Tcl_Size size)
+{
+    return EmitByteSequence(statePtr->interp, statePtr->bytesPtr, size, statePtr->chan);
+}
+
+static int BenchEmitTclSize(BenchState* statePtr, Tcl_Size size)
+{
+    Tcl_Size i;
+
+    for (i = 0; i < size; i++)
+    {
+        if (EmitTclSize(statePtr->interp, statePtr->values[i], ' ', statePtr->chan) != TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+    }
+    return TCL_OK;
+}
+
+static int BenchEmitObject(BenchState* statePtr, Tcl_Size size)
+{
+    Tcl_Size i;
+
+    for (i = 0; i < size; i++)
+    {
+        if (EmitObject(statePtr->interp, statePtr->literals[i], statePtr->chan) != TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+    }
+    return TCL_OK;
+}
+
+static int BenchLocArrayLength(BenchState* statePtr, Tcl_Size size)
+{
+    (void)size;
+
+    if (CalculateLocArrayLength(statePtr->locPtr, BENCH_NUM_COMMANDS) != statePtr->locBytes)
+    {
+        Tcl_SetObjResult(statePtr->interp, Tcl_NewStringObj("wrong location array length", -1));
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RunBenchmark --
+ *
+ *  Runs a benchmark until the minimum time has elapsed, doubling the
+ *  number of iterations between checks of the clock, and prints its
+ *  cost per call and per input byte.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *
+ * Side effects:
+ *  Writes a line to stdout.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int RunBenchmark(BenchState* statePtr, const Benchmark* benchPtr, Tcl_Size size)
+{
+    Tcl_Time start, now;
+    Tcl_WideInt elapsed, iterations = 0, batch = 1, calls, bytes;
+    Tcl_Size i;
+
+    Tcl_GetTime(&start);
+    do
+    {
+        for (i = 0; i < batch; i++)
+        {
+            if (benchPtr->proc(statePtr, size) != TCL_OK)
+            {
+                return TCL_ERROR;
+            }
+        }
+        iterations += batch;
+        batch *= 2;
+        Tcl_GetTime(&now);
+        elapsed = ((Tcl_WideInt)(now.sec - start.sec)) * 1000000 + (now.usec - start.usec);
+    } while (elapsed < statePtr->minTime);
+
+    if (benchPtr->proc == BenchEmitTclSize)
+    {
+        calls = iterations * size;
+        bytes = iterations * statePtr->valueBytes;
+    }
+    else if (benchPtr->proc == BenchEmitObject)
+    {
+        calls = iterations * size;
+        bytes = iterations * statePtr->literalBytes;
+    }
+    else if (benchPtr->proc == BenchLocArrayLength)
+    {
+        calls = iterations;
+        bytes = iterations * statePtr->locBytes;
+    }
+    else
+    {
+        calls = (benchPtr->proc == BenchA85Encode) ? iterations * ((size + 3) / 4) : iterations;
+        bytes = iterations * size;
+    }
+
+    printf("%-24s %8ld %12" TCL_LL_MODIFIER "d %10.2f %8.3f\n",
+           benchPtr->name,
+           (long)size,
+           iterations,
+           elapsed * 1000.0 / calls,
+           elapsed * 1000.0 / bytes);
+    return TCL_OK;
+}
+
+int main(int argc, char** argv)
+{
+    BenchState state;
+    const Benchmark* benchPtr;
+    const char* pattern = "*";
+    int i, result = TCL_OK;
+
+    state.seed = 2463534242U;
+    state.minTime = 200000;
+    for (i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-seed") == 0) && (i + 1 < argc))
+        {
+            state.seed = (unsigned int)strtoul(argv[++i], NULL, 0);
+            if (state.seed == 0)
+            {
+                state.seed = 1;
+            }
+        }
+        else if ((strcmp(argv[i], "-time") == 0) && (i + 1 < argc))
+        {
+            state.minTime = 1000 * (Tcl_WideInt)strtol(argv[++i], NULL, 0);
+        }
+        else if ((argv[i][0] != '-') && (i + 1 == argc))
+        {
+            pattern = argv[i];
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s ?-seed n? ?-time ms? ?pattern?\n", argv[0]);
+            return 1;
+        }
+    }
+
+    Tcl_FindExecutable(argv[0]);
+    state.interp = Tcl_CreateInterp();
+    CompilerInit(state.interp);
+    state.chan = Tcl_OpenFileChannel(state.interp, NULL_DEVICE, "w", 0644);
+    if (!state.chan)
+    {
+        fprintf(stderr, "%s\n", Tcl_GetStringResult(state.interp));
+        return 1;
+    }
+    InitInputs(&state);
+
+    printf("%-24s %8s %12s %10s %8s\n", "benchmark", "size", "iterations", "ns/call", "ns/byte");
+    for (benchPtr = &benchmarks[0]; (result == TCL_OK) && benchPtr->name; benchPtr++)
+    {
+        if (!Tcl_StringMatch(benchPtr->name, pattern))
+        {
+            continue;
+        }
+        for (i = 0; (result == TCL_OK) && (i < BENCH_NUM_SIZES) && benchPtr->sizes[i]; i++)
+        {
+            result = RunBenchmark(&state, benchPtr, benchPtr->sizes[i]);
+        }
+    }
+    if (result != TCL_OK)
+    {
+        fprintf(stderr, "%s\n", Tcl_GetStringResult(state.interp));
+    }
+
+    Tcl_Close(NULL, state.chan);
+    for (i = 0; i < BENCH_NUM_LITERALS; i++)
+    {
+        Tcl_DecrRefCount(state.literals[i]);
+    }
+    Tcl_Free((char*)state.bytesPtr);
+    Tcl_Free((char*)state.locPtr);
+    Tcl_DeleteInterp(state.interp);
+    return (result == TCL_OK) ? 0 : 1;
+}
@@ -0,0 +1,389 @@
+# corpus.tcl --
+#
+#	Generator of synthetic Tcl scripts for the compiler benchmarks (see
+#	bench.tcl). Each corpus stresses one part of the compiler:
+#
+#	  procs-N   N ordinary procedures, for each requested N
+#	  literals  procedures with large string, list and dict literals
+#	  nesting   deeply nested control structures and expressions
+#	  dispatch  heavy switch, dict and foreach usage
+#	  manylits  more than 255 literals, both in the top level script and
+#	            in procedure bodies, so that UpdateByteCodes has to widen
+#	            one byte push instructions
+#
+#	corpus::application writes a different kind of corpus, an application
+#	tree of interdependent packages, for the startup benchmark (see
+#	startup.tcl).
+#
+#	The scripts are deterministic, so that the results of two commits can
+#	be compared. Standalone usage:
+#
+#	  tclsh corpus.tcl outputDir ?procCounts? ?scale?
+#
+# Released under the BSD-3 license. See LICENSE file for details.
+
+namespace eval ::corpus {
+    namespace export generate
+}
+
+# corpus::generate --
+#
+#	Writes the corpora to a directory.
+#
+# Arguments:
+#	dir		Output directory, created if needed.
+#	procCounts	List of the numbers of procedures of the "procs"
+#			corpora.
+#	scale		Size factor of the other corpora.
+#
+# Results:
+#	A dict mapping corpus names to the files written.
+
+proc ::corpus::generate {dir procCounts {scale 1}} {
+    file mkdir $dir
+    set files [dict create]
+    set corpora {}
+    foreach numProcs $procCounts {
+        lappend corpora procs-$numProcs [Procs $numProcs]
+    }
+    foreach {name script} [list {*}$corpora \
+            literals [Literals [expr {20 * $scale}]] \
+            nesting [Nesting [expr {20 * $scale}] 40] \
+            dispatch [Dispatch [expr {20 * $scale}] 200] \
+            manylits [ManyLiterals [expr {10 * $scale}] 400]] {
+        set file [file join $dir $name.tcl]
+        set f [open $file w]
+        fconfigure $f -translation lf
+        puts -nonewline $f $script
+        close $f
+        dict set files $name $file
+    }
+    return $files
+}
+
+# corpus::Procs --
+#
+#	N procedures of a typical size, in a handful of namespaces.
+
+proc ::corpus::Procs {n} {
+    set script ""
+    for {set i 0} {$i < $n} {incr i} {
+        set ns [expr {$i % 16}]
+        append script [string map [list @NS@ $ns @I@ $i] {
+namespace eval ::bench::ns@NS@ {}
+proc ::bench::ns@NS@::p@I@ {a b {c 0}} {
+    set r [expr {$a * @I@ + $b}]
+    if {$c > 0} {
+        incr r $c
+    } elseif {$r < 0} {
+        set r [expr {-$r}]
+    }
+    set l {}
+    foreach x [list $a $b $c] {
+        lappend l [string length $x] [string toupper $x]
+    }
+    return [list $r [join $l ,] key@I@]
+}
+}]
+    }
+    return $script
+}
+
+# corpus::Literals --
+#
+#	Procedures with large literals: a long string, a long list and a
+#	dict.
+
+proc ::corpus::Literals {n} {
+    set script "namespace eval ::bench {}\n"
+    for {set i 0} {$i < $n} {incr i} {
+        set text [string repeat "line $i of a long literal string; " 2000]
+        set list {}
+        set dict {}
+        for {set j 0} {$j < 2000} {incr j} {
+            lappend list item$i.$j
+            if {$j < 500} {
+                lappend dict key$j [list value $i $j]
+            }
+        }
+        append script "proc ::bench::literal$i {} \{\n"
+        append script "    set text [list $text]\n"
+        append script "    set items [list $list]\n"
+        append script "    set map [list $dict]\n"
+        append script "    return \[list \[string length \$text\] \[llength \$items\] \[dict size \$map\]\]\n"
+        append script "\}\n"
+    }
+    return $script
+}
+
+# corpus::Nesting --
+#
+#	Procedures whose bodies nest control structures and expressions
+#	depth levels deep.
+
+proc ::corpus::Nesting {n depth} {
+    set script "namespace eval ::bench {}\n"
+    for {set i 0} {$i < $n} {incr i} {
+        set body "set r \[expr {[string repeat ( $depth]\$x[string repeat " + 1) * 2" $depth]}\]"
+        for {set d 0} {$d < $depth} {incr d} {
+            switch [expr {$d % 4}] {
+                0 { set body "if {\$x > $d} {\n$body\n} else {\nincr x\n}" }
+                1 { set body "foreach y$d \[list 1 2\] {\n$body\n}" }
+                2 { set body "while {\$x < [expr {$d + 1000}]} {\n$body\nbreak\n}" }
+                3 { set body "catch {\n$body\n}" }
+            }
+        }
+        append script "proc ::bench::nested$i {x} {\nset r 0\n$body\nreturn \$r\n}\n"
+    }
+    return $script
+}
+
+# corpus::Dispatch --
+#
+#	Procedures built around large switch statements, dict updates and
+#	multi-list foreach loops.
+
+proc ::corpus::Dispatch {n arms} {
+    set script "namespace eval ::bench {}\n"
+    for {set i 0} {$i < $n} {incr i} {
+        set cases ""
+        for {set j 0} {$j < $arms} {incr j} {
+            append cases "        op$j {\n"
+            append cases "            dict incr state count$j\n"
+            append cases "            dict lappend state log \[list $j \$arg\]\n"
+            append cases "        }\n"
+        }
+        append script "proc ::bench::dispatch$i {state op arg} {\n"
+        append script "    switch -exact -- \$op {\n$cases"
+        append script "        default { dict set state error \$op }\n"
+        append script "    }\n"
+        append script "    dict for {k v} \$state {\n"
+        append script "        dict with state {}\n"
+        append script "        dict update state \$k value { append value . }\n"
+        append script "    }\n"
+        append script "    foreach {a b} \[dict keys \$state\] c \[dict values \$state\] {\n"
+        append script "        lappend out \$a \$b \$c\n"
+        append script "    }\n"
+        append script "    return \$state\n"
+        append script "}\n"
+    }
+    return $script
+}
+
+# corpus::ManyLiterals --
+#
+#	A top level script with numLiterals distinct literals ahead of the
+#	procedure definitions, and procedures that use as many literals.
+
+proc ::corpus::ManyLiterals {n numLiterals} {
+    set script "namespace eval ::bench {}\n"
+    for {set j 0} {$j < $numLiterals} {incr j} {
+        append script "set ::bench::constant($j) \"top level literal $j\"\n"
+    }
+    for {set i 0} {$i < $n} {incr i} {
+        append script "proc ::bench::many$i {x} \{\n"
+        for {set j 0} {$j < $numLiterals} {incr j} {
+            append script "    lappend x \"body $i literal $j\"\n"
+        }
+        append script "    return \$x\n\}\n"
+    }
+    return $script
+}
+
+# corpus::application --
+#
+#	Writes an application made of packages that require each other, in
+#	the layout of an installed application:
+#
+#	  dir/start.tcl			launcher: extends auto_path, sources
+#					main$ext, prints the result of app::start
+#	  dir/main$ext			requires the packages, defines app::start
+#	  dir/lib/pkg/pkgIndex.tcl	package ifneeded pkg 1.0 ... pkg$ext
+#	  dir/lib/pkg/pkg$ext		package provide, namespace setup, requires
+#					the dependencies, sources its siblings
+#	  dir/lib/pkg/pkg-N$ext		more procedures
+#
+#	All the scripts are written with a .tcl extension, but refer to each
+#	other with ext, so that a tree written with ".tbc" can be compiled
+#	file by file into a tree that loads the compiled files.
+#
+# Arguments:
+#	dir		Output directory, created if needed.
+#	ext		Extension the scripts use to source each other.
+#	scale		Number of procedures per file, in units of 12.
+#	calls		Fraction of the procedures that app::start calls.
+#
+# Results:
+#	A dict mapping the paths of the scripts, relative to dir, to the files
+#	written.
+
+proc ::corpus::application {dir ext {scale 1} {calls 0.5}} {
+    set packages {
+        util {} 3
+        log {util} 1
+        config {util} 2
+        model {util} 4
+        store {model util log} 3
+        net {util log} 2
+        ui {model config log} 4
+    }
+    set perFile [expr {12 * $scale}]
+    set scripts [dict create]
+
+    foreach {pkg deps numFiles} $packages {
+        set numProcs [expr {$perFile * $numFiles}]
+        set called {}
+        for {set i 0} {$i < $numProcs} {incr i} {
+            if {int(($i + 1) * $calls) > int($i * $calls)} {
+                lappend called p$i
+            }
+        }
+
+        set index "package ifneeded $pkg 1.0 \[list source \[file join \$dir $pkg$ext\]\]\n"
+        dict set scripts lib/$pkg/pkgIndex.tcl $index
+
+        for {set f 0} {$f < $numFiles} {incr f} {
+            set script ""
+            if {$f == 0} {
+                foreach dep $deps {
+                    append script "package require $dep 1.0\n"
+                }
+                append script [string map [list @P@ $pkg @CALLED@ $called] {
+namespace eval ::@P@ {
+    namespace export {[a-z]*}
+    variable state [dict create calls 0]
+    variable defaults
+    array set defaults {
+        width 80 height 24 encoding utf-8 timeout 30000
+        retries 3 verbose 0 format text prefix @P@
+    }
+}
+
+proc ::@P@::init {} {
+    set n 0
+    foreach p {@CALLED@} {
+        incr n [string length [$p 1 2]]
+    }
+    return $n
+}
+}]
+            }
+            for {set j 0} {$j < $perFile} {incr j} {
+                set i [expr {$f * $perFile + $j}]
+                set call {}
+                if {[llength $deps] && $i % 4 == 1} {
+                    set dep [lindex $deps [expr {$i / 4 % [llength $deps]}]]
+                    set call "\n    incr n \[string length \[::$dep\::p[expr {$i % $perFile}] \$a \$b\]\]"
+                }
+                append script [string map [list @P@ $pkg @I@ $i @CALL@ $call] \
+                        [lindex [ApplicationBodies] [expr {$i % 3}]]]
+            }
+            if {$f == 0} {
+                for {set g 1} {$g < $numFiles} {incr g} {
+                    append script "source \[file join \[file dirname \[info script\]\] $pkg-$g$ext\]\n"
+                }
+                append script "package provide $pkg 1.0\n"
+                dict set scripts lib/$pkg/$pkg.tcl $script
+            } else {
+                dict set scripts lib/$pkg/$pkg-$f.tcl $script
+            }
+        }
+    }
+
+    set names [lmap {pkg deps numFiles} $packages {set pkg}]
+    set main ""
+    foreach pkg $names {
+        append main "package require $pkg 1.0\n"
+    }
+    append main [string map [list @PACKAGES@ $names] {
+namespace eval ::app {}
+
+proc ::app::start {} {
+    set n 0
+    foreach pkg {@PACKAGES@} {
+        incr n [::${pkg}::init]
+    }
+    return $n
+}
+}]
+    dict set scripts main.tcl $main
+    dict set scripts start.tcl [string map [list @EXT@ $ext] {
+set dir [file dirname [file normalize [info script]]]
+lappend auto_path [file join $dir lib]
+source [file join $dir main@EXT@]
+puts [app::start]
+}]
+
+    set files [dict create]
+    dict for {path script} $scripts {
+        set file [file join $dir $path]
+        file mkdir [file dirname $file]
+        set f [open $file w]
+        fconfigure $f -translation lf
+        puts -nonewline $f $script
+        close $f
+        dict set files $path $file
+    }
+    return $files
+}
+
+# corpus::ApplicationBodies --
+#
+#	The procedure templates of corpus::application: string handling, list
+#	and dict handling, and control flow.
+
+proc ::corpus::ApplicationBodies {} {
+    return {{
+proc ::@P@::p@I@ {a b {c 0}} {
+    variable state
+    variable defaults
+    set n 0
+    set s [format "%s-%s-%d-%s" $a $b @I@ $defaults(prefix)]
+    if {[string length $s] > $defaults(width)} {
+        set s [string range $s 0 [expr {$defaults(width) - 1}]]
+    }
+    set parts [split $s -]
+    dict incr state calls@CALL@
+    return [join [lreverse $parts] :]$n
+}
+} {
+proc ::@P@::p@I@ {a b {c 0}} {
+    set n 0
+    set d [dict create a $a b $b c $c index @I@]
+    set l {}
+    foreach k [lsort [dict keys $d]] {
+        lappend l $k [dict get $d $k]
+    }
+    set pairs [lsort -index 1 [lmap {k v} $l {list $k $v}]]@CALL@
+    return [list [llength $pairs] [lindex $pairs 0] $n]
+}
+} {
+proc ::@P@::p@I@ {a b {c 0}} {
+    set n 0
+    switch -glob -- $a {
+        1* { set r [expr {$b * 2 + @I@}] }
+        x* { set r [string repeat x $b] }
+        default { set r $a }
+    }
+    for {set i 0} {$i < 3} {incr i} {
+        if {$i % 2} {
+            append r .
+        } elseif {$c > $i} {
+            incr c -1
+        }
+    }@CALL@
+    return $r$n
+}
+}}
+}
+
+if {[info exists argv0] && [file tail [info script]] eq [file tail $argv0]} {
+    if {[llength $argv] < 1 || [llength $argv] > 3} {
+        puts stderr "usage: [file tail $argv0] outputDir ?procCounts? ?scale?"
+        exit 1
+    }
+    lassign [concat $argv 1000 1] dir procCounts scale
+    dict for {name file} [::corpus::generate $dir $procCounts $scale] {
+        puts "$name: $file ([file size $file] bytes)"
+    }
+}
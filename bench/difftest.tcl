@@ -0,0 +1,374 @@
+# difftest.tcl --
+#
+#	Differential test of the compiler: compiles each script of a corpus,
+#	then runs it twice in fresh interpreters, once with "source" on the
+#	original and once on the compiled file, and checks that both runs
+#	give the same result, output and error. Every procedure the script
+#	defines is then called, with each required argument set to 1, and the
+#	results, output and errors of the calls are compared as well.
+#
+#	For each side it reports the time to load the script, the time of the
+#	first calls of its procedures, which includes compiling their bodies
+#	when running from source, and the best time of the calls that follow.
+#	The startup column is the ratio of load plus first calls, source over
+#	compiled, which is the gain of shipping compiled files.
+#
+#	The compiled files are loaded with tbcload when it is installed;
+#	otherwise, or with "-loader reference", tbcload::bceval is aliased to
+#	compiler::bceval, which evaluates them with the reference decoder.
+#
+#	Usage (normally through "make difftest", with DIFFTESTFLAGS):
+#
+#	  tclsh difftest.tcl ?-repeat n? ?-loader auto|tbcload|reference?
+#	                     ?-procs counts? ?-scale n? ?-dir dir? ?-keep?
+#	                     ?-save file? ?file ...?
+#
+#	Without files, the scripts of the test suite and the synthetic corpora
+#	of corpus.tcl (with -procs and -scale) are used. The exit status is 1
+#	if any script behaves differently once compiled.
+#
+# Released under the BSD-3 license. See LICENSE file for details.
+
+package require Tcl 8.6
+package require tclcompiler
+
+source [file join [file dirname [info script]] corpus.tcl]
+
+namespace eval ::difftest {
+    variable options [dict create \
+            -repeat 5 \
+            -loader auto \
+            -procs {10 1000} \
+            -scale 1 \
+            -dir difftest-corpus \
+            -keep 0 \
+            -save {}]
+
+    # The script evaluated in each interpreter before the corpus script:
+    # it captures the standard output and error, turns exit into an error,
+    # and measures the load and the calls from inside the interpreter.
+
+    variable childScript {
+        namespace eval ::difftest {
+            variable output {}
+        }
+
+        rename ::puts ::difftest::RealPuts
+        proc ::puts {args} {
+            set words $args
+            set newline \n
+            if {[llength $words] > 1 && [lindex $words 0] eq "-nonewline"} {
+                set newline {}
+                set words [lrange $words 1 end]
+            }
+            if {[llength $words] == 1} {
+                set words [list stdout {*}$words]
+            }
+            if {[llength $words] != 2 || [lindex $words 0] ni {stdout stderr}} {
+                tailcall ::difftest::RealPuts {*}$args
+            }
+            lappend ::difftest::output [lindex $words 0] [lindex $words 1]$newline
+            return
+        }
+
+        proc ::exit {{status 0}} {
+            return -code error -errorcode [list DIFFTEST EXIT $status] \
+                    "exit $status"
+        }
+
+        # difftest::UseReferenceLoader --
+        #
+        #	Stands in for tbcload with the reference decoder.
+
+        proc ::difftest::UseReferenceLoader {version} {
+            package require tclcompiler
+            namespace eval ::tbcload {}
+            interp alias {} ::tbcload::bceval {} ::compiler::bceval
+            interp alias {} ::tbcload::bcproc {} ::proc
+            package provide tbcload $version
+        }
+
+        # difftest::Procs --
+        #
+        #	Lists the procedures of a namespace and of its children.
+
+        proc ::difftest::Procs {{ns ::}} {
+            set procs [info procs [string trimright $ns :]::*]
+            foreach child [namespace children $ns] {
+                lappend procs {*}[Procs $child]
+            }
+            return $procs
+        }
+
+        # difftest::Outcome --
+        #
+        #	What a script or call did, as compared between the two runs.
+
+        proc ::difftest::Outcome {code result options} {
+            variable output
+            set outcome [dict create code $code result $result \
+                    errorCode [expr {$code == 1 ? [dict get $options -errorcode] : {}}] \
+                    output $output]
+            set output {}
+            return $outcome
+        }
+
+        # difftest::Load --
+        #
+        #	Sources a file at the global level.
+
+        proc ::difftest::Load {file} {
+            variable procs
+            set before [Procs]
+            set start [clock microseconds]
+            set code [catch {uplevel #0 [list source $file]} result options]
+            set time [expr {[clock microseconds] - $start}]
+            set procs [lsort [lmap p [Procs] {
+                if {$p in $before} continue
+                set p
+            }]]
+            return [dict create time $time outcome [Outcome $code $result $options] \
+                    procs $procs]
+        }
+
+        # difftest::Call --
+        #
+        #	Calls each procedure defined by the script once, with its
+        #	required arguments set to 1.
+
+        proc ::difftest::Call {} {
+            variable procs
+            set outcomes {}
+            set start [clock microseconds]
+            foreach p $procs {
+                set argList {}
+                foreach arg [info args $p] {
+                    if {$arg eq "args" || [info default $p $arg default]} {
+                        break
+                    }
+                    lappend argList 1
+                }
+                set code [catch {uplevel #0 [list $p {*}$argList]} result options]
+                lappend outcomes $p [Outcome $code $result $options]
+            }
+            set time [expr {[clock microseconds] - $start}]
+            return [dict create time $time outcomes $outcomes]
+        }
+    }
+}
+
+# difftest::ParseOptions --
+#
+#	Parses the command line into the options dict.
+#
+# Results:
+#	The list of files given after the options.
+
+proc ::difftest::ParseOptions {argv} {
+    variable options
+    while {[llength $argv] && [string match -* [lindex $argv 0]]} {
+        set argv [lassign $argv option]
+        if {![dict exists $options $option]} {
+            return -code error "unknown option \"$option\": must be\
+                    [join [dict keys $options] {, }]"
+        }
+        if {$option eq "-keep"} {
+            dict set options -keep 1
+            continue
+        }
+        if {![llength $argv]} {
+            return -code error "missing value for $option"
+        }
+        set argv [lassign $argv value]
+        dict set options $option $value
+    }
+    if {[dict get $options -loader] ni {auto tbcload reference}} {
+        return -code error "bad -loader \"[dict get $options -loader]\":\
+                must be auto, tbcload or reference"
+    }
+    return $argv
+}
+
+# difftest::ChooseLoader --
+#
+#	Resolves "-loader auto" to tbcload when it is installed, and checks
+#	that it is for "-loader tbcload".
+
+proc ::difftest::ChooseLoader {loader} {
+    if {$loader eq "reference"} {
+        return $loader
+    }
+    set child [interp create]
+    set found [expr {![catch {$child eval package require tbcload} message]}]
+    interp delete $child
+    if {$found} {
+        return tbcload
+    } elseif {$loader eq "tbcload"} {
+        return -code error "cannot use tbcload: $message"
+    }
+    return reference
+}
+
+# difftest::Run --
+#
+#	Runs a script in a fresh interpreter: loads it, then calls its
+#	procedures once, then repeat more times for the steady state.
+#
+# Results:
+#	A dict with the outcome of the load and of the first calls, and the
+#	load, first call and best call times in microseconds.
+
+proc ::difftest::Run {file loader repeat} {
+    variable childScript
+    set child [interp create]
+    $child eval $childScript
+    if {$loader eq "reference"} {
+        set version [package present tclcompiler]
+        $child eval [list package ifneeded tclcompiler $version \
+                [package ifneeded tclcompiler $version]]
+        set f [open $file]
+        set preamble [read $f 1024]
+        close $f
+        if {![regexp {package require tbcload ([0-9.]+)} $preamble -> tbcVersion]} {
+            set tbcVersion 0
+        }
+        $child eval [list ::difftest::UseReferenceLoader $tbcVersion]
+    }
+
+    set load [$child eval [list ::difftest::Load $file]]
+    set calls [$child eval ::difftest::Call]
+    set best {}
+    for {set i 0} {$i < $repeat} {incr i} {
+        set time [dict get [$child eval ::difftest::Call] time]
+        if {$best eq {} || $time < $best} {
+            set best $time
+        }
+    }
+    interp delete $child
+
+    return [dict create \
+            outcome [dict get $load outcome] \
+            procs [dict get $load procs] \
+            calls [dict get $calls outcomes] \
+            loadTime [dict get $load time] \
+            firstTime [dict get $calls time] \
+            steadyTime [expr {$best eq {} ? 0 : $best}]]
+}
+
+# difftest::Compare --
+#
+#	Compares the runs from source and from the compiled file.
+#
+# Results:
+#	A list of the differences, empty if the runs match.
+
+proc ::difftest::Compare {source compiled} {
+    set diffs {}
+    foreach key {code result errorCode output} {
+        Differ diffs $key [dict get $source outcome $key] \
+                [dict get $compiled outcome $key]
+    }
+    Differ diffs procs [dict get $source procs] [dict get $compiled procs]
+    dict for {p outcome} [dict get $source calls] {
+        if {![dict exists $compiled calls $p]} {
+            continue
+        }
+        foreach key {code result errorCode output} {
+            Differ diffs "$key of $p" [dict get $outcome $key] \
+                    [dict get $compiled calls $p $key]
+        }
+    }
+    return $diffs
+}
+
+# difftest::Differ --
+#
+#	Appends a difference to the list in diffsVar if two values differ.
+
+proc ::difftest::Differ {diffsVar what sourceValue compiledValue} {
+    upvar 1 $diffsVar diffs
+    if {$sourceValue ne $compiledValue} {
+        lappend diffs [format {%s: "%.60s" from source, "%.60s" compiled} \
+                $what $sourceValue $compiledValue]
+    }
+}
+
+# difftest::Main --
+#
+#	Compiles and runs the corpus, and prints one row per script, then the
+#	differences.
+
+proc ::difftest::Main {argv} {
+    variable options
+    set files [ParseOptions $argv]
+    set dir [file normalize [dict get $options -dir]]
+    set repeat [dict get $options -repeat]
+    set loader [ChooseLoader [dict get $options -loader]]
+    file mkdir $dir
+
+    if {![llength $files]} {
+        set testDir [file join [file dirname [file normalize [info script]]] .. tests]
+        set files [lsort [glob -directory $testDir tc*.tcl]]
+        lappend files {*}[dict values [corpus::generate [file join $dir corpus] \
+                [dict get $options -procs] [dict get $options -scale]]]
+    }
+
+    puts "compiled files loaded with [expr {$loader eq "tbcload" ? "tbcload" : "the reference decoder"}]"
+    set format "%-12s %-5s %9s %9s %9s %9s %9s %9s %8s"
+    set header [format $format script check "load src" "load tbc" \
+            "first src" "first tbc" "steady src" "steady tbc" startup]
+    puts $header
+    puts [string repeat - [string length $header]]
+
+    set results [dict create]
+    set report {}
+    foreach file $files {
+        set name [file rootname [file tail $file]]
+        set out [file join $dir $name[compiler::getBytecodeExtension]]
+        for {set i 2} {[dict exists $results $name]} {incr i} {
+            set name [file rootname [file tail $file]]-$i
+            set out [file join $dir $name[compiler::getBytecodeExtension]]
+        }
+        compiler::compile $file $out
+
+        set source [Run $file source $repeat]
+        set compiled [Run $out $loader $repeat]
+        set diffs [Compare $source $compiled]
+        dict set results $name [dict create diffs $diffs \
+                source [dict remove $source outcome procs calls] \
+                compiled [dict remove $compiled outcome procs calls]]
+        foreach diff $diffs {
+            lappend report "$name: $diff"
+        }
+
+        set row [list $name [expr {[llength $diffs] ? "DIFF" : "ok"}]]
+        foreach key {loadTime firstTime steadyTime} {
+            lappend row [format %.2f [expr {[dict get $source $key] / 1000.0}]] \
+                    [format %.2f [expr {[dict get $compiled $key] / 1000.0}]]
+        }
+        set startup [expr {[dict get $compiled loadTime] + [dict get $compiled firstTime]}]
+        lappend row [format %.2f [expr {([dict get $source loadTime] \
+                + [dict get $source firstTime]) / double(max($startup, 1))}]]
+        puts [format $format {*}$row]
+    }
+
+    if {[llength $report]} {
+        puts ""
+        puts [join $report \n]
+    }
+    if {[dict get $options -save] ne {}} {
+        set f [open [dict get $options -save] w]
+        puts $f $results
+        close $f
+    }
+    if {![dict get $options -keep]} {
+        file delete -force $dir
+    }
+    return [expr {[llength $report] > 0}]
+}
+
+if {[catch {::difftest::Main $argv} status]} {
+    puts stderr $status
+    exit 1
+}
+exit $status
@@ -0,0 +1,448 @@
+# startup.tcl --
+#
+#	Startup benchmark: generates the application tree of
+#	corpus::application, a handful of packages that require each other,
+#	compiles every file of a second copy of it, and measures how long the
+#	application takes to start from source and from the compiled files.
+#
+#	Two measures are reported for each tree. "process" is the wall time of
+#	a fresh tclsh running the launcher, the figure users see; the time of
+#	a tclsh running an empty script is printed for reference. The others
+#	come from loading the application in a fresh interpreter in which
+#	source, proc, package and tbcload::bcproc are wrapped to split the
+#	time, each phase excluding the phases nested in it:
+#
+#	  require	package require, minus the files it sources: searching
+#			auto_path, reading the pkgIndex.tcl files, loading tbcload
+#	  read		reading the files of the application
+#	  decode	evaluating the top level of the files: decoding them and
+#			running the preamble written by EmitScriptPreamble for the
+#			compiled files, compiling them for the source ones
+#	  procs		defining the procedures
+#	  compile	first call of app::start minus a later one, which is
+#			mostly compiling the procedure bodies from source
+#	  run		a later call of app::start
+#
+#	The compiled files are loaded with tbcload when it is installed;
+#	otherwise, or with "-loader reference", the tree gets a tbcload
+#	package that maps tbcload::bceval to compiler::bceval, the reference
+#	decoder.
+#
+#	Usage (normally through "make startup", with STARTUPFLAGS):
+#
+#	  tclsh startup.tcl ?-scale n? ?-calls fraction? ?-repeat n?
+#	                    ?-loader auto|tbcload|reference? ?-dir dir? ?-keep?
+#	                    ?-save file? ?-compare file?
+#
+#	-scale sets the number of procedures per file in units of 12 and
+#	-calls the fraction of them called at startup. -save and -compare
+#	work as in bench.tcl: -compare adds the ratio of each time to the one
+#	saved, for comparing two commits on the same machine.
+#
+# Released under the BSD-3 license. See LICENSE file for details.
+
+package require Tcl 8.6
+package require tclcompiler
+
+source [file join [file dirname [info script]] corpus.tcl]
+
+namespace eval ::startup {
+    variable options [dict create \
+            -scale 4 \
+            -calls 0.5 \
+            -repeat 5 \
+            -loader auto \
+            -dir startup-app \
+            -keep 0 \
+            -save {} \
+            -compare {}]
+
+    # The phases reported, in the order of the columns.
+
+    variable phases {require read decode procs compile run}
+
+    # The script evaluated in each interpreter before loading the
+    # application: it wraps the commands that mark the phases.
+
+    variable childScript {
+        namespace eval ::startup {
+            variable times {}
+            variable stack {}
+            variable root {}
+        }
+
+        # startup::Timed --
+        #
+        #	Evaluates a script in the caller's frame and adds its time to
+        #	a phase, minus the time of the phases nested in it.
+
+        proc ::startup::Timed {phase script} {
+            variable times
+            variable stack
+            lappend stack 0
+            set start [clock microseconds]
+            set code [catch {uplevel 1 $script} result options]
+            set time [expr {[clock microseconds] - $start}]
+            set nested [lindex $stack end]
+            set stack [lrange $stack 0 end-1]
+            dict incr times $phase [expr {$time - $nested}]
+            if {[llength $stack]} {
+                lset stack end [expr {[lindex $stack end] + $time}]
+            }
+            return -options $options $result
+        }
+
+        # startup::Read --
+        #
+        #	Reads a file the way source does.
+
+        proc ::startup::Read {file} {
+            set f [open $file]
+            fconfigure $f -eofchar \032
+            set data [read $f]
+            close $f
+            return $data
+        }
+
+        # startup::Source --
+        #
+        #	Replaces source: the files of the application are read and
+        #	evaluated in two phases, others, such as the package indexes,
+        #	go to the real source.
+
+        proc ::startup::Source {args} {
+            variable root
+            set file [lindex $args end]
+            if {[llength $args] != 1 || [file tail $file] eq "pkgIndex.tcl"
+                    || ![string match $root/* [file normalize $file]]} {
+                tailcall ::startup::RealSource {*}$args
+            }
+            set script [Timed read {Read $file}]
+            set oldScript [info script $file]
+            set code [catch {Timed decode {uplevel 1 $script}} result options]
+            info script $oldScript
+            if {$code == 2} {
+                return $result
+            }
+            return -options $options $result
+        }
+
+        proc ::startup::Proc {name argList body} {
+            Timed procs {uplevel 1 [list ::startup::RealProc $name $argList $body]}
+        }
+
+        proc ::startup::Bcproc {args} {
+            Timed procs {uplevel 1 [list ::startup::RealBcproc {*}$args]}
+        }
+
+        proc ::startup::Package {subcommand args} {
+            if {$subcommand eq "require"} {
+                return [Timed require {uplevel 1 [list ::startup::RealPackage require {*}$args]}]
+            }
+            tailcall ::startup::RealPackage $subcommand {*}$args
+        }
+
+        # startup::Run --
+        #
+        #	Loads the application rooted at dir, with main$ext, then calls
+        #	app::start once, then repeat more times for the steady state.
+        #
+        # Results:
+        #	A dict with the time of each phase in microseconds and the
+        #	result of app::start.
+
+        proc ::startup::Run {dir ext repeat} {
+            variable times
+            variable root
+            set root [file normalize $dir]
+            set times [dict create require 0 read 0 decode 0 procs 0 first 0]
+            lappend ::auto_path [file join $root lib]
+
+            foreach command {source proc package} {
+                rename ::$command ::startup::Real[string totitle $command]
+                interp alias {} ::$command {} ::startup::[string totitle $command]
+            }
+            if {$ext ne ".tcl"} {
+                Timed require {package require tbcload}
+            }
+            if {$ext ne ".tcl" && [interp alias {} ::tbcload::bcproc] eq {}} {
+                rename ::tbcload::bcproc ::startup::RealBcproc
+                interp alias {} ::tbcload::bcproc {} ::startup::Bcproc
+            }
+            uplevel #0 [list source [file join $root main$ext]]
+            set result [Timed first {app::start}]
+
+            set best {}
+            for {set i 0} {$i < $repeat} {incr i} {
+                set start [clock microseconds]
+                app::start
+                set time [expr {[clock microseconds] - $start}]
+                if {$best eq {} || $time < $best} {
+                    set best $time
+                }
+            }
+            set best [expr {$best eq {} ? 0 : $best}]
+            dict set times compile [expr {max([dict get $times first] - $best, 0)}]
+            dict set times run $best
+            return [dict create times [dict remove $times first] result $result]
+        }
+    }
+}
+
+# startup::ParseOptions --
+#
+#	Parses the command line into the options dict.
+
+proc ::startup::ParseOptions {argv} {
+    variable options
+    while {[llength $argv]} {
+        set argv [lassign $argv option]
+        if {![dict exists $options $option]} {
+            return -code error "unknown option \"$option\": must be\
+                    [join [dict keys $options] {, }]"
+        }
+        if {$option eq "-keep"} {
+            dict set options -keep 1
+            continue
+        }
+        if {![llength $argv]} {
+            return -code error "missing value for $option"
+        }
+        set argv [lassign $argv value]
+        dict set options $option $value
+    }
+    if {[dict get $options -loader] ni {auto tbcload reference}} {
+        return -code error "bad -loader \"[dict get $options -loader]\":\
+                must be auto, tbcload or reference"
+    }
+}
+
+# startup::ChooseLoader --
+#
+#	Resolves "-loader auto" to tbcload when it is installed, and checks
+#	that it is for "-loader tbcload".
+
+proc ::startup::ChooseLoader {loader} {
+    if {$loader eq "reference"} {
+        return $loader
+    }
+    set child [interp create]
+    set found [expr {![catch {$child eval package require tbcload} message]}]
+    interp delete $child
+    if {$found} {
+        return tbcload
+    } elseif {$loader eq "tbcload"} {
+        return -code error "cannot use tbcload: $message"
+    }
+    return reference
+}
+
+# startup::Build --
+#
+#	Writes the source tree of the application, and the compiled tree: a
+#	copy written to refer to .tbc files, whose scripts other than the
+#	package indexes and the launcher are compiled.
+#
+# Results:
+#	A dict with the number of files and procedures and the size of the
+#	scripts of each tree.
+
+proc ::startup::Build {dir scale calls loader} {
+    set files [corpus::application [file join $dir source] .tcl $scale $calls]
+    set procs 0
+    set sourceBytes 0
+    dict for {path file} $files {
+        if {$path ne "start.tcl"} {
+            set f [open $file]
+            incr procs [regexp -all -line {^proc } [read $f]]
+            close $f
+            incr sourceBytes [file size $file]
+        }
+    }
+
+    set compiledBytes 0
+    set tbcDir [file join $dir compiled]
+    dict for {path file} [corpus::application [file join $dir copy] .tbc $scale $calls] {
+        set out [file join $tbcDir $path]
+        file mkdir [file dirname $out]
+        if {[file tail $path] in {pkgIndex.tcl start.tcl}} {
+            file copy -force $file $out
+        } else {
+            set out [file rootname $out].tbc
+            compiler::compile $file $out
+        }
+        if {$path ne "start.tcl"} {
+            incr compiledBytes [file size $out]
+        }
+    }
+
+    if {$loader eq "reference"} {
+        set f [open [file join $tbcDir main.tbc]]
+        set preamble [read $f 1024]
+        close $f
+        if {![regexp {package require tbcload ([0-9.]+)} $preamble -> version]} {
+            return -code error "no tbcload version in the preamble"
+        }
+        file mkdir [file join $tbcDir lib tbcload]
+        set f [open [file join $tbcDir lib tbcload pkgIndex.tcl] w]
+        puts $f [list package ifneeded tbcload $version [string map [list @V@ $version] {
+            package require tclcompiler
+            namespace eval ::tbcload {}
+            interp alias {} ::tbcload::bceval {} ::compiler::bceval
+            interp alias {} ::tbcload::bcproc {} ::proc
+            package provide tbcload @V@
+        }]]
+        close $f
+    }
+
+    return [dict create files [expr {[dict size $files] - 1}] procs $procs \
+            sourceBytes $sourceBytes compiledBytes $compiledBytes]
+}
+
+# startup::Process --
+#
+#	Runs a script in a fresh tclsh repeat times.
+#
+# Results:
+#	A list of the best wall time in microseconds and the output.
+
+proc ::startup::Process {script repeat} {
+    set best {}
+    set output {}
+    for {set i 0} {$i < $repeat} {incr i} {
+        set start [clock microseconds]
+        set output [exec [info nameofexecutable] $script]
+        set time [expr {[clock microseconds] - $start}]
+        if {$best eq {} || $time < $best} {
+            set best $time
+        }
+    }
+    return [list $best $output]
+}
+
+# startup::Measure --
+#
+#	Measures the startup of one tree, in fresh processes and in fresh
+#	interpreters, repeat times each.
+#
+# Results:
+#	A dict with the time of each phase of the run with the best total, in
+#	microseconds, the process time and the results of app::start.
+
+proc ::startup::Measure {dir ext repeat} {
+    variable childScript
+    lassign [Process [file join $dir start.tcl] $repeat] process output
+
+    set version [package present tclcompiler]
+    set best {}
+    for {set i 0} {$i < max($repeat, 1)} {incr i} {
+        set child [interp create]
+        $child eval [list package ifneeded tclcompiler $version \
+                [package ifneeded tclcompiler $version]]
+        $child eval $childScript
+        set r [$child eval [list ::startup::Run $dir $ext $repeat]]
+        interp delete $child
+        set total [tcl::mathop::+ {*}[dict values [dict get $r times]]]
+        if {$best eq {} || $total < [dict get $best total]} {
+            set best [dict merge [dict get $r times] [dict create total $total \
+                    result [dict get $r result]]]
+        }
+    }
+    return [dict merge $best [dict create process $process output $output]]
+}
+
+# startup::Main --
+#
+#	Builds the application, measures both trees and prints one row per
+#	tree, then the ratios.
+
+proc ::startup::Main {argv} {
+    variable options
+    variable phases
+    ParseOptions $argv
+    set dir [file normalize [dict get $options -dir]]
+    set repeat [dict get $options -repeat]
+    set loader [ChooseLoader [dict get $options -loader]]
+
+    set baseline {}
+    if {[dict get $options -compare] ne {}} {
+        set f [open [dict get $options -compare]]
+        set baseline [read $f]
+        close $f
+    }
+
+    file delete -force $dir
+    set info [Build $dir [dict get $options -scale] [dict get $options -calls] $loader]
+    set empty [file join $dir empty.tcl]
+    close [open $empty w]
+    lassign [Process $empty $repeat] emptyTime
+
+    puts [format "application: %d files, %d procedures, %d KB source,\
+            %d KB compiled" [dict get $info files] [dict get $info procs] \
+            [expr {[dict get $info sourceBytes] / 1024}] \
+            [expr {[dict get $info compiledBytes] / 1024}]]
+    puts "compiled files loaded with [expr {$loader eq "tbcload" ? "tbcload" : "the reference decoder"}]"
+    puts [format "empty tclsh: %.2f ms" [expr {$emptyTime / 1000.0}]]
+
+    set results [dict create \
+            source [Measure [file join $dir source] .tcl $repeat] \
+            compiled [Measure [file join $dir compiled] .tbc $repeat]]
+    foreach key {output result} {
+        if {[dict get $results source $key] ne [dict get $results compiled $key]} {
+            return -code error "the compiled application started differently:\
+                    \"[dict get $results source $key]\" from source,\
+                    \"[dict get $results compiled $key]\" compiled"
+        }
+    }
+
+    set columns [list process total {*}$phases]
+    set format "%-18s[string repeat { %9s} [llength $columns]]"
+    set header [format $format "" {*}$columns]
+    puts $header
+    puts [string repeat - [string length $header]]
+    foreach tree {source compiled} {
+        puts [format $format $tree {*}[lmap column $columns {
+            format %.2f [expr {[dict get $results $tree $column] / 1000.0}]
+        }]]
+    }
+    puts [format $format source/compiled {*}[lmap column $columns {
+        Ratio [dict get $results source $column] [dict get $results compiled $column]
+    }]]
+    if {$baseline ne {}} {
+        foreach tree {source compiled} {
+            puts [format $format "$tree/saved" {*}[lmap column $columns {
+                if {![dict exists $baseline $tree $column]} {
+                    string cat -
+                } else {
+                    Ratio [dict get $results $tree $column] \
+                            [dict get $baseline $tree $column]
+                }
+            }]]
+        }
+    }
+
+    if {[dict get $options -save] ne {}} {
+        set f [open [dict get $options -save] w]
+        puts $f [dict map {tree r} $results {dict remove $r output result}]
+        close $f
+    }
+    if {![dict get $options -keep]} {
+        file delete -force $dir
+    }
+}
+
+# startup::Ratio --
+#
+#	Formats the ratio of two times, or "-" when the second is 0.
+
+proc ::startup::Ratio {time otherTime} {
+    if {$otherTime == 0} {
+        return -
+    }
+    return [format %.2f [expr {$time / double($otherTime)}]]
+}
+
+if {[catch {::startup::Main $argv} message]} {
+    puts stderr $message
+    exit 1
+}
@@ -0,0 +1,2133 @@
+/*
+ * cmpDecode.c --
+ *
+ *  A reference decoder for the files written by the compiler. It rebuilds
+ *  in memory the ByteCode structures, procedure bodies and literals of a
+ *  compiled file, laid out and typed as the loader would, so that they
+ *  are released by the Tcl object machinery.
+ *  compiler::verify uses it to check that what EmitCompiledObject writes
+ *  reads back into the ByteCodes it was written from, compiler::decode
+ *  to measure how fast a compiled file loads, and compiler::bceval to
+ *  run compiled files where the loader is not installed.
+ *  The decoder is chosen by the format version on the signature line;
+ *  versions 3 and 4 are the ASCII85 text format of cmpWrite.c. A new
+ *  format gets a decoder of its own, dispatched from DecodeCompiledFile.
+ *
+ *  Released under the BSD-3 license. See LICENSE file for details.
+ */
+
+#include "cmpInt.h"
+#include "cmpWrite.h"
+
+/*
+ * The decoding state of a compiled file, held in memory.
+ */
+
+typedef struct DecodeContext
+{
+    Tcl_Interp* interp;
+    const char* basePtr;   /* start of the file contents */
+    const char* curPtr;    /* next character to decode */
+    const char* endPtr;    /* one past the last character */
+    int formatVersion;     /* from the signature line */
+    int forExecution;      /* whether the ByteCodes are to be executed */
+    DecodeStats* statsPtr; /* where the decoded items are counted */
+} DecodeContext;
+
+/*
+ * Inverse of the encodeMap of cmpWrite.c: the value of each character of
+ * the modified ASCII85 encoding, or -1. Built on first use from
+ * a85Characters, which must be kept consistent with encodeMap.
+ */
+
+static const char a85Characters[] = "!v#w%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZxy|^_`abcdefghijklmnopqrstu";
+static signed char decodeMap[256];
+
+/*
+ * The VAR_ flags of the bits of a compiled local's flags mask; must be
+ * kept consistent with varFlagsList in cmpWrite.c.
+ */
+
+static const int varFlagsList[] = {0, 0, 0, 0, 0, 0, 0, 0, VAR_ARGUMENT, VAR_TEMPORARY, 0};
+#define NUM_VAR_FLAGS ((int)(sizeof(varFlagsList) / sizeof(varFlagsList[0])))
+
+/*
+ * The object and AuxData types, looked up once like in cmpWrite.c, under a
+ * mutex since the decoder may first run in several threads at once.
+ */
+
+static int didLoadTypes = 0;
+TCL_DECLARE_MUTEX(decodeTypesMutex)
+static const Tcl_ObjType* decByteCodeType = 0;
+static const Tcl_ObjType* decProcBodyType = 0;
+static const AuxDataType* decJumptableInfoType = 0;
+static const AuxDataType* decDictUpdateInfoType = 0;
+static const AuxDataType* decNewForeachInfoType = 0;
+
+/*
+ * Declarations for local procedures to this file:
+ */
+
+static int CheckStackDepths(DecodeContext* ctxPtr, ByteCode* codePtr);
+static Tcl_Obj* CloneProcBody(Proc* origPtr);
+static int CompareAuxData(Tcl_Interp* interp, AuxData* origPtr, AuxData* decodedPtr, Tcl_Obj* wherePtr);
+static int CompareByteCodes(Tcl_Interp* interp, ByteCode* origPtr, ByteCode* decodedPtr, Tcl_Obj* wherePtr);
+static int CompareLiterals(Tcl_Interp* interp, Tcl_Obj* origPtr, Tcl_Obj* decodedPtr, Tcl_Obj* wherePtr);
+static int CompareProcs(Tcl_Interp* interp, Proc* origPtr, Proc* decodedPtr, Tcl_Obj* wherePtr);
+static int DecodeAuxData(DecodeContext* ctxPtr, AuxData* auxDataPtr);
+static int DecodeByteCode(DecodeContext* ctxPtr, Proc* procPtr, Tcl_Obj** objPtrPtr);
+static int DecodeBytes(DecodeContext* ctxPtr, unsigned char* destPtr, Tcl_Size length);
+static int DecodeChar(DecodeContext* ctxPtr, int* charPtr);
+static int DecodeCompiledFile(Tcl_Interp* interp,
+                              const char* bytes,
+                              Tcl_Size length,
+                              Tcl_Size* offsetPtr,
+                              int forExecution,
+                              Tcl_Obj** objPtrPtr,
+                              DecodeStats* statsPtr);
+static int DecodeCompiledLocal(DecodeContext* ctxPtr, CompiledLocal** localPtrPtr);
+static int DecodeCount(DecodeContext* ctxPtr, Tcl_Size* countPtr);
+static int DecodeExpectedCount(DecodeContext* ctxPtr, Tcl_Size expected);
+static int DecodeError(DecodeContext* ctxPtr, const char* message);
+static int DecodeExceptionRange(DecodeContext* ctxPtr, ExceptionRange* rangePtr);
+static int DecodeLiteral(DecodeContext* ctxPtr, ByteCode* codePtr, Tcl_Obj** objPtrPtr);
+static int DecodeLocMap(DecodeContext* ctxPtr, ByteCode* codePtr, const Tcl_Size* sizes);
+static int DecodeObject(DecodeContext* ctxPtr, int typeCode, Tcl_Obj** objPtrPtr);
+static int DecodeProcBody(DecodeContext* ctxPtr, Tcl_Obj** objPtrPtr);
+static int DecodeSize(DecodeContext* ctxPtr, Tcl_Size* valuePtr);
+static int DecodeString(DecodeContext* ctxPtr, Tcl_Obj** objPtrPtr);
+static void InitDecodeTypes(void);
+static Tcl_Obj* DecodeStatsObj(const DecodeStats* statsPtr);
+static const char* FindSignatureLine(const char* curPtr, const char* endPtr);
+static Tcl_Size LocArrayLength(unsigned char* bytes, Tcl_Size numCommands);
+static int Mismatch(Tcl_Interp* interp, Tcl_Obj* wherePtr, const char* what, Tcl_WideInt origValue, Tcl_WideInt decodedValue);
+static int ReadCompiledFile(Tcl_Interp* interp,
+                            const char* fileName,
+                            Tcl_WideInt offset,
+                            char** bytesPtr,
+                            Tcl_Size* lengthPtr);
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Compiler_BcevalObjCmd --
+ *
+ *  Evaluates a compiled script with the reference decoder, like the
+ *  bceval command of the loader. With tbcload::bceval aliased to it and
+ *  tbcload::bcproc to proc, a compiled file can be sourced without the
+ *  loader, which is how the differential test harness runs compiled files
+ *  where tbcload is not installed.
+ *
+ *  Call format:
+ *    compiler::bceval compiledScript
+ *  where compiledScript is the text that follows the script preamble in a
+ *  compiled file, from the signature line on.
+ *
+ * Results:
+ *  Returns the result of the evaluation.
+ *
+ * Side effects:
+ *  Whatever the compiled script does.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int Compiler_BcevalObjCmd(void* dummy, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+{
+    DecodeStats stats;
+    Tcl_Obj* objPtr;
+    const char* bytes;
+    Tcl_Size length;
+    int result;
+
+    (void)dummy;
+
+    if (objc != 2)
+    {
+        Tcl_WrongNumArgs(interp, 1, objv, "compiledScript");
+        return TCL_ERROR;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    bytes = Tcl_GetStringFromObj(objv[1], &length);
+    if (DecodeCompiledFile(interp, bytes, length, NULL, 1, &objPtr, &stats) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+    result = Tcl_EvalObjEx(interp, objPtr, 0);
+    Tcl_DecrRefCount(objPtr);
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Compiler_DecodeObjCmd --
+ *
+ *  Decodes a compiled file into ByteCode structures, and frees them. A
+ *  file compiled with -chunk holds one top level ByteCode per chunk, which
+ *  are all decoded.
+ *
+ *  Call format:
+ *    compiler::decode ?-repeat count? fileName
+ *  The file is read once, then decoded count times (default 1), which
+ *  is how the load time of a compiled file is measured.
+ *
+ * Results:
+ *  Returns a standard TCL result code. The result is a dict with the
+ *  format version, the number of ByteCodes, procedure bodies, literals,
+ *  list literals and code bytes in the file, its size in bytes, and the
+ *  best decoding time in microseconds.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int Compiler_DecodeObjCmd(void* dummy, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+{
+    DecodeStats stats;
+    Tcl_Obj *objPtr, *resultPtr;
+    Tcl_Time start, now;
+    Tcl_WideInt time, bestTime = -1;
+    Tcl_Size length, offset;
+    char* bytes;
+    int i, repeat = 1, result = TCL_OK;
+
+    (void)dummy;
+
+    if ((objc == 4) && (strcmp(Tcl_GetString(objv[1]), "-repeat") == 0))
+    {
+        if (Tcl_GetIntFromObj(interp, objv[2], &repeat) != TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+        if (repeat < 1)
+        {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("bad -repeat value: must be a positive integer", -1));
+            return TCL_ERROR;
+        }
+    }
+    else if (objc != 2)
+    {
+        Tcl_WrongNumArgs(interp, 1, objv, "?-repeat count? fileName");
+        return TCL_ERROR;
+    }
+
+    if (ReadCompiledFile(interp, Tcl_GetString(objv[objc - 1]), 0, &bytes, &length) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    for (i = 0; (result == TCL_OK) && (i < repeat); i++)
+    {
+        memset(&stats, 0, sizeof(stats));
+        Tcl_GetTime(&start);
+        offset = 0;
+        do
+        {
+            result = DecodeCompiledFile(interp, bytes, length, &offset, 0, &objPtr, &stats);
+            if (result == TCL_OK)
+            {
+                Tcl_DecrRefCount(objPtr);
+            }
+        } while ((result == TCL_OK) && FindSignatureLine(bytes + offset, bytes + length));
+        Tcl_GetTime(&now);
+        time = ((Tcl_WideInt)(now.sec - start.sec)) * 1000000 + (now.usec - start.usec);
+        if ((bestTime < 0) || (time < bestTime))
+        {
+            bestTime = time;
+        }
+    }
+    Tcl_Free(bytes);
+
+    if (result == TCL_OK)
+    {
+        resultPtr = DecodeStatsObj(&stats);
+        Tcl_DictObjPut(NULL, resultPtr, Tcl_NewStringObj("fileBytes", -1), Tcl_NewWideIntObj(length));
+        Tcl_DictObjPut(NULL, resultPtr, Tcl_NewStringObj("time", -1), Tcl_NewWideIntObj(bestTime));
+        Tcl_SetObjResult(interp, resultPtr);
+    }
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Compiler_VerifyObjCmd --
+ *
+ *  Compiles files like compiler::compile, then reads each output file
+ *  back with the reference decoder and checks that it holds the ByteCodes
+ *  that were written (see CompilerVerifyFile).
+ *
+ *  Call format:
+ *    compiler::verify ?options? inputFile ?outputFile?
+ *  with the options and arguments of compiler::compile.
+ *
+ * Results:
+ *  Returns a standard TCL result code. The result is a dict with the
+ *  format version and the number of ByteCodes, procedure bodies, literals,
+ *  list literals and code bytes that were checked.
+ *
+ * Side effects:
+ *  Writes the output files, and updates the statistics like
+ *  compiler::compile.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int Compiler_VerifyObjCmd(void* dummy, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+{
+    CompilerContext* ctxPtr = CompilerGetContext(interp);
+    DecodeStats stats;
+    int result;
+
+    memset(&stats, 0, sizeof(stats));
+    ctxPtr->verifyPtr = &stats;
+    result = Compiler_CompileObjCmd(dummy, interp, objc, objv);
+    ctxPtr->verifyPtr = NULL;
+
+    if (result == TCL_OK)
+    {
+        Tcl_SetObjResult(interp, DecodeStatsObj(&stats));
+    }
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeStatsObj --
+ *
+ *  Builds the dict reported by compiler::decode and compiler::verify.
+ *
+ * Results:
+ *  Returns a new dict object.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj* DecodeStatsObj(const DecodeStats* statsPtr)
+{
+    Tcl_Obj* dictPtr = Tcl_NewDictObj();
+
+    Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("version", -1), Tcl_NewIntObj(statsPtr->formatVersion));
+    Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("byteCodes", -1), Tcl_NewWideIntObj(statsPtr->numByteCodes));
+    Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("procBodies", -1), Tcl_NewWideIntObj(statsPtr->numProcBodies));
+    Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("literals", -1), Tcl_NewWideIntObj(statsPtr->numLiterals));
+    Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("listLiterals", -1), Tcl_NewWideIntObj(statsPtr->numListLiterals));
+    Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("codeBytes", -1), Tcl_NewWideIntObj(statsPtr->numCodeBytes));
+    return dictPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompilerVerifyFile --
+ *
+ *  Decodes a compiled file and compares the result with the ByteCode it
+ *  was written from: the instructions, location map, literals, exception
+ *  ranges and AuxData of the top level ByteCode and, recursively, of the
+ *  procedure bodies among its literals. The file is read from offset on,
+ *  which is where the chunk of a file compiled with -chunk starts.
+ *
+ * Results:
+ *  Returns TCL_OK if the file reads back into the same ByteCodes, or
+ *  TCL_ERROR with the first difference in the result.
+ *
+ * Side effects:
+ *  Adds the contents of the file to *statsPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int CompilerVerifyFile(Tcl_Interp* interp,
+                       const char* fileName,
+                       Tcl_WideInt offset,
+                       Tcl_Obj* objPtr,
+                       DecodeStats* statsPtr)
+{
+    Tcl_Obj *decodedPtr, *wherePtr;
+    Tcl_Size length;
+    char* bytes;
+    int result;
+
+    if (ReadCompiledFile(interp, fileName, offset, &bytes, &length) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+    result = DecodeCompiledFile(interp, bytes, length, NULL, 0, &decodedPtr, statsPtr);
+    Tcl_Free(bytes);
+    if (result != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    wherePtr = Tcl_NewStringObj("the top level script", -1);
+    Tcl_IncrRefCount(wherePtr);
+    result = CompareByteCodes(interp,
+                              (ByteCode*)objPtr->internalRep.otherValuePtr,
+                              (ByteCode*)decodedPtr->internalRep.otherValuePtr,
+                              wherePtr);
+    Tcl_DecrRefCount(wherePtr);
+    Tcl_DecrRefCount(decodedPtr);
+    if (result != TCL_OK)
+    {
+        Tcl_AppendObjToObj(Tcl_GetObjResult(interp), Tcl_ObjPrintf(" in \"%s\"", fileName));
+    }
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReadCompiledFile --
+ *
+ *  Reads a compiled file in memory from offset on, without translation.
+ *
+ * Results:
+ *  Returns a standard TCL result code. On success, *bytesPtr is a buffer
+ *  to be freed with Tcl_Free that holds the *lengthPtr bytes of the file.
+ *
+ * Side effects:
+ *  Sets the TCL result on error.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int ReadCompiledFile(Tcl_Interp* interp,
+                            const char* fileName,
+                            Tcl_WideInt offset,
+                            char** bytesPtr,
+                            Tcl_Size* lengthPtr)
+{
+    Tcl_Channel chan;
+    Tcl_WideInt size;
+    char* bytes;
+
+    chan = Tcl_OpenFileChannel(interp, fileName, "r", 0);
+    if (!chan)
+    {
+        return TCL_ERROR;
+    }
+    Tcl_SetChannelOption(NULL, chan, "-translation", "binary");
+    size = Tcl_Seek(chan, 0, SEEK_END) - offset;
+    if ((size < 0) || (size > TCL_SIZE_MAX - 1) || (Tcl_Seek(chan, offset, SEEK_SET) < 0))
+    {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't read file \"%s\": %s", fileName, Tcl_PosixError(interp)));
+        Tcl_Close(NULL, chan);
+        return TCL_ERROR;
+    }
+
+    bytes = Tcl_Alloc((size_t)size + 1);
+    if (Tcl_Read(chan, bytes, (Tcl_Size)size) != (Tcl_Size)size)
+    {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't read file \"%s\": %s", fileName, Tcl_PosixError(interp)));
+        Tcl_Free(bytes);
+        Tcl_Close(NULL, chan);
+        return TCL_ERROR;
+    }
+    Tcl_Close(NULL, chan);
+    bytes[size] = '\0';
+
+    *bytesPtr = bytes;
+    *lengthPtr = (Tcl_Size)size;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InitDecodeTypes --
+ *
+ *  Looks up the object and AuxData types of the decoded structures, and
+ *  builds the ASCII85 decoding table.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Initializes the static variables of this file.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void InitDecodeTypes(void)
+{
+    int i;
+
+    /*
+     * The flag is only read under the mutex: once per decoded file, that is
+     * cheap, and it orders the reads of the tables after their writes.
+     */
+
+    Tcl_MutexLock(&decodeTypesMutex);
+    if (didLoadTypes)
+    {
+        Tcl_MutexUnlock(&decodeTypesMutex);
+        return;
+    }
+
+    decByteCodeType = Tcl_GetObjType("bytecode");
+    decProcBodyType = Tcl_GetObjType("procbody");
+    decJumptableInfoType = TclGetAuxDataType("JumptableInfo");
+    decDictUpdateInfoType = TclGetAuxDataType("DictUpdateInfo");
+    decNewForeachInfoType = TclGetAuxDataType("NewForeachInfo");
+    if (!decByteCodeType || !decProcBodyType || !decJumptableInfoType || !decDictUpdateInfoType ||
+        !decNewForeachInfoType)
+    {
+        Tcl_Panic("InitDecodeTypes: failed to find the bytecode types");
+    }
+
+    memset(decodeMap, -1, sizeof(decodeMap));
+    for (i = 0; a85Characters[i]; i++)
+    {
+        decodeMap[(unsigned char)a85Characters[i]] = (signed char)i;
+    }
+    didLoadTypes = 1;
+    Tcl_MutexUnlock(&decodeTypesMutex);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeCompiledFile --
+ *
+ *  Finds the signature line of a compiled file, after the script
+ *  preamble, and decodes the top level ByteCode that follows it. If
+ *  offsetPtr is not NULL, the search starts at *offsetPtr, which is set to
+ *  where the decoding stopped, so that the next chunk of a file compiled
+ *  with -chunk can be decoded in turn. If forExecution is true, the stack
+ *  depths of the ByteCodes are raised to their bounds, see
+ *  CheckStackDepths.
+ *
+ * Results:
+ *  Returns a standard TCL result code. On success, *objPtrPtr is a new
+ *  bytecode object with a reference count of 1.
+ *
+ * Side effects:
+ *  Adds the decoded items to *statsPtr. Sets the TCL result on error.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DecodeCompiledFile(Tcl_Interp* interp,
+                              const char* bytes,
+                              Tcl_Size length,
+                              Tcl_Size* offsetPtr,
+                              int forExecution,
+                              Tcl_Obj** objPtrPtr,
+                              DecodeStats* statsPtr)
+{
+    DecodeContext ctx;
+    Tcl_Size version;
+    int result;
+
+    InitDecodeTypes();
+
+    ctx.interp = interp;
+    ctx.basePtr = bytes;
+    ctx.endPtr = bytes + length;
+    ctx.forExecution = forExecution;
+    ctx.statsPtr = statsPtr;
+
+    ctx.curPtr = FindSignatureLine(bytes + (offsetPtr ? *offsetPtr : 0), ctx.endPtr);
+    if (!ctx.curPtr)
+    {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("bad compiled file: no signature line", -1));
+        return TCL_ERROR;
+    }
+    ctx.curPtr += sizeof(CMP_SIGNATURE_HEADER " ") - 1;
+    if (DecodeSize(&ctx, &version) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    /*
+     * The rest of the signature line holds the versions of the compiler
+     * and of Tcl.
+     */
+
+    ctx.curPtr = memchr(ctx.curPtr, '\n', ctx.endPtr - ctx.curPtr);
+    if (!ctx.curPtr)
+    {
+        ctx.curPtr = ctx.endPtr;
+        return DecodeError(&ctx, "truncated signature line");
+    }
+    ctx.curPtr += 1;
+
+    ctx.formatVersion = (int)version;
+    statsPtr->formatVersion = ctx.formatVersion;
+    switch (ctx.formatVersion)
+    {
+        case 3:
+        case 4:
+            result = DecodeByteCode(&ctx, NULL, objPtrPtr);
+            break;
+        default:
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("unsupported compiled file format version %" TCL_SIZE_MODIFIER "d", version));
+            return TCL_ERROR;
+    }
+    if (offsetPtr)
+    {
+        *offsetPtr = ctx.curPtr - bytes;
+    }
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FindSignatureLine --
+ *
+ *  Finds the next line of a compiled file, from curPtr on, that starts
+ *  with the signature header.
+ *
+ * Results:
+ *  Returns the start of the line, or NULL if there is none.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char* FindSignatureLine(const char* curPtr, const char* endPtr)
+{
+    static const char signature[] = CMP_SIGNATURE_HEADER " ";
+    const Tcl_Size signatureLength = sizeof(signature) - 1;
+
+    while ((endPtr - curPtr > signatureLength) && (memcmp(curPtr, signature, signatureLength) != 0))
+    {
+        curPtr = memchr(curPtr, '\n', endPtr - curPtr);
+        if (!curPtr)
+        {
+            return NULL;
+        }
+        curPtr += 1;
+    }
+    return (endPtr - curPtr > signatureLength) ? curPtr : NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeError --
+ *
+ *  Reports a malformed compiled file, with the offset where decoding
+ *  stopped.
+ *
+ * Results:
+ *  Returns TCL_ERROR.
+ *
+ * Side effects:
+ *  Sets the TCL result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DecodeError(DecodeContext* ctxPtr, const char* message)
+{
+    Tcl_SetObjResult(ctxPtr->interp,
+                     Tcl_ObjPrintf("bad compiled file: %s at offset %ld", message, (long)(ctxPtr->curPtr - ctxPtr->basePtr)));
+    return TCL_ERROR;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeSize --
+ *
+ *  Decodes an integer written by EmitTclSize, skipping the white space
+ *  before it and consuming the separator after it.
+ *
+ * Results:
+ *  Returns a standard TCL result code.
+ *
+ * Side effects:
+ *  Advances the decoding position.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DecodeSize(DecodeContext* ctxPtr, Tcl_Size* valuePtr)
+{
+    const char* p = ctxPtr->curPtr;
+    Tcl_WideInt value = 0;
+    int negative = 0;
+
+    while ((p < ctxPtr->endPtr) && ((*p == ' ') || (*p == '\n') || (*p == '\r')))
+    {
+        p++;
+    }
+    if ((p < ctxPtr->endPtr) && (*p == '-'))
+    {
+        negative = 1;
+        p++;
+    }
+    ctxPtr->curPtr = p;
+    while ((p < ctxPtr->endPtr) && (*p >= '0') && (*p <= '9'))
+    {
+        value = value * 10 + (*p - '0');
+        if (value > TCL_SIZE_MAX)
+        {
+            return DecodeError(ctxPtr, "integer too large");
+        }
+        p++;
+    }
+    if (p == ctxPtr->curPtr)
+    {
+        return DecodeError(ctxPtr, "expected an integer");
+    }
+    if ((p < ctxPtr->endPtr) && ((*p == ' ') || (*p == '\n')))
+    {
+        p++;
+    }
+
+    ctxPtr->curPtr = p;
+    *valuePtr = (Tcl_Size)(negative ? -value : value);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeCount --
+ *
+ *  Decodes the number of items or bytes of an array. The count must not
+ *  be negative, nor larger than what the rest of the file could encode,
+ *  which keeps a corrupted file from causing huge allocations.
+ *
+ * Results:
+ *  Returns a standard TCL result code.
+ *
+ * Side effects:
+ *  Advances the decoding position.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DecodeCount(DecodeContext* ctxPtr, Tcl_Size* countPtr)
+{
+    if (DecodeSize(ctxPtr, countPtr) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+    if ((*countPtr < 0) || ((Tcl_WideInt)*countPtr > 4 * (Tcl_WideInt)(ctxPtr->endPtr - ctxPtr->curPtr)))
+    {
+        return DecodeError(ctxPtr, "bad count");
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeExpectedCount --
+ *
+ *  Decodes the count that precedes an array whose size was already given
+ *  by the ByteCode header, and checks that the two agree.
+ *
+ * Results:
+ *  Returns a standard TCL result code.
+ *
+ * Side effects:
+ *  Advances the decoding position.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DecodeExpectedCount(DecodeContext* ctxPtr, Tcl_Size expected)
+{
+    Tcl_Size count;
+
+    if (DecodeCount(ctxPtr, &count) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+    if (count != expected)
+    {
+        return DecodeError(ctxPtr, "array size does not match the ByteCode header");
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeChar --
+ *
+ *  Decodes a character written by EmitChar, skipping the white space
+ *  before it and consuming the separator after it.
+ *
+ * Results:
+ *  Returns a standard TCL result code.
+ *
+ * Side effects:
+ *  Advances the decoding position.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DecodeChar(DecodeContext* ctxPtr, int* charPtr)
+{
+    const char* p = ctxPtr->curPtr;
+
+    while ((p < ctxPtr->endPtr) && ((*p == ' ') || (*p == '\n') || (*p == '\r')))
+    {
+        p++;
+    }
+    if (p >= ctxPtr->endPtr)
+    {
+        ctxPtr->curPtr = p;
+        return DecodeError(ctxPtr, "unexpected end of file");
+    }
+    *charPtr = (unsigned char)*p++;
+    if ((p < ctxPtr->endPtr) && ((*p == ' ') || (*p == '\n')))
+    {
+        p++;
+    }
+    ctxPtr->curPtr = p;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeBytes --
+ *
+ *  Decodes length bytes of the modified ASCII85 encoding written by
+ *  A85EncodeBytes: 'z' for a tuple of zero bytes, otherwise one character
+ *  more than the bytes in the tuple, least significant first. Line breaks
+ *  between the characters are skipped.
+ *
+ * Results:
+ *  Returns a standard TCL result code.
+ *
+ * Side effects:
+ *  Fills destPtr, and advances the decoding position.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DecodeBytes(DecodeContext* ctxPtr, unsigned char* destPtr, Tcl_Size length)
+{
+    const char* p = ctxPtr->curPtr;
+    const char* endPtr = ctxPtr->endPtr;
+    Tcl_WideUInt word, scale;
+    int i, numBytes, digit;
+
+    while (length > 0)
+    {
+        numBytes = (length < 4) ? (int)length : 4;
+
+        while ((p < endPtr) && ((*p == '\n') || (*p == '\r')))
+        {
+            p++;
+        }
+        if ((p < endPtr) && (*p == 'z'))
+        {
+            memset(destPtr, 0, numBytes);
+            p++;
+        }
+        else
+        {
+            word = 0;
+            scale = 1;
+            for (i = 0; i <= numBytes; i++)
+            {
+                while ((p < endPtr) && ((*p == '\n') || (*p == '\r')))
+                {
+                    p++;
+                }
+                digit = (p < endPtr) ? decodeMap[(unsigned char)*p] : -1;
+                if (digit < 0)
+                {
+                    ctxPtr->curPtr = p;
+                    return DecodeError(ctxPtr, (p < endPtr) ? "bad ASCII85 character" : "unexpected end of file");
+                }
+                word += digit * scale;
+                scale *= 85;
+                p++;
+            }
+            for (i = 0; i < numBytes; i++)
+            {
+                destPtr[i] = (unsigned char)(word & 0xff);
+                word >>= 8;
+            }
+        }
+        destPtr += numBytes;
+        length -= numBytes;
+    }
+
+    ctxPtr->curPtr = p;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeString --
+ *
+ *  Decodes a byte sequence written by EmitByteSequence, its length then
+ *  its ASCII85 encoding, into a new string object.
+ *
+ * Results:
+ *  Returns a standard TCL result code. On success, *objPtrPtr is a new
+ *  object with a reference count of 0.
+ *
+ * Side effects:
+ *  Advances the decoding position.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DecodeString(DecodeContext* ctxPtr, Tcl_Obj** objPtrPtr)
+{
+    Tcl_Obj* objPtr;
+    Tcl_Size length;
+
+    if (DecodeCount(ctxPtr, &length) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+    objPtr = Tcl_NewObj();
+    Tcl_SetObjLength(objPtr, length);
+    if (DecodeBytes(ctxPtr, (unsigned char*)objPtr->bytes, length) != TCL_OK)
+    {
+        Tcl_DecrRefCount(objPtr);
+        return TCL_ERROR;
+    }
+    *objPtrPtr = objPtr;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeByteCode --
+ *
+ *  Decodes a ByteCode written by EmitByteCode: the header with the sizes
+ *  of its parts, the instructions, the location map, the literals, the
+ *  exception ranges and the AuxData items. The ByteCode is allocated with
+ *  the layout of TclInitByteCode and marked as precompiled, so that its
+ *  literals are released with it.
+ *  When the source map was not emitted, the source deltas and lengths are
+ *  all zero, as for the loader.
+ *
+ * Results:
+ *  Returns a standard TCL result code. On success, *objPtrPtr is a new
+ *  bytecode object with a reference count of 1.
+ *
+ * Side effects:
+ *  Advances the decoding position, and counts the decoded items.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DecodeByteCode(DecodeContext* ctxPtr, Proc* procPtr, Tcl_Obj** objPtrPtr)
+{
+    Interp* iPtr = (Interp*)ctxPtr->interp;
+    Tcl_Size sizes[13]; /* the header, in the order of EmitByteCode */
+    Tcl_Size numCommands, numCodeBytes, numLitObjects, numExceptRanges, numAuxDataItems, numCmdLocBytes, i;
+    size_t structureSize;
+    ByteCode* codePtr;
+    Tcl_Obj* objPtr;
+    unsigned char* p;
+
+    for (i = 0; i < 13; i++)
+    {
+        if (((i < 7) ? DecodeCount(ctxPtr, &sizes[i]) : DecodeSize(ctxPtr, &sizes[i])) != TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+    }
+    numCommands = sizes[0];
+    numCodeBytes = sizes[2];
+    numLitObjects = sizes[3];
+    numExceptRanges = sizes[4];
+    numAuxDataItems = sizes[5];
+    numCmdLocBytes = sizes[6];
+
+    structureSize = sizeof(ByteCode) + TCL_ALIGN(numCodeBytes) + TCL_ALIGN(numLitObjects * sizeof(Tcl_Obj*)) +
+                    TCL_ALIGN(numExceptRanges * sizeof(ExceptionRange)) + numAuxDataItems * sizeof(AuxData) +
+                    numCmdLocBytes;
+    codePtr = (ByteCode*)Tcl_Alloc(structureSize);
+    memset(codePtr, 0, sizeof(ByteCode));
+    codePtr->interpHandle = TclHandlePreserve(iPtr->handle);
+    codePtr->compileEpoch = iPtr->compileEpoch;
+    codePtr->nsPtr = iPtr->globalNsPtr;
+    codePtr->nsEpoch = iPtr->globalNsPtr->resolverEpoch;
+    codePtr->refCount = 1;
+    codePtr->flags = TCL_BYTECODE_PRECOMPILED;
+    codePtr->procPtr = procPtr;
+    codePtr->structureSize = structureSize;
+    codePtr->numCommands = numCommands;
+    codePtr->numCodeBytes = numCodeBytes;
+    codePtr->numExceptRanges = numExceptRanges;
+    codePtr->numCmdLocBytes = numCmdLocBytes;
+    codePtr->maxExceptDepth = sizes[7];
+    codePtr->maxStackDepth = sizes[8];
+
+    p = (unsigned char*)codePtr + sizeof(ByteCode);
+    codePtr->codeStart = p;
+    p += TCL_ALIGN(numCodeBytes);
+    codePtr->objArrayPtr = (Tcl_Obj**)p;
+    p += TCL_ALIGN(numLitObjects * sizeof(Tcl_Obj*));
+    codePtr->exceptArrayPtr = (ExceptionRange*)p;
+    p += TCL_ALIGN(numExceptRanges * sizeof(ExceptionRange));
+    codePtr->auxDataArrayPtr = (AuxData*)p;
+    p += numAuxDataItems * sizeof(AuxData);
+    codePtr->codeDeltaStart = p;
+
+    /*
+     * From here on the ByteCode belongs to its object, which releases what
+     * has been decoded so far if the rest fails: the literal and AuxData
+     * counts only grow as the items are decoded.
+     */
+
+    objPtr = Tcl_NewObj();
+    Tcl_IncrRefCount(objPtr);
+    objPtr->internalRep.twoPtrValue.ptr1 = codePtr;
+    objPtr->internalRep.twoPtrValue.ptr2 = NULL;
+    objPtr->typePtr = decByteCodeType;
+
+    if ((DecodeExpectedCount(ctxPtr, numCodeBytes) != TCL_OK) ||
+        (DecodeBytes(ctxPtr, codePtr->codeStart, numCodeBytes) != TCL_OK) ||
+        (CheckStackDepths(ctxPtr, codePtr) != TCL_OK) ||
+        (DecodeLocMap(ctxPtr, codePtr, sizes + 9) != TCL_OK))
+    {
+        goto error;
+    }
+
+    if (DecodeExpectedCount(ctxPtr, numLitObjects) != TCL_OK)
+    {
+        goto error;
+    }
+    for (i = 0; i < numLitObjects; i++)
+    {
+        if (DecodeLiteral(ctxPtr, codePtr, &codePtr->objArrayPtr[i]) != TCL_OK)
+        {
+            goto error;
+        }
+        codePtr->numLitObjects++;
+    }
+
+    if (DecodeExpectedCount(ctxPtr, numExceptRanges) != TCL_OK)
+    {
+        goto error;
+    }
+    for (i = 0; i < numExceptRanges; i++)
+    {
+        if (DecodeExceptionRange(ctxPtr, &codePtr->exceptArrayPtr[i]) != TCL_OK)
+        {
+            goto error;
+        }
+    }
+
+    if (DecodeExpectedCount(ctxPtr, numAuxDataItems) != TCL_OK)
+    {
+        goto error;
+    }
+    for (i = 0; i < numAuxDataItems; i++)
+    {
+        if (DecodeAuxData(ctxPtr, &codePtr->auxDataArrayPtr[i]) != TCL_OK)
+        {
+            goto error;
+        }
+        codePtr->numAuxDataItems++;
+    }
+
+    ctxPtr->statsPtr->numByteCodes++;
+    ctxPtr->statsPtr->numLiterals += numLitObjects;
+    ctxPtr->statsPtr->numCodeBytes += numCodeBytes;
+    *objPtrPtr = objPtr;
+    return TCL_OK;
+
+error:
+    Tcl_DecrRefCount(objPtr);
+    return TCL_ERROR;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CheckStackDepths --
+ *
+ *  Checks the stack depths in the header of a decoded ByteCode, which
+ *  TclExecuteByteCode trusts to size the stack it allocates for the
+ *  operands and the enclosing catches. The operands cannot grow the stack
+ *  by more than the sum of the worst-case stack effects of the
+ *  instructions, each counted once, as long as every loop leaves the stack
+ *  as it found it, which the compiler guarantees but which is not checked
+ *  here; catches cannot nest deeper than there are exception ranges, and
+ *  -1 stands for no ranges.
+ *  When the ByteCode is to be executed, its depths are raised to these
+ *  bounds, so that a header that understates them cannot make the stack
+ *  overflow; otherwise they are left as written, for compiler::verify.
+ *
+ * Results:
+ *  Returns TCL_ERROR if an instruction is unknown or runs past the end of
+ *  the code, or if a depth is out of its bounds.
+ *
+ * Side effects:
+ *  May raise the stack depths of the ByteCode.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int CheckStackDepths(DecodeContext* ctxPtr, ByteCode* codePtr)
+{
+    InstructionDesc* opCodesTablePtr = (InstructionDesc*)TclGetInstructionTable();
+    const unsigned char* pc = codePtr->codeStart;
+    const unsigned char* endPtr = pc + codePtr->numCodeBytes;
+    Tcl_WideInt stackBound = 0;
+    int effect;
+
+    while (pc < endPtr)
+    {
+        if ((*pc > LAST_INST_OPCODE) || (opCodesTablePtr[*pc].numBytes > endPtr - pc))
+        {
+            return DecodeError(ctxPtr, "bad instruction");
+        }
+
+        /*
+         * INT_MIN stands for an effect of 1 minus the first operand, which
+         * is never more than 1.
+         */
+
+        effect = opCodesTablePtr[*pc].stackEffect;
+        if (effect == INT_MIN)
+        {
+            effect = 1;
+        }
+        if (effect > 0)
+        {
+            stackBound += effect;
+        }
+        pc += opCodesTablePtr[*pc].numBytes;
+    }
+
+    if ((codePtr->maxStackDepth < 0) || (codePtr->maxStackDepth > stackBound) || (codePtr->maxExceptDepth < -1) ||
+        (codePtr->maxExceptDepth > codePtr->numExceptRanges))
+    {
+        return DecodeError(ctxPtr, "bad stack depth");
+    }
+    if (ctxPtr->forExecution)
+    {
+        codePtr->maxStackDepth = stackBound;
+        codePtr->maxExceptDepth = codePtr->numExceptRanges;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeLocMap --
+ *
+ *  Decodes the command location map of a ByteCode, whose array sizes
+ *  are given in the order of the header: code deltas, code lengths,
+ *  source deltas, source lengths, the last two being -1 when the source
+ *  map was not emitted.
+ *
+ * Results:
+ *  Returns a standard TCL result code.
+ *
+ * Side effects:
+ *  Fills the location arrays of the ByteCode.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DecodeLocMap(DecodeContext* ctxPtr, ByteCode* codePtr, const Tcl_Size* sizes)
+{
+    Tcl_Size numCommands = codePtr->numCommands, i;
+    Tcl_Size srcDeltaSize = (sizes[2] < 0) ? numCommands : sizes[2];
+    Tcl_Size srcLengthSize = (sizes[3] < 0) ? numCommands : sizes[3];
+    unsigned char* p = codePtr->codeDeltaStart;
+
+    if ((sizes[0] < 0) || (sizes[1] < 0) ||
+        ((Tcl_WideInt)sizes[0] + sizes[1] + srcDeltaSize + srcLengthSize > codePtr->numCmdLocBytes))
+    {
+        return DecodeError(ctxPtr, "bad location map sizes");
+    }
+
+    for (i = 0; i < 4; i++)
+    {
+        switch (i)
+        {
+            case 0:
+                codePtr->codeDeltaStart = p;
+                break;
+            case 1:
+                codePtr->codeLengthStart = p;
+                break;
+            case 2:
+                codePtr->srcDeltaStart = p;
+                break;
+            default:
+                codePtr->srcLengthStart = p;
+                break;
+        }
+        if (sizes[i] < 0)
+        {
+            memset(p, 0, numCommands);
+            p += numCommands;
+            continue;
+        }
+        if ((DecodeExpectedCount(ctxPtr, sizes[i]) != TCL_OK) || (DecodeBytes(ctxPtr, p, sizes[i]) != TCL_OK))
+        {
+            return TCL_ERROR;
+        }
+        p += sizes[i];
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeLiteral --
+ *
+ *  Decodes an entry of the literal array written by EmitObjArray: an
+ *  object, a clone of an earlier procedure body, or a list whose elements
+ *  are objects or references to earlier literals. The references must
+ *  point backwards, to literals already in the ByteCode.
+ *
+ * Results:
+ *  Returns a standard TCL result code. On success, *objPtrPtr is an
+ *  object whose reference count was incremented.
+ *
+ * Side effects:
+ *  Advances the decoding position.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DecodeLiteral(DecodeContext* ctxPtr, ByteCode* codePtr, Tcl_Obj** objPtrPtr)
+{
+    Tcl_Obj *objPtr, *elemPtr;
+    Tcl_Size numElems, index, i;
+    int typeCode;
+
+    if (DecodeChar(ctxPtr, &typeCode) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    if (((typeCode == CMP_PROCCLONE_CODE) || (typeCode == CMP_LIST_CODE)) && (ctxPtr->formatVersion < 4))
+    {
+        return DecodeError(ctxPtr, "literal type not in this format version");
+    }
+
+    if (typeCode == CMP_PROCCLONE_CODE)
+    {
+        if ((DecodeSize(ctxPtr, &index) != TCL_OK))
+        {
+            return TCL_ERROR;
+        }
+        if ((index < 0) || (index >= codePtr->numLitObjects) || (codePtr->objArrayPtr[index]->typePtr != decProcBodyType))
+        {
+            return DecodeError(ctxPtr, "bad procedure body reference");
+        }
+        objPtr = CloneProcBody((Proc*)codePtr->objArrayPtr[index]->internalRep.otherValuePtr);
+    }
+    else if (typeCode == CMP_LIST_CODE)
+    {
+        if (DecodeCount(ctxPtr, &numElems) != TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+        ctxPtr->statsPtr->numListLiterals++;
+        objPtr = Tcl_NewListObj(0, NULL);
+        for (i = 0; i < numElems; i++)
+        {
+            if (DecodeChar(ctxPtr, &typeCode) != TCL_OK)
+            {
+                Tcl_DecrRefCount(objPtr);
+                return TCL_ERROR;
+            }
+            if (typeCode == CMP_LITREF_CODE)
+            {
+                if (DecodeSize(ctxPtr, &index) != TCL_OK)
+                {
+                    Tcl_DecrRefCount(objPtr);
+                    return TCL_ERROR;
+                }
+                if ((index < 0) || (index >= codePtr->numLitObjects))
+                {
+                    Tcl_DecrRefCount(objPtr);
+                    return DecodeError(ctxPtr, "bad literal reference");
+                }
+                elemPtr = codePtr->objArrayPtr[index];
+            }
+            else if (DecodeObject(ctxPtr, typeCode, &elemPtr) != TCL_OK)
+            {
+                Tcl_DecrRefCount(objPtr);
+                return TCL_ERROR;
+            }
+            Tcl_ListObjAppendElement(NULL, objPtr, elemPtr);
+        }
+    }
+    else if (typeCode == CMP_BYTECODE_CODE)
+    {
+        if (DecodeByteCode(ctxPtr, NULL, &objPtr) != TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+        *objPtrPtr = objPtr;
+        return TCL_OK;
+    }
+    else if (typeCode == CMP_PROCBODY_CODE)
+    {
+        return DecodeProcBody(ctxPtr, objPtrPtr);
+    }
+    else if (DecodeObject(ctxPtr, typeCode, &objPtr) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    Tcl_IncrRefCount(objPtr);
+    *objPtrPtr = objPtr;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeObject --
+ *
+ *  Decodes, after its type code, an object written by EmitObject that is
+ *  not a ByteCode or procedure body: an integer or double as a line of
+ *  text, a string with its length then its bytes, or a string in ASCII85.
+ *
+ * Results:
+ *  Returns a standard TCL result code. On success, *objPtrPtr is a new
+ *  object with a reference count of 0.
+ *
+ * Side effects:
+ *  Advances the decoding position.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DecodeObject(DecodeContext* ctxPtr, int typeCode, Tcl_Obj** objPtrPtr)
+{
+    const char* p;
+    Tcl_Obj* objPtr;
+    Tcl_WideInt wideValue;
+    double doubleValue;
+    Tcl_Size length;
+
+    switch (typeCode)
+    {
+        case CMP_INT_CODE:
+        case CMP_DOUBLE_CODE:
+            p = memchr(ctxPtr->curPtr, '\n', ctxPtr->endPtr - ctxPtr->curPtr);
+            if (!p)
+            {
+                return DecodeError(ctxPtr, "unexpected end of file");
+            }
+            length = p - ctxPtr->curPtr;
+            if ((length > 0) && (p[-1] == '\r'))
+            {
+                length--;
+            }
+            objPtr = Tcl_NewStringObj(ctxPtr->curPtr, length);
+            ctxPtr->curPtr = p + 1;
+            if (typeCode == CMP_INT_CODE)
+            {
+                Tcl_GetWideIntFromObj(NULL, objPtr, &wideValue);
+            }
+            else
+            {
+                Tcl_GetDoubleFromObj(NULL, objPtr, &doubleValue);
+            }
+            break;
+
+        case CMP_STRING_CODE:
+            if (DecodeCount(ctxPtr, &length) != TCL_OK)
+            {
+                return TCL_ERROR;
+            }
+            if (length >= ctxPtr->endPtr - ctxPtr->curPtr)
+            {
+                return DecodeError(ctxPtr, "unexpected end of file");
+            }
+            objPtr = Tcl_NewStringObj(ctxPtr->curPtr, length);
+            ctxPtr->curPtr += length + 1;
+            break;
+
+        case CMP_XSTRING_CODE:
+            if (DecodeString(ctxPtr, &objPtr) != TCL_OK)
+            {
+                return TCL_ERROR;
+            }
+            break;
+
+        default:
+            return DecodeError(ctxPtr, "unknown literal type");
+    }
+
+    *objPtrPtr = objPtr;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeProcBody --
+ *
+ *  Decodes a procedure body written by EmitProcBody: its ByteCode, then
+ *  the argument and local counts and the compiled locals. The Proc is
+ *  held by a procbody object, which frees it when released.
+ *
+ * Results:
+ *  Returns a standard TCL result code. On success, *objPtrPtr is a new
+ *  procbody object with a reference count of 1.
+ *
+ * Side effects:
+ *  Advances the decoding position, and counts the procedure body.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DecodeProcBody(DecodeContext* ctxPtr, Tcl_Obj** objPtrPtr)
+{
+    Proc* procPtr;
+    Tcl_Obj *objPtr, *bodyPtr;
+    CompiledLocal* localPtr;
+    Tcl_Size numArgs, numCompiledLocals, i;
+
+    procPtr = (Proc*)Tcl_Alloc(sizeof(Proc));
+    memset(procPtr, 0, sizeof(Proc));
+    procPtr->iPtr = (Interp*)ctxPtr->interp;
+    objPtr = TclNewProcBodyObj(procPtr);
+    Tcl_IncrRefCount(objPtr);
+
+    if (DecodeByteCode(ctxPtr, procPtr, &bodyPtr) != TCL_OK)
+    {
+        Tcl_DecrRefCount(objPtr);
+        return TCL_ERROR;
+    }
+    procPtr->bodyPtr = bodyPtr;
+
+    if ((DecodeSize(ctxPtr, &numArgs) != TCL_OK) || (DecodeCount(ctxPtr, &numCompiledLocals) != TCL_OK))
+    {
+        Tcl_DecrRefCount(objPtr);
+        return TCL_ERROR;
+    }
+    procPtr->numArgs = numArgs;
+
+    for (i = 0; i < numCompiledLocals; i++)
+    {
+        if (DecodeCompiledLocal(ctxPtr, &localPtr) != TCL_OK)
+        {
+            Tcl_DecrRefCount(objPtr);
+            return TCL_ERROR;
+        }
+        if (procPtr->lastLocalPtr)
+        {
+            procPtr->lastLocalPtr->nextPtr = localPtr;
+        }
+        else
+        {
+            procPtr->firstLocalPtr = localPtr;
+        }
+        procPtr->lastLocalPtr = localPtr;
+        procPtr->numCompiledLocals++;
+    }
+
+    ctxPtr->statsPtr->numProcBodies++;
+    *objPtrPtr = objPtr;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CloneProcBody --
+ *
+ *  Creates the procedure body of a CMP_PROCCLONE_CODE literal: a fresh
+ *  Proc, with a copy of the compiled locals of an earlier procedure body,
+ *  around the same ByteCode. Each proc command needs a Proc of its own,
+ *  since the Proc records the command it belongs to.
+ *
+ * Results:
+ *  Returns a new procbody object with a reference count of 0.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj* CloneProcBody(Proc* origPtr)
+{
+    Proc* procPtr;
+    CompiledLocal *origLocalPtr, *localPtr;
+    size_t localSize;
+
+    procPtr = (Proc*)Tcl_Alloc(sizeof(Proc));
+    memset(procPtr, 0, sizeof(Proc));
+    procPtr->iPtr = origPtr->iPtr;
+    procPtr->bodyPtr = origPtr->bodyPtr;
+    Tcl_IncrRefCount(procPtr->bodyPtr);
+    procPtr->numArgs = origPtr->numArgs;
+    procPtr->numCompiledLocals = origPtr->numCompiledLocals;
+
+    for (origLocalPtr = origPtr->firstLocalPtr; origLocalPtr; origLocalPtr = origLocalPtr->nextPtr)
+    {
+        localSize = offsetof(CompiledLocal, name) + origLocalPtr->nameLength + 1;
+        localPtr = (CompiledLocal*)Tcl_Alloc(localSize);
+        memcpy(localPtr, origLocalPtr, localSize);
+        localPtr->nextPtr = NULL;
+        localPtr->resolveInfo = NULL;
+        if (localPtr->defValuePtr)
+        {
+            Tcl_IncrRefCount(localPtr->defValuePtr);
+        }
+        if (procPtr->lastLocalPtr)
+        {
+            procPtr->lastLocalPtr->nextPtr = localPtr;
+        }
+        else
+        {
+            procPtr->firstLocalPtr = localPtr;
+        }
+        procPtr->lastLocalPtr = localPtr;
+    }
+
+    return TclNewProcBodyObj(procPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeCompiledLocal --
+ *
+ *  Decodes a CompiledLocal written by EmitCompiledLocal: the name, the
+ *  frame index, whether there is a default value, the flags mask, and the
+ *  default value.
+ *
+ * Results:
+ *  Returns a standard TCL result code. On success, *localPtrPtr is a new
+ *  CompiledLocal, allocated like the ones of TclCreateProc.
+ *
+ * Side effects:
+ *  Advances the decoding position.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DecodeCompiledLocal(DecodeContext* ctxPtr, CompiledLocal** localPtrPtr)
+{
+    CompiledLocal* localPtr;
+    Tcl_Size nameLength, frameIndex, hasDef, mask;
+    Tcl_Obj* defPtr;
+    int typeCode, i;
+
+    if (DecodeCount(ctxPtr, &nameLength) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+    localPtr = (CompiledLocal*)Tcl_Alloc(offsetof(CompiledLocal, name) + nameLength + 1);
+    memset(localPtr, 0, offsetof(CompiledLocal, name));
+    localPtr->nameLength = nameLength;
+    localPtr->name[nameLength] = '\0';
+
+    if ((DecodeBytes(ctxPtr, (unsigned char*)localPtr->name, nameLength) != TCL_OK) ||
+        (DecodeSize(ctxPtr, &frameIndex) != TCL_OK) || (DecodeSize(ctxPtr, &hasDef) != TCL_OK) ||
+        (DecodeSize(ctxPtr, &mask) != TCL_OK))
+    {
+        Tcl_Free((char*)localPtr);
+        return TCL_ERROR;
+    }
+    localPtr->frameIndex = frameIndex;
+    for (i = 0; i < NUM_VAR_FLAGS; i++)
+    {
+        if (mask & (1 << i))
+        {
+            localPtr->flags |= varFlagsList[i];
+        }
+    }
+
+    if (hasDef)
+    {
+        if ((DecodeChar(ctxPtr, &typeCode) != TCL_OK) || (DecodeObject(ctxPtr, typeCode, &defPtr) != TCL_OK))
+        {
+            Tcl_Free((char*)localPtr);
+            return TCL_ERROR;
+        }
+        localPtr->defValuePtr = defPtr;
+        Tcl_IncrRefCount(defPtr);
+    }
+
+    *localPtrPtr = localPtr;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeExceptionRange --
+ *
+ *  Decodes an exception range written by EmitExcRangeArray.
+ *
+ * Results:
+ *  Returns a standard TCL result code.
+ *
+ * Side effects:
+ *  Fills *rangePtr, and advances the decoding position.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DecodeExceptionRange(DecodeContext* ctxPtr, ExceptionRange* rangePtr)
+{
+    Tcl_Size fields[6];
+    int typeCode, i;
+
+    if (DecodeChar(ctxPtr, &typeCode) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+    if (typeCode == CMP_LOOP_EXCEPTION_RANGE)
+    {
+        rangePtr->type = LOOP_EXCEPTION_RANGE;
+    }
+    else if (typeCode == CMP_CATCH_EXCEPTION_RANGE)
+    {
+        rangePtr->type = CATCH_EXCEPTION_RANGE;
+    }
+    else
+    {
+        return DecodeError(ctxPtr, "unknown exception range type");
+    }
+
+    for (i = 0; i < 6; i++)
+    {
+        if (DecodeSize(ctxPtr, &fields[i]) != TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+    }
+    rangePtr->nestingLevel = fields[0];
+    rangePtr->codeOffset = fields[1];
+    rangePtr->numCodeBytes = fields[2];
+    rangePtr->breakOffset = fields[3];
+    rangePtr->continueOffset = fields[4];
+    rangePtr->catchOffset = fields[5];
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeAuxData --
+ *
+ *  Decodes an AuxData item written by EmitAuxDataArray: a jump table, a
+ *  "dict update" variable list or a foreach variable list, allocated as
+ *  Tcl does so that the free procedure of the type releases it.
+ *
+ * Results:
+ *  Returns a standard TCL result code.
+ *
+ * Side effects:
+ *  Fills *auxDataPtr, and advances the decoding position.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DecodeAuxData(DecodeContext* ctxPtr, AuxData* auxDataPtr)
+{
+    JumptableInfo* jtPtr;
+    DictUpdateInfo* duiPtr;
+    ForeachInfo* infoPtr;
+    ForeachVarList* varListPtr;
+    Tcl_HashEntry* entryPtr;
+    Tcl_Obj* keyPtr;
+    Tcl_Size count, numVars, value, i, j;
+    int typeCode, isNew;
+
+    if ((DecodeChar(ctxPtr, &typeCode) != TCL_OK) || (DecodeCount(ctxPtr, &count) != TCL_OK))
+    {
+        return TCL_ERROR;
+    }
+
+    switch (typeCode)
+    {
+        case CMP_JUMPTABLE_INFO:
+            jtPtr = (JumptableInfo*)Tcl_Alloc(sizeof(JumptableInfo));
+            Tcl_InitHashTable(&jtPtr->hashTable, TCL_STRING_KEYS);
+            for (i = 0; i < count; i++)
+            {
+                if ((DecodeSize(ctxPtr, &value) != TCL_OK) || (DecodeString(ctxPtr, &keyPtr) != TCL_OK))
+                {
+                    decJumptableInfoType->freeProc(jtPtr);
+                    return TCL_ERROR;
+                }
+                entryPtr = Tcl_CreateHashEntry(&jtPtr->hashTable, Tcl_GetString(keyPtr), &isNew);
+                Tcl_SetHashValue(entryPtr, SIZE2PTR(value));
+                Tcl_DecrRefCount(keyPtr);
+            }
+            auxDataPtr->type = decJumptableInfoType;
+            auxDataPtr->clientData = jtPtr;
+            return TCL_OK;
+
+        case CMP_DICTUPDATE_INFO:
+            duiPtr = (DictUpdateInfo*)Tcl_Alloc(offsetof(DictUpdateInfo, varIndices) + sizeof(duiPtr->varIndices[0]) * (count ? count : 1));
+            duiPtr->length = count;
+            for (i = 0; i < count; i++)
+            {
+                if (DecodeSize(ctxPtr, &value) != TCL_OK)
+                {
+                    Tcl_Free((char*)duiPtr);
+                    return TCL_ERROR;
+                }
+                duiPtr->varIndices[i] = value;
+            }
+            auxDataPtr->type = decDictUpdateInfoType;
+            auxDataPtr->clientData = duiPtr;
+            return TCL_OK;
+
+        case CMP_NEW_FOREACH_INFO:
+            /*
+             * count is the number of lists; the loop counter temporary
+             * follows on the same line.
+             */
+
+            infoPtr = (ForeachInfo*)Tcl_Alloc(offsetof(ForeachInfo, varLists) +
+                                              sizeof(ForeachVarList*) * (count ? count : 1));
+            infoPtr->numLists = 0;
+            infoPtr->firstValueTemp = 0;
+            if (DecodeSize(ctxPtr, &value) != TCL_OK)
+            {
+                decNewForeachInfoType->freeProc(infoPtr);
+                return TCL_ERROR;
+            }
+            infoPtr->loopCtTemp = value;
+            for (i = 0; i < count; i++)
+            {
+                if (DecodeCount(ctxPtr, &numVars) != TCL_OK)
+                {
+                    decNewForeachInfoType->freeProc(infoPtr);
+                    return TCL_ERROR;
+                }
+                varListPtr = (ForeachVarList*)Tcl_Alloc(offsetof(ForeachVarList, varIndexes) +
+                                                        sizeof(varListPtr->varIndexes[0]) * (numVars ? numVars : 1));
+                varListPtr->numVars = numVars;
+                infoPtr->varLists[i] = varListPtr;
+                infoPtr->numLists++;
+                for (j = 0; j < numVars; j++)
+                {
+                    if (DecodeSize(ctxPtr, &value) != TCL_OK)
+                    {
+                        decNewForeachInfoType->freeProc(infoPtr);
+                        return TCL_ERROR;
+                    }
+                    varListPtr->varIndexes[j] = value;
+                }
+            }
+            auxDataPtr->type = decNewForeachInfoType;
+            auxDataPtr->clientData = infoPtr;
+            return TCL_OK;
+
+        default:
+            return DecodeError(ctxPtr, "unknown AuxData type");
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LocArrayLength --
+ *
+ *  Calculates the length of a location array, like
+ *  CalculateLocArrayLength in cmpWrite.c.
+ *
+ * Results:
+ *  Returns the length, in bytes, of the array.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Size LocArrayLength(unsigned char* bytes, Tcl_Size numCommands)
+{
+    Tcl_Size i, length = 0;
+
+    for (i = 0; i < numCommands; i++)
+    {
+        length += (bytes[length] == 0xff) ? 5 : 1;
+    }
+    return length;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Mismatch --
+ *
+ *  Reports a difference between an original and a decoded structure.
+ *
+ * Results:
+ *  Returns TCL_ERROR.
+ *
+ * Side effects:
+ *  Sets the TCL result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int Mismatch(Tcl_Interp* interp, Tcl_Obj* wherePtr, const char* what, Tcl_WideInt origValue, Tcl_WideInt decodedValue)
+{
+    Tcl_SetObjResult(interp,
+                     Tcl_ObjPrintf("round trip mismatch in %s: %s is %" TCL_LL_MODIFIER "d, decoded as %" TCL_LL_MODIFIER "d",
+                                   Tcl_GetString(wherePtr),
+                                   what,
+                                   origValue,
+                                   decodedValue));
+    return TCL_ERROR;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompareByteCodes --
+ *
+ *  Compares an original ByteCode with its decoded copy.
+ *
+ * Results:
+ *  Returns TCL_OK if they match, or TCL_ERROR with the first difference
+ *  in the result.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int CompareByteCodes(Tcl_Interp* interp, ByteCode* origPtr, ByteCode* decodedPtr, Tcl_Obj* wherePtr)
+{
+    ExceptionRange *origRangePtr, *decodedRangePtr;
+    Tcl_Obj* literalWherePtr;
+    Tcl_Size i, length;
+    int result = TCL_OK;
+
+#define COMPARE_FIELD(field)                                                                                       \
+    if (origPtr->field != decodedPtr->field)                                                                       \
+    {                                                                                                              \
+        return Mismatch(interp, wherePtr, #field, origPtr->field, decodedPtr->field);                              \
+    }
+    COMPARE_FIELD(numCommands);
+    COMPARE_FIELD(numCodeBytes);
+    COMPARE_FIELD(numLitObjects);
+    COMPARE_FIELD(numExceptRanges);
+    COMPARE_FIELD(numAuxDataItems);
+    COMPARE_FIELD(numCmdLocBytes);
+    COMPARE_FIELD(maxExceptDepth);
+    COMPARE_FIELD(maxStackDepth);
+#undef COMPARE_FIELD
+
+    for (i = 0; i < origPtr->numCodeBytes; i++)
+    {
+        if (origPtr->codeStart[i] != decodedPtr->codeStart[i])
+        {
+            return Mismatch(interp, wherePtr, "an instruction byte", origPtr->codeStart[i], decodedPtr->codeStart[i]);
+        }
+    }
+
+    length = LocArrayLength(origPtr->codeDeltaStart, origPtr->numCommands);
+    if (memcmp(origPtr->codeDeltaStart, decodedPtr->codeDeltaStart, length) != 0)
+    {
+        return Mismatch(interp, wherePtr, "the code delta array length", length, -1);
+    }
+    length = LocArrayLength(origPtr->codeLengthStart, origPtr->numCommands);
+    if (memcmp(origPtr->codeLengthStart, decodedPtr->codeLengthStart, length) != 0)
+    {
+        return Mismatch(interp, wherePtr, "the code length array length", length, -1);
+    }
+#if EMIT_SRCMAP
+    length = LocArrayLength(origPtr->srcDeltaStart, origPtr->numCommands);
+    if (memcmp(origPtr->srcDeltaStart, decodedPtr->srcDeltaStart, length) != 0)
+    {
+        return Mismatch(interp, wherePtr, "the source delta array length", length, -1);
+    }
+    length = LocArrayLength(origPtr->srcLengthStart, origPtr->numCommands);
+    if (memcmp(origPtr->srcLengthStart, decodedPtr->srcLengthStart, length) != 0)
+    {
+        return Mismatch(interp, wherePtr, "the source length array length", length, -1);
+    }
+#endif
+
+    for (i = 0; (result == TCL_OK) && (i < origPtr->numLitObjects); i++)
+    {
+        literalWherePtr = Tcl_ObjPrintf("literal %" TCL_SIZE_MODIFIER "d of %s", i, Tcl_GetString(wherePtr));
+        Tcl_IncrRefCount(literalWherePtr);
+        result = CompareLiterals(interp, origPtr->objArrayPtr[i], decodedPtr->objArrayPtr[i], literalWherePtr);
+        Tcl_DecrRefCount(literalWherePtr);
+    }
+    if (result != TCL_OK)
+    {
+        return result;
+    }
+
+    for (i = 0; i < origPtr->numExceptRanges; i++)
+    {
+        origRangePtr = &origPtr->exceptArrayPtr[i];
+        decodedRangePtr = &decodedPtr->exceptArrayPtr[i];
+        if ((origRangePtr->type != decodedRangePtr->type) ||
+            (origRangePtr->nestingLevel != decodedRangePtr->nestingLevel) ||
+            (origRangePtr->codeOffset != decodedRangePtr->codeOffset) ||
+            (origRangePtr->numCodeBytes != decodedRangePtr->numCodeBytes) ||
+            (origRangePtr->breakOffset != decodedRangePtr->breakOffset) ||
+            (origRangePtr->continueOffset != decodedRangePtr->continueOffset) ||
+            (origRangePtr->catchOffset != decodedRangePtr->catchOffset))
+        {
+            return Mismatch(interp, wherePtr, "an exception range at code offset", origRangePtr->codeOffset,
+                            decodedRangePtr->codeOffset);
+        }
+    }
+
+    for (i = 0; i < origPtr->numAuxDataItems; i++)
+    {
+        if (CompareAuxData(interp, &origPtr->auxDataArrayPtr[i], &decodedPtr->auxDataArrayPtr[i], wherePtr) != TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+    }
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompareLiterals --
+ *
+ *  Compares an original literal with its decoded copy: procedure bodies
+ *  and ByteCodes recursively, other literals by their string.
+ *
+ * Results:
+ *  Returns TCL_OK if they match, or TCL_ERROR with the first difference
+ *  in the result.
+ *
+ * Side effects:
+ *  May generate the string representation of the decoded literal.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int CompareLiterals(Tcl_Interp* interp, Tcl_Obj* origPtr, Tcl_Obj* decodedPtr, Tcl_Obj* wherePtr)
+{
+    const char *origBytes, *decodedBytes;
+    Tcl_Size origLength, decodedLength;
+
+    if (origPtr->typePtr == decProcBodyType)
+    {
+        if (decodedPtr->typePtr != decProcBodyType)
+        {
+            return Mismatch(interp, wherePtr, "a procedure body", 1, 0);
+        }
+        return CompareProcs(interp,
+                            (Proc*)origPtr->internalRep.otherValuePtr,
+                            (Proc*)decodedPtr->internalRep.otherValuePtr,
+                            wherePtr);
+    }
+    if (origPtr->typePtr == decByteCodeType)
+    {
+        if (decodedPtr->typePtr != decByteCodeType)
+        {
+            return Mismatch(interp, wherePtr, "a ByteCode", 1, 0);
+        }
+        return CompareByteCodes(interp,
+                                (ByteCode*)origPtr->internalRep.otherValuePtr,
+                                (ByteCode*)decodedPtr->internalRep.otherValuePtr,
+                                wherePtr);
+    }
+
+    origBytes = Tcl_GetStringFromObj(origPtr, &origLength);
+    decodedBytes = Tcl_GetStringFromObj(decodedPtr, &decodedLength);
+    if ((origLength != decodedLength) || (memcmp(origBytes, decodedBytes, origLength) != 0))
+    {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("round trip mismatch in %s: \"%.40s\" is decoded as \"%.40s\"",
+                                       Tcl_GetString(wherePtr),
+                                       origBytes,
+                                       decodedBytes));
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompareProcs --
+ *
+ *  Compares an original procedure body with its decoded copy: the
+ *  argument count, the compiled locals and the ByteCode. Only the flags
+ *  that are emitted are compared.
+ *
+ * Results:
+ *  Returns TCL_OK if they match, or TCL_ERROR with the first difference
+ *  in the result.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int CompareProcs(Tcl_Interp* interp, Proc* origPtr, Proc* decodedPtr, Tcl_Obj* wherePtr)
+{
+    CompiledLocal *origLocalPtr, *decodedLocalPtr;
+    Tcl_Obj* bodyWherePtr;
+    int result;
+
+    if (origPtr->numArgs != decodedPtr->numArgs)
+    {
+        return Mismatch(interp, wherePtr, "numArgs", origPtr->numArgs, decodedPtr->numArgs);
+    }
+    if (origPtr->numCompiledLocals != decodedPtr->numCompiledLocals)
+    {
+        return Mismatch(interp, wherePtr, "numCompiledLocals", origPtr->numCompiledLocals, decodedPtr->numCompiledLocals);
+    }
+
+    for (origLocalPtr = origPtr->firstLocalPtr, decodedLocalPtr = decodedPtr->firstLocalPtr; origLocalPtr;
+         origLocalPtr = origLocalPtr->nextPtr, decodedLocalPtr = decodedLocalPtr->nextPtr)
+    {
+        if ((origLocalPtr->nameLength != decodedLocalPtr->nameLength) ||
+            (memcmp(origLocalPtr->name, decodedLocalPtr->name, origLocalPtr->nameLength) != 0) ||
+            (origLocalPtr->frameIndex != decodedLocalPtr->frameIndex) ||
+            ((origLocalPtr->flags & (VAR_ARGUMENT | VAR_TEMPORARY)) != decodedLocalPtr->flags) ||
+            (!origLocalPtr->defValuePtr != !decodedLocalPtr->defValuePtr) ||
+            (origLocalPtr->defValuePtr &&
+             (strcmp(Tcl_GetString(origLocalPtr->defValuePtr), Tcl_GetString(decodedLocalPtr->defValuePtr)) != 0)))
+        {
+            return Mismatch(interp, wherePtr, "the compiled local at frame index", origLocalPtr->frameIndex,
+                            decodedLocalPtr->frameIndex);
+        }
+    }
+
+    bodyWherePtr = Tcl_ObjPrintf("the body of %s", Tcl_GetString(wherePtr));
+    Tcl_IncrRefCount(bodyWherePtr);
+    result = CompareByteCodes(interp,
+                              (ByteCode*)origPtr->bodyPtr->internalRep.otherValuePtr,
+                              (ByteCode*)decodedPtr->bodyPtr->internalRep.otherValuePtr,
+                              bodyWherePtr);
+    Tcl_DecrRefCount(bodyWherePtr);
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompareAuxData --
+ *
+ *  Compares an original AuxData item with its decoded copy.
+ *
+ * Results:
+ *  Returns TCL_OK if they match, or TCL_ERROR with the first difference
+ *  in the result.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int CompareAuxData(Tcl_Interp* interp, AuxData* origPtr, AuxData* decodedPtr, Tcl_Obj* wherePtr)
+{
+    Tcl_HashSearch search;
+    Tcl_HashEntry *origEntryPtr, *decodedEntryPtr;
+    JumptableInfo *origJtPtr, *decodedJtPtr;
+    DictUpdateInfo *origDuiPtr, *decodedDuiPtr;
+    ForeachInfo *origInfoPtr, *decodedInfoPtr;
+    ForeachVarList *origListPtr, *decodedListPtr;
+    int i, j;
+
+    if (origPtr->type != decodedPtr->type)
+    {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("round trip mismatch in %s: %s AuxData is decoded as %s",
+                                       Tcl_GetString(wherePtr),
+                                       origPtr->type->name,
+                                       decodedPtr->type->name));
+        return TCL_ERROR;
+    }
+
+    if (origPtr->type == decJumptableInfoType)
+    {
+        origJtPtr = (JumptableInfo*)origPtr->clientData;
+        decodedJtPtr = (JumptableInfo*)decodedPtr->clientData;
+        if (origJtPtr->hashTable.numEntries != decodedJtPtr->hashTable.numEntries)
+        {
+            return Mismatch(interp, wherePtr, "the number of jump table entries", origJtPtr->hashTable.numEntries,
+                            decodedJtPtr->hashTable.numEntries);
+        }
+        for (origEntryPtr = Tcl_FirstHashEntry(&origJtPtr->hashTable, &search); origEntryPtr;
+             origEntryPtr = Tcl_NextHashEntry(&search))
+        {
+            decodedEntryPtr = Tcl_FindHashEntry(&decodedJtPtr->hashTable, Tcl_GetHashKey(&origJtPtr->hashTable, origEntryPtr));
+            if (!decodedEntryPtr || (Tcl_GetHashValue(origEntryPtr) != Tcl_GetHashValue(decodedEntryPtr)))
+            {
+                return Mismatch(interp, wherePtr, "a jump table offset", PTR2SIZE(Tcl_GetHashValue(origEntryPtr)),
+                                decodedEntryPtr ? PTR2SIZE(Tcl_GetHashValue(decodedEntryPtr)) : -1);
+            }
+        }
+    }
+    else if (origPtr->type == decDictUpdateInfoType)
+    {
+        origDuiPtr = (DictUpdateInfo*)origPtr->clientData;
+        decodedDuiPtr = (DictUpdateInfo*)decodedPtr->clientData;
+        if (origDuiPtr->length != decodedDuiPtr->length)
+        {
+            return Mismatch(interp, wherePtr, "the dict update length", origDuiPtr->length, decodedDuiPtr->length);
+        }
+        for (i = 0; i < origDuiPtr->length; i++)
+        {
+            if (origDuiPtr->varIndices[i] != decodedDuiPtr->varIndices[i])
+            {
+                return Mismatch(interp, wherePtr, "a dict update variable", origDuiPtr->varIndices[i],
+                                decodedDuiPtr->varIndices[i]);
+            }
+        }
+    }
+    else if (origPtr->type == decNewForeachInfoType)
+    {
+        origInfoPtr = (ForeachInfo*)origPtr->clientData;
+        decodedInfoPtr = (ForeachInfo*)decodedPtr->clientData;
+        if ((origInfoPtr->numLists != decodedInfoPtr->numLists) || (origInfoPtr->loopCtTemp != decodedInfoPtr->loopCtTemp))
+        {
+            return Mismatch(interp, wherePtr, "the foreach list count", origInfoPtr->numLists, decodedInfoPtr->numLists);
+        }
+        for (i = 0; i < origInfoPtr->numLists; i++)
+        {
+            origListPtr = origInfoPtr->varLists[i];
+            decodedListPtr = decodedInfoPtr->varLists[i];
+            if (origListPtr->numVars != decodedListPtr->numVars)
+            {
+                return Mismatch(interp, wherePtr, "a foreach variable count", origListPtr->numVars, decodedListPtr->numVars);
+            }
+            for (j = 0; j < origListPtr->numVars; j++)
+            {
+                if (origListPtr->varIndexes[j] != decodedListPtr->varIndexes[j])
+                {
+                    return Mismatch(interp, wherePtr, "a foreach variable", origListPtr->varIndexes[j],
+                                    decodedListPtr->varIndexes[j]);
+                }
+            }
+        }
+    }
+    return TCL_OK;
+}
@@ -73,6 +73,15 @@ Tcl_FreeInternalRep(Tcl_Obj *objPtr) {
 }
 #endif /* TCL_MAJOR_VERSION < 8 */
 
+/*
+ * Conversions between Tcl_Size values (literal indices, code and source
+ * offsets) and the pointer-sized keys and values of hash tables. INT2PTR
+ * and PTR2INT go through int, which truncates them where Tcl_Size is 64
+ * bit.
+ */
+#define SIZE2PTR(i) ((void*)(intptr_t)(i))
+#define PTR2SIZE(p) ((Tcl_Size)(intptr_t)(p))
+
 /*
  * USE_CATCH_WRAPPER controls whether the emitted code has a catch around
  * the call to loader::bceval and code to strip off the additional back trace
@@ -101,6 +110,52 @@ Tcl_FreeInternalRep(Tcl_Obj *objPtr) {
  */
 /* #define EMIT_SRCMAP 0 */
 
+/*
+ * The format versions of the compiled files, chosen with compiler::compile
+ * -format. Version 3, the default, is what every tbcload 2.0 reads. In
+ * version 4, a procedure body that shares its compiled code with an
+ * earlier procedure body in the same literal array (same argument list and
+ * body text, see CloneProcBody) is emitted as CMP_PROCCLONE_CODE and the
+ * index of that earlier literal, rather than as a full copy; the reader
+ * must create a fresh Proc around the shared ByteCode for each clone, as
+ * compiler::bceval does. Also in version 4, literals whose string
+ * representation is a canonical list of at least two elements (option
+ * lists, foreach value lists, dict-shaped constants) are emitted as
+ * CMP_LIST_CODE and an element vector rather than as opaque strings. Each
+ * element is either a back-reference to an earlier entry in the same
+ * literal array or an ordinary object, so the reader can build the list
+ * internal representation directly instead of reparsing the string on first
+ * use.
+ */
+#define CMP_FORMAT_VERSION 3
+#define CMP_MAX_FORMAT_VERSION 4
+
+/*
+ * If CMP_ENABLE_PROBES is defined (configure --enable-probes), the compiler
+ * fires systemtap compatible static probes of the provider "tclcompiler",
+ * which perf, bpftrace or stap can attach to in a production build:
+ *   file__start(file), file__end(file, result)     Compiler_CompileFile
+ *   proc__start(name), proc__end(name, result)     each procedure body
+ *   rewrite__start(numProcs), rewrite__end(numProcs)   UpdateByteCodes
+ *   emit__section(section, bytes)                  each output section, as
+ *                                                  a CompilerSection
+ * Otherwise the probes compile to nothing.
+ */
+#ifdef CMP_ENABLE_PROBES
+#include <sys/sdt.h>
+#define CMP_PROBE1(name, arg1) DTRACE_PROBE1(tclcompiler, name, arg1)
+#define CMP_PROBE2(name, arg1, arg2) DTRACE_PROBE2(tclcompiler, name, arg1, arg2)
+#else
+#define CMP_PROBE1(name, arg1)
+#define CMP_PROBE2(name, arg1, arg2)
+#endif
+
+/*
+ * Upper bound on the element count of a list literal emitted as an element
+ * vector. Larger lists are still emitted as strings.
+ */
+#define CMP_MAX_LIST_LITERAL 256
+
 /*
  * structure to hold the calculated lengths of the location information
  * arrays for a ByteCode structure
@@ -179,9 +234,10 @@ typedef struct ProcBodyInfo
 /*
  * The PostProcessInfo struct holds compilation info used by the compiler to
  * postprocess the compiled proc body. The counters numProcs, numCompiledBodies,
- * and numUnshared are on a compilation by compilation basis (they refer to the
+ * numClonedBodies and numUnshared are on a compilation by compilation basis (they refer to the
  * current compilation), whereas the counter in the CompilerContext struct
- * defined below are cumulative for all compilations.
+ * defined below are cumulative for all compilations. The struct itself is
+ * kept by the CompilerContext and reset after each compilation.
  *
  * This struct is exported for use by the compiler test package, otherwise it
  * could be kept local to the writer.
@@ -194,6 +250,10 @@ typedef struct PostProcessInfo
     Tcl_HashTable objTable;      /* this hash table is keyed by object
                                   * index and is used to store information
                                   * about references to this object. */
+    Tcl_HashTable bodyTable;     /* the first definition of each distinct
+                                  * procedure, keyed by the literal indices
+                                  * of its arguments and body (see
+                                  * CompileProcBodies) */
     ProcBodyInfo** infoArrayPtr; /* NULL-terminated array to pointers of
                                   * info structs that are generated for
                                   * each proc at the start of the post
@@ -201,11 +261,170 @@ typedef struct PostProcessInfo
     Tcl_Size numCompiledBodies;  /* total number of procedure bodies that
                                   * were compiled. Not all procedure
                                   * bodies are compiled. */
+    Tcl_Size numClonedBodies;    /* total number of procedure bodies that
+                                  * reuse the compiled code of an earlier
+                                  * identical one instead */
     Tcl_Size numUnshares;        /* total number of unshares that were
                                   * performed. If 0, then there were no
                                   * shared procedure bodies */
 } PostProcessInfo;
 
+/*
+ * Sections of the output file, for the byte counts in CompilerStats. The
+ * sections of nested procedure bodies are added to those of the top level
+ * script; the literals section only counts the bytes that are not part of
+ * a nested body.
+ */
+
+typedef enum CompilerSection
+{
+    CMP_SECTION_PREAMBLE,   /* -preamble script, loader preamble, signature */
+    CMP_SECTION_HEADER,     /* the sizes line at the start of each ByteCode */
+    CMP_SECTION_CODE,       /* the instructions */
+    CMP_SECTION_LOCMAP,     /* the command location map */
+    CMP_SECTION_LITERALS,   /* the literal objects */
+    CMP_SECTION_EXCEPTIONS, /* the exception ranges */
+    CMP_SECTION_AUXDATA,    /* the AuxData items */
+    CMP_SECTION_POSTAMBLE,  /* the loader postamble */
+    CMP_NUM_SECTIONS
+} CompilerSection;
+
+/*
+ * The CompilerStats struct accumulates counters and timings across
+ * compilations, until they are reset by "compiler::stats -reset". Times are
+ * in microseconds.
+ */
+
+typedef struct CompilerStats
+{
+    Tcl_WideInt numCompiles;       /* how many scripts were compiled */
+    Tcl_WideInt numProcs;          /* the CompilerContext counters, summed */
+    Tcl_WideInt numCompiledBodies; /* over all compilations */
+    Tcl_WideInt numClonedBodies;
+    Tcl_WideInt numUnsharedBodies;
+    Tcl_WideInt numUnshares;
+    Tcl_WideInt readTime;     /* reading the input files */
+    Tcl_WideInt compileTime;  /* compiling the top level scripts */
+    Tcl_WideInt procBodyTime; /* compiling the procedure bodies */
+    Tcl_WideInt rewriteTime;  /* rewriting the top level bytecodes */
+    Tcl_WideInt emitTime;     /* writing the output files */
+    Tcl_WideInt sectionBytes[CMP_NUM_SECTIONS]; /* output bytes by section */
+    Tcl_WideInt byteCodeBytes; /* total output bytes of the ByteCodes
+                                * emitted so far, used to take the nested
+                                * bodies out of the literals section */
+    Tcl_WideInt allocBytes;   /* bytes allocated by the compiler for its own
+                               * use (see CmpAlloc) */
+    Tcl_WideInt peakBytes;    /* highest number of those bytes live during
+                               * one compilation */
+    Tcl_WideInt reusedBytes;  /* bytes that CmpAlloc took from the buffers
+                               * of earlier compilations instead */
+} CompilerStats;
+
+/*
+ * The CompileCost struct records what it took to compile one ByteCode, the
+ * top level script of a file or a procedure body, for the report of the
+ * most expensive ones by compiler::stats. The time is in microseconds; for
+ * a script, it does not include the compilation of its procedure bodies.
+ */
+
+typedef struct CompileCost
+{
+    Tcl_Obj* namePtr;     /* procedure name, or file name for a top level
+                           * script */
+    Tcl_Obj* filePtr;     /* name of the compiled file */
+    int isProcBody;       /* 1 for a procedure body, 0 for a script */
+    Tcl_WideInt time;     /* compile time */
+    Tcl_Size codeBytes;   /* size of the instructions */
+    Tcl_Size numLiterals; /* size of the literal array */
+} CompileCost;
+
+/*
+ * The StrippedCmd struct records a command whose CompileProc was overridden
+ * for a compilation, to drop its invocations from the compiled code (see the
+ * -strip flag of compiler::compile) or to fold the constants of -define in
+ * "if", so that the command can be restored afterwards.
+ */
+
+typedef struct StrippedCmd
+{
+    Command* cmdPtr;               /* the command */
+    CompileProc* savedCompileProc; /* its original CompileProc */
+    int isTemporary;               /* 1 if the command did not exist and was
+                                    * created for the compilation */
+    Tcl_Obj* nsNamePtr;            /* name of the outermost namespace that
+                                    * was created along with the temporary
+                                    * command, or NULL */
+} StrippedCmd;
+
+/*
+ * The DisassemblyInfo struct accumulates the output of compiler::disassemble
+ * over the ByteCodes of one or more files. Instructions longer than
+ * CMP_MAX_INST_SIZE bytes are counted in the last bucket of sizeCounts.
+ */
+
+#define CMP_MAX_INST_SIZE 16
+
+typedef struct DisassemblyInfo
+{
+    Tcl_Obj* listingPtr;                         /* the listing, or NULL if
+                                                  * only the histograms are
+                                                  * wanted */
+    Tcl_WideInt opCounts[256];                   /* instructions by opcode */
+    Tcl_WideInt sizeCounts[CMP_MAX_INST_SIZE + 1]; /* instructions by length in
+                                                  * bytes */
+} DisassemblyInfo;
+
+/*
+ * The OpcodeCount struct is used to sort the opcode histogram of
+ * compiler::disassemble.
+ */
+
+typedef struct OpcodeCount
+{
+    int opCode;        /* the opcode */
+    Tcl_WideInt count; /* how many instructions use it */
+} OpcodeCount;
+
+/*
+ * The DecodeStats struct counts what the reference decoder of cmpDecode.c
+ * read back from compiled files, for compiler::decode and compiler::verify.
+ */
+
+typedef struct DecodeStats
+{
+    int formatVersion;           /* from the signature line of the last file */
+    Tcl_WideInt numByteCodes;    /* ByteCodes, including procedure bodies */
+    Tcl_WideInt numProcBodies;   /* procedure bodies */
+    Tcl_WideInt numLiterals;     /* entries of the literal arrays */
+    Tcl_WideInt numListLiterals; /* of which element vectors (CMP_LIST_CODE) */
+    Tcl_WideInt numCodeBytes;    /* instruction bytes */
+} DecodeStats;
+
+/*
+ * The CompilerPool struct keeps the working buffers of the compilations of
+ * an interpreter, so that each compilation reuses those of the previous ones
+ * instead of allocating its own. The blocks that CmpAlloc hands out during a
+ * compilation are rounded up to a power of two, from 1 << CMP_POOL_MIN_SHIFT
+ * bytes to 1 << (CMP_POOL_MIN_SHIFT + CMP_POOL_NUM_CLASSES - 1), and CmpFree
+ * puts them on the free list of their size class rather than freeing them.
+ * The bucket array of the transient literal table (see InitLiteralTable) is
+ * kept as well.
+ */
+
+#define CMP_POOL_MIN_SHIFT 4
+#define CMP_POOL_NUM_CLASSES 17
+
+typedef struct CompilerPool
+{
+    void* freeBlocks[CMP_POOL_NUM_CLASSES]; /* free lists of the blocks, by
+                                             * size class */
+    Tcl_WideInt pooledBytes;                /* bytes in the free lists */
+    LiteralEntry** literalBuckets;          /* bucket array of the last
+                                             * transient literal table, all
+                                             * NULL, or NULL */
+    Tcl_Size numLiteralBuckets;             /* its size */
+} CompilerPool;
+
 /*
  * The CompilerContext struct holds context for use by the compiler code. It
  * contains a pointer to the PostProcessInfo, counters for various statistics,
@@ -222,6 +441,66 @@ typedef struct CompilerContext
     Tcl_Size numCompiledBodies; /* how many proc bodies were compiled */
     Tcl_Size numUnsharedBodies; /* how many were unshared */
     Tcl_Size numUnshares;       /* how many copies were made when unsharing proc bodies */
+    Tcl_Size numClonedBodies;   /* how many proc bodies were identical to an
+                                 * earlier one and reused its compiled code */
+    Tcl_Obj* definesPtr;        /* dict of the global variables declared
+                                 * constant with -define, or NULL */
+    CompileProc* savedIfCompileProc; /* the CompileProc of "if" while it is
+                                 * overridden to fold -define constants */
+    Tcl_Obj* stripPtr;          /* list of the commands given with -strip,
+                                 * or NULL */
+    StrippedCmd* strippedPtr;   /* array of the commands overridden for
+                                 * -strip and -define during a
+                                 * compilation */
+    Tcl_Size numStripped;       /* how many entries in the array */
+    CompilerStats stats;        /* statistics reported by compiler::stats */
+    CompileCost* costsPtr;      /* array of the compile costs of the
+                                 * ByteCodes compiled since the last
+                                 * "compiler::stats -reset" */
+    Tcl_Size numCosts;          /* how many entries are used */
+    Tcl_Size costsSize;         /* how many entries are allocated */
+    Tcl_Obj* analysisPtr;       /* while compiler::analyze runs, the list
+                                 * of the records describing each emitted
+                                 * ByteCode; otherwise NULL */
+    Tcl_Obj* analysisNamePtr;   /* name for the record of the next ByteCode
+                                 * to be emitted, or NULL */
+    DisassemblyInfo* disassemblyPtr; /* while compiler::disassemble runs,
+                                 * where the compiled scripts are
+                                 * disassembled instead of emitted;
+                                 * otherwise NULL */
+    Tcl_Obj* profilePtr;        /* name of the file where a script compiled
+                                 * with -profile dumps its counters, or
+                                 * NULL */
+    const char* scriptName;     /* name of the file being compiled, or NULL */
+    Tcl_Obj* reportPtr;         /* with -report, the list of the procedure
+                                 * definition sites of the compiled script;
+                                 * otherwise NULL */
+    Tcl_Obj* tracePtr;          /* with -trace, the trace events of the
+                                 * compilation, in the Chrome trace event
+                                 * JSON format; otherwise NULL */
+    DecodeStats* verifyPtr;     /* while compiler::verify runs, where the
+                                 * output files that were read back are
+                                 * counted; otherwise NULL */
+    Tcl_WideInt chunkSize;      /* with -chunk, the size in bytes past which
+                                 * the top level script is cut into chunks
+                                 * compiled and emitted one at a time;
+                                 * otherwise 0 */
+    Tcl_Size firstLine;         /* line of the file where the script being
+                                 * compiled starts: 1, or the first line of
+                                 * the chunk */
+    Tcl_Size firstCommand;      /* commands in the chunks of the file
+                                 * compiled before this one, which offsets
+                                 * the -profile command indices */
+    CompilerPool pool;          /* the buffers kept from one compilation to
+                                 * the next */
+    Tcl_Size dummyCounter;      /* suffix of the name of the next temporary
+                                 * command created to compile a procedure
+                                 * body */
+    Tcl_Size channelCounter;    /* suffix of the name of the next channel
+                                 * created by CreateCountingChannel */
+    int formatVersion;          /* format version of the files written by
+                                 * the current compilation, set with
+                                 * -format */
 } CompilerContext;
 
 /*
@@ -244,6 +523,12 @@ typedef struct CompilerContext
  */
 #define CMP_PROC_COMMAND "bcproc"
 
+/*
+ * Name of the global array that holds the per-command execution counters
+ * of a script compiled with -profile
+ */
+#define CMP_PROFILE_VARIABLE "::tbcprofile"
+
 /*
  * Name of the writer (compiler) and reader (loader) packages
  */
@@ -270,6 +555,9 @@ typedef struct CompilerContext
 #define CMP_PROCBODY_CODE 'p'
 #define CMP_BOOLEAN_CODE 'b'
 #define CMP_BYTECODE_CODE 'c'
+#define CMP_LIST_CODE 'l'
+#define CMP_LITREF_CODE 'r'
+#define CMP_PROCCLONE_CODE 'P'
 
 /*
  * The one-letter codes for the exception range types
@@ -344,6 +632,11 @@ EXTERN int Cmptest_Init(Tcl_Interp* interp);
 EXTERN CompilerContext* CompilerGetContext(Tcl_Interp* interp);
 
 EXTERN void CompilerInit(Tcl_Interp* interp);
+EXTERN int CompilerVerifyFile(Tcl_Interp* interp,
+                              const char* fileName,
+                              Tcl_WideInt offset,
+                              Tcl_Obj* objPtr,
+                              DecodeStats* statsPtr);
 
 #undef TCL_STORAGE_CLASS
 #define TCL_STORAGE_CLASS DLLIMPORT
@@ -0,0 +1,721 @@
+/*
+ * cmpServe.c --
+ *
+ *  The compile server of compiler::serve. A build that compiles each file
+ *  with a tclsh of its own pays for starting the shell, loading the
+ *  package and building its type tables once per file; the server pays
+ *  for them once, and runs the requests of its clients in an interpreter
+ *  it keeps warm, with the working buffers of the compiler pooled from
+ *  one compilation to the next.
+ *  The requests are read from standard input, with the replies on
+ *  standard output, or, on Unix, from the clients of a Unix domain socket.
+ *
+ *  Released under the BSD-3 license. See LICENSE file for details.
+ */
+
+#include "cmpInt.h"
+#include "cmpWrite.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+/*
+ * A request that is still not complete after CMP_SERVE_MAX_REQUEST bytes
+ * is rejected, and its connection closed.
+ */
+
+#define CMP_SERVE_MAX_REQUEST (1024 * 1024)
+
+typedef struct ServeConn ServeConn;
+
+/*
+ * The state of a running compiler::serve.
+ */
+
+typedef struct ServeState
+{
+    Tcl_Interp* workerInterp; /* the warm interpreter that runs the
+                               * requests */
+    int listenFd;             /* the listening socket, or -1 when serving
+                               * standard input */
+    const char* socketPath;   /* path of the socket, or NULL */
+    ServeConn* connsPtr;      /* the open connections */
+    int done;                 /* set by a shutdown request, or at the end
+                               * of standard input */
+    Tcl_Time startTime;       /* when the server started */
+    Tcl_WideInt numRequests;  /* requests answered */
+    Tcl_WideInt numErrors;    /* requests answered with an error */
+    Tcl_WideInt busyTime;     /* microseconds spent running requests */
+} ServeState;
+
+/*
+ * A connection to the server: standard input and output, or a client of
+ * the socket.
+ */
+
+struct ServeConn
+{
+    ServeState* statePtr;
+    Tcl_Channel inChan;  /* where the requests are read */
+    Tcl_Channel outChan; /* where the replies are written; the same
+                          * channel as inChan for a socket client */
+    Tcl_Obj* requestPtr; /* the lines of the request read so far */
+    ServeConn* nextPtr;  /* next connection of the server */
+};
+
+/*
+ * Declarations for local procedures to this file:
+ */
+
+static void CloseServeConn(ServeConn* connPtr);
+static Tcl_WideInt ElapsedMicroseconds(const Tcl_Time* startPtr);
+static int HandleServeRequest(ServeConn* connPtr);
+static ServeConn* OpenServeConn(ServeState* statePtr, Tcl_Channel inChan, Tcl_Channel outChan);
+static void ReadServeConn(void* clientData, int mask);
+static Tcl_Obj* ServeStatsObj(ServeState* statePtr);
+static int WriteServeReply(ServeConn* connPtr, int code, Tcl_Obj* resultPtr, Tcl_Obj* statsPtr);
+#ifndef _WIN32
+static void AcceptServeConn(void* clientData, int mask);
+static int ListenOnSocket(Tcl_Interp* interp, const char* path);
+#endif
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Compiler_ServeObjCmd --
+ *
+ *  Runs a compile server until it is shut down.
+ *  Each request is a Tcl list on a line of its own, or on several lines
+ *  if its elements hold newlines:
+ *    compile ?options? inputFile ?outputFile?
+ *      Compiles a file, with the options and arguments of
+ *      compiler::compile. Relative file names are resolved in the working
+ *      directory of the server, not of the client.
+ *    ping
+ *      Does nothing; checks that the server is up.
+ *    stats
+ *      Returns the statistics of the server.
+ *    shutdown
+ *      Stops the server once the reply is written.
+ *  The reply is a list on a line: "ok" or "error", the result of the
+ *  request or its error message, and a dict. For stats, the dict holds
+ *  the number of requests and errors, and the time spent running requests
+ *  and since the server started, in microseconds. For the others, it
+ *  holds the time of the request in microseconds under the "time" key,
+ *  and the error code under the "errorCode" key if it failed; for
+ *  compile, it also holds what compiler::stats returns for that
+ *  compilation alone.
+ *  The requests run one at a time, in an interpreter created for the
+ *  server and kept until it stops; the clients see nothing of the
+ *  application that runs the server.
+ *
+ *  Call format:
+ *    compiler::serve ?-socket path?
+ *  Without -socket, the requests are read from standard input, and the
+ *  server stops at its end. With -socket, they are read from the clients
+ *  that connect to the Unix domain socket path, which is removed when the
+ *  server stops; a stale socket left by a server that did not stop
+ *  cleanly is replaced. Only the user running the server can connect to
+ *  the socket. -socket is not available on Windows.
+ *
+ * Results:
+ *  Returns a standard TCL result code. The result is the dict of the
+ *  stats request, for the whole run.
+ *
+ * Side effects:
+ *  Runs the event loop until the server stops.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int Compiler_ServeObjCmd(void* dummy, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+{
+    ServeState state;
+
+    (void)dummy;
+
+    if ((objc != 1) && ((objc != 3) || (strcmp(Tcl_GetString(objv[1]), "-socket") != 0)))
+    {
+        Tcl_WrongNumArgs(interp, 1, objv, "?-socket path?");
+        return TCL_ERROR;
+    }
+
+    memset(&state, 0, sizeof(state));
+    state.listenFd = -1;
+    Tcl_GetTime(&state.startTime);
+
+    if (objc == 3)
+    {
+#ifdef _WIN32
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("-socket is not supported on this platform", -1));
+        return TCL_ERROR;
+#else
+        state.socketPath = Tcl_GetString(objv[2]);
+        state.listenFd = ListenOnSocket(interp, state.socketPath);
+        if (state.listenFd < 0)
+        {
+            return TCL_ERROR;
+        }
+#endif
+    }
+
+    /*
+     * A fresh interpreter rather than a child of interp: Tcl_Init is not
+     * needed to compile, and the package is initialized directly, so the
+     * worker costs neither a search of the library nor a package require.
+     */
+
+    state.workerInterp = Tcl_CreateInterp();
+    if (Tclcompiler_Init(state.workerInterp) != TCL_OK)
+    {
+        Tcl_SetObjResult(interp, Tcl_GetObjResult(state.workerInterp));
+        Tcl_DeleteInterp(state.workerInterp);
+#ifndef _WIN32
+        if (state.listenFd >= 0)
+        {
+            close(state.listenFd);
+            unlink(state.socketPath);
+        }
+#endif
+        return TCL_ERROR;
+    }
+
+    if (state.listenFd < 0)
+    {
+        Tcl_Channel inChan = Tcl_GetStdChannel(TCL_STDIN);
+        Tcl_Channel outChan = Tcl_GetStdChannel(TCL_STDOUT);
+
+        if (!inChan || !outChan)
+        {
+            Tcl_DeleteInterp(state.workerInterp);
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("no standard input or output to serve", -1));
+            return TCL_ERROR;
+        }
+        OpenServeConn(&state, inChan, outChan);
+    }
+#ifndef _WIN32
+    else
+    {
+        Tcl_CreateFileHandler(state.listenFd, TCL_READABLE, AcceptServeConn, &state);
+    }
+#endif
+
+    while (!state.done)
+    {
+        Tcl_DoOneEvent(TCL_ALL_EVENTS);
+    }
+
+    while (state.connsPtr)
+    {
+        CloseServeConn(state.connsPtr);
+    }
+#ifndef _WIN32
+    if (state.listenFd >= 0)
+    {
+        Tcl_DeleteFileHandler(state.listenFd);
+        close(state.listenFd);
+        unlink(state.socketPath);
+    }
+#endif
+    Tcl_DeleteInterp(state.workerInterp);
+
+    Tcl_SetObjResult(interp, ServeStatsObj(&state));
+    return TCL_OK;
+}
+
+#ifndef _WIN32
+/*
+ *----------------------------------------------------------------------
+ *
+ * ListenOnSocket --
+ *
+ *  Creates the listening socket of the server. If path is taken by a
+ *  socket that nothing listens on anymore, it is removed first. The
+ *  socket is bound under a umask of 077, so that only the user running
+ *  the server can connect to it: a client can have any file compiled and
+ *  written where the server is allowed to write.
+ *
+ * Results:
+ *  Returns the descriptor of the socket, or -1 with an error message in
+ *  interp.
+ *
+ * Side effects:
+ *  Creates the socket file path.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int ListenOnSocket(Tcl_Interp* interp, const char* path)
+{
+    struct sockaddr_un addr;
+    int fd, probeFd, inUse, status;
+    mode_t oldMask;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("socket path \"%s\" is too long", path));
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't create socket: %s", Tcl_PosixError(interp)));
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    oldMask = umask(077);
+    status = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    if ((status != 0) && (errno == EADDRINUSE))
+    {
+        /*
+         * A server that is still running accepts the probe; the socket of
+         * one that died refuses it, and can be replaced.
+         */
+
+        inUse = 1;
+        probeFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probeFd >= 0)
+        {
+            inUse = (connect(probeFd, (struct sockaddr*)&addr, sizeof(addr)) == 0) || (errno != ECONNREFUSED);
+            close(probeFd);
+        }
+        if (inUse)
+        {
+            errno = EADDRINUSE;
+        }
+        else
+        {
+            unlink(path);
+            status = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+        }
+    }
+    umask(oldMask);
+
+    if ((status != 0) || (listen(fd, SOMAXCONN) != 0))
+    {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't listen on \"%s\": %s", path, Tcl_PosixError(interp)));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AcceptServeConn --
+ *
+ *  File handler of the listening socket: accepts a client, and adds it to
+ *  the connections of the server.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Creates a channel for the client.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void AcceptServeConn(void* clientData, int mask)
+{
+    ServeState* statePtr = (ServeState*)clientData;
+    Tcl_Channel chan;
+    int fd;
+
+    (void)mask;
+
+    fd = accept(statePtr->listenFd, NULL, NULL);
+    if (fd < 0)
+    {
+        return;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    chan = Tcl_MakeFileChannel(SIZE2PTR(fd), TCL_READABLE | TCL_WRITABLE);
+    Tcl_SetChannelOption(NULL, chan, "-translation", "lf");
+    Tcl_SetChannelOption(NULL, chan, "-encoding", "utf-8");
+    Tcl_SetChannelOption(NULL, chan, "-buffering", "full");
+    OpenServeConn(statePtr, chan, chan);
+}
+#endif
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * OpenServeConn --
+ *
+ *  Adds a connection to the server, and starts reading its requests.
+ *
+ * Results:
+ *  Returns the connection.
+ *
+ * Side effects:
+ *  Makes inChan non-blocking.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static ServeConn* OpenServeConn(ServeState* statePtr, Tcl_Channel inChan, Tcl_Channel outChan)
+{
+    ServeConn* connPtr = (ServeConn*)Tcl_Alloc(sizeof(ServeConn));
+
+    connPtr->statePtr = statePtr;
+    connPtr->inChan = inChan;
+    connPtr->outChan = outChan;
+    connPtr->requestPtr = Tcl_NewObj();
+    Tcl_IncrRefCount(connPtr->requestPtr);
+    connPtr->nextPtr = statePtr->connsPtr;
+    statePtr->connsPtr = connPtr;
+
+    Tcl_SetChannelOption(NULL, inChan, "-blocking", "0");
+    Tcl_CreateChannelHandler(inChan, TCL_READABLE, ReadServeConn, connPtr);
+    return connPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CloseServeConn --
+ *
+ *  Removes a connection from the server. The channel of a socket client
+ *  is closed; standard input, which belongs to the application, is only
+ *  made blocking again.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Frees the connection.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void CloseServeConn(ServeConn* connPtr)
+{
+    ServeConn** linkPtr = &connPtr->statePtr->connsPtr;
+
+    while (*linkPtr != connPtr)
+    {
+        linkPtr = &(*linkPtr)->nextPtr;
+    }
+    *linkPtr = connPtr->nextPtr;
+
+    Tcl_DeleteChannelHandler(connPtr->inChan, ReadServeConn, connPtr);
+    if (connPtr->statePtr->listenFd >= 0)
+    {
+        Tcl_Close(NULL, connPtr->inChan);
+    }
+    else
+    {
+        Tcl_SetChannelOption(NULL, connPtr->inChan, "-blocking", "1");
+    }
+    Tcl_DecrRefCount(connPtr->requestPtr);
+    Tcl_Free((char*)connPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReadServeConn --
+ *
+ *  Channel handler of a connection: reads the lines that are available,
+ *  and runs each request as soon as it is complete.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Closes the connection at the end of its input or if a reply cannot be
+ *  written, which stops a server of standard input.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void ReadServeConn(void* clientData, int mask)
+{
+    ServeConn* connPtr = (ServeConn*)clientData;
+    ServeState* statePtr = connPtr->statePtr;
+    Tcl_Size length;
+    int closeConn = 0;
+
+    (void)mask;
+
+    while (!statePtr->done)
+    {
+        if (Tcl_GetsObj(connPtr->inChan, connPtr->requestPtr) < 0)
+        {
+            if (!Tcl_InputBlocked(connPtr->inChan))
+            {
+                closeConn = 1;
+            }
+            else if (Tcl_InputBuffered(connPtr->inChan) > CMP_SERVE_MAX_REQUEST)
+            {
+                WriteServeReply(connPtr, TCL_ERROR, Tcl_NewStringObj("request too long", -1), Tcl_NewObj());
+                closeConn = 1;
+            }
+            break;
+        }
+
+        Tcl_AppendToObj(connPtr->requestPtr, "\n", 1);
+        if (Tcl_CommandComplete(Tcl_GetStringFromObj(connPtr->requestPtr, &length)))
+        {
+            if (HandleServeRequest(connPtr) != TCL_OK)
+            {
+                closeConn = 1;
+                break;
+            }
+            Tcl_DecrRefCount(connPtr->requestPtr);
+            connPtr->requestPtr = Tcl_NewObj();
+            Tcl_IncrRefCount(connPtr->requestPtr);
+        }
+        else if (length > CMP_SERVE_MAX_REQUEST)
+        {
+            WriteServeReply(connPtr, TCL_ERROR, Tcl_NewStringObj("request too long", -1), Tcl_NewObj());
+            closeConn = 1;
+            break;
+        }
+    }
+
+    if (closeConn)
+    {
+        if (statePtr->listenFd < 0)
+        {
+            statePtr->done = 1;
+        }
+        CloseServeConn(connPtr);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HandleServeRequest --
+ *
+ *  Runs the request read on a connection in the worker interpreter, and
+ *  writes its reply. Blank requests are ignored.
+ *
+ * Results:
+ *  TCL_OK, or TCL_ERROR if the reply could not be written.
+ *
+ * Side effects:
+ *  Whatever the request does.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int HandleServeRequest(ServeConn* connPtr)
+{
+    static const char* requests[] = {"compile", "ping", "shutdown", "stats", NULL};
+    enum requests
+    {
+        CMP_SERVE_COMPILE,
+        CMP_SERVE_PING,
+        CMP_SERVE_SHUTDOWN,
+        CMP_SERVE_STATS
+    };
+    ServeState* statePtr = connPtr->statePtr;
+    Tcl_Interp* workerInterp = statePtr->workerInterp;
+    Tcl_Obj *cmdPtr, *keyPtr, *resultPtr, *statsPtr, *optionsPtr;
+    Tcl_Obj* errorCodePtr = NULL;
+    Tcl_Obj** elemPtrs;
+    Tcl_Size numElems;
+    Tcl_Time start;
+    Tcl_WideInt time;
+    int index = -1, code;
+
+    Tcl_GetTime(&start);
+    code = Tcl_ListObjGetElements(workerInterp, connPtr->requestPtr, &numElems, &elemPtrs);
+    if ((code == TCL_OK) && (numElems == 0))
+    {
+        return TCL_OK;
+    }
+    if (code == TCL_OK)
+    {
+        code = Tcl_GetIndexFromObj(workerInterp, elemPtrs[0], requests, "request", 0, &index);
+    }
+
+    if (code == TCL_OK)
+    {
+        Tcl_ResetResult(workerInterp);
+        switch ((enum requests)index)
+        {
+            case CMP_SERVE_COMPILE:
+                cmdPtr = Tcl_NewListObj(numElems - 1, elemPtrs + 1);
+                Tcl_IncrRefCount(cmdPtr);
+                keyPtr = Tcl_NewStringObj("::compiler::compile", -1);
+                Tcl_ListObjReplace(NULL, cmdPtr, 0, 0, 1, &keyPtr);
+                code = Tcl_EvalObjEx(workerInterp, cmdPtr, TCL_EVAL_GLOBAL);
+                Tcl_DecrRefCount(cmdPtr);
+                break;
+
+            case CMP_SERVE_PING:
+            case CMP_SERVE_STATS:
+                break;
+
+            case CMP_SERVE_SHUTDOWN:
+                statePtr->done = 1;
+                break;
+        }
+    }
+
+    resultPtr = Tcl_GetObjResult(workerInterp);
+    Tcl_IncrRefCount(resultPtr);
+    if (code != TCL_OK)
+    {
+        optionsPtr = Tcl_GetReturnOptions(workerInterp, code);
+        Tcl_IncrRefCount(optionsPtr);
+        keyPtr = Tcl_NewStringObj("-errorcode", -1);
+        Tcl_IncrRefCount(keyPtr);
+        Tcl_DictObjGet(NULL, optionsPtr, keyPtr, &errorCodePtr);
+        if (errorCodePtr)
+        {
+            Tcl_IncrRefCount(errorCodePtr);
+        }
+        Tcl_DecrRefCount(keyPtr);
+        Tcl_DecrRefCount(optionsPtr);
+    }
+
+    time = ElapsedMicroseconds(&start);
+    statePtr->numRequests++;
+    statePtr->busyTime += time;
+    if (code != TCL_OK)
+    {
+        statePtr->numErrors++;
+    }
+
+    /*
+     * The statistics of a compile request are those of its compilation
+     * alone: those of the worker are reset after each one.
+     */
+
+    if (index == CMP_SERVE_STATS)
+    {
+        statsPtr = ServeStatsObj(statePtr);
+    }
+    else
+    {
+        if ((index == CMP_SERVE_COMPILE) &&
+            (Tcl_EvalEx(workerInterp, "::compiler::stats -reset", -1, TCL_EVAL_GLOBAL) == TCL_OK))
+        {
+            statsPtr = Tcl_DuplicateObj(Tcl_GetObjResult(workerInterp));
+        }
+        else
+        {
+            statsPtr = Tcl_NewDictObj();
+        }
+        Tcl_ResetResult(workerInterp);
+        Tcl_DictObjPut(NULL, statsPtr, Tcl_NewStringObj("time", -1), Tcl_NewWideIntObj(time));
+    }
+    if (errorCodePtr)
+    {
+        Tcl_DictObjPut(NULL, statsPtr, Tcl_NewStringObj("errorCode", -1), errorCodePtr);
+        Tcl_DecrRefCount(errorCodePtr);
+    }
+
+    code = WriteServeReply(connPtr, code, resultPtr, statsPtr);
+    Tcl_DecrRefCount(resultPtr);
+    return code;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WriteServeReply --
+ *
+ *  Writes the reply to a request on a line, and flushes it.
+ *
+ * Results:
+ *  TCL_OK, or TCL_ERROR if the reply could not be written.
+ *
+ * Side effects:
+ *  Frees resultPtr and statsPtr if nothing else references them.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int WriteServeReply(ServeConn* connPtr, int code, Tcl_Obj* resultPtr, Tcl_Obj* statsPtr)
+{
+    Tcl_Obj* elemPtrs[3];
+    Tcl_Obj* replyPtr;
+    int status = TCL_OK;
+
+    elemPtrs[0] = Tcl_NewStringObj((code == TCL_OK) ? "ok" : "error", -1);
+    elemPtrs[1] = resultPtr;
+    elemPtrs[2] = statsPtr;
+    replyPtr = Tcl_NewListObj(3, elemPtrs);
+    Tcl_IncrRefCount(replyPtr);
+    Tcl_AppendToObj(replyPtr, "\n", 1);
+
+    if ((Tcl_WriteObj(connPtr->outChan, replyPtr) < 0) || (Tcl_Flush(connPtr->outChan) != TCL_OK))
+    {
+        status = TCL_ERROR;
+    }
+    Tcl_DecrRefCount(replyPtr);
+    return status;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ServeStatsObj --
+ *
+ *  Builds the statistics of a server.
+ *
+ * Results:
+ *  Returns a new dict of the number of requests and errors, and of the
+ *  time spent running requests (busy) and since the start (uptime), in
+ *  microseconds.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj* ServeStatsObj(ServeState* statePtr)
+{
+    Tcl_Obj* statsPtr = Tcl_NewDictObj();
+
+    Tcl_DictObjPut(NULL, statsPtr, Tcl_NewStringObj("requests", -1), Tcl_NewWideIntObj(statePtr->numRequests));
+    Tcl_DictObjPut(NULL, statsPtr, Tcl_NewStringObj("errors", -1), Tcl_NewWideIntObj(statePtr->numErrors));
+    Tcl_DictObjPut(NULL, statsPtr, Tcl_NewStringObj("busy", -1), Tcl_NewWideIntObj(statePtr->busyTime));
+    Tcl_DictObjPut(NULL, statsPtr, Tcl_NewStringObj("uptime", -1),
+                   Tcl_NewWideIntObj(ElapsedMicroseconds(&statePtr->startTime)));
+    return statsPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ElapsedMicroseconds --
+ *
+ *  Measures the time since startPtr.
+ *
+ * Results:
+ *  Returns the elapsed time in microseconds.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_WideInt ElapsedMicroseconds(const Tcl_Time* startPtr)
+{
+    Tcl_Time now;
+
+    Tcl_GetTime(&now);
+    return ((Tcl_WideInt)(now.sec - startPtr->sec)) * 1000000 + (now.usec - startPtr->usec);
+}
@@ -44,9 +44,16 @@ static int Compiler_GetTclVerObjCmd(void* dummy, Tcl_Interp* interp, int objc, T
 /* Variables & commands installed by this package */
 static const VarTable variables[] = {{errorVariable, errorMessage}, {NULL, NULL}};
 
-static const CmdTable commands[] = {{"compile", Compiler_CompileObjCmd, 1},
+static const CmdTable commands[] = {{"analyze", Compiler_AnalyzeObjCmd, 1},
+                                    {"bceval", Compiler_BcevalObjCmd, 1},
+                                    {"compile", Compiler_CompileObjCmd, 1},
+                                    {"decode", Compiler_DecodeObjCmd, 1},
+                                    {"disassemble", Compiler_DisassembleObjCmd, 1},
                                     {"getBytecodeExtension", Compiler_GetBytecodeExtensionObjCmd, 1},
                                     {"getTclVer", Compiler_GetTclVerObjCmd, 1},
+                                    {"serve", Compiler_ServeObjCmd, 1},
+                                    {"stats", Compiler_StatsObjCmd, 1},
+                                    {"verify", Compiler_VerifyObjCmd, 1},
                                     {NULL, NULL, 0}};
 
 /* --- helpers --- */
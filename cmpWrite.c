@@ -16,6 +16,13 @@
 #include "cmpWrite.h"
 #include "cmpInt.h"
 
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 /*
  * A ProcInfo structure is used to store temporary information about the
  * current proc command implementation.
@@ -48,6 +55,130 @@ typedef struct ObjRefInfo
                                  * track unsharing */
 } ObjRefInfo;
 
+/*
+ * A ProcBodyKey is the hash key used by CompileProcBodies to detect procedure
+ * definitions with identical argument lists and bodies. Since identical
+ * literals share a single slot in the literal array, the two literal indices
+ * identify the contents.
+ */
+typedef struct ProcBodyKey
+{
+    Tcl_Size argsIndex; /* literal index of the argument list */
+    Tcl_Size bodyIndex; /* literal index of the original body */
+} ProcBodyKey;
+
+/*
+ * A LitWeight structure holds the weighted number of pushes of a literal,
+ * as computed by RenumberLiterals.
+ */
+typedef struct LitWeight
+{
+    Tcl_Size index;  /* index of the literal in the literal array */
+    Tcl_Size weight; /* number of pushes, weighted by loop depth */
+} LitWeight;
+
+/*
+ * A RelayoutShift structure records an instruction that changes size when
+ * RelayoutByteCodes rewrites the bytecodes: its offset in the old code, and
+ * the growth of the code up to and including it (which may be negative).
+ */
+typedef struct RelayoutShift
+{
+    Tcl_Size offset; /* offset of the instruction in the old code */
+    Tcl_Size growth; /* new minus old size of the code up to its end */
+} RelayoutShift;
+
+/*
+ * A RelayoutPrefix structure records code that RelayoutByteCodes inserts
+ * before an instruction: the offset of the instruction in the old code, and
+ * where the inserted bytes are in the prefix buffer.
+ */
+typedef struct RelayoutPrefix
+{
+    Tcl_Size offset; /* offset of the instruction in the old code */
+    Tcl_Size start;  /* index of the first inserted byte */
+    Tcl_Size length; /* number of inserted bytes */
+} RelayoutPrefix;
+
+/*
+ * A CostRank structure holds the sort key of a CompileCost, for the report
+ * of compiler::stats.
+ */
+typedef struct CostRank
+{
+    Tcl_WideInt key; /* the value of the sort field */
+    Tcl_Size index;  /* index of the CompileCost in the context's array */
+} CostRank;
+
+/*
+ * A MemoryCounters structure tracks the memory that the compiler allocates
+ * for its own use: the working structures and buffers of a compilation,
+ * which are allocated with CmpAlloc, and the literal copies made by
+ * UnshareObject, which are freed by Tcl along with their ByteCode and are
+ * only counted as live until the end of the compilation. There is one per
+ * thread. The blocks in the CompilerPool of the compiling interpreter are
+ * not live; taking one counts as reused rather than allocated.
+ */
+typedef struct MemoryCounters
+{
+    Tcl_WideInt allocated; /* bytes allocated so far */
+    Tcl_WideInt reused;    /* bytes taken from a CompilerPool so far */
+    Tcl_WideInt live;      /* bytes currently allocated */
+    Tcl_WideInt peak;      /* highest value of live since the start of the
+                            * current compilation */
+    Tcl_WideInt transient; /* part of live that is not freed by CmpFree */
+    CompilerPool* poolPtr; /* pool of the current compilation, or NULL */
+} MemoryCounters;
+
+/*
+ * A MemoryMark structure holds the state of the memory accounting at the
+ * start of a compilation (see StartMemoryAccounting).
+ */
+typedef struct MemoryMark
+{
+    Tcl_WideInt allocated; /* MemoryCounters fields at the start */
+    Tcl_WideInt reused;
+    Tcl_WideInt live;
+    CompilerPool* poolPtr;
+} MemoryMark;
+
+/*
+ * The header put by CmpAlloc in front of each block to remember its size.
+ * The union keeps the block aligned for any type.
+ */
+typedef union AllocHeader
+{
+    size_t size;
+    double alignDouble;
+    Tcl_WideInt alignWide;
+    void* alignPointer;
+} AllocHeader;
+
+/*
+ * A CompilerPool keeps at most CMP_POOL_MAX_BYTES in its free lists, and a
+ * literal bucket array of at most CMP_POOL_MAX_BUCKETS entries, so that one
+ * large file does not leave its buffers to the compilations that follow.
+ */
+
+#define CMP_POOL_MAX_BYTES (4 * 1024 * 1024)
+#define CMP_POOL_MAX_BUCKETS 16384
+
+/*
+ * A ProcSite structure describes a procedure definition found by
+ * ReportProcDefinitions. FindProcDefinitions descends at most
+ * CMP_MAX_SCAN_DEPTH levels of nested scripts.
+ */
+
+#define CMP_MAX_SCAN_DEPTH 32
+
+typedef struct ProcSite
+{
+    Tcl_Size offset;    /* offset of the "proc" command in the source */
+    Tcl_Obj* namePtr;   /* the procedure name, empty if it is computed */
+    const char* reason; /* why the body is not precompiled, or NULL if it
+                         * is */
+} ProcSite;
+
 /*
  * This struct holds the encoding context for a run of EmitByteSequence
  */
@@ -75,11 +206,6 @@ typedef struct A85EncodeContext
  */
 #define CMP_ASSOC_KEY CMP_WRITER_PACKAGE
 
-/*
- * The format version number for this file.
- */
-static int formatVersion = 3;
-
 /*
  * This is the start of the signature line
  */
@@ -92,22 +218,19 @@ static char signatureHeader[] = CMP_SIGNATURE_HEADER;
 static char tcExtension[] = CMP_TC_EXTENSION;
 
 /*
- * The following variables make up the pieces of the script preamble
+ * The following variables make up the pieces of the script preamble: the
+ * loading of the loader package, then the opening of the eval command,
+ * which is repeated for each chunk of a script compiled with -chunk.
  */
-#if USE_CATCH_WRAPPER
 static char preambleFormat[] = "\
 if {[catch {package require %s %s} err] == 1} {\n\
     return -code error \"[info script]: %s -- $err\"\n\
-}\n\
-if {[catch {%s::%s {\
+}\
 ";
+#if USE_CATCH_WRAPPER
+static char evalFormat[] = "if {[catch {%s::%s {";
 #else
-static char preambleFormat[] = "\
-if {[catch {package require %s %s} err] == 1} {\n\
-    return -code error \"[info script]: %s -- $err\"\n\
-}\n\
-%s::%s {\
-";
+static char evalFormat[] = "%s::%s {";
 #endif
 
 static char errorMessage[] = LOADER_ERROR_MESSAGE;
@@ -117,6 +240,8 @@ static char loaderName[] = CMP_READER_PACKAGE;
 static char loaderVersion[] = TBCLOAD_VERSION;
 static char procCommand[] = CMP_PROC_COMMAND;
 
+static Tcl_ThreadDataKey memoryCountersKey;
+
 /*
  * The following variables make up the pieces of the script postamble
  */
@@ -135,6 +260,28 @@ static char errorInfoMarker[] = CMP_ERRORINFO_MARKER;
 static char postambleFormat[] = "}";
 #endif
 
+/*
+ * The support code for -profile, see EmitProfileRuntime. The format takes
+ * the name of the file where the counters are written.
+ */
+
+static char profileFormat[] = "\
+if {![info exists " CMP_PROFILE_VARIABLE "]} {\n\
+    array set " CMP_PROFILE_VARIABLE " {}\n\
+    trace add execution exit enter [list apply {{fileName args} {\n\
+        catch {\n\
+            set lines {}\n\
+            foreach {key count} [array get " CMP_PROFILE_VARIABLE "] {\n\
+                lappend lines [linsert $key end $count]\n\
+            }\n\
+            set f [open $fileName w]\n\
+            puts $f [join [lsort -integer -decreasing -index end $lines] \\n]\n\
+            close $f\n\
+        }\n\
+    }} %s]\n\
+}\
+";
+
 /*
  * Map between ExceptionRangeType enums and type codes.
  * This map must be kept consistent with the equivalent one in cmpRead.c.
@@ -284,11 +431,18 @@ static const AuxDataType* cmpNewForeachInfoType = 0;
 static int didLoadTypes = 0;
 
 /*
- * Format for the name of the dummy command used to compile procedure bodies,
- * and counter used to generate unique names.
+ * The package may be loaded in several threads at once; the lookup of the
+ * types is serialized. Everything else the compiler changes while it runs
+ * belongs to the interp that compiles: the CompilerContext, and the Command
+ * structs of "proc", "if" and the -strip commands.
+ */
+TCL_DECLARE_MUTEX(typesMutex)
+
+/*
+ * Format for the name of the dummy command used to compile procedure bodies.
+ * The counter that makes the names unique is in the CompilerContext.
  */
-static char dummyCommandName[] = "$$compiler$$dummy%d";
-static int dummyCommandCounter = 1;
+static char dummyCommandName[] = "$$compiler$$dummy%" TCL_SIZE_MODIFIER "d";
 
 /*
  * Prototypes for procedures defined later in this file:
@@ -297,11 +451,20 @@ static int A85EmitChar(Tcl_Interp* interp, int toEmit, A85EncodeContext* ctxPtr)
 static int A85EncodeBytes(Tcl_Interp* interp, unsigned char* bytesPtr, Tcl_Size numBytes, A85EncodeContext* ctxPtr);
 static int A85Flush(Tcl_Interp* interp, A85EncodeContext* ctxPtr);
 static void A85InitEncodeContext(Tcl_Channel target, int separator, A85EncodeContext* ctxPtr);
+static void AddProfileCounters(CompileEnv* compEnvPtr, const char* unitName, Tcl_Size firstIndex);
 static void AppendInstLocList(Tcl_Interp* interp, CompileEnv* envPtr);
 static Tcl_Size CalculateLocArrayLength(unsigned char* bytes, Tcl_Size numCommands);
 static void CalculateLocMapSizes(ByteCode* codePtr, LocMapSizes* sizes);
 static void CleanObjRefInfoTable(PostProcessInfo* locInfoPtr);
+static void* CmpAlloc(size_t size);
+static void CmpFree(void* ptr);
 static void CleanCompilerContext(void* clientData, Tcl_Interp* interp);
+static int CompileFileInChunks(Tcl_Interp* interp,
+                               Tcl_Channel inChan,
+                               const char* inFilePtr,
+                               const char* nativeOutName,
+                               int fileMode,
+                               char* preamblePtr);
 static int CompileObject(Tcl_Interp* interp, Tcl_Obj* objPtr);
 static int CompileOneProcBody(Tcl_Interp* interp, ProcBodyInfo* infoPtr, CompilerContext* ctxPtr, CompileEnv* compEnvPtr);
 static int CompileProcBodies(Tcl_Interp* interp, CompileEnv* compEnvPtr);
@@ -309,14 +472,36 @@ static void CreateProcBodyInfoArray(PostProcessInfo* locInfoPtr, CompileEnv* com
 static PostProcessInfo* CreatePostProcessInfo(void);
 static InstLocList* CreateInstLocList(CompileEnv* envPtr);
 static void CmpDeleteProc(void* clientData);
+static int CloneProcBody(ProcBodyInfo* firstPtr, ProcBodyInfo* infoPtr, CompilerContext* ctxPtr, CompileEnv* compEnvPtr);
+static int CompareCostRanks(const void* first, const void* second);
+static int CompareLitWeights(const void* first, const void* second);
+static int CompareOpcodeCounts(const void* first, const void* second);
+static int CompareProcSites(const void* first, const void* second);
+static int CompareRelayoutPrefixes(const void* first, const void* second);
+static int CompareSizes(const void* first, const void* second);
+static void AppendJsonString(Tcl_Obj* bufPtr, const char* string);
+static void AppendSource(Tcl_Obj* bufPtr, const char* stringPtr, Tcl_Size length, int maxChars);
+static void CountEmittedBytes(Tcl_WideInt* sectionBytes, CompilerSection section, Tcl_Channel chan, Tcl_WideInt* markPtr);
+static int CountingCloseProc(void* instanceData, Tcl_Interp* interp, int flags);
+static int CountingOutputProc(void* instanceData, const char* buf, int toWrite, int* errorCodePtr);
+#if TCL_MAJOR_VERSION < 9
+static int CountingSeekProc(void* instanceData, long offset, int mode, int* errorCodePtr);
+#endif
+static void CountingWatchProc(void* instanceData, int mask);
+static Tcl_WideInt CountingWideSeekProc(void* instanceData, Tcl_WideInt offset, int mode, int* errorCodePtr);
+static Tcl_Channel CreateCountingChannel(CompilerContext* ctxPtr);
+static void DisassembleByteCode(DisassemblyInfo* infoPtr, ByteCode* codePtr, const char* kind, Tcl_Obj* namePtr, Proc* procPtr, Tcl_HashTable* visitedPtr);
+static void DisassembleObject(DisassemblyInfo* infoPtr, Tcl_Obj* objPtr, const char* name);
+static Tcl_WideInt ElapsedTime(const Tcl_Time* startPtr);
 static Tcl_ObjCmdProc DummyObjInterpProc;
 static int EmitAuxDataArray(Tcl_Interp* interp, ByteCode* codePtr, Tcl_Channel chan);
 static int EmitByteCode(Tcl_Interp* interp, ByteCode* codePtr, Tcl_Channel chan);
 static int EmitByteSequence(Tcl_Interp* interp, unsigned char* bytesPtr, Tcl_Size length, Tcl_Channel chan);
 static int EmitChar(Tcl_Interp* interp, int value, int separator, Tcl_Channel chan);
 static int EmitCompiledLocal(Tcl_Interp* interp, CompiledLocal* localPtr, Tcl_Channel chan);
-static int EmitCompiledObject(Tcl_Interp* interp, Tcl_Obj* objPtr, Tcl_Channel chan);
+static int EmitCompiledObject(Tcl_Interp* interp, Tcl_Obj* objPtr, int isFirst, Tcl_Channel chan);
 static int EmitExcRangeArray(Tcl_Interp* interp, ByteCode* codePtr, Tcl_Channel chan);
+static int EmitListObject(Tcl_Interp* interp, Tcl_Obj* listPtr, Tcl_HashTable* litTablePtr, Tcl_Channel chan);
 static int EmitJumptableInfo(Tcl_Interp* interp, JumptableInfo* infoPtr, Tcl_Channel chan);
 static int EmitDictUpdateInfo(Tcl_Interp* interp, DictUpdateInfo* infoPtr, Tcl_Channel chan);
 static int EmitNewForeachInfo(Tcl_Interp* interp, ForeachInfo* infoPtr, Tcl_Channel chan);
@@ -324,30 +509,93 @@ static int EmitTclSize(Tcl_Interp* interp, Tcl_Size value, int separator, Tcl_Ch
 static int EmitObjArray(Tcl_Interp* interp, ByteCode* codePtr, Tcl_Channel chan);
 static int EmitObject(Tcl_Interp* interp, Tcl_Obj* objPtr, Tcl_Channel chan);
 static int EmitProcBody(Tcl_Interp* interp, Proc* procPtr, Tcl_Channel chan);
+static int EmitProfileRuntime(Tcl_Interp* interp, Tcl_Obj* fileNamePtr, Tcl_Channel chan);
+static int EmitScriptEval(Tcl_Interp* interp, Tcl_Channel chan);
 static int EmitScriptPostamble(Tcl_Interp* interp, Tcl_Channel chan);
 static int EmitScriptPreamble(Tcl_Interp* interp, Tcl_Channel chan);
 static int EmitSignature(Tcl_Interp* interp, Tcl_Channel chan);
 static int EmitString(Tcl_Interp* interp, char* src, Tcl_Size length, int separator, Tcl_Channel chan);
+static Tcl_Obj* GetCanonicalList(Tcl_Obj* objPtr);
+static void FillByteCodeAnalysis(Tcl_Obj* recordPtr, ByteCode* codePtr, LocMapSizes* locMapSizesPtr, Tcl_WideInt* sectionBytes);
+static void FormatAuxData(Tcl_Obj* bufPtr, AuxData* auxDataPtr);
+static int FormatInstruction(ByteCode* codePtr, unsigned char* pc, Proc* procPtr, Tcl_Obj* bufPtr);
+static void FindProcDefinitions(Tcl_HashTable* sitesPtr,
+                                const char* source,
+                                const char* script,
+                                Tcl_Size length,
+                                const char* context,
+                                int descendAll,
+                                int depth);
+static Tcl_Obj* FindProcName(ByteCode* codePtr, Tcl_Size bodyIndex);
+static void FinishMemoryAccounting(CompilerContext* ctxPtr, const MemoryMark* markPtr);
+static void FreeCompileCosts(CompilerContext* ctxPtr);
+static void FreeCompilerPool(CompilerPool* poolPtr);
 static void FreeProcBodyInfoArray(PostProcessInfo* infoPtr);
 static void FreePostProcessInfo(PostProcessInfo* infoPtr);
 static Tcl_Size GetSharedIndex(unsigned char* pc);
 static void InitCompilerContext(Tcl_Interp* interp);
+static size_t HashLiteral(const char* bytes, Tcl_Size length);
+static void InitLiteralTable(LiteralTable* tablePtr, CompilerPool* poolPtr);
 static void InitTypes(void);
+static const char* LocalVarName(Proc* procPtr, int index);
+static MemoryCounters* GetMemoryCounters(void);
 static void LoadObjRefInfoTable(PostProcessInfo* locInfoPtr, CompileEnv* compEnvPtr);
 static void LoadProcBodyInfo(InstLocList* locInfoPtr, CompileEnv* compEnvPtr, ProcBodyInfo* infoPtr);
+static int LocalIfCompileProc(Tcl_Interp* interp, Tcl_Parse* parsePtr, Command* cmdPtr, struct CompileEnv* compEnvPtr);
 static int LocalProcCompileProc(Tcl_Interp* interp, Tcl_Parse* parsePtr, Command* cmdPtr, struct CompileEnv* compEnvPtr);
+static int LocalStripCompileProc(Tcl_Interp* interp, Tcl_Parse* parsePtr, Command* cmdPtr, struct CompileEnv* compEnvPtr);
+static int MatchCommandName(const char* name, Tcl_Size length, const char* const* table);
 static char NameFromExcRange(ExceptionRangeType type);
+static void OverrideIfCommand(Tcl_Interp* interp, CompilerContext* ctxPtr);
+static void OverrideStrippedCommands(Tcl_Interp* interp, CompilerContext* ctxPtr);
+static int ParseDefines(Tcl_Interp* interp, Tcl_Obj* objPtr, Tcl_Obj** definesPtrPtr);
+static Tcl_Obj* ParseProcCall(const char* script, Tcl_Size length, const char** reasonPtr);
+static void PermuteLiterals(CompileEnv* compEnvPtr, const Tcl_Size* litMap);
 static int PostProcessCompile(Tcl_Interp* interp, struct CompileEnv* compEnvPtr, void* clientData);
+static int PostProcessProcBody(Tcl_Interp* interp, struct CompileEnv* compEnvPtr, void* clientData);
 static void PrependResult(Tcl_Interp* interp, char* msgPtr);
+static int RelayoutByteCodes(CompileEnv* compEnvPtr,
+                             const Tcl_Size* litMap,
+                             Tcl_HashTable* operandTablePtr,
+                             const RelayoutPrefix* prefixes,
+                             Tcl_Size numPrefixes,
+                             const unsigned char* prefixBytes);
+static unsigned char* RelayoutCopyIsland(const unsigned char* codeStart,
+                                         const unsigned char* flags,
+                                         Tcl_Size branch,
+                                         const RelayoutShift* shifts,
+                                         Tcl_Size numShifts,
+                                         unsigned char* newCode,
+                                         unsigned char* newPc);
+static Tcl_Size RelayoutIslandLength(const unsigned char* codeStart, const unsigned char* flags, Tcl_Size offset);
+static Tcl_Size RelayoutIslandSlot(const unsigned char* codeStart,
+                                   const unsigned char* flags,
+                                   Tcl_Size branch,
+                                   Tcl_Size offset);
+static Tcl_Size RelayoutNewOffset(const RelayoutShift* shifts, Tcl_Size numShifts, Tcl_Size offset);
+static Tcl_Size RelayoutPrefixLength(const RelayoutPrefix* prefixes,
+                                     Tcl_Size numPrefixes,
+                                     Tcl_Size offset,
+                                     Tcl_Size* startPtr);
+static Tcl_Size RelayoutPushOperand(unsigned char* pc, Tcl_Size offset, const Tcl_Size* litMap, Tcl_HashTable* operandTablePtr);
+static Tcl_Size RelayoutTableBranch(const unsigned char* flags, Tcl_Size offset);
+static void RecordCompileCost(CompilerContext* ctxPtr, const char* name, int isProcBody, Tcl_WideInt time, ByteCode* codePtr);
+static void ResetPostProcessInfo(PostProcessInfo* infoPtr);
+static Tcl_WideInt ResidentSetSize(void);
 static void ReleaseCompilerContext(Tcl_Interp* interp);
-static int ReplacePushIndex(Tcl_Size commandIndex, unsigned char* pc, Tcl_Size newIndex, CompileEnv* compEnvPtr);
-static void ShiftByteCodes(Tcl_Size commandIndex, Tcl_Size startOffset, Tcl_Size shiftCount, CompileEnv* compEnvPtr);
-static int UnshareObject(Tcl_Size origIndex, CompileEnv* compEnvPtr);
+static void RenumberLiterals(CompileEnv* compEnvPtr);
+static void ReportProcDefinitions(CompilerContext* ctxPtr, CompileEnv* compEnvPtr);
+static void RestoreLiteralTable(Interp* iPtr, LiteralTable* savedPtr, CompilerPool* poolPtr);
+static void RestoreStrippedCommands(Tcl_Interp* interp, CompilerContext* ctxPtr);
+static void StartMemoryAccounting(CompilerContext* ctxPtr, MemoryMark* markPtr);
+static int StripPlaceholderObjCmd(void* dummy, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[]);
+static int SubstituteDefines(Tcl_Obj* definesPtr, const char* bytes, Tcl_Size length, Tcl_Obj** exprPtrPtr, int* isConstantPtr);
+static Tcl_Size UnshareObject(Tcl_Size origIndex, CompileEnv* compEnvPtr);
+static void TraceSpan(CompilerContext* ctxPtr, const char* name, const char* category, const Tcl_Time* startPtr);
 static void UnshareProcBodies(Tcl_Interp* interp, CompilerContext* ctxPtr, CompileEnv* compEnvPtr);
-static void UpdateByteCodes(PostProcessInfo* infoPtr, CompileEnv* compEnvPtr);
-#ifdef DEBUG_REWRITE
-static void FormatInstruction(CompileEnv* compEnvPtr, unsigned char* pc);
-#endif
+static int UpdateByteCodes(Tcl_Interp* interp, PostProcessInfo* infoPtr, CompileEnv* compEnvPtr);
+static int WriteCoverageReport(Tcl_Interp* interp, Tcl_Obj* fileNamePtr, const char* scriptName, Tcl_Obj* reportPtr);
+static int WriteTraceEvents(Tcl_Interp* interp, Tcl_Obj* fileNamePtr, Tcl_Obj* eventsPtr);
 
 /*
  *----------------------------------------------------------------------
@@ -360,9 +608,45 @@ static void FormatInstruction(CompileEnv* compEnvPtr, unsigned char* pc);
  *  will have the same root as the input, with extension ".tbc".
  *
  *  Call format:
- *    compiler::compile ?-preamble value? inputFile ?outputFile?
+ *    compiler::compile ?-chunk size? ?-define dict? ?-format version?
+ *                      ?-preamble value? ?-profile fileName? ?-report fileName?
+ *                      ?-strip commandList? ?-trace fileName?
+ *                      ?--? inputFile ?outputFile?
+ *  The -chunk flag compiles the top level script in chunks of whole
+ *  commands of about size bytes, each emitted as a separate eval command
+ *  and freed before the next one is read, so that the memory used for
+ *  large generated scripts depends on the chunk size and not on the size
+ *  of the file (see CompileFileInChunks).
+ *  The -define flag declares global variables whose values are constant
+ *  for this build (see LocalIfCompileProc); the dict maps variable names
+ *  to numeric or boolean values. Only the braced conditions of "if" and
+ *  "elseif" are folded, and only their references of the form $::NAME or
+ *  ${::NAME}; a condition holding brackets, quotes, backslashes or nested
+ *  braces is compiled as written.
+ *  The -format flag chooses the format version of the output, 3 (the
+ *  default) or 4, whose smaller files only compiler::bceval reads (see
+ *  CMP_FORMAT_VERSION).
  *  The -preamble flag specifies a chunk of code to be prepended to the
  *  generated compiled script.
+ *  The -profile flag instruments the compiled code with a counter for each
+ *  command (see AddProfileCounters); the counts are written to fileName
+ *  when the application exits.
+ *  The -report flag writes to fileName the procedure definitions of the
+ *  input file, with the reason why each body that is not precompiled
+ *  cannot be, and the percentage that is (see ReportProcDefinitions).
+ *  The -trace flag appends to fileName the Chrome trace events of the
+ *  compilation, which chrome://tracing and Perfetto display: a span for the
+ *  file, for each phase and for each procedure body, in a lane for the
+ *  process and thread (see TraceSpan). Several compilations, in the same
+ *  or in different processes, can add to the same file.
+ *  The -strip flag lists commands, such as logging or assertion commands,
+ *  whose invocations are dropped from the compiled code along with the
+ *  evaluation of their arguments (see LocalStripCompileProc). Only the
+ *  invocations that are compiled are dropped: those in the bodies that
+ *  Tcl 8.6 leaves uncompiled at the top level, such as foreach, lmap and
+ *  dict for, and the {*}log and $cmd forms still call the command.
+ *  The -- flag ends the options, for an input file whose name starts with
+ *  a dash.
  *
  * Results:
  *  Returns a standard TCL result code.
@@ -375,39 +659,137 @@ static void FormatInstruction(CompileEnv* compEnvPtr, unsigned char* pc);
 
 int Compiler_CompileObjCmd(void* dummy, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
 {
-    static char argsMsg[] = "?-preamble value? inputFileName ?outputFileName?";
+    static char argsMsg[] =
+        "?-chunk size? ?-define dict? ?-format version? ?-preamble value? ?-profile fileName? "
+        "?-report fileName? ?-strip commandList? ?-trace fileName? ?--? inputFileName ?outputFileName?";
+    static const char* options[] = {
+        "-chunk", "-define", "-format", "-preamble", "-profile", "-report", "-strip", "-trace", "--", NULL};
+    enum options
+    {
+        CMP_OPT_CHUNK,
+        CMP_OPT_DEFINE,
+        CMP_OPT_FORMAT,
+        CMP_OPT_PREAMBLE,
+        CMP_OPT_PROFILE,
+        CMP_OPT_REPORT,
+        CMP_OPT_STRIP,
+        CMP_OPT_TRACE,
+        CMP_OPT_LAST
+    };
 
+    CompilerContext* ctxPtr = CompilerGetContext(interp);
     char* inFilePtr;
     char* outFilePtr = NULL;
     char* preamblePtr = NULL;
-    int fileIndex = 1;
-    int argCount = 2;
+    Tcl_Obj* definesPtr = NULL;
+    Tcl_Obj* profilePtr = NULL;
+    Tcl_Obj* reportFilePtr = NULL;
+    Tcl_Obj* stripPtr = NULL;
+    Tcl_Obj* traceFilePtr = NULL;
+    Tcl_WideInt chunkSize = 0;
+    int formatVersion = CMP_FORMAT_VERSION;
+    int fileIndex, index, result;
     Tcl_Size len;
 
     Tcl_ResetResult(interp);
 
-    if (objc < 2)
+    for (fileIndex = 1; fileIndex < objc; fileIndex += 2)
     {
-        Tcl_WrongNumArgs(interp, 1, objv, argsMsg);
-        return TCL_ERROR;
-    }
+        if (Tcl_GetString(objv[fileIndex])[0] != '-')
+        {
+            break;
+        }
+        if (Tcl_GetIndexFromObj(interp, objv[fileIndex], options, "option", 0, &index) != TCL_OK)
+        {
+            result = TCL_ERROR;
+            goto done;
+        }
+        if (index == CMP_OPT_LAST)
+        {
+            fileIndex++;
+            break;
+        }
+        if (fileIndex + 1 >= objc)
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("missing value for the %s flag", options[index]));
+            result = TCL_ERROR;
+            goto done;
+        }
 
-    if (strcmp(Tcl_GetString(objv[1]), "-preamble") == 0)
-    {
-        if (objc < 3)
+        switch ((enum options)index)
         {
-            Tcl_SetObjResult(interp, Tcl_NewStringObj("missing value for the -preamble flag", -1));
-            return TCL_ERROR;
+            case CMP_OPT_CHUNK:
+                if ((Tcl_GetWideIntFromObj(NULL, objv[fileIndex + 1], &chunkSize) != TCL_OK) || (chunkSize < 1))
+                {
+                    Tcl_SetObjResult(interp,
+                                     Tcl_ObjPrintf("bad -chunk value \"%s\": must be a positive integer",
+                                                   Tcl_GetString(objv[fileIndex + 1])));
+                    result = TCL_ERROR;
+                    goto done;
+                }
+                break;
+
+            case CMP_OPT_DEFINE:
+                if (definesPtr)
+                {
+                    Tcl_DecrRefCount(definesPtr);
+                }
+                if (ParseDefines(interp, objv[fileIndex + 1], &definesPtr) != TCL_OK)
+                {
+                    result = TCL_ERROR;
+                    goto done;
+                }
+                break;
+
+            case CMP_OPT_FORMAT:
+                if ((Tcl_GetIntFromObj(NULL, objv[fileIndex + 1], &formatVersion) != TCL_OK) ||
+                    (formatVersion < CMP_FORMAT_VERSION) || (formatVersion > CMP_MAX_FORMAT_VERSION))
+                {
+                    Tcl_SetObjResult(interp,
+                                     Tcl_ObjPrintf("bad -format value \"%s\": must be %d or %d",
+                                                   Tcl_GetString(objv[fileIndex + 1]), CMP_FORMAT_VERSION,
+                                                   CMP_MAX_FORMAT_VERSION));
+                    result = TCL_ERROR;
+                    goto done;
+                }
+                break;
+
+            case CMP_OPT_PREAMBLE:
+                preamblePtr = Tcl_GetString(objv[fileIndex + 1]);
+                break;
+
+            case CMP_OPT_PROFILE:
+                profilePtr = objv[fileIndex + 1];
+                break;
+
+            case CMP_OPT_REPORT:
+                reportFilePtr = objv[fileIndex + 1];
+                break;
+
+            case CMP_OPT_STRIP:
+                if (Tcl_ListObjLength(interp, objv[fileIndex + 1], &len) != TCL_OK)
+                {
+                    PrependResult(interp, "bad -strip value: ");
+                    result = TCL_ERROR;
+                    goto done;
+                }
+                stripPtr = objv[fileIndex + 1];
+                break;
+
+            case CMP_OPT_TRACE:
+                traceFilePtr = objv[fileIndex + 1];
+                break;
+
+            case CMP_OPT_LAST:
+                break;
         }
-        preamblePtr = Tcl_GetString(objv[2]);
-        fileIndex = 3;
-        argCount = 4;
     }
 
-    if (objc < argCount)
+    if ((objc - fileIndex < 1) || (objc - fileIndex > 2))
     {
         Tcl_WrongNumArgs(interp, 1, objv, argsMsg);
-        return TCL_ERROR;
+        result = TCL_ERROR;
+        goto done;
     }
 
     /*
@@ -416,400 +798,420 @@ int Compiler_CompileObjCmd(void* dummy, Tcl_Interp* interp, int objc, Tcl_Obj* c
 
     inFilePtr = Tcl_GetStringFromObj(objv[fileIndex], &len);
 
-    if (objc > argCount)
+    if (objc - fileIndex > 1)
     {
         outFilePtr = Tcl_GetStringFromObj(objv[fileIndex + 1], &len);
     }
 
-    return Compiler_CompileFile(interp, inFilePtr, outFilePtr, preamblePtr);
+    ctxPtr->definesPtr = definesPtr;
+    ctxPtr->profilePtr = profilePtr;
+    ctxPtr->stripPtr = stripPtr;
+    ctxPtr->chunkSize = chunkSize;
+    ctxPtr->formatVersion = formatVersion;
+    if (reportFilePtr)
+    {
+        ctxPtr->reportPtr = Tcl_NewListObj(0, NULL);
+        Tcl_IncrRefCount(ctxPtr->reportPtr);
+    }
+    if (traceFilePtr)
+    {
+        ctxPtr->tracePtr = Tcl_NewObj();
+        Tcl_IncrRefCount(ctxPtr->tracePtr);
+    }
+    result = Compiler_CompileFile(interp, inFilePtr, outFilePtr, preamblePtr);
+    ctxPtr->definesPtr = NULL;
+    ctxPtr->profilePtr = NULL;
+    ctxPtr->stripPtr = NULL;
+    ctxPtr->chunkSize = 0;
+    ctxPtr->formatVersion = CMP_FORMAT_VERSION;
+    if (reportFilePtr)
+    {
+        if (result == TCL_OK)
+        {
+            result = WriteCoverageReport(interp, reportFilePtr, inFilePtr, ctxPtr->reportPtr);
+        }
+        Tcl_DecrRefCount(ctxPtr->reportPtr);
+        ctxPtr->reportPtr = NULL;
+    }
+    if (traceFilePtr)
+    {
+        /*
+         * The events are written even if the compilation failed, but the
+         * compilation error takes precedence.
+         */
+
+        if ((WriteTraceEvents(interp, traceFilePtr, ctxPtr->tracePtr) != TCL_OK) && (result == TCL_OK))
+        {
+            result = TCL_ERROR;
+        }
+        Tcl_DecrRefCount(ctxPtr->tracePtr);
+        ctxPtr->tracePtr = NULL;
+    }
+
+done:
+    if (definesPtr)
+    {
+        Tcl_DecrRefCount(definesPtr);
+    }
+    return result;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * Compiler_GetBytecodeExtensionObjCmd --
- *
- *  Returns the default extension used for bytecode compiled files.
+ * WriteCoverageReport --
  *
- *  Call format:
- *    compiler::getBytecodeExtension
+ *  Writes the -report file of compiler::compile: one line per procedure
+ *  definition in reportPtr, as built by ReportProcDefinitions, in the
+ *  "file:line:" form understood by editors, then a summary line with the
+ *  percentage of the definitions whose body was precompiled.
  *
  * Results:
  *  Returns a standard TCL result code.
  *
  * Side effects:
- *  None.
+ *  Creates or overwrites the file. Sets the TCL result on error.
  *
  *----------------------------------------------------------------------
  */
 
-int Compiler_GetBytecodeExtensionObjCmd(void* dummy, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+static int WriteCoverageReport(Tcl_Interp* interp, Tcl_Obj* fileNamePtr, const char* scriptName, Tcl_Obj* reportPtr)
 {
-    Tcl_Obj* objPtr = Tcl_NewStringObj(tcExtension, -1);
-    Tcl_SetObjResult(interp, objPtr);
-    return TCL_OK;
+    Tcl_Channel chan;
+    Tcl_Obj *textPtr, **recordsPtr, **fieldsPtr;
+    Tcl_Size numRecords, numFields, numPrecompiled = 0, i;
+    const char *name, *reason;
+    int result = TCL_OK;
+
+    Tcl_ListObjGetElements(NULL, reportPtr, &numRecords, &recordsPtr);
+    textPtr = Tcl_NewObj();
+    Tcl_IncrRefCount(textPtr);
+    for (i = 0; i < numRecords; i++)
+    {
+        Tcl_ListObjGetElements(NULL, recordsPtr[i], &numFields, &fieldsPtr);
+        name = Tcl_GetString(fieldsPtr[1]);
+        reason = Tcl_GetString(fieldsPtr[2]);
+        Tcl_AppendPrintfToObj(textPtr,
+                              "%s:%s: proc %s: ",
+                              scriptName,
+                              Tcl_GetString(fieldsPtr[0]),
+                              (*name ? name : "(computed name)"));
+        if (*reason)
+        {
+            Tcl_AppendPrintfToObj(textPtr, "not precompiled: %s\n", reason);
+        }
+        else
+        {
+            Tcl_AppendToObj(textPtr, "precompiled\n", -1);
+            numPrecompiled++;
+        }
+    }
+    Tcl_AppendPrintfToObj(textPtr,
+                          "%s: %" TCL_SIZE_MODIFIER "d of %" TCL_SIZE_MODIFIER
+                          "d procedure definitions precompiled (%.1f%%)\n",
+                          scriptName,
+                          numPrecompiled,
+                          numRecords,
+                          (numRecords ? (100.0 * numPrecompiled) / numRecords : 100.0));
+
+    chan = Tcl_FSOpenFileChannel(interp, fileNamePtr, "w", 0666);
+    if (!chan)
+    {
+        PrependResult(interp, "error writing the -report file: ");
+        result = TCL_ERROR;
+    }
+    else
+    {
+        if (Tcl_WriteObj(chan, textPtr) < 0)
+        {
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("error writing \"%s\": %s", Tcl_GetString(fileNamePtr), Tcl_PosixError(interp)));
+            result = TCL_ERROR;
+        }
+        if ((Tcl_Close(interp, chan) != TCL_OK) && (result == TCL_OK))
+        {
+            result = TCL_ERROR;
+        }
+    }
+    Tcl_DecrRefCount(textPtr);
+
+    return result;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * Compiler_CompileFile --
- *
- *  Read in a file containing a Tcl script, and compile it. The resulting
- *  ByteCode structure is then written out to the file specified in the
- *  second argument. If the second argument is NULL, the output file will
- *  have the same root as the input, and extension ".tbc".
- *  The preamblePtr argument specifies a preamble to be written out to the
- *  output file before the body of the compiled script is emitted; this can
- *  be used to customize the generated script. A value of NULL means no
- *  preamble is to be emitted.
- *
- *  Tilde expansion and conversion to native format will be done for both
- *  file names.
+ * WriteTraceEvents --
  *
- *  Currently overwrites the input file if input and output file are the
- *  same. Does this need to be fixed?
+ *  Appends the trace events of a compilation to the -trace file of
+ *  compiler::compile. The file holds a JSON array whose closing bracket
+ *  is left out, as the trace event format allows, so that later
+ *  compilations can append to it; the opening bracket is written when the
+ *  file is empty. On Unix, the file is opened with O_APPEND and locked
+ *  while its size is checked and the events are written with a single
+ *  write, so that processes compiling in parallel can share the file.
+ *  Elsewhere, the events go through a Tcl channel, and concurrent writers
+ *  may interleave.
  *
  * Results:
  *  Returns a standard TCL result code.
  *
  * Side effects:
- *  None.
+ *  Creates or appends to the file. Sets the TCL result on error, unless
+ *  the result already holds an error.
  *
  *----------------------------------------------------------------------
  */
 
-int Compiler_CompileFile(Tcl_Interp* interp, char* inFilePtr, char* outFilePtr, char* preamblePtr)
+static int WriteTraceEvents(Tcl_Interp* interp, Tcl_Obj* fileNamePtr, Tcl_Obj* eventsPtr)
 {
-    Interp* iPtr = (Interp*)interp;
-    Tcl_DString inBuffer, outBuffer;
-    char* nativeInName;
-    char* nativeOutName;
-    Tcl_Channel chan;
-    int result;
-    struct stat statBuf;
-    unsigned short fileMode;
-    Tcl_Obj* cmdObjPtr;
-    LiteralTable glt; /* Save buffer for global literals */
-
-    Tcl_ResetResult(interp);
-
-    Tcl_DStringInit(&inBuffer);
-    Tcl_DStringInit(&outBuffer);
-
-    nativeInName = Tcl_TranslateFileName(interp, inFilePtr, &inBuffer);
-    if (nativeInName == NULL)
-    {
+    Tcl_Obj* textPtr = NULL;
+    Tcl_Size length;
+    int result = TCL_ERROR;
+#ifndef _WIN32
+    const char* nativePath = (const char*)Tcl_FSGetNativePath(fileNamePtr);
+    const char* bytes;
+    struct flock lock;
+    struct stat info;
+    ssize_t numWritten;
+    int fd, savedErrno;
+
+    if (!nativePath)
+    {
+        Tcl_SetErrno(EINVAL);
         goto error;
     }
-
-    if (outFilePtr == NULL)
-    {
-        nativeOutName = nativeInName;
-        Tcl_DStringAppend(&outBuffer, nativeOutName, -1);
-    }
-    else
+    fd = open(nativePath, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if (fd < 0)
     {
-        nativeOutName = Tcl_TranslateFileName(interp, outFilePtr, &outBuffer);
-        if (nativeOutName == NULL)
-        {
-            goto error;
-        }
+        goto error;
     }
 
     /*
-     * If Tcl_TranslateFileName didn't already copy the file names, do it
-     * here.  This way we don't depend on fileName staying constant
-     * throughout the execution of the script (e.g., what if it happens
-     * to point to a Tcl variable that the script could change?).
-     * This part came from Tcl_EvalFile, not sure it is needed here, the
-     * compiler should not affect the variable.
+     * The lock is released when the descriptor is closed.
      */
 
-    if (nativeInName != Tcl_DStringValue(&inBuffer))
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &lock) < 0)
     {
-        Tcl_DStringSetLength(&inBuffer, 0);
-        Tcl_DStringAppend(&inBuffer, nativeInName, -1);
-        nativeInName = Tcl_DStringValue(&inBuffer);
+        if (errno != EINTR)
+        {
+            goto closeFile;
+        }
     }
-
-    if (nativeOutName != Tcl_DStringValue(&outBuffer))
+    if (fstat(fd, &info) < 0)
     {
-        Tcl_DStringSetLength(&outBuffer, 0);
-        Tcl_DStringAppend(&outBuffer, nativeOutName, -1);
-        nativeOutName = Tcl_DStringValue(&outBuffer);
+        goto closeFile;
     }
 
-    /*
-     * If the outFilePtr argument was a NULL, then we must replace the
-     * extension for its current value, because its current value is inFilePtr.
-     */
-    if (outFilePtr == NULL)
+    textPtr = Tcl_NewStringObj((info.st_size > 0) ? "" : "[\n", -1);
+    Tcl_IncrRefCount(textPtr);
+    Tcl_AppendObjToObj(textPtr, eventsPtr);
+    bytes = Tcl_GetStringFromObj(textPtr, &length);
+    while (length > 0)
     {
-        const char* extension = TclGetExtension(nativeOutName);
-        if (extension != NULL)
+        numWritten = write(fd, bytes, length);
+        if (numWritten < 0)
         {
-            Tcl_DStringSetLength(&outBuffer, (Tcl_DStringLength(&outBuffer) - strlen(extension)));
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            goto closeFile;
         }
-        Tcl_DStringAppend(&outBuffer, tcExtension, -1);
-        nativeOutName = Tcl_DStringValue(&outBuffer);
+        bytes += numWritten;
+        length -= numWritten;
     }
+    result = TCL_OK;
 
-    if (stat(nativeInName, &statBuf) == -1)
+closeFile:
+    savedErrno = errno;
+    if ((close(fd) < 0) && (result == TCL_OK))
     {
-        Tcl_SetErrno(errno);
-        Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't read file \"%s\": %s", inFilePtr, Tcl_PosixError(interp)));
-        goto error;
+        result = TCL_ERROR;
     }
-    fileMode = statBuf.st_mode & ACCESSPERMS;
-
-    chan = Tcl_OpenFileChannel(interp, nativeInName, "r", 0644);
-    if (chan == (Tcl_Channel)NULL)
-    {
-        Tcl_ResetResult(interp);
-        Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't read file \"%s\": %s", inFilePtr, Tcl_PosixError(interp)));
-        goto error;
-    }
-    cmdObjPtr = Tcl_NewObj();
-    result = Tcl_ReadChars(chan, cmdObjPtr, -1, 0);
-    if (result < 0)
+    else
     {
-        Tcl_Close(interp, chan);
-        Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't read file \"%s\": %s", inFilePtr, Tcl_PosixError(interp)));
-        goto error;
+        errno = savedErrno;
     }
-    if (Tcl_Close(interp, chan) != TCL_OK)
+#else
+    Tcl_Channel chan;
+
+    chan = Tcl_FSOpenFileChannel(NULL, fileNamePtr, "a", 0666);
+    if (!chan)
     {
         goto error;
     }
 
-    /*
-     * Saving state of interpreter literals, then reinitializing
-     * for compiler. Prevents interference between application
-     * running the compiler and compiler itself.
-     */
-
-    memcpy(&glt, &iPtr->literalTable, sizeof(LiteralTable));
-
-    /* Inlined copy of "TclInitLiteralTable (&iPtr->literalTable);"
-     * This function is not in the stub table of Tcl, not even in
-     * the internal one. This causes link problems.
-     */
-
-#define REBUILD_MULTIPLIER 3
-
-    iPtr->literalTable.buckets = iPtr->literalTable.staticBuckets;
-    iPtr->literalTable.staticBuckets[0] = iPtr->literalTable.staticBuckets[1] = 0;
-    iPtr->literalTable.staticBuckets[2] = iPtr->literalTable.staticBuckets[3] = 0;
-    iPtr->literalTable.numBuckets = TCL_SMALL_HASH_TABLE;
-    iPtr->literalTable.numEntries = 0;
-    iPtr->literalTable.rebuildSize = TCL_SMALL_HASH_TABLE * REBUILD_MULTIPLIER;
-    iPtr->literalTable.mask = 3;
+    textPtr = Tcl_NewStringObj((Tcl_Tell(chan) > 0) ? "" : "[\n", -1);
+    Tcl_IncrRefCount(textPtr);
+    Tcl_AppendObjToObj(textPtr, eventsPtr);
+    Tcl_GetStringFromObj(textPtr, &length);
 
-    Tcl_IncrRefCount(cmdObjPtr);
-    result = Compiler_CompileObj(interp, cmdObjPtr);
-    if (result == TCL_RETURN)
+    Tcl_SetChannelOption(NULL, chan, "-translation", "binary");
+    if (Tcl_WriteObj(chan, textPtr) >= 0)
     {
-        result = TclUpdateReturnInfo(iPtr);
+        result = TCL_OK;
     }
-    else if (result == TCL_ERROR)
+    if (Tcl_Close(NULL, chan) != TCL_OK)
     {
-        char msg[200];
-
-        /*
-         * Record information telling where the error occurred.
-         */
-
-        sprintf(msg, "\n    (file \"%.150s\" line %d)", inFilePtr, Tcl_GetErrorLine(interp));
-        Tcl_AppendObjToErrorInfo(interp, Tcl_NewStringObj(msg, -1));
+        result = TCL_ERROR;
     }
-    else
+#endif
+
+error:
+    if (result != TCL_OK)
     {
-        chan = Tcl_OpenFileChannel(interp, nativeOutName, "w", fileMode);
-        if (chan == (Tcl_Channel)NULL)
-        {
-            Tcl_ResetResult(interp);
-            Tcl_SetObjResult(interp,
-                             Tcl_ObjPrintf("couldn't create output file \"%s\": %s", nativeOutName, Tcl_PosixError(interp)));
-            result = TCL_ERROR;
-        }
-        else
-        {
-            result = TCL_OK;
-            if (preamblePtr)
-            {
-                result = EmitString(interp, preamblePtr, -1, '\n', chan);
-            }
-            if (result == TCL_OK)
-            {
-                result = EmitCompiledObject(interp, cmdObjPtr, chan);
-            }
-            if (Tcl_Close(interp, chan) != TCL_OK)
-            {
-                Tcl_SetObjResult(interp, Tcl_ObjPrintf("error closing bytecode stream: %s", Tcl_PosixError(interp)));
-                result = TCL_ERROR;
-            }
-        }
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("error writing the -trace file \"%s\": %s",
+                                       Tcl_GetString(fileNamePtr),
+                                       Tcl_PosixError(interp)));
     }
-    if (result != TCL_ERROR)
+    if (textPtr)
     {
-        /*
-         * If an error was returned, the previous internal rep may
-         * already be freed, and this can cause crash conditions.
-         * [AS Bug 20078]
-         */
-        Tcl_DecrRefCount(cmdObjPtr);
+        Tcl_DecrRefCount(textPtr);
     }
-
-    /*
-     * Restore interpreter literals from save buffer. Can't delete the
-     * transient table, causes crashes.
-     */
-
-    /* ** TclDeleteLiteralTable (interp,&iPtr->literalTable); ** */
-    memcpy(&iPtr->literalTable, &glt, sizeof(LiteralTable));
-
-    Tcl_DStringFree(&inBuffer);
-    Tcl_DStringFree(&outBuffer);
-
     return result;
-
-error:
-    Tcl_DStringFree(&inBuffer);
-    Tcl_DStringFree(&outBuffer);
-
-    return TCL_ERROR;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * Compiler_CompileObj --
- *
- *  Compile Tcl commands stored in a Tcl object. These commands are
- *  compiled into bytecodes.
+ * ParseDefines --
  *
- *  Scarfed from Tcl_EvalObj, where we run the compilation step but not
- *  the execution step.
+ *  Validates the value of the -define flag and converts it to the form
+ *  used by LocalIfCompileProc: a dict keyed by the variable name without
+ *  any leading "::", whose values are the canonical decimal form of the
+ *  given numbers, with booleans mapped to 1 and 0.
  *
  * Results:
- *  The return value is one of the return codes defined in tcl.h
- *  (such as TCL_OK), and the interpreter's result contains a value
- *  to supplement the return code.
+ *  Returns a standard TCL result code. On success, *definesPtrPtr holds
+ *  the new dict with a reference count of 1.
  *
  * Side effects:
- *  The object is converted to a ByteCode object that holds the bytecode
- *  instructions for the commands.
+ *  Sets the TCL result on error.
  *
  *----------------------------------------------------------------------
  */
 
-int Compiler_CompileObj(Tcl_Interp* interp, Tcl_Obj* objPtr)
+static int ParseDefines(Tcl_Interp* interp, Tcl_Obj* objPtr, Tcl_Obj** definesPtrPtr)
 {
-    Interp* iPtr = (Interp*)interp;
-    int result = TCL_OK;
-
-    /*
-     * If the interpreter has been deleted, return an error.
-     */
+    Tcl_Obj *definesPtr, *keyPtr, *valuePtr, *newValuePtr;
+    Tcl_DictSearch search;
+    Tcl_WideInt wideValue;
+    double doubleValue;
+    const char* name;
+    int done, boolValue;
 
-    if (iPtr->flags & DELETED)
+    if (Tcl_DictObjFirst(interp, objPtr, &search, &keyPtr, &valuePtr, &done) != TCL_OK)
     {
-        Tcl_ResetResult(interp);
-        Tcl_AppendToObj(Tcl_GetObjResult(interp), "attempt to call compile in deleted interpreter", -1);
-        Tcl_SetErrorCode(interp, "COMPILER", "COMPILE", "attempt to call compile in deleted interpreter", (char*)NULL);
+        PrependResult(interp, "bad -define value: ");
         return TCL_ERROR;
     }
 
-    /*
-     * We force a recompilation even though this object may already be
-     * compiled. However, we do not attempt to recompile an object that had
-     * been generated from a compiled script.
-     */
-    const Tcl_ObjInternalRep* ir = Tcl_FetchInternalRep(objPtr, cmpByteCodeType);
-    if (ir)
-    {
-        ByteCode* codePtr = (ByteCode*)ir->twoPtrValue.ptr1;
-        if (codePtr->flags & TCL_BYTECODE_PRECOMPILED)
-            return TCL_OK;
-        Tcl_FreeInternalRep(objPtr);
-        ir = NULL;
-    }
-    if (!ir)
+    definesPtr = Tcl_NewDictObj();
+    Tcl_IncrRefCount(definesPtr);
+    for (; !done; Tcl_DictObjNext(&search, &keyPtr, &valuePtr, &done))
     {
-        Tcl_SetErrorLine(interp, 1);
-        if (CompileObject(interp, objPtr) != TCL_OK)
-            return TCL_ERROR;
-        if (Tcl_ConvertToType(interp, objPtr, cmpByteCodeType) != TCL_OK)
+        if (Tcl_GetWideIntFromObj(NULL, valuePtr, &wideValue) == TCL_OK)
+        {
+            newValuePtr = Tcl_NewWideIntObj(wideValue);
+        }
+        else if ((Tcl_GetDoubleFromObj(NULL, valuePtr, &doubleValue) == TCL_OK) && (doubleValue - doubleValue == 0.0))
+        {
+            newValuePtr = Tcl_NewDoubleObj(doubleValue);
+        }
+        else if (Tcl_GetBooleanFromObj(NULL, valuePtr, &boolValue) == TCL_OK)
+        {
+            newValuePtr = Tcl_NewIntObj(boolValue);
+        }
+        else
+        {
+            Tcl_DictObjDone(&search);
+            Tcl_DecrRefCount(definesPtr);
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("bad -define value for \"%s\": expected a number or boolean but got \"%s\"",
+                                           Tcl_GetString(keyPtr),
+                                           Tcl_GetString(valuePtr)));
             return TCL_ERROR;
+        }
+
+        name = Tcl_GetString(keyPtr);
+        while (*name == ':')
+        {
+            name++;
+        }
+        Tcl_DictObjPut(NULL, definesPtr, Tcl_NewStringObj(name, -1), newValuePtr);
     }
 
-    return result;
+    *definesPtrPtr = definesPtr;
+    return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * EmitCompiledObject --
+ * Compiler_GetBytecodeExtensionObjCmd --
  *
- *  Emits the contents of a ByteCode structure to a Tcl_Channel to generate
- *  a TCL "object file".
- *  There are three parts to the object file:
- *   - a header containing information about the ByteCode structure.
- *   - the dump of the bytecodes
- *   - the dump of the support arrays; this includes the dump of all the
- *     objects used by the byte code itself.
+ *  Returns the default extension used for bytecode compiled files.
+ *
+ *  Call format:
+ *    compiler::getBytecodeExtension
  *
  * Results:
- *  Returns a TCL result code.
+ *  Returns a standard TCL result code.
  *
  * Side effects:
- *  Appends an error message to the TCL error.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static int EmitCompiledObject(Tcl_Interp* interp, Tcl_Obj* objPtr, Tcl_Channel chan)
+int Compiler_GetBytecodeExtensionObjCmd(void* dummy, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
 {
-    if ((EmitScriptPreamble(interp, chan) != TCL_OK) || (EmitSignature(interp, chan) != TCL_OK))
-    {
-        return TCL_ERROR;
-    }
-
-    if (EmitByteCode(interp, (ByteCode*)objPtr->internalRep.otherValuePtr, chan) != TCL_OK)
-    {
-        PrependResult(interp, "error writing bytecode stream: ");
-        return TCL_ERROR;
-    }
-
-    if (EmitScriptPostamble(interp, chan) != TCL_OK)
-    {
-        return TCL_ERROR;
-    }
-
-    if (Tcl_Flush(chan) != TCL_OK)
-    {
-        Tcl_SetObjResult(interp, Tcl_ObjPrintf("error flushing bytecode stream: Tcl_Flush: %s", Tcl_PosixError(interp)));
-        return TCL_ERROR;
-    }
-
+    Tcl_Obj* objPtr = Tcl_NewStringObj(tcExtension, -1);
+    Tcl_SetObjResult(interp, objPtr);
     return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * EmitByteCode --
+ * Compiler_StatsObjCmd --
+ *
+ *  Returns the statistics accumulated by the compilations done in this
+ *  interpreter, as a dict. It holds the number of compiled scripts, the
+ *  procedure counters kept in the CompilerContext, the time spent in each
+ *  phase in microseconds, and under the "bytes" key the number of output
+ *  bytes in each section of the compiled files.
+ *  Under the "memory" key, it holds the bytes allocated by the compiler
+ *  for its own structures, the peak of those live during a compilation,
+ *  the bytes reused from the buffers that earlier compilations left in
+ *  the pool of the interpreter, the bytes the pool currently holds in
+ *  its free lists and in the bucket array of the last transient literal
+ *  table ("pooledBuckets"), and the current resident set size of the
+ *  process ("rss"), which also covers the CompileEnvs and ByteCodes
+ *  allocated by the Tcl core. The resident set size is read when the
+ *  statistics are returned, and left out where it is not known, as on
+ *  the platforms without /proc/self/statm.
+ *  Under the "units" key, it lists the most expensive ByteCodes compiled,
+ *  top level scripts and procedure bodies, as dicts that hold their name,
+ *  type, file, compile time in microseconds, code size in bytes, and
+ *  number of literals; this finds the procedures that dominate the compile
+ *  time of generated files.
  *
- *  Emits the contents of a ByteCode structure to a Tcl_Channel.
- *  There are three parts to the dumped information:
- *   - a header containing information about the ByteCode structure.
- *   - the dump of the bytecodes
- *   - the dump of the support arrays; this includes the dump of all the
- *     objects used by the byte code itself.
+ *  Call format:
+ *    compiler::stats ?-reset? ?-sort field? ?-top count?
+ *  The -reset flag resets the statistics after returning them.
+ *  The -sort flag selects the field that ranks the units: time (the
+ *  default), codeBytes or literals.
+ *  The -top flag sets how many units are listed, 10 by default; 0 lists
+ *  them all.
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *  Returns a standard TCL result code.
  *
  * Side effects:
  *  None.
@@ -817,342 +1219,484 @@ static int EmitCompiledObject(Tcl_Interp* interp, Tcl_Obj* objPtr, Tcl_Channel c
  *----------------------------------------------------------------------
  */
 
-static int EmitByteCode(Tcl_Interp* interp, ByteCode* codePtr, Tcl_Channel chan)
+int Compiler_StatsObjCmd(void* dummy, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
 {
-    LocMapSizes locMapSizes;
+    static const char* options[] = {"-reset", "-sort", "-top", NULL};
+    enum options
+    {
+        CMP_STATS_RESET,
+        CMP_STATS_SORT,
+        CMP_STATS_TOP
+    };
+    static const char* sortFields[] = {"time", "codeBytes", "literals", NULL};
+    enum sortFields
+    {
+        CMP_SORT_TIME,
+        CMP_SORT_CODEBYTES,
+        CMP_SORT_LITERALS
+    };
+    static const struct
+    {
+        const char* name;
+        size_t offset;
+    } counters[] = {{"compiles", offsetof(CompilerStats, numCompiles)},
+                    {"procs", offsetof(CompilerStats, numProcs)},
+                    {"compiledBodies", offsetof(CompilerStats, numCompiledBodies)},
+                    {"clonedBodies", offsetof(CompilerStats, numClonedBodies)},
+                    {"unsharedBodies", offsetof(CompilerStats, numUnsharedBodies)},
+                    {"unshares", offsetof(CompilerStats, numUnshares)},
+                    {"readTime", offsetof(CompilerStats, readTime)},
+                    {"compileTime", offsetof(CompilerStats, compileTime)},
+                    {"procBodyTime", offsetof(CompilerStats, procBodyTime)},
+                    {"rewriteTime", offsetof(CompilerStats, rewriteTime)},
+                    {"emitTime", offsetof(CompilerStats, emitTime)},
+                    {NULL, 0}};
+    static const char* sectionNames[CMP_NUM_SECTIONS] = {
+        "preamble", "header", "code", "locmap", "literals", "exceptions", "auxdata", "postamble"};
 
-    /*
-     * Emit the sizes of the various components of the ByteCode struct,
-     * so that the size can be recalculated at read time.
-     * These fields are currently written out as 0 always:
-     * numSrcChars
-     */
+    CompilerContext* ctxPtr = CompilerGetContext(interp);
+    CompilerStats* statsPtr = &ctxPtr->stats;
+    CompileCost* costPtr;
+    CostRank* ranksPtr;
+    Tcl_Obj *resultPtr, *bytesPtr, *memoryPtr, *unitsPtr, *unitPtr;
+    Tcl_WideInt rss, total = 0;
+    Tcl_Size numUnits, j;
+    int i, index, sortField = CMP_SORT_TIME, top = 10, reset = 0;
 
-    CalculateLocMapSizes(codePtr, &locMapSizes);
+    for (i = 1; i < objc; i++)
+    {
+        if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0, &index) != TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+        if ((index != CMP_STATS_RESET) && (i + 1 >= objc))
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("missing value for the %s flag", options[index]));
+            return TCL_ERROR;
+        }
+        switch ((enum options)index)
+        {
+            case CMP_STATS_RESET:
+                reset = 1;
+                break;
 
-    if ((EmitTclSize(interp, codePtr->numCommands, ' ', chan) != TCL_OK) ||
-        (EmitTclSize(interp, 0, ' ', chan) != TCL_OK) /* numSrcChars */
-        || (EmitTclSize(interp, codePtr->numCodeBytes, ' ', chan) != TCL_OK) ||
-        (EmitTclSize(interp, codePtr->numLitObjects, ' ', chan) != TCL_OK) ||
-        (EmitTclSize(interp, codePtr->numExceptRanges, ' ', chan) != TCL_OK) ||
-        (EmitTclSize(interp, codePtr->numAuxDataItems, ' ', chan) != TCL_OK) ||
-        (EmitTclSize(interp, codePtr->numCmdLocBytes, ' ', chan) != TCL_OK) ||
-        (EmitTclSize(interp, codePtr->maxExceptDepth, ' ', chan) != TCL_OK) ||
-        (EmitTclSize(interp, codePtr->maxStackDepth, ' ', chan) != TCL_OK))
+            case CMP_STATS_SORT:
+                if (Tcl_GetIndexFromObj(interp, objv[++i], sortFields, "field", 0, &sortField) != TCL_OK)
+                {
+                    return TCL_ERROR;
+                }
+                break;
+
+            case CMP_STATS_TOP:
+                if ((Tcl_GetIntFromObj(interp, objv[++i], &top) != TCL_OK) || (top < 0))
+                {
+                    Tcl_SetObjResult(interp,
+                                     Tcl_ObjPrintf("bad -top value \"%s\": must be a non-negative integer",
+                                                   Tcl_GetString(objv[i])));
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+
+    resultPtr = Tcl_NewDictObj();
+    for (i = 0; counters[i].name; i++)
     {
-        return TCL_ERROR;
+        Tcl_DictObjPut(NULL,
+                       resultPtr,
+                       Tcl_NewStringObj(counters[i].name, -1),
+                       Tcl_NewWideIntObj(*(Tcl_WideInt*)((char*)statsPtr + counters[i].offset)));
     }
 
-#if EMIT_SRCMAP
-    if ((EmitTclSize(interp, locMapSizes.codeDeltaSize, ' ', chan) != TCL_OK) ||
-        (EmitTclSize(interp, locMapSizes.codeLengthSize, ' ', chan) != TCL_OK) ||
-        (EmitTclSize(interp, locMapSizes.srcDeltaSize, ' ', chan) != TCL_OK) ||
-        (EmitTclSize(interp, locMapSizes.srcLengthSize, '\n', chan) != TCL_OK))
+    bytesPtr = Tcl_NewDictObj();
+    for (i = 0; i < CMP_NUM_SECTIONS; i++)
     {
-        return TCL_ERROR;
+        Tcl_DictObjPut(NULL, bytesPtr, Tcl_NewStringObj(sectionNames[i], -1), Tcl_NewWideIntObj(statsPtr->sectionBytes[i]));
+        total += statsPtr->sectionBytes[i];
     }
-#else
-    if ((EmitTclSize(interp, locMapSizes.codeDeltaSize, ' ', chan) != TCL_OK) ||
-        (EmitTclSize(interp, locMapSizes.codeLengthSize, ' ', chan) != TCL_OK) ||
-        (EmitTclSize(interp, -1, ' ', chan) != TCL_OK) || (EmitTclSize(interp, -1, '\n', chan) != TCL_OK))
+    Tcl_DictObjPut(NULL, bytesPtr, Tcl_NewStringObj("total", -1), Tcl_NewWideIntObj(total));
+    Tcl_DictObjPut(NULL, resultPtr, Tcl_NewStringObj("bytes", -1), bytesPtr);
+
+    memoryPtr = Tcl_NewDictObj();
+    Tcl_DictObjPut(NULL, memoryPtr, Tcl_NewStringObj("allocated", -1), Tcl_NewWideIntObj(statsPtr->allocBytes));
+    Tcl_DictObjPut(NULL, memoryPtr, Tcl_NewStringObj("peak", -1), Tcl_NewWideIntObj(statsPtr->peakBytes));
+    Tcl_DictObjPut(NULL, memoryPtr, Tcl_NewStringObj("reused", -1), Tcl_NewWideIntObj(statsPtr->reusedBytes));
+    Tcl_DictObjPut(NULL, memoryPtr, Tcl_NewStringObj("pooled", -1), Tcl_NewWideIntObj(ctxPtr->pool.pooledBytes));
+    Tcl_DictObjPut(NULL,
+                   memoryPtr,
+                   Tcl_NewStringObj("pooledBuckets", -1),
+                   Tcl_NewWideIntObj((Tcl_WideInt)ctxPtr->pool.numLiteralBuckets * sizeof(LiteralEntry*)));
+    rss = ResidentSetSize();
+    if (rss >= 0)
     {
-        return TCL_ERROR;
+        Tcl_DictObjPut(NULL, memoryPtr, Tcl_NewStringObj("rss", -1), Tcl_NewWideIntObj(rss));
     }
-#endif
+    Tcl_DictObjPut(NULL, resultPtr, Tcl_NewStringObj("memory", -1), memoryPtr);
 
     /*
-     * The byte code dumps
+     * Rank the units by decreasing value of the sort field; ties keep the
+     * order of compilation.
      */
 
-    if (EmitByteSequence(interp, codePtr->codeStart, codePtr->numCodeBytes, chan) != TCL_OK)
+    unitsPtr = Tcl_NewListObj(0, NULL);
+    if (ctxPtr->numCosts > 0)
     {
-        return TCL_ERROR;
+        ranksPtr = (CostRank*)Tcl_Alloc(ctxPtr->numCosts * sizeof(CostRank));
+        for (j = 0; j < ctxPtr->numCosts; j++)
+        {
+            costPtr = &ctxPtr->costsPtr[j];
+            ranksPtr[j].index = j;
+            ranksPtr[j].key = (sortField == CMP_SORT_TIME)        ? costPtr->time
+                              : (sortField == CMP_SORT_CODEBYTES) ? costPtr->codeBytes
+                                                                  : costPtr->numLiterals;
+        }
+        qsort(ranksPtr, ctxPtr->numCosts, sizeof(CostRank), CompareCostRanks);
+
+        numUnits = ((top == 0) || (top > ctxPtr->numCosts)) ? ctxPtr->numCosts : top;
+        for (j = 0; j < numUnits; j++)
+        {
+            costPtr = &ctxPtr->costsPtr[ranksPtr[j].index];
+            unitPtr = Tcl_NewDictObj();
+            Tcl_DictObjPut(NULL, unitPtr, Tcl_NewStringObj("name", -1), costPtr->namePtr);
+            Tcl_DictObjPut(NULL,
+                           unitPtr,
+                           Tcl_NewStringObj("type", -1),
+                           Tcl_NewStringObj(costPtr->isProcBody ? "proc" : "script", -1));
+            Tcl_DictObjPut(NULL, unitPtr, Tcl_NewStringObj("file", -1), costPtr->filePtr);
+            Tcl_DictObjPut(NULL, unitPtr, Tcl_NewStringObj("time", -1), Tcl_NewWideIntObj(costPtr->time));
+            Tcl_DictObjPut(NULL, unitPtr, Tcl_NewStringObj("codeBytes", -1), Tcl_NewWideIntObj(costPtr->codeBytes));
+            Tcl_DictObjPut(NULL, unitPtr, Tcl_NewStringObj("literals", -1), Tcl_NewWideIntObj(costPtr->numLiterals));
+            Tcl_ListObjAppendElement(NULL, unitsPtr, unitPtr);
+        }
+        Tcl_Free((char*)ranksPtr);
     }
+    Tcl_DictObjPut(NULL, resultPtr, Tcl_NewStringObj("units", -1), unitsPtr);
 
-    if ((EmitByteSequence(interp, codePtr->codeDeltaStart, locMapSizes.codeDeltaSize, chan) != TCL_OK) ||
-        (EmitByteSequence(interp, codePtr->codeLengthStart, locMapSizes.codeLengthSize, chan) != TCL_OK))
+    if (reset)
     {
-        return TCL_ERROR;
-    }
-#if EMIT_SRCMAP
-    if ((EmitByteSequence(interp, codePtr->srcDeltaStart, locMapSizes.srcDeltaSize, chan) != TCL_OK) ||
-        (EmitByteSequence(interp, codePtr->srcLengthStart, locMapSizes.srcLengthSize, chan) != TCL_OK))
-    {
-        return TCL_ERROR;
-    }
-#endif
-
-    /*
-     * the support arrays
-     */
-
-    if ((EmitObjArray(interp, codePtr, chan) != TCL_OK) || (EmitExcRangeArray(interp, codePtr, chan) != TCL_OK) ||
-        (EmitAuxDataArray(interp, codePtr, chan) != TCL_OK))
-    {
-        return TCL_ERROR;
+        memset(statsPtr, 0, sizeof(CompilerStats));
+        FreeCompileCosts(ctxPtr);
     }
 
+    Tcl_SetObjResult(interp, resultPtr);
     return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * EmitChar --
+ * Compiler_AnalyzeObjCmd --
  *
- *  Emits a character value to a Tcl_Channel.
- *  The separator argument specifies a character to be emitted after the
- *  integer.
+ *  Compiles a file like compiler::compile, but instead of writing the
+ *  output, reports where its bytes go. The result is a list of dicts, one
+ *  for the top level script followed by one for each procedure body, with
+ *  the sizes described in FillByteCodeAnalysis; the "name" key holds the
+ *  file name for the script, and the procedure name for the bodies.
+ *
+ *  Call format:
+ *    compiler::analyze inputFile
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *  Returns a standard TCL result code.
  *
  * Side effects:
- *  None.
+ *  Updates the statistics like compiler::compile.
  *
  *----------------------------------------------------------------------
  */
 
-static int EmitChar(Tcl_Interp* interp, int value, int separator, Tcl_Channel chan)
+int Compiler_AnalyzeObjCmd(void* dummy, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
 {
-    char buf[2];
+    CompilerContext* ctxPtr = CompilerGetContext(interp);
+    Tcl_Obj* analysisPtr;
+    int result;
 
-    buf[0] = value;
-    buf[1] = separator;
-    if (Tcl_Write(chan, buf, 2) < 0)
+    if (objc != 2)
     {
-        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Tcl_Write: %s", Tcl_PosixError(interp)));
+        Tcl_WrongNumArgs(interp, 1, objv, "inputFileName");
         return TCL_ERROR;
     }
 
-    return TCL_OK;
-}
+    analysisPtr = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(analysisPtr);
+    ctxPtr->analysisPtr = analysisPtr;
+    ctxPtr->analysisNamePtr = objv[1];
+    Tcl_IncrRefCount(ctxPtr->analysisNamePtr);
 
-/*
- *----------------------------------------------------------------------
- *
- * EmitTclSize --
- *
- *  Emits an integer value to a Tcl_Channel.
- *  The separator argument specifies a character to be emitted after the
- *  integer.
- *
- * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
- *
- * Side effects:
- *  None.
- *
- *----------------------------------------------------------------------
- */
+    result = Compiler_CompileFile(interp, Tcl_GetString(objv[1]), NULL, NULL);
 
-static int EmitTclSize(Tcl_Interp* interp, Tcl_Size value, int separator, Tcl_Channel chan)
-{
-    char buf[64];
-    int n = snprintf(buf, sizeof(buf), "%" TCL_SIZE_MODIFIER "d%c", value, (char)separator);
-    if (n < 0 || Tcl_Write(chan, buf, n) < 0)
+    ctxPtr->analysisPtr = NULL;
+    if (ctxPtr->analysisNamePtr)
     {
-        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Tcl_WriteObj: %s", Tcl_PosixError(interp)));
-        return TCL_ERROR;
+        Tcl_DecrRefCount(ctxPtr->analysisNamePtr);
+        ctxPtr->analysisNamePtr = NULL;
     }
-    return TCL_OK;
+
+    if (result == TCL_OK)
+    {
+        Tcl_SetObjResult(interp, analysisPtr);
+    }
+    Tcl_DecrRefCount(analysisPtr);
+    return result;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * EmitString --
+ * Compiler_DisassembleObjCmd --
  *
- *  Emits a string value to a Tcl_Channel.
- *  If the length is passed as -1, it is calculated with strlen.
- *  The separator argument specifies a character to be emitted after the
- *  string.
+ *  Compiles files like compiler::compile and, instead of writing the
+ *  output, disassembles the ByteCodes that would have been emitted: the
+ *  top level script of each file, then the procedure bodies, with their
+ *  literals, exception ranges and AuxData (see DisassembleByteCode).
+ *
+ *  Call format:
+ *    compiler::disassemble ?-histogram? inputFile ?inputFile ...?
+ *  Without -histogram the result is the listing. With -histogram, it is a
+ *  dict that holds the number of instructions and code bytes, the opcode
+ *  frequencies under "opcodes", sorted by decreasing count, and the
+ *  number of instructions of each length in bytes under "sizes"; this is
+ *  meant to be run over all the files of a source tree.
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *  Returns a standard TCL result code.
  *
  * Side effects:
- *  None.
+ *  Updates the statistics like compiler::compile.
  *
  *----------------------------------------------------------------------
  */
 
-static int EmitString(Tcl_Interp* interp, char* src, Tcl_Size length, int separator, Tcl_Channel chan)
+int Compiler_DisassembleObjCmd(void* dummy, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
 {
-    if (length < 0)
+    InstructionDesc* opCodesTablePtr = (InstructionDesc*)TclGetInstructionTable();
+    CompilerContext* ctxPtr = CompilerGetContext(interp);
+    DisassemblyInfo* infoPtr;
+    OpcodeCount* countsPtr;
+    Tcl_Obj *resultPtr, *opcodesPtr, *sizesPtr;
+    Tcl_WideInt numInsts = 0, numBytes = 0;
+    int i, numCounts, firstFile = 1, histogram = 0, result = TCL_OK;
+
+    if ((objc > 1) && (strcmp(Tcl_GetString(objv[1]), "-histogram") == 0))
     {
-        length = strlen(src);
+        histogram = 1;
+        firstFile = 2;
     }
-
-    if ((length > 0) && (Tcl_Write(chan, src, length) < 0))
+    if (objc <= firstFile)
     {
-        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Tcl_Write: %s", Tcl_PosixError(interp)));
+        Tcl_WrongNumArgs(interp, 1, objv, "?-histogram? inputFileName ?inputFileName ...?");
         return TCL_ERROR;
     }
 
-    const char c = (char)separator;
-    if (Tcl_Write(chan, &c, 1) < 0)
+    infoPtr = (DisassemblyInfo*)Tcl_Alloc(sizeof(DisassemblyInfo));
+    memset(infoPtr, 0, sizeof(DisassemblyInfo));
+    if (!histogram)
     {
-        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Tcl_Write: %s", Tcl_PosixError(interp)));
-        return TCL_ERROR;
+        infoPtr->listingPtr = Tcl_NewObj();
+        Tcl_IncrRefCount(infoPtr->listingPtr);
     }
 
-    return TCL_OK;
-}
-
-/*
- *----------------------------------------------------------------------
- *
- * EmitByteSequence --
- *
- *  Emits an array of bytes to a Tcl_Channel, in ASCII85.
- *  This procedure encodes its input with a modified version of the ASCII85
- *  encode filter.
- *  There are two differences from the standard ASCII85 algorithm:
- *  - the encoding characters are obtained from a table rather than
- *    being generated arithmetically. This is done because we want to
- *    avoid using Tcl special characters.
- *  - the order in which bytes in a 4-tuple are encoded is the opposite
- *    of the standard order. This lets us drop ! bytes in the encoded
- *    5-tuple, which buys us better encoding with short strings.
- *  As a consequence, this encoder is not general purpose; only a similarly
- *  specialized decoder can extract the bytes back.
- *
- *  The format is a line containing the byte count, then lines each containing
- *  72 ASCII characters, or fewer for the last line.
- *
- * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
- *
- * Side effects:
- *  None.
- *
- *----------------------------------------------------------------------
- */
-
-static int EmitByteSequence(Tcl_Interp* interp, unsigned char* bytesPtr, Tcl_Size length, Tcl_Channel chan)
-{
-    A85EncodeContext encodeCtx;
-    unsigned char bytes[4];
-    Tcl_Size numBytes = 0;
-
-    if (EmitTclSize(interp, length, '\n', chan) != TCL_OK)
+    ctxPtr->disassemblyPtr = infoPtr;
+    for (i = firstFile; (result == TCL_OK) && (i < objc); i++)
     {
-        return TCL_ERROR;
+        result = Compiler_CompileFile(interp, Tcl_GetString(objv[i]), NULL, NULL);
     }
+    ctxPtr->disassemblyPtr = NULL;
 
-    A85InitEncodeContext(chan, '\n', &encodeCtx);
-
-    while (length > 0)
+    if (result != TCL_OK)
     {
-        bytes[numBytes] = *bytesPtr;
+        /* the error is already in the result */
+    }
+    else if (!histogram)
+    {
+        Tcl_SetObjResult(interp, infoPtr->listingPtr);
+    }
+    else
+    {
+        countsPtr = (OpcodeCount*)Tcl_Alloc(256 * sizeof(OpcodeCount));
+        for (i = 0, numCounts = 0; i < 256; i++)
+        {
+            if (infoPtr->opCounts[i] > 0)
+            {
+                countsPtr[numCounts].opCode = i;
+                countsPtr[numCounts].count = infoPtr->opCounts[i];
+                numCounts++;
+                numInsts += infoPtr->opCounts[i];
+            }
+        }
+        qsort(countsPtr, numCounts, sizeof(OpcodeCount), CompareOpcodeCounts);
 
-        if (numBytes == 3)
+        opcodesPtr = Tcl_NewDictObj();
+        for (i = 0; i < numCounts; i++)
         {
-            if (A85EncodeBytes(interp, bytes, 4, &encodeCtx) != TCL_OK)
+            Tcl_DictObjPut(NULL,
+                           opcodesPtr,
+                           Tcl_NewStringObj(opCodesTablePtr[countsPtr[i].opCode].name, -1),
+                           Tcl_NewWideIntObj(countsPtr[i].count));
+        }
+        Tcl_Free((char*)countsPtr);
+
+        sizesPtr = Tcl_NewDictObj();
+        for (i = 1; i <= CMP_MAX_INST_SIZE; i++)
+        {
+            if (infoPtr->sizeCounts[i] > 0)
             {
-                return TCL_ERROR;
+                Tcl_DictObjPut(NULL, sizesPtr, Tcl_NewIntObj(i), Tcl_NewWideIntObj(infoPtr->sizeCounts[i]));
+                numBytes += i * infoPtr->sizeCounts[i];
             }
-            numBytes = -1;
         }
 
-        numBytes += 1;
-        bytesPtr += 1;
-        length -= 1;
+        resultPtr = Tcl_NewDictObj();
+        Tcl_DictObjPut(NULL, resultPtr, Tcl_NewStringObj("instructions", -1), Tcl_NewWideIntObj(numInsts));
+        Tcl_DictObjPut(NULL, resultPtr, Tcl_NewStringObj("codeBytes", -1), Tcl_NewWideIntObj(numBytes));
+        Tcl_DictObjPut(NULL, resultPtr, Tcl_NewStringObj("opcodes", -1), opcodesPtr);
+        Tcl_DictObjPut(NULL, resultPtr, Tcl_NewStringObj("sizes", -1), sizesPtr);
+        Tcl_SetObjResult(interp, resultPtr);
     }
 
-    if ((numBytes != 0) && (A85EncodeBytes(interp, bytes, numBytes, &encodeCtx) != TCL_OK))
+    if (infoPtr->listingPtr)
     {
-        return TCL_ERROR;
+        Tcl_DecrRefCount(infoPtr->listingPtr);
     }
-
-    return A85Flush(interp, &encodeCtx);
+    Tcl_Free((char*)infoPtr);
+    return result;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * CalculateLocMapSizes --
+ * CreateCountingChannel --
  *
- *  Calculates the lengths of the location map arrays in a ByteCode
- *  struct and places them in the LocMapSizes argument.
- *  Note that, although it could use pointer arithmetic for all but the
- *  last one (because the arrays are contiguous), we elect to do it by
- *  scanning the arrays in all cases.
+ *  Creates a write-only channel that discards its output, but keeps track
+ *  of its size so that Tcl_Tell reports how many bytes were written.
+ *  compiler::analyze emits into such a channel.
  *
  * Results:
- *  None.
+ *  Returns the new channel, which is not registered in any interpreter.
  *
  * Side effects:
- *  Fills in the fields of the LocMapSizes struct.
+ *  Advances the channel counter of the context, which numbers the names
+ *  of the channels of an interpreter.
  *
  *----------------------------------------------------------------------
  */
-static void CalculateLocMapSizes(ByteCode* codePtr, LocMapSizes* sizes)
+
+static Tcl_ChannelType countingChannelType = {
+    "compilercount",           /* typeName */
+    TCL_CHANNEL_VERSION_5,     /* version */
+    TCL_CLOSE2PROC,            /* closeProc */
+    NULL,                      /* inputProc */
+    CountingOutputProc,        /* outputProc */
+#if TCL_MAJOR_VERSION < 9
+    CountingSeekProc,          /* seekProc */
+#else
+    NULL,                      /* seekProc */
+#endif
+    NULL,                      /* setOptionProc */
+    NULL,                      /* getOptionProc */
+    CountingWatchProc,         /* watchProc */
+    NULL,                      /* getHandleProc */
+    CountingCloseProc,         /* close2Proc */
+    NULL,                      /* blockModeProc */
+    NULL,                      /* flushProc */
+    NULL,                      /* handlerProc */
+    CountingWideSeekProc,      /* wideSeekProc */
+    NULL,                      /* threadActionProc */
+    NULL                       /* truncateProc */
+};
+
+static Tcl_Channel CreateCountingChannel(CompilerContext* ctxPtr)
 {
-    /*
-     * EMIL for all but the last, we could do sanity checking by using
-     * pointer arithmetic.
-     */
+    Tcl_WideInt* offsetPtr = (Tcl_WideInt*)Tcl_Alloc(sizeof(Tcl_WideInt));
+    Tcl_Channel chan;
+    char name[40];
 
-    sizes->codeDeltaSize = CalculateLocArrayLength(codePtr->codeDeltaStart, codePtr->numCommands);
-    sizes->codeLengthSize = CalculateLocArrayLength(codePtr->codeLengthStart, codePtr->numCommands);
-    sizes->srcDeltaSize = CalculateLocArrayLength(codePtr->srcDeltaStart, codePtr->numCommands);
-    sizes->srcLengthSize = CalculateLocArrayLength(codePtr->srcLengthStart, codePtr->numCommands);
+    *offsetPtr = 0;
+    sprintf(name, "compilercount%" TCL_SIZE_MODIFIER "d", ctxPtr->channelCounter++);
+    chan = Tcl_CreateChannel(&countingChannelType, name, (void*)offsetPtr, TCL_WRITABLE);
+    return chan;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * CalculateLocArrayLength --
+ * CountingOutputProc, CountingSeekProc, CountingWideSeekProc,
+ * CountingWatchProc, CountingCloseProc --
  *
- *  Calculates the length of the given location array; numCommands is the
- *  number of commands in the ByteCode structure.
+ *  The driver procedures of the channels created by CreateCountingChannel.
+ *  The instance data is the number of bytes written so far; the channel
+ *  can only be asked for its current position.
  *
  * Results:
- *  Returns the length, in bytes, of the array.
+ *  See the Tcl_CreateChannel documentation.
  *
  * Side effects:
- *  None.
+ *  CountingCloseProc frees the instance data.
  *
  *----------------------------------------------------------------------
  */
 
-static Tcl_Size CalculateLocArrayLength(unsigned char* bytes, Tcl_Size numCommands)
+static int CountingOutputProc(void* instanceData, const char* buf, int toWrite, int* errorCodePtr)
 {
-    int i, length = 0;
+    *(Tcl_WideInt*)instanceData += toWrite;
+    return toWrite;
+}
 
-    /*
-     * array is encoded as either a single byte, or a four-byte sequence
-     * preceded by the 0xff tag
-     */
+#if TCL_MAJOR_VERSION < 9
+static int CountingSeekProc(void* instanceData, long offset, int mode, int* errorCodePtr)
+{
+    return (int)CountingWideSeekProc(instanceData, offset, mode, errorCodePtr);
+}
+#endif
 
-    for (i = 0; i < numCommands; i++)
+static Tcl_WideInt CountingWideSeekProc(void* instanceData, Tcl_WideInt offset, int mode, int* errorCodePtr)
+{
+    if ((offset != 0) || (mode != SEEK_CUR))
     {
-        if (*bytes == 0xff)
-        {
-            length += 5;
-            bytes += 5;
-        }
-        else
-        {
-            length += 1;
-            bytes += 1;
-        }
+        *errorCodePtr = EINVAL;
+        return -1;
     }
+    return *(Tcl_WideInt*)instanceData;
+}
 
-    return length;
+static void CountingWatchProc(void* instanceData, int mask)
+{
+}
+
+static int CountingCloseProc(void* instanceData, Tcl_Interp* interp, int flags)
+{
+    if (flags & (TCL_CLOSE_READ | TCL_CLOSE_WRITE))
+    {
+        return EINVAL;
+    }
+    Tcl_Free((char*)instanceData);
+    return 0;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * EmitObjArray --
+ * Compiler_CompileFile --
  *
- *  Emits the object array for a ByteCode struct to a Tcl_Channel.
+ *  Read in a file containing a Tcl script, and compile it. The resulting
+ *  ByteCode structure is then written out to the file specified in the
+ *  second argument. If the second argument is NULL, the output file will
+ *  have the same root as the input, and extension ".tbc".
+ *  The preamblePtr argument specifies a preamble to be written out to the
+ *  output file before the body of the compiled script is emitted; this can
+ *  be used to customize the generated script. A value of NULL means no
+ *  preamble is to be emitted.
+ *
+ *  Tilde expansion and conversion to native format will be done for both
+ *  file names.
+ *  While compiler::analyze runs, the output is discarded instead (see
+ *  Compiler_AnalyzeObjCmd).
+ *
+ *  Currently overwrites the input file if input and output file are the
+ *  same. Does this need to be fixed?
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *  Returns a standard TCL result code.
  *
  * Side effects:
  *  None.
@@ -1160,311 +1704,540 @@ static Tcl_Size CalculateLocArrayLength(unsigned char* bytes, Tcl_Size numComman
  *----------------------------------------------------------------------
  */
 
-static int EmitObjArray(Tcl_Interp* interp, ByteCode* codePtr, Tcl_Channel chan)
+int Compiler_CompileFile(Tcl_Interp* interp, char* inFilePtr, char* outFilePtr, char* preamblePtr)
 {
+    Interp* iPtr = (Interp*)interp;
+    Tcl_DString inBuffer, outBuffer;
+    char* nativeInName;
+    char* nativeOutName;
+    Tcl_Channel chan;
+    Tcl_Time writeStart;
     int result;
-    Tcl_Size i, numLitObjects = codePtr->numLitObjects;
-    Tcl_Obj** objArrayPtr = &codePtr->objArrayPtr[0];
+    struct stat statBuf;
+    unsigned short fileMode;
+    Tcl_Obj* cmdObjPtr;
+    LiteralTable glt; /* Save buffer for global literals */
+    CompilerContext* ctxPtr = CompilerGetContext(interp);
+    Tcl_Time start, fileStart;
 
-    if (EmitTclSize(interp, numLitObjects, '\n', chan) != TCL_OK)
+    Tcl_ResetResult(interp);
+    CMP_PROBE1(file__start, inFilePtr);
+    Tcl_GetTime(&fileStart);
+
+    Tcl_DStringInit(&inBuffer);
+    Tcl_DStringInit(&outBuffer);
+
+    nativeInName = Tcl_TranslateFileName(interp, inFilePtr, &inBuffer);
+    if (nativeInName == NULL)
     {
-        return TCL_ERROR;
+        goto error;
     }
 
-    for (i = 0; i < numLitObjects; i++)
+    if (outFilePtr == NULL)
     {
-        result = EmitObject(interp, objArrayPtr[i], chan);
-        if (result != TCL_OK)
+        nativeOutName = nativeInName;
+        Tcl_DStringAppend(&outBuffer, nativeOutName, -1);
+    }
+    else
+    {
+        nativeOutName = Tcl_TranslateFileName(interp, outFilePtr, &outBuffer);
+        if (nativeOutName == NULL)
         {
-            return result;
+            goto error;
         }
     }
 
-    return TCL_OK;
-}
-
-/*
- *----------------------------------------------------------------------
- *
- * EmitObject --
- *
- *  Emits a Tcl_Obj to a Tcl_Channel.
- *
- * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
- *
- * Side effects:
- *  None.
- *
- *----------------------------------------------------------------------
- */
-
-static int EmitObject(Tcl_Interp* interp, Tcl_Obj* objPtr, Tcl_Channel chan)
-{
-    const Tcl_ObjType* objTypePtr;
-    char* objBytes;
-    Tcl_Size objLength;
-    char typeCode = CMP_STRING_CODE;
-    int emitCount = 1;
+    /*
+     * If Tcl_TranslateFileName didn't already copy the file names, do it
+     * here.  This way we don't depend on fileName staying constant
+     * throughout the execution of the script (e.g., what if it happens
+     * to point to a Tcl variable that the script could change?).
+     * This part came from Tcl_EvalFile, not sure it is needed here, the
+     * compiler should not affect the variable.
+     */
 
-    objTypePtr = objPtr->typePtr;
-    objBytes = Tcl_GetStringFromObj(objPtr, &objLength);
-    if (!objBytes)
+    if (nativeInName != Tcl_DStringValue(&inBuffer))
     {
-        objBytes = "";
-        objLength = 0;
+        Tcl_DStringSetLength(&inBuffer, 0);
+        Tcl_DStringAppend(&inBuffer, nativeInName, -1);
+        nativeInName = Tcl_DStringValue(&inBuffer);
     }
 
-    if (objTypePtr == cmpIntType)
-    {
-        typeCode = CMP_INT_CODE;
-        emitCount = 0;
-    }
-    else if (objTypePtr == cmpDoubleType)
+    if (nativeOutName != Tcl_DStringValue(&outBuffer))
     {
-        typeCode = CMP_DOUBLE_CODE;
-        emitCount = 0;
+        Tcl_DStringSetLength(&outBuffer, 0);
+        Tcl_DStringAppend(&outBuffer, nativeOutName, -1);
+        nativeOutName = Tcl_DStringValue(&outBuffer);
     }
-    else if (objTypePtr == cmpByteCodeType)
+
+    /*
+     * If the outFilePtr argument was a NULL, then we must replace the
+     * extension for its current value, because its current value is inFilePtr.
+     */
+    if (outFilePtr == NULL)
     {
-        if (EmitChar(interp, CMP_BYTECODE_CODE, '\n', chan) != TCL_OK)
+        const char* extension = TclGetExtension(nativeOutName);
+        if (extension != NULL)
         {
-            return TCL_ERROR;
+            Tcl_DStringSetLength(&outBuffer, (Tcl_DStringLength(&outBuffer) - strlen(extension)));
         }
-        return EmitByteCode(interp, (ByteCode*)objPtr->internalRep.otherValuePtr, chan);
+        Tcl_DStringAppend(&outBuffer, tcExtension, -1);
+        nativeOutName = Tcl_DStringValue(&outBuffer);
     }
-    else if (objTypePtr == cmpProcBodyType)
+
+    Tcl_GetTime(&start);
+    if (stat(nativeInName, &statBuf) == -1)
     {
-        if (EmitChar(interp, CMP_PROCBODY_CODE, '\n', chan) != TCL_OK)
-        {
-            return TCL_ERROR;
-        }
-        return EmitProcBody(interp, (Proc*)objPtr->internalRep.otherValuePtr, chan);
+        Tcl_SetErrno(errno);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't read file \"%s\": %s", inFilePtr, Tcl_PosixError(interp)));
+        goto error;
     }
-    else
+    fileMode = statBuf.st_mode & ACCESSPERMS;
+
+    chan = Tcl_OpenFileChannel(interp, nativeInName, "r", 0644);
+    if (chan == (Tcl_Channel)NULL)
     {
-        if (EmitChar(interp, CMP_XSTRING_CODE, '\n', chan) != TCL_OK)
+        Tcl_ResetResult(interp);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't read file \"%s\": %s", inFilePtr, Tcl_PosixError(interp)));
+        goto error;
+    }
+    if (ctxPtr->chunkSize > 0)
+    {
+        ctxPtr->scriptName = inFilePtr;
+        result = CompileFileInChunks(interp, chan, inFilePtr, nativeOutName, fileMode, preamblePtr);
+        if (Tcl_Close((result == TCL_OK) ? interp : NULL, chan) != TCL_OK)
         {
-            return TCL_ERROR;
+            result = TCL_ERROR;
         }
-        return EmitByteSequence(interp, (unsigned char*)objBytes, objLength, chan);
+        goto done;
     }
-    if (EmitChar(interp, typeCode, '\n', chan) != TCL_OK)
+    cmdObjPtr = Tcl_NewObj();
+    if (Tcl_ReadChars(chan, cmdObjPtr, -1, 0) < 0)
     {
-        return TCL_ERROR;
+        Tcl_Close(interp, chan);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't read file \"%s\": %s", inFilePtr, Tcl_PosixError(interp)));
+        goto error;
     }
-    if (emitCount && (EmitTclSize(interp, objLength, '\n', chan) != TCL_OK))
+    if (Tcl_Close(interp, chan) != TCL_OK)
     {
-        return TCL_ERROR;
+        goto error;
     }
-    return EmitString(interp, objBytes, objLength, '\n', chan);
-}
+    ctxPtr->stats.readTime += ElapsedTime(&start);
+    ctxPtr->scriptName = inFilePtr;
+    TraceSpan(ctxPtr, "read", "phase", &start);
 
-/*
- *----------------------------------------------------------------------
- *
- * EmitExcRangeArray --
- *
- *  Emits the exception range array for a ByteCode struct to a Tcl_Channel.
- *
- * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
- *
- * Side effects:
- *  None.
- *
- *----------------------------------------------------------------------
- */
+    /*
+     * Saving state of interpreter literals, then reinitializing
+     * for compiler. Prevents interference between application
+     * running the compiler and compiler itself.
+     */
 
-static int EmitExcRangeArray(Tcl_Interp* interp, ByteCode* codePtr, Tcl_Channel chan)
-{
-    Tcl_Size i, numExceptRanges = codePtr->numExceptRanges;
-    ExceptionRange* excArrayPtr = codePtr->exceptArrayPtr;
-    char excName;
+    memcpy(&glt, &iPtr->literalTable, sizeof(LiteralTable));
+    InitLiteralTable(&iPtr->literalTable, &ctxPtr->pool);
 
-    if (EmitTclSize(interp, numExceptRanges, '\n', chan) != TCL_OK)
+    Tcl_IncrRefCount(cmdObjPtr);
+    result = Compiler_CompileObj(interp, cmdObjPtr);
+    if (result == TCL_RETURN)
     {
-        return TCL_ERROR;
+        result = TclUpdateReturnInfo(iPtr);
     }
+    else if (result == TCL_ERROR)
+    {
+        char msg[200];
 
-    for (i = 0; i < numExceptRanges; i++)
+        /*
+         * Record information telling where the error occurred.
+         */
+
+        sprintf(msg, "\n    (file \"%.150s\" line %d)", inFilePtr, Tcl_GetErrorLine(interp));
+        Tcl_AppendObjToErrorInfo(interp, Tcl_NewStringObj(msg, -1));
+    }
+    else if (ctxPtr->disassemblyPtr)
     {
-        excName = NameFromExcRange(excArrayPtr->type);
-        if (excName == '\0')
+        DisassembleObject(ctxPtr->disassemblyPtr, cmdObjPtr, inFilePtr);
+        result = TCL_OK;
+    }
+    else
+    {
+        Tcl_GetTime(&start);
+        if (ctxPtr->analysisPtr)
         {
-            return -1;
+            chan = CreateCountingChannel(ctxPtr);
         }
-
-        if ((EmitChar(interp, excName, ' ', chan) != TCL_OK) ||
-            (EmitTclSize(interp, excArrayPtr->nestingLevel, ' ', chan) != TCL_OK) ||
-            (EmitTclSize(interp, excArrayPtr->codeOffset, ' ', chan) != TCL_OK) ||
-            (EmitTclSize(interp, excArrayPtr->numCodeBytes, ' ', chan) != TCL_OK) ||
-            (EmitTclSize(interp, excArrayPtr->breakOffset, ' ', chan) != TCL_OK) ||
-            (EmitTclSize(interp, excArrayPtr->continueOffset, ' ', chan) != TCL_OK) ||
-            (EmitTclSize(interp, excArrayPtr->catchOffset, '\n', chan) != TCL_OK))
+        else
         {
-            return TCL_ERROR;
+            chan = Tcl_OpenFileChannel(interp, nativeOutName, "w", fileMode);
+        }
+        if (chan == (Tcl_Channel)NULL)
+        {
+            Tcl_ResetResult(interp);
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("couldn't create output file \"%s\": %s", nativeOutName, Tcl_PosixError(interp)));
+            result = TCL_ERROR;
+        }
+        else
+        {
+            result = TCL_OK;
+            if (preamblePtr)
+            {
+                result = EmitString(interp, preamblePtr, -1, '\n', chan);
+            }
+            if (result == TCL_OK)
+            {
+                result = EmitCompiledObject(interp, cmdObjPtr, 1, chan);
+            }
+            TraceSpan(ctxPtr, "emit", "phase", &start);
+
+            Tcl_GetTime(&writeStart);
+            if (Tcl_Close(interp, chan) != TCL_OK)
+            {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("error closing bytecode stream: %s", Tcl_PosixError(interp)));
+                result = TCL_ERROR;
+            }
+            TraceSpan(ctxPtr, "write", "phase", &writeStart);
         }
+        ctxPtr->stats.emitTime += ElapsedTime(&start);
 
-        excArrayPtr += 1;
+        /*
+         * With compiler::verify, read the file back and check it against
+         * the ByteCode it was written from.
+         */
+
+        if ((result == TCL_OK) && ctxPtr->verifyPtr && !ctxPtr->analysisPtr)
+        {
+            result = CompilerVerifyFile(interp, nativeOutName, 0, cmdObjPtr, ctxPtr->verifyPtr);
+        }
     }
 
-    return TCL_OK;
+    /*
+     * When the compilation fails, TclSetByteCodeFromAny leaves the object
+     * as it was, so it can be freed like when it succeeds. This releases
+     * its literals from the transient table, which RestoreLiteralTable
+     * then frees.
+     */
+
+    Tcl_DecrRefCount(cmdObjPtr);
+    RestoreLiteralTable(iPtr, &glt, &ctxPtr->pool);
+
+done:
+    Tcl_DStringFree(&inBuffer);
+    Tcl_DStringFree(&outBuffer);
+
+    TraceSpan(ctxPtr, inFilePtr, "file", &fileStart);
+    ctxPtr->scriptName = NULL;
+    CMP_PROBE2(file__end, inFilePtr, result);
+    return result;
+
+error:
+    Tcl_DStringFree(&inBuffer);
+    Tcl_DStringFree(&outBuffer);
+
+    ctxPtr->scriptName = inFilePtr;
+    TraceSpan(ctxPtr, inFilePtr, "file", &fileStart);
+    ctxPtr->scriptName = NULL;
+    CMP_PROBE2(file__end, inFilePtr, TCL_ERROR);
+    return TCL_ERROR;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * EmitAuxDataArray --
- *
- *  Emits the AuxData array for a ByteCode struct to a Tcl_Channel.
+ * CompileFileInChunks --
+ *
+ *  Compiles the script read from inChan for -chunk: the script is read
+ *  line by line, and as soon as the lines read hold at least
+ *  ctxPtr->chunkSize bytes and end with a whole command, they are
+ *  compiled, emitted to the output file as one eval command of the loader
+ *  and freed. Each chunk is an independent ByteCode, so that neither the
+ *  source nor the ByteCode of the whole script is ever held in memory.
+ *  The chunks are evaluated in order when the file is sourced; a chunk
+ *  cannot end in the middle of a command. A chunk other than the first
+ *  that holds no command, only blank or comment lines, is not emitted:
+ *  its eval command would return an empty result, and the sourced file
+ *  would no longer return the result of its last command. The procedure
+ *  bodies of one chunk are not shared with the identical bodies of
+ *  another.
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *  Returns a standard TCL result code.
  *
  * Side effects:
- *  None.
+ *  Writes the output file. Does not close inChan.
  *
  *----------------------------------------------------------------------
  */
 
-static int EmitAuxDataArray(Tcl_Interp* interp, ByteCode* codePtr, Tcl_Channel chan)
+static int CompileFileInChunks(Tcl_Interp* interp,
+                               Tcl_Channel inChan,
+                               const char* inFilePtr,
+                               const char* nativeOutName,
+                               int fileMode,
+                               char* preamblePtr)
 {
-    int result;
-    Tcl_Size i, numAuxDataItems = codePtr->numAuxDataItems;
-    AuxData* auxDataPtr = codePtr->auxDataArrayPtr;
-    const AuxDataType* typePtr;
-
-    if (EmitTclSize(interp, numAuxDataItems, '\n', chan) != TCL_OK)
+    Interp* iPtr = (Interp*)interp;
+    CompilerContext* ctxPtr = CompilerGetContext(interp);
+    LiteralTable glt; /* Save buffer for global literals */
+    Tcl_Channel chan;
+    Tcl_Obj* chunkPtr;
+    Tcl_WideInt recordStart;
+    Tcl_Size length, cmdStart, nextParse, numLines;
+    Tcl_Parse parse;
+    Tcl_Time start, writeStart;
+    const char* bytes;
+    int result = TCL_OK, isFirst = 1, isLast = 0;
+    char msg[200];
+
+    chan = Tcl_OpenFileChannel(interp, nativeOutName, "w", fileMode);
+    if (chan == (Tcl_Channel)NULL)
+    {
+        Tcl_ResetResult(interp);
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("couldn't create output file \"%s\": %s", nativeOutName, Tcl_PosixError(interp)));
+        return TCL_ERROR;
+    }
+    if (preamblePtr && (EmitString(interp, preamblePtr, -1, '\n', chan) != TCL_OK))
     {
+        Tcl_Close(NULL, chan);
         return TCL_ERROR;
     }
 
-    for (i = 0; i < numAuxDataItems; i++)
+    /*
+     * All the chunks are compiled in the same transient literal table; the
+     * literals of a chunk leave it when its ByteCode is freed.
+     */
+
+    memcpy(&glt, &iPtr->literalTable, sizeof(LiteralTable));
+    InitLiteralTable(&iPtr->literalTable, &ctxPtr->pool);
+
+    ctxPtr->firstLine = 1;
+    ctxPtr->firstCommand = 0;
+    while (!isLast)
     {
         /*
-         * write out the type, then switch based on the AuxData type
+         * Read up to the first end of line where the chunk is big enough
+         * and ends with a whole command. The commands are parsed as the
+         * lines come in; an incomplete one is parsed again only once its
+         * text has doubled, so that a command much longer than a line, such
+         * as a large braced literal, is not scanned again at each line.
+         * Past a syntax error, the rest of the script never runs, so any
+         * end of line will do.
          */
-        typePtr = auxDataPtr->type;
-        if (typePtr == cmpJumptableInfoType)
+
+        Tcl_GetTime(&start);
+        chunkPtr = Tcl_NewObj();
+        Tcl_IncrRefCount(chunkPtr);
+        numLines = 0;
+        cmdStart = 0;
+        nextParse = 0;
+        while (1)
         {
-            result = EmitChar(interp, CMP_JUMPTABLE_INFO, '\n', chan);
-            if (result != TCL_OK)
+            if (Tcl_GetsObj(inChan, chunkPtr) < 0)
             {
-                return result;
+                if (!Tcl_Eof(inChan))
+                {
+                    Tcl_SetObjResult(interp,
+                                     Tcl_ObjPrintf("couldn't read file \"%s\": %s", inFilePtr, Tcl_PosixError(interp)));
+                    result = TCL_ERROR;
+                }
+                isLast = 1;
+                break;
             }
-            result = EmitJumptableInfo(interp, (JumptableInfo*)auxDataPtr->clientData, chan);
-            if (result != TCL_OK)
+            Tcl_AppendToObj(chunkPtr, "\n", 1);
+            numLines++;
+            bytes = Tcl_GetStringFromObj(chunkPtr, &length);
+            if (length < nextParse)
             {
-                return result;
+                continue;
             }
-        }
-        else if (typePtr == cmpDictUpdateInfoType)
-        {
-            result = EmitChar(interp, CMP_DICTUPDATE_INFO, '\n', chan);
-            if (result != TCL_OK)
+            while (cmdStart < length)
             {
-                return result;
+                if (Tcl_ParseCommand(NULL, bytes + cmdStart, length - cmdStart, 0, &parse) != TCL_OK)
+                {
+                    cmdStart = parse.incomplete ? cmdStart : length;
+                    break;
+                }
+                Tcl_FreeParse(&parse);
+                if (parse.incomplete)
+                {
+                    break;
+                }
+                cmdStart = (parse.commandStart + parse.commandSize) - bytes;
             }
-            result = EmitDictUpdateInfo(interp, (DictUpdateInfo*)auxDataPtr->clientData, chan);
-            if (result != TCL_OK)
+            if (cmdStart < length)
             {
-                return result;
+                nextParse = length + (length - cmdStart);
+            }
+            else if (length >= ctxPtr->chunkSize)
+            {
+                break;
             }
         }
-        else if (typePtr == cmpNewForeachInfoType)
+        ctxPtr->stats.readTime += ElapsedTime(&start);
+        TraceSpan(ctxPtr, "read", "phase", &start);
+
+        if ((result != TCL_OK) || (!isFirst && (numLines == 0)))
         {
-            result = EmitChar(interp, CMP_NEW_FOREACH_INFO, '\n', chan);
-            if (result != TCL_OK)
+            Tcl_DecrRefCount(chunkPtr);
+            break;
+        }
+
+        result = Compiler_CompileObj(interp, chunkPtr);
+        if (result != TCL_OK)
+        {
+            if (result == TCL_RETURN)
             {
-                return result;
+                result = TclUpdateReturnInfo(iPtr);
             }
-            result = EmitNewForeachInfo(interp, (ForeachInfo*)auxDataPtr->clientData, chan);
-            if (result != TCL_OK)
+            else if (result == TCL_ERROR)
             {
-                return result;
+                sprintf(msg,
+                        "\n    (file \"%.150s\" line %" TCL_SIZE_MODIFIER "d)",
+                        inFilePtr,
+                        ctxPtr->firstLine + Tcl_GetErrorLine(interp) - 1);
+                Tcl_AppendObjToErrorInfo(interp, Tcl_NewStringObj(msg, -1));
             }
+            Tcl_DecrRefCount(chunkPtr);
+            break;
         }
-        else
+
+        if (!isFirst && (((ByteCode*)chunkPtr->internalRep.otherValuePtr)->numCommands == 0))
         {
-            Tcl_Panic("EmitAuxDataArray: unknown AuxType \"%s\"", typePtr->name);
+            ctxPtr->firstLine += numLines;
+            Tcl_DecrRefCount(chunkPtr);
+            continue;
+        }
+
+        Tcl_GetTime(&start);
+        recordStart = Tcl_Tell(chan);
+        result = EmitCompiledObject(interp, chunkPtr, isFirst, chan);
+        TraceSpan(ctxPtr, "emit", "phase", &start);
+        ctxPtr->stats.emitTime += ElapsedTime(&start);
+        if ((result == TCL_OK) && ctxPtr->verifyPtr)
+        {
+            result = CompilerVerifyFile(interp, nativeOutName, recordStart, chunkPtr, ctxPtr->verifyPtr);
+        }
+
+        ctxPtr->firstLine += numLines;
+        ctxPtr->firstCommand += ((ByteCode*)chunkPtr->internalRep.otherValuePtr)->numCommands;
+        Tcl_DecrRefCount(chunkPtr);
+        isFirst = 0;
+        if (result != TCL_OK)
+        {
+            break;
         }
-        auxDataPtr += 1;
     }
-    return TCL_OK;
-}
+    ctxPtr->firstLine = 1;
+    ctxPtr->firstCommand = 0;
 
-/*
- *----------------------------------------------------------------------
- *
- * EmitSignature --
- *
- *  Emit a signature string to be used in the header of a compiled TCL
- *  script. The signature is used to mark the file as a compiled TCL script.
- *
- * Results:
- *  Returns TCL_OK on success, TCL_ERROR on error.
- *
- * Side effects:
- *  None.
- *
- *----------------------------------------------------------------------
- */
+    RestoreLiteralTable(iPtr, &glt, &ctxPtr->pool);
 
-static int EmitSignature(Tcl_Interp* interp, Tcl_Channel chan)
-{
-    if ((EmitString(interp, signatureHeader, -1, ' ', chan) != TCL_OK) ||
-        (EmitTclSize(interp, formatVersion, ' ', chan) != TCL_OK) || (EmitString(interp, PACKAGE_VERSION, -1, ' ', chan) != TCL_OK) ||
-        (EmitString(interp, TCL_VERSION, -1, '\n', chan) != TCL_OK))
+    Tcl_GetTime(&writeStart);
+    if (Tcl_Close((result == TCL_OK) ? interp : NULL, chan) != TCL_OK)
     {
-        PrependResult(interp, "error writing signature: ");
-        return TCL_ERROR;
+        if (result == TCL_OK)
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("error closing bytecode stream: %s", Tcl_PosixError(interp)));
+        }
+        result = TCL_ERROR;
     }
-    return TCL_OK;
+    TraceSpan(ctxPtr, "write", "phase", &writeStart);
+    ctxPtr->stats.emitTime += ElapsedTime(&writeStart);
+
+    return result;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * NameFromExcRange --
+ * RestoreLiteralTable --
  *
- *  Given an ExceptionRangeType enum, return the corresponding name.
+ *  Ends the compilation of a file: frees the transient literal table of
+ *  the interpreter, and reinstalls the table saved in *savedPtr before the
+ *  compilation (see InitLiteralTable). A bucket array of at most
+ *  CMP_POOL_MAX_BUCKETS entries is cleared and kept in *poolPtr for the
+ *  next compilation instead of being freed.
+ *  The literals of the compiled ByteCodes left the transient table when
+ *  they were freed. Any that remain are still used by objects that outlive
+ *  the compilation; their entries are moved to the restored table, where
+ *  TclReleaseLiteral finds them when these objects are freed.
  *
  * Results:
- *  Returns the name if it was successful at converting the enum value to
- *  a name, '\0' otherwise.
+ *  None.
  *
  * Side effects:
- *  None.
+ *  Frees or pools the bucket array of the transient table.
  *
  *----------------------------------------------------------------------
  */
 
-static char NameFromExcRange(ExceptionRangeType type)
+static void RestoreLiteralTable(Interp* iPtr, LiteralTable* savedPtr, CompilerPool* poolPtr)
 {
-    const ExcRangeMap* mapPtr;
+    LiteralTable* tablePtr = &iPtr->literalTable;
+    LiteralTable transient;
+    LiteralEntry *entryPtr, *nextPtr;
+    const char* bytes;
+    Tcl_Size length, i;
+    size_t index;
 
-    for (mapPtr = &excRangeMap[0]; mapPtr->name != 0; mapPtr++)
+    /*
+     * Both tables use the static buckets of the interpreter while they
+     * are small; those of the transient table are only in its copy once
+     * the saved table is back in place.
+     */
+
+    memcpy(&transient, tablePtr, sizeof(LiteralTable));
+    memcpy(tablePtr, savedPtr, sizeof(LiteralTable));
+    if (transient.buckets == tablePtr->staticBuckets)
     {
-        if (mapPtr->type == type)
+        transient.buckets = transient.staticBuckets;
+    }
+
+    for (i = 0; (i < (Tcl_Size)transient.numBuckets) && (transient.numEntries > 0); i++)
+    {
+        for (entryPtr = transient.buckets[i]; entryPtr; entryPtr = nextPtr)
         {
-            return mapPtr->name;
+            nextPtr = entryPtr->nextPtr;
+            bytes = Tcl_GetStringFromObj(entryPtr->objPtr, &length);
+            index = HashLiteral(bytes, length) & tablePtr->mask;
+            entryPtr->nextPtr = tablePtr->buckets[index];
+            tablePtr->buckets[index] = entryPtr;
+            tablePtr->numEntries++;
+            transient.numEntries--;
         }
     }
 
-    return '\0';
+    if (transient.buckets == transient.staticBuckets)
+    {
+        return;
+    }
+    if (((Tcl_Size)transient.numBuckets <= CMP_POOL_MAX_BUCKETS) &&
+        ((Tcl_Size)transient.numBuckets > poolPtr->numLiteralBuckets))
+    {
+        if (poolPtr->literalBuckets)
+        {
+            Tcl_Free((char*)poolPtr->literalBuckets);
+        }
+        memset(transient.buckets, 0, (size_t)transient.numBuckets * sizeof(LiteralEntry*));
+        poolPtr->literalBuckets = transient.buckets;
+        poolPtr->numLiteralBuckets = transient.numBuckets;
+    }
+    else
+    {
+        Tcl_Free((char*)transient.buckets);
+    }
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * InitTypes --
+ * HashLiteral --
  *
- *  Uses Tcl_GetObjType to load pointers to known object types into static
- *  variables, which can then be used instead of the known objects themselves.
+ *  Computes the hash of a literal, like HashString in tclLiteral.c, which
+ *  is not exported.
  *
  * Results:
- *  None.
+ *  Returns the hash value; its bits under the mask of a literal table are
+ *  the index of the bucket.
  *
  * Side effects:
  *  None.
@@ -1472,139 +2245,127 @@ static char NameFromExcRange(ExceptionRangeType type)
  *----------------------------------------------------------------------
  */
 
-static void InitTypes()
+static size_t HashLiteral(const char* bytes, Tcl_Size length)
 {
-    if (didLoadTypes == 0)
-    {
-        cmpProcBodyType = Tcl_GetObjType("procbody");
-        if (!cmpProcBodyType)
-        {
-            Tcl_Panic("InitTypes: failed to find the procbody type");
-        }
-
-        cmpByteCodeType = Tcl_GetObjType("bytecode");
-        if (!cmpByteCodeType)
-        {
-            Tcl_Panic("InitTypes: failed to find the bytecode type");
-        }
-
-        cmpDoubleType = Tcl_GetObjType("double");
-        if (!cmpByteCodeType)
-        {
-            Tcl_Panic("InitTypes: failed to find the double type");
-        }
-
-        Tcl_Obj* obj = Tcl_NewIntObj(0);
-        cmpIntType = obj->typePtr;
-        Tcl_DecrRefCount(obj);
+    size_t result = 0;
 
-        cmpJumptableInfoType = TclGetAuxDataType("JumptableInfo");
-        if (!cmpJumptableInfoType)
-        {
-            Tcl_Panic("InitTypes: failed to find the JumptableInfo AuxData type");
-        }
-        cmpDictUpdateInfoType = TclGetAuxDataType("DictUpdateInfo");
-        if (!cmpDictUpdateInfoType)
-        {
-            Tcl_Panic("InitTypes: failed to find the DictUpdateInfo AuxData type");
-        }
-        cmpNewForeachInfoType = TclGetAuxDataType("NewForeachInfo");
-        if (!cmpNewForeachInfoType)
-        {
-            Tcl_Panic("InitTypes: failed to find the NewForeachInfo AuxData type");
-        }
-        didLoadTypes = 1;
+    while (length-- > 0)
+    {
+        result += (result << 3) + UCHAR(*bytes++);
     }
+    return result;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * PrependResult --
+ * InitLiteralTable --
  *
- *  Prepends the string in msgPtr to the current result value. Used by error
- *  reporting to augment a generic error string.
+ *  Initializes an empty literal table, for the compilation of a file. The
+ *  table of the interpreter is saved before, and restored after, with
+ *  RestoreLiteralTable, so that the application and the compiler do not
+ *  share literals.
+ *  Inlined copy of TclInitLiteralTable: this function is not in the stub
+ *  table of Tcl, not even in the internal one. This causes link problems.
+ *  If an earlier compilation left its bucket array in *poolPtr, the table
+ *  starts with it, at the size that RebuildLiteralTable in tclLiteral.c
+ *  had grown it to, which saves the rebuilds on the way there.
  *
  * Results:
  *  None.
  *
  * Side effects:
- *  None.
+ *  Overwrites *tablePtr, without freeing its buckets. Takes the bucket
+ *  array out of *poolPtr.
  *
  *----------------------------------------------------------------------
  */
 
-static void PrependResult(Tcl_Interp* interp, char* msgPtr)
-{
-    Tcl_DString buf;
-    Tcl_Obj* resultPtr = Tcl_GetObjResult(interp);
-
-    Tcl_DStringInit(&buf);
-    Tcl_DStringAppend(&buf, msgPtr, -1);
-    Tcl_DStringAppend(&buf, resultPtr->bytes, resultPtr->length);
+#define REBUILD_MULTIPLIER 3
 
-    resultPtr = Tcl_NewStringObj(Tcl_DStringValue(&buf), Tcl_DStringLength(&buf));
-    Tcl_SetObjResult(interp, resultPtr);
+static void InitLiteralTable(LiteralTable* tablePtr, CompilerPool* poolPtr)
+{
+    tablePtr->buckets = tablePtr->staticBuckets;
+    tablePtr->staticBuckets[0] = tablePtr->staticBuckets[1] = 0;
+    tablePtr->staticBuckets[2] = tablePtr->staticBuckets[3] = 0;
+    tablePtr->numBuckets = TCL_SMALL_HASH_TABLE;
+    tablePtr->numEntries = 0;
+    tablePtr->rebuildSize = TCL_SMALL_HASH_TABLE * REBUILD_MULTIPLIER;
+    tablePtr->mask = 3;
+
+    if (poolPtr->literalBuckets)
+    {
+        tablePtr->buckets = poolPtr->literalBuckets;
+        tablePtr->numBuckets = poolPtr->numLiteralBuckets;
+        tablePtr->rebuildSize = poolPtr->numLiteralBuckets * REBUILD_MULTIPLIER;
+        tablePtr->mask = poolPtr->numLiteralBuckets - 1;
+        poolPtr->literalBuckets = NULL;
+        poolPtr->numLiteralBuckets = 0;
+    }
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * EmitScriptPreamble --
+ * Compiler_CompileObj --
  *
- *  Emit the preamble for the compiled script. Writes out the TCL boilerplate
- *  that requires the loader package and evals the bytecodes.
+ *  Compile Tcl commands stored in a Tcl object. These commands are
+ *  compiled into bytecodes.
+ *
+ *  Scarfed from Tcl_EvalObj, where we run the compilation step but not
+ *  the execution step.
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on error.
+ *  The return value is one of the return codes defined in tcl.h
+ *  (such as TCL_OK), and the interpreter's result contains a value
+ *  to supplement the return code.
  *
  * Side effects:
- *  None.
+ *  The object is converted to a ByteCode object that holds the bytecode
+ *  instructions for the commands.
  *
  *----------------------------------------------------------------------
  */
 
-static int EmitScriptPreamble(Tcl_Interp* interp, Tcl_Channel chan)
+int Compiler_CompileObj(Tcl_Interp* interp, Tcl_Obj* objPtr)
 {
-    char buf[256];
-    char* errMsgPtr;
+    Interp* iPtr = (Interp*)interp;
     int result = TCL_OK;
-    Tcl_Obj* errObjPtr = 0;
 
     /*
-     * Extract the loader error message from the package itself, and if not
-     * present use the default value. This lets us modify the error message
-     * in a script.
+     * If the interpreter has been deleted, return an error.
      */
 
-    sprintf(buf, "variable %s; set %s", errorVariable, errorVariable);
-    Tcl_Obj* script = Tcl_NewStringObj(buf, -1);
-    Tcl_IncrRefCount(script);
-    int _rc = Tcl_EvalObjEx(interp, script, 0);
-    Tcl_DecrRefCount(script);
-    if (_rc != TCL_OK)
-    {
-        errMsgPtr = errorMessage;
-    }
-    else
+    if (iPtr->flags & DELETED)
     {
-        Tcl_Obj* errObjPtr = Tcl_GetObjResult(interp);
-        Tcl_IncrRefCount(errObjPtr);
-        errMsgPtr = errObjPtr->bytes;
+        Tcl_ResetResult(interp);
+        Tcl_AppendToObj(Tcl_GetObjResult(interp), "attempt to call compile in deleted interpreter", -1);
+        Tcl_SetErrorCode(interp, "COMPILER", "COMPILE", "attempt to call compile in deleted interpreter", (char*)NULL);
+        return TCL_ERROR;
     }
 
-    sprintf(buf, preambleFormat, loaderName, loaderVersion, errMsgPtr, loaderName, evalCommand);
-    if (EmitString(interp, buf, -1, '\n', chan) != TCL_OK)
+    /*
+     * We force a recompilation even though this object may already be
+     * compiled. However, we do not attempt to recompile an object that had
+     * been generated from a compiled script.
+     */
+    const Tcl_ObjInternalRep* ir = Tcl_FetchInternalRep(objPtr, cmpByteCodeType);
+    if (ir)
     {
-        PrependResult(interp, "error writing script preamble: ");
-        result = TCL_ERROR;
+        ByteCode* codePtr = (ByteCode*)ir->twoPtrValue.ptr1;
+        if (codePtr->flags & TCL_BYTECODE_PRECOMPILED)
+            return TCL_OK;
+        Tcl_FreeInternalRep(objPtr);
+        ir = NULL;
     }
-
-    if (errObjPtr)
+    if (!ir)
     {
-        Tcl_DecrRefCount(errObjPtr);
+        Tcl_SetErrorLine(interp, 1);
+        if (CompileObject(interp, objPtr) != TCL_OK)
+            return TCL_ERROR;
+        if (Tcl_ConvertToType(interp, objPtr, cmpByteCodeType) != TCL_OK)
+            return TCL_ERROR;
     }
-    Tcl_ResetResult(interp);
 
     return result;
 }
@@ -1612,49 +2373,94 @@ static int EmitScriptPreamble(Tcl_Interp* interp, Tcl_Channel chan)
 /*
  *----------------------------------------------------------------------
  *
- * EmitScriptPostamble --
+ * EmitCompiledObject --
  *
- *  Emit the postamble for the compiled script. Writes out the TCL boilerplate
- *  that requires the loader package and evals the bytecodes.
+ *  Emits the contents of a ByteCode structure to a Tcl_Channel to generate
+ *  a TCL "object file". The chunks of a script compiled with -chunk after
+ *  the first, for which isFirst is 0, are emitted as further eval commands
+ *  of the same file, without the code that loads the loader.
+ *  There are three parts to the object file:
+ *   - a header containing information about the ByteCode structure.
+ *   - the dump of the bytecodes
+ *   - the dump of the support arrays; this includes the dump of all the
+ *     objects used by the byte code itself.
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on error.
+ *  Returns a TCL result code.
  *
  * Side effects:
- *  None.
+ *  Appends an error message to the TCL error.
  *
  *----------------------------------------------------------------------
  */
 
-static int EmitScriptPostamble(Tcl_Interp* interp, Tcl_Channel chan)
+static int EmitCompiledObject(Tcl_Interp* interp, Tcl_Obj* objPtr, int isFirst, Tcl_Channel chan)
 {
-    char buf[256];
+    CompilerContext* ctxPtr = CompilerGetContext(interp);
+    Tcl_WideInt mark = 0; /* the channel was created for this object, and
+                           * may hold the -preamble script already */
 
-#if USE_CATCH_WRAPPER
-    sprintf(buf, postambleFormat, errorInfoMarker);
-#else
-    strcpy(buf, postambleFormat);
-#endif
-    if (EmitString(interp, buf, -1, '\n', chan) != TCL_OK)
+    if (isFirst)
+    {
+        if (ctxPtr->profilePtr && (EmitProfileRuntime(interp, ctxPtr->profilePtr, chan) != TCL_OK))
+        {
+            return TCL_ERROR;
+        }
+        if (EmitScriptPreamble(interp, chan) != TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+    }
+    else
+    {
+        mark = Tcl_Tell(chan);
+        if (EmitScriptEval(interp, chan) != TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+    }
+    if (EmitSignature(interp, chan) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+    CountEmittedBytes(ctxPtr->stats.sectionBytes, CMP_SECTION_PREAMBLE, chan, &mark);
+
+    if (EmitByteCode(interp, (ByteCode*)objPtr->internalRep.otherValuePtr, chan) != TCL_OK)
+    {
+        PrependResult(interp, "error writing bytecode stream: ");
+        return TCL_ERROR;
+    }
+
+    mark = Tcl_Tell(chan);
+    if (EmitScriptPostamble(interp, chan) != TCL_OK)
     {
-        PrependResult(interp, "error writing script postamble: ");
         return TCL_ERROR;
     }
+    CountEmittedBytes(ctxPtr->stats.sectionBytes, CMP_SECTION_POSTAMBLE, chan, &mark);
+
+    if (Tcl_Flush(chan) != TCL_OK)
+    {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("error flushing bytecode stream: Tcl_Flush: %s", Tcl_PosixError(interp)));
+        return TCL_ERROR;
+    }
+
     return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * LocalProcCompileProc --
+ * EmitByteCode --
  *
- *  This procedure is registered as the CompileProc for the "proc" command,
- *  and is used to make a record of where in the bytecodes the calls to
- *  "proc" have been emitted. This information is used in a post-processing
- *  pass to compile the procedure bodies.
+ *  Emits the contents of a ByteCode structure to a Tcl_Channel.
+ *  There are three parts to the dumped information:
+ *   - a header containing information about the ByteCode structure.
+ *   - the dump of the bytecodes
+ *   - the dump of the support arrays; this includes the dump of all the
+ *     objects used by the byte code itself.
  *
  * Results:
- *  Returns TCL_OUT_LINE_COMPILE, to make the compiler create non-inline code.
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
  *
  * Side effects:
  *  None.
@@ -1662,172 +2468,379 @@ static int EmitScriptPostamble(Tcl_Interp* interp, Tcl_Channel chan)
  *----------------------------------------------------------------------
  */
 
-static int LocalProcCompileProc(Tcl_Interp* interp, Tcl_Parse* parsePtr, Command* cmdPtr, struct CompileEnv* compEnvPtr)
+static int EmitByteCode(Tcl_Interp* interp, ByteCode* codePtr, Tcl_Channel chan)
 {
-    AppendInstLocList(interp, compEnvPtr);
-    return TCL_ERROR;
+    CompilerContext* ctxPtr = CompilerGetContext(interp);
+    LocMapSizes locMapSizes;
+    Tcl_WideInt start, mark, nestedBytes;
+    Tcl_WideInt sectionBytes[CMP_NUM_SECTIONS];
+    Tcl_Obj* recordPtr = NULL;
+    int i;
+
+    memset(sectionBytes, 0, sizeof(sectionBytes));
+    start = mark = Tcl_Tell(chan);
+
+    /*
+     * When analyzing, reserve the record for this ByteCode now, so that it
+     * precedes the records of the procedure bodies among its literals.
+     */
+
+    if (ctxPtr->analysisPtr)
+    {
+        recordPtr = Tcl_NewDictObj();
+        Tcl_DictObjPut(NULL,
+                       recordPtr,
+                       Tcl_NewStringObj("name", -1),
+                       ctxPtr->analysisNamePtr ? ctxPtr->analysisNamePtr : Tcl_NewObj());
+        if (ctxPtr->analysisNamePtr)
+        {
+            Tcl_DecrRefCount(ctxPtr->analysisNamePtr);
+            ctxPtr->analysisNamePtr = NULL;
+        }
+        Tcl_ListObjAppendElement(NULL, ctxPtr->analysisPtr, recordPtr);
+    }
+
+    /*
+     * Emit the sizes of the various components of the ByteCode struct,
+     * so that the size can be recalculated at read time.
+     * These fields are currently written out as 0 always:
+     * numSrcChars
+     */
+
+    CalculateLocMapSizes(codePtr, &locMapSizes);
+
+    if ((EmitTclSize(interp, codePtr->numCommands, ' ', chan) != TCL_OK) ||
+        (EmitTclSize(interp, 0, ' ', chan) != TCL_OK) /* numSrcChars */
+        || (EmitTclSize(interp, codePtr->numCodeBytes, ' ', chan) != TCL_OK) ||
+        (EmitTclSize(interp, codePtr->numLitObjects, ' ', chan) != TCL_OK) ||
+        (EmitTclSize(interp, codePtr->numExceptRanges, ' ', chan) != TCL_OK) ||
+        (EmitTclSize(interp, codePtr->numAuxDataItems, ' ', chan) != TCL_OK) ||
+        (EmitTclSize(interp, codePtr->numCmdLocBytes, ' ', chan) != TCL_OK) ||
+        (EmitTclSize(interp, codePtr->maxExceptDepth, ' ', chan) != TCL_OK) ||
+        (EmitTclSize(interp, codePtr->maxStackDepth, ' ', chan) != TCL_OK))
+    {
+        return TCL_ERROR;
+    }
+
+#if EMIT_SRCMAP
+    if ((EmitTclSize(interp, locMapSizes.codeDeltaSize, ' ', chan) != TCL_OK) ||
+        (EmitTclSize(interp, locMapSizes.codeLengthSize, ' ', chan) != TCL_OK) ||
+        (EmitTclSize(interp, locMapSizes.srcDeltaSize, ' ', chan) != TCL_OK) ||
+        (EmitTclSize(interp, locMapSizes.srcLengthSize, '\n', chan) != TCL_OK))
+    {
+        return TCL_ERROR;
+    }
+#else
+    if ((EmitTclSize(interp, locMapSizes.codeDeltaSize, ' ', chan) != TCL_OK) ||
+        (EmitTclSize(interp, locMapSizes.codeLengthSize, ' ', chan) != TCL_OK) ||
+        (EmitTclSize(interp, -1, ' ', chan) != TCL_OK) || (EmitTclSize(interp, -1, '\n', chan) != TCL_OK))
+    {
+        return TCL_ERROR;
+    }
+#endif
+    CountEmittedBytes(sectionBytes, CMP_SECTION_HEADER, chan, &mark);
+
+    /*
+     * The byte code dumps
+     */
+
+    if (EmitByteSequence(interp, codePtr->codeStart, codePtr->numCodeBytes, chan) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+    CountEmittedBytes(sectionBytes, CMP_SECTION_CODE, chan, &mark);
+
+    if ((EmitByteSequence(interp, codePtr->codeDeltaStart, locMapSizes.codeDeltaSize, chan) != TCL_OK) ||
+        (EmitByteSequence(interp, codePtr->codeLengthStart, locMapSizes.codeLengthSize, chan) != TCL_OK))
+    {
+        return TCL_ERROR;
+    }
+#if EMIT_SRCMAP
+    if ((EmitByteSequence(interp, codePtr->srcDeltaStart, locMapSizes.srcDeltaSize, chan) != TCL_OK) ||
+        (EmitByteSequence(interp, codePtr->srcLengthStart, locMapSizes.srcLengthSize, chan) != TCL_OK))
+    {
+        return TCL_ERROR;
+    }
+#endif
+    CountEmittedBytes(sectionBytes, CMP_SECTION_LOCMAP, chan, &mark);
+
+    /*
+     * the support arrays. The procedure bodies among the literals count
+     * their own sections.
+     */
+
+    nestedBytes = ctxPtr->stats.byteCodeBytes;
+    if (EmitObjArray(interp, codePtr, chan) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+    CountEmittedBytes(sectionBytes, CMP_SECTION_LITERALS, chan, &mark);
+    sectionBytes[CMP_SECTION_LITERALS] -= ctxPtr->stats.byteCodeBytes - nestedBytes;
+
+    if (EmitExcRangeArray(interp, codePtr, chan) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+    CountEmittedBytes(sectionBytes, CMP_SECTION_EXCEPTIONS, chan, &mark);
+
+    if (EmitAuxDataArray(interp, codePtr, chan) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+    CountEmittedBytes(sectionBytes, CMP_SECTION_AUXDATA, chan, &mark);
+
+    for (i = 0; i < CMP_NUM_SECTIONS; i++)
+    {
+        ctxPtr->stats.sectionBytes[i] += sectionBytes[i];
+    }
+    if ((start >= 0) && (mark >= 0))
+    {
+        ctxPtr->stats.byteCodeBytes += mark - start;
+    }
+
+    if (recordPtr)
+    {
+        FillByteCodeAnalysis(recordPtr, codePtr, &locMapSizes, sectionBytes);
+    }
+
+    return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * CompilerInit --
+ * FillByteCodeAnalysis --
  *
- *  Initializes the internal structures used by the Compiler package.
- *  Must be called before the public interfaces to the Compiler package;
- *  this is done typically in the package registration proc (Compiler_Init).
+ *  Adds to an analysis record the sizes of the parts of an emitted
+ *  ByteCode: the raw and encoded sizes of the instructions and of the
+ *  location map, the number of literals, exception ranges and AuxData
+ *  items with their encoded sizes, and the encoded size of the header.
+ *  The encoded sizes are those of this ByteCode alone, without the
+ *  procedure bodies among its literals. The A85 overhead is the growth of
+ *  the instructions and location map from their raw size.
  *
  * Results:
  *  None.
  *
  * Side effects:
- *  Initializes a number of internal data structures used by the Compiler
- *  implementation.
+ *  Modifies the record, which must not be shared.
  *
  *----------------------------------------------------------------------
  */
 
-void CompilerInit(Tcl_Interp* interp)
+static void FillByteCodeAnalysis(Tcl_Obj* recordPtr, ByteCode* codePtr, LocMapSizes* locMapSizesPtr, Tcl_WideInt* sectionBytes)
 {
-    CompilerContext* ctxPtr;
-
-    /*
-     * Initialize the local copies of pointers to some built-in object types.
-     * We need to do it because the built-in types are not exported by the
-     * windows Tcl DLL.
-     */
+    Tcl_WideInt locMapBytes, totalBytes = 0;
+    int i;
 
-    InitTypes();
-
-    /*
-     * Create the compiler context structure and attach it to the interp
-     */
-
-    ctxPtr = (CompilerContext*)Tcl_Alloc(sizeof(CompilerContext));
-    Tcl_SetAssocData(interp, CMP_ASSOC_KEY, CleanCompilerContext, (void*)ctxPtr);
-    ctxPtr->ppi = (PostProcessInfo*)NULL;
-    ctxPtr->numProcs = 0;
-    ctxPtr->numCompiledBodies = 0;
-    ctxPtr->numUnsharedBodies = 0;
-    ctxPtr->numUnshares = 0;
+    locMapBytes = locMapSizesPtr->codeDeltaSize + locMapSizesPtr->codeLengthSize;
+#if EMIT_SRCMAP
+    locMapBytes += locMapSizesPtr->srcDeltaSize + locMapSizesPtr->srcLengthSize;
+#endif
+    for (i = 0; i < CMP_NUM_SECTIONS; i++)
+    {
+        totalBytes += sectionBytes[i];
+    }
+
+#define PUT_SIZE(key, value) Tcl_DictObjPut(NULL, recordPtr, Tcl_NewStringObj((key), -1), Tcl_NewWideIntObj(value))
+    PUT_SIZE("commands", codePtr->numCommands);
+    PUT_SIZE("codeBytes", codePtr->numCodeBytes);
+    PUT_SIZE("codeEncodedBytes", sectionBytes[CMP_SECTION_CODE]);
+    PUT_SIZE("locMapBytes", locMapBytes);
+    PUT_SIZE("locMapEncodedBytes", sectionBytes[CMP_SECTION_LOCMAP]);
+    PUT_SIZE("literals", codePtr->numLitObjects);
+    PUT_SIZE("literalBytes", sectionBytes[CMP_SECTION_LITERALS]);
+    PUT_SIZE("exceptionRanges", codePtr->numExceptRanges);
+    PUT_SIZE("exceptionBytes", sectionBytes[CMP_SECTION_EXCEPTIONS]);
+    PUT_SIZE("auxData", codePtr->numAuxDataItems);
+    PUT_SIZE("auxDataBytes", sectionBytes[CMP_SECTION_AUXDATA]);
+    PUT_SIZE("headerBytes", sectionBytes[CMP_SECTION_HEADER]);
+    PUT_SIZE("totalBytes", totalBytes);
+    PUT_SIZE("a85Overhead",
+             sectionBytes[CMP_SECTION_CODE] + sectionBytes[CMP_SECTION_LOCMAP] - codePtr->numCodeBytes - locMapBytes);
+#undef PUT_SIZE
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * CleanCompilerContext --
+ * FindProcName --
  *
- *  Cleans up the compiler context.
- *  Frees the post-processing info if any is present, then frees the context
- *  struct itself.
+ *  Looks in the instructions of a ByteCode for the "proc" command that
+ *  defines the body stored in its literal array at the given index. Once
+ *  the proc calls have been rewritten (see UpdateByteCodes), the command
+ *  name, procedure name, argument list and body are pushed by consecutive
+ *  instructions.
  *
  * Results:
- *  None.
+ *  Returns the literal holding the procedure name, or NULL if the name is
+ *  not a literal.
  *
  * Side effects:
- *  See above.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static void CleanCompilerContext(void* clientData, Tcl_Interp* interp)
+static Tcl_Obj* FindProcName(ByteCode* codePtr, Tcl_Size bodyIndex)
 {
-    CompilerContext* ctxPtr = (CompilerContext*)clientData;
+    InstructionDesc* opCodesTablePtr = (InstructionDesc*)TclGetInstructionTable();
+    unsigned char* pc;
+    unsigned char* codeEnd = codePtr->codeStart + codePtr->numCodeBytes;
+    Tcl_Size pushed[3] = {-1, -1, -1}; /* operands of the last 3 pushes */
+    Tcl_Size index;
 
-    FreePostProcessInfo(ctxPtr->ppi);
-    Tcl_Free((char*)ctxPtr);
+    for (pc = codePtr->codeStart; pc < codeEnd; pc += opCodesTablePtr[*pc].numBytes)
+    {
+        if (*pc == INST_PUSH1)
+        {
+            index = TclGetUInt1AtPtr(pc + 1);
+        }
+        else if (*pc == INST_PUSH4)
+        {
+            index = TclGetUInt4AtPtr(pc + 1);
+        }
+        else
+        {
+            pushed[0] = pushed[1] = pushed[2] = -1;
+            continue;
+        }
+
+        if ((index == bodyIndex) && (pushed[1] >= 0) && (pushed[2] >= 0))
+        {
+            return codePtr->objArrayPtr[pushed[1]];
+        }
+        pushed[0] = pushed[1];
+        pushed[1] = pushed[2];
+        pushed[2] = index;
+    }
+
+    return NULL;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * CompilerGetContext --
+ * CountEmittedBytes --
  *
- *  Returns a pointer to the CompilerContext struct for the given interp.
+ *  Adds the bytes written to a channel since *markPtr to the byte count of
+ *  the given output section in the sectionBytes array, and moves the mark
+ *  to the current position. Nothing is counted if the channel does not
+ *  support Tcl_Tell.
  *
  * Results:
- *  See above.
+ *  None.
  *
  * Side effects:
- *  None.
+ *  Updates the sectionBytes array, and *markPtr.
  *
  *----------------------------------------------------------------------
  */
 
-CompilerContext* CompilerGetContext(Tcl_Interp* interp)
+static void CountEmittedBytes(Tcl_WideInt* sectionBytes, CompilerSection section, Tcl_Channel chan, Tcl_WideInt* markPtr)
 {
-    CompilerContext* ctxPtr = (CompilerContext*)Tcl_GetAssocData(interp, CMP_ASSOC_KEY, NULL);
+    Tcl_WideInt offset = Tcl_Tell(chan);
 
-    if (!ctxPtr)
+    if ((offset >= 0) && (*markPtr >= 0))
     {
-        Tcl_Panic("unregistered compiler context!");
+        sectionBytes[section] += offset - *markPtr;
+        CMP_PROBE2(emit__section, (int)section, offset - *markPtr);
     }
-
-    return ctxPtr;
+    *markPtr = offset;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * InitCompilerContext --
+ * TraceSpan --
  *
- *  Initializes the compiler context for a given interpreter.
+ *  With -trace, appends a complete ("X") event in the Chrome trace event
+ *  format for a span that started at *startPtr and ends now. The lane of
+ *  the event is the current process and thread, so that the compilations
+ *  of parallel workers show side by side; its "file" argument is the
+ *  file being compiled.
  *
  * Results:
  *  None.
  *
  * Side effects:
- *  Allocates a new PostProcessInfo, and frees the old one.
+ *  Appends to ctxPtr->tracePtr, if it is not NULL.
  *
  *----------------------------------------------------------------------
  */
 
-static void InitCompilerContext(Tcl_Interp* interp)
+static void TraceSpan(CompilerContext* ctxPtr, const char* name, const char* category, const Tcl_Time* startPtr)
 {
-    CompilerContext* ctxPtr = CompilerGetContext(interp);
+    Tcl_Obj* bufPtr = ctxPtr->tracePtr;
 
-    FreePostProcessInfo(ctxPtr->ppi);
-    ctxPtr->ppi = CreatePostProcessInfo();
-    ctxPtr->numProcs = 0;
-    ctxPtr->numCompiledBodies = 0;
-    ctxPtr->numUnsharedBodies = 0;
-    ctxPtr->numUnshares = 0;
+    if (!bufPtr)
+    {
+        return;
+    }
+
+    Tcl_AppendToObj(bufPtr, "{\"name\":", -1);
+    AppendJsonString(bufPtr, name);
+    Tcl_AppendPrintfToObj(bufPtr,
+                          ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%" TCL_LL_MODIFIER "d,\"dur\":%" TCL_LL_MODIFIER
+                          "d,\"pid\":%d,\"tid\":%" TCL_LL_MODIFIER "d,\"args\":{\"file\":",
+                          category,
+                          (Tcl_WideInt)startPtr->sec * 1000000 + startPtr->usec,
+                          ElapsedTime(startPtr),
+                          (int)getpid(),
+                          (Tcl_WideInt)(size_t)Tcl_GetCurrentThread());
+    AppendJsonString(bufPtr, ctxPtr->scriptName ? ctxPtr->scriptName : "");
+    Tcl_AppendToObj(bufPtr, "}},\n", -1);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * ReleaseCompilerContext --
+ * AppendJsonString --
  *
- *  Frees the post-processing info associated with the compiler context.
+ *  Appends a string to a buffer as a JSON string literal.
  *
  * Results:
  *  None.
  *
  * Side effects:
- *  None.
+ *  Appends to the buffer.
  *
  *----------------------------------------------------------------------
  */
 
-static void ReleaseCompilerContext(Tcl_Interp* interp)
+static void AppendJsonString(Tcl_Obj* bufPtr, const char* string)
 {
-    CompilerContext* ctxPtr = CompilerGetContext(interp);
+    const char* p;
 
-    FreePostProcessInfo(ctxPtr->ppi);
-    ctxPtr->ppi = (PostProcessInfo*)NULL;
+    Tcl_AppendToObj(bufPtr, "\"", 1);
+    for (p = string; *p; p++)
+    {
+        if ((*p == '"') || (*p == '\\'))
+        {
+            Tcl_AppendPrintfToObj(bufPtr, "\\%c", *p);
+        }
+        else if ((unsigned char)*p < 0x20)
+        {
+            Tcl_AppendPrintfToObj(bufPtr, "\\u%04x", (unsigned char)*p);
+        }
+        else
+        {
+            Tcl_AppendToObj(bufPtr, p, 1);
+        }
+    }
+    Tcl_AppendToObj(bufPtr, "\"", 1);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * CreateInstLocList --
+ * ElapsedTime --
  *
- *  Creates a InstLocList struct.
+ *  Returns the time elapsed since the given time, as obtained from
+ *  Tcl_GetTime.
  *
  * Results:
- *  Returns a Tcl_Alloc'ed InstLocList, initialized with the next field set to
- *  0, and the bytecodeOffset to the given value..
+ *  The elapsed time, in microseconds.
  *
  * Side effects:
  *  None.
@@ -1835,38 +2848,25 @@ static void ReleaseCompilerContext(Tcl_Interp* interp)
  *----------------------------------------------------------------------
  */
 
-static InstLocList* CreateInstLocList(CompileEnv* envPtr)
+static Tcl_WideInt ElapsedTime(const Tcl_Time* startPtr)
 {
-    InstLocList* listPtr = (InstLocList*)Tcl_Alloc(sizeof(struct InstLocList));
-    listPtr->next = (InstLocList*)NULL;
-    listPtr->bytecodeOffset = envPtr->codeNext - envPtr->codeStart;
-    listPtr->commandIndex = envPtr->numCommands - 1;
-    if ((listPtr->bytecodeOffset >= 9) && (INST_START_CMD == *(envPtr->codeNext - 9)))
-    {
-        /*
-         * Tcl 8.5 core. Did emit an INST_START_CMD instruction. This
-         * instruction goes away again due to us forcing the outline
-         * compile in our caller (LocalProcCompileProc), so we have to
-         * adjust the remembered offset. Irrelevant for the first
-         * command (offset 0).
-         *
-         * 9 = 1byte ISC opcode + 2 4byte ISC operands.
-         */
-        listPtr->bytecodeOffset -= 9;
-    }
-    return listPtr;
+    Tcl_Time now;
+
+    Tcl_GetTime(&now);
+    return ((Tcl_WideInt)(now.sec - startPtr->sec)) * 1000000 + (now.usec - startPtr->usec);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * CreatePostProcessInfo --
+ * EmitChar --
  *
- *  Creates a PostProcessInfo struct.
+ *  Emits a character value to a Tcl_Channel.
+ *  The separator argument specifies a character to be emitted after the
+ *  integer.
  *
  * Results:
- *  Returns a Tcl_Alloc'ed InstLocList, initialized with the list field set to
- *  0, and the numProcs field set to 0.
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
  *
  * Side effects:
  *  None.
@@ -1874,28 +2874,32 @@ static InstLocList* CreateInstLocList(CompileEnv* envPtr)
  *----------------------------------------------------------------------
  */
 
-static PostProcessInfo* CreatePostProcessInfo()
+static int EmitChar(Tcl_Interp* interp, int value, int separator, Tcl_Channel chan)
 {
-    PostProcessInfo* infoPtr = (PostProcessInfo*)Tcl_Alloc(sizeof(PostProcessInfo));
-    infoPtr->procs = (InstLocList*)NULL;
-    infoPtr->numProcs = 0;
-    Tcl_InitHashTable(&infoPtr->objTable, TCL_ONE_WORD_KEYS);
-    infoPtr->infoArrayPtr = (ProcBodyInfo**)NULL;
-    infoPtr->numUnshares = 0;
-    infoPtr->numCompiledBodies = 0;
+    char buf[2];
 
-    return infoPtr;
+    buf[0] = value;
+    buf[1] = separator;
+    if (Tcl_Write(chan, buf, 2) < 0)
+    {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Tcl_Write: %s", Tcl_PosixError(interp)));
+        return TCL_ERROR;
+    }
+
+    return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * FreePostProcessInfo --
+ * EmitTclSize --
  *
- *  Frees all entries in the proc location list, then the info itself.
+ *  Emits an integer value to a Tcl_Channel.
+ *  The separator argument specifies a character to be emitted after the
+ *  integer.
  *
  * Results:
- *  None.
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
  *
  * Side effects:
  *  None.
@@ -1903,37 +2907,30 @@ static PostProcessInfo* CreatePostProcessInfo()
  *----------------------------------------------------------------------
  */
 
-static void FreePostProcessInfo(PostProcessInfo* infoPtr)
+static int EmitTclSize(Tcl_Interp* interp, Tcl_Size value, int separator, Tcl_Channel chan)
 {
-    if (infoPtr)
+    char buf[64];
+    int n = snprintf(buf, sizeof(buf), "%" TCL_SIZE_MODIFIER "d%c", value, (char)separator);
+    if (n < 0 || Tcl_Write(chan, buf, n) < 0)
     {
-        InstLocList* nextPtr;
-        InstLocList* listPtr;
-
-        for (listPtr = infoPtr->procs; listPtr; listPtr = nextPtr)
-        {
-            nextPtr = listPtr->next;
-            Tcl_Free((char*)listPtr);
-        }
-
-        FreeProcBodyInfoArray(infoPtr);
-
-        Tcl_DeleteHashTable(&infoPtr->objTable);
-
-        Tcl_Free((char*)infoPtr);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Tcl_WriteObj: %s", Tcl_PosixError(interp)));
+        return TCL_ERROR;
     }
+    return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * AppendInstLocList --
+ * EmitString --
  *
- *  Appends the given bytecode offset to the proc location list for a given
- *  interpreter.
+ *  Emits a string value to a Tcl_Channel.
+ *  If the length is passed as -1, it is calculated with strlen.
+ *  The separator argument specifies a character to be emitted after the
+ *  string.
  *
  * Results:
- *  None.
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
  *
  * Side effects:
  *  None.
@@ -1941,327 +2938,361 @@ static void FreePostProcessInfo(PostProcessInfo* infoPtr)
  *----------------------------------------------------------------------
  */
 
-static void AppendInstLocList(Tcl_Interp* interp, CompileEnv* compEnvPtr)
+static int EmitString(Tcl_Interp* interp, char* src, Tcl_Size length, int separator, Tcl_Channel chan)
 {
-    CompilerContext* ctxPtr = CompilerGetContext(interp);
-    PostProcessInfo* infoPtr = ctxPtr->ppi;
-    InstLocList* newPtr = CreateInstLocList(compEnvPtr);
-    InstLocList* listPtr = infoPtr->procs;
+    if (length < 0)
+    {
+        length = strlen(src);
+    }
 
-    if (listPtr)
+    if ((length > 0) && (Tcl_Write(chan, src, length) < 0))
     {
-        while (listPtr->next)
-        {
-            listPtr = listPtr->next;
-        }
-        listPtr->next = newPtr;
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Tcl_Write: %s", Tcl_PosixError(interp)));
+        return TCL_ERROR;
     }
-    else
+
+    const char c = (char)separator;
+    if (Tcl_Write(chan, &c, 1) < 0)
     {
-        infoPtr->procs = newPtr;
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Tcl_Write: %s", Tcl_PosixError(interp)));
+        return TCL_ERROR;
     }
 
-    infoPtr->numProcs += 1;
-    ctxPtr->numProcs += 1;
+    return TCL_OK;
 }
 
 /*
- *-----------------------------------------------------------------------
- *
- * CompileObject --
+ *----------------------------------------------------------------------
  *
- *  Lifted from SetByteCodeFromAny in tclCompile.c, does pretty much the
- *  same thing, except that it postprocesses the compiled string to also
- *  compile any procedure bodies. It needs to have access to the compile
- *  environment, because it may have to add objects to the list that was
- *  created by the compiler.
+ * EmitByteSequence --
  *
- *  The rest of this comment block comes from the SetByteCodeFromAny header.
+ *  Emits an array of bytes to a Tcl_Channel, in ASCII85.
+ *  This procedure encodes its input with a modified version of the ASCII85
+ *  encode filter.
+ *  There are two differences from the standard ASCII85 algorithm:
+ *  - the encoding characters are obtained from a table rather than
+ *    being generated arithmetically. This is done because we want to
+ *    avoid using Tcl special characters.
+ *  - the order in which bytes in a 4-tuple are encoded is the opposite
+ *    of the standard order. This lets us drop ! bytes in the encoded
+ *    5-tuple, which buys us better encoding with short strings.
+ *  As a consequence, this encoder is not general purpose; only a similarly
+ *  specialized decoder can extract the bytes back.
  *
- *  Part of the bytecode Tcl object type implementation. Attempts to
- *  generate an byte code internal form for the Tcl object "objPtr" by
- *  compiling its string representation.
+ *  The format is a line containing the byte count, then lines each containing
+ *  72 ASCII characters, or fewer for the last line.
  *
  * Results:
- *  The return value is a standard Tcl object result. If an error occurs
- *  during compilation, an error message is left in the interpreter's
- *  result unless "interp" is NULL.
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
  *
  * Side effects:
- *  Frees the old internal representation. If no error occurs, then the
- *  compiled code is stored as "objPtr"s bytecode representation.
- *  Also, if debugging, initializes the "tcl_traceCompile" Tcl variable
- *  used to trace compilations.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static int CompileObject(Tcl_Interp* interp, Tcl_Obj* objPtr)
+static int EmitByteSequence(Tcl_Interp* interp, unsigned char* bytesPtr, Tcl_Size length, Tcl_Channel chan)
 {
-    int result;
-    ProcInfo info;
-
-    /*
-     * Before starting the compile, temporarily override the Command struct
-     * for the "proc" command to use our CompileProc. This lets us trap
-     * calls to "proc" during compilation, from which we can compile the
-     * procedure bodies
-     */
-
-    info.procCmdPtr = (Command*)Tcl_FindCommand(interp, "proc", (Tcl_Namespace*)NULL, 0);
+    A85EncodeContext encodeCtx;
+    unsigned char bytes[4];
+    Tcl_Size numBytes = 0;
 
-    if (info.procCmdPtr)
+    if (EmitTclSize(interp, length, '\n', chan) != TCL_OK)
     {
-        /*
-         * For the time being, we don't need to make sure that this is really
-         * the builtin "proc" command because we are running the compiler from
-         * our own script in our own executable, and therefore nobody has
-         * had a chance to redefine "proc"
-         */
-
-        /*
-         * EMIL we need to save the current value somewhere where
-         * LocalProcCompileProc can find it and, if it is not 0,
-         * call it.
-         * Probably a global hash table keyed by interpreter
-         */
-
-        info.savedCompileProc = info.procCmdPtr->compileProc;
-        info.procCmdPtr->compileProc = LocalProcCompileProc;
+        return TCL_ERROR;
     }
 
-    /*
-     * Initialize the compiler context struct. This includes the proc location
-     * list for this interpreter; this list will be populated by the local
-     * compile proc and used later to compile the procedure bodies
-     */
+    A85InitEncodeContext(chan, '\n', &encodeCtx);
 
-    InitCompilerContext(interp);
+    while (length > 0)
+    {
+        bytes[numBytes] = *bytesPtr;
 
-    result = TclSetByteCodeFromAny(interp, objPtr, PostProcessCompile, (void*)&info);
+        if (numBytes == 3)
+        {
+            if (A85EncodeBytes(interp, bytes, 4, &encodeCtx) != TCL_OK)
+            {
+                return TCL_ERROR;
+            }
+            numBytes = -1;
+        }
 
-    /*
-     * Restore the "proc" command compile procedure.  This may be unnecessary
-     * since PostProcessCompile will normally restore the function, but in
-     * error cases it may never be called.
-     */
+        numBytes += 1;
+        bytesPtr += 1;
+        length -= 1;
+    }
 
-    if (info.procCmdPtr)
+    if ((numBytes != 0) && (A85EncodeBytes(interp, bytes, numBytes, &encodeCtx) != TCL_OK))
     {
-        info.procCmdPtr->compileProc = info.savedCompileProc;
+        return TCL_ERROR;
     }
 
-    ReleaseCompilerContext(interp);
-
-    return result;
+    return A85Flush(interp, &encodeCtx);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * PostProcessCompile --
+ * CalculateLocMapSizes --
  *
- *  Runs the postprocessing step on a compilation environment.
+ *  Calculates the lengths of the location map arrays in a ByteCode
+ *  struct and places them in the LocMapSizes argument.
+ *  Note that, although it could use pointer arithmetic for all but the
+ *  last one (because the arrays are contiguous), we elect to do it by
+ *  scanning the arrays in all cases.
  *
  * Results:
- *  A standard TCL error code.
+ *  None.
  *
  * Side effects:
- *  The various postprocessing steps may have side effects.
+ *  Fills in the fields of the LocMapSizes struct.
  *
  *----------------------------------------------------------------------
  */
-
-static int PostProcessCompile(Tcl_Interp* interp, struct CompileEnv* compEnvPtr, void* clientData)
+static void CalculateLocMapSizes(ByteCode* codePtr, LocMapSizes* sizes)
 {
-    int result;
-    ProcInfo* infoPtr = (ProcInfo*)clientData;
-
-    /*
-     * restore the original compile proc for "proc" before we postprocess
-     * the compiled environment. If we don't, and there are procedures that
-     * call "proc" in their bodies, the numProc field in the post
-     * process info gets corrupted (it is bumped up, which makes it
-     * inconsistent with the number of process info struct stored).
-     */
-
-    if (infoPtr->procCmdPtr)
-    {
-        infoPtr->procCmdPtr->compileProc = infoPtr->savedCompileProc;
-    }
-
     /*
-     * Only postprocessing so far is the compilation of procedure bodies
+     * EMIL for all but the last, we could do sanity checking by using
+     * pointer arithmetic.
      */
 
-    result = CompileProcBodies(interp, compEnvPtr);
-    if (result != TCL_OK)
-    {
-        return result;
-    }
-
-    return result;
+    sizes->codeDeltaSize = CalculateLocArrayLength(codePtr->codeDeltaStart, codePtr->numCommands);
+    sizes->codeLengthSize = CalculateLocArrayLength(codePtr->codeLengthStart, codePtr->numCommands);
+    sizes->srcDeltaSize = CalculateLocArrayLength(codePtr->srcDeltaStart, codePtr->numCommands);
+    sizes->srcLengthSize = CalculateLocArrayLength(codePtr->srcLengthStart, codePtr->numCommands);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * CompileProcBodies --
+ * CalculateLocArrayLength --
  *
- *  Compiles the procedure bodies present in a compilation environment.
+ *  Calculates the length of the given location array; numCommands is the
+ *  number of commands in the ByteCode structure.
  *
  * Results:
- *  A standard TCL error code.
+ *  Returns the length, in bytes, of the array.
  *
  * Side effects:
- *  Compiles procedure bodies if any; the objects will have an internal
- *  bytecode representation. Additionally, if the procedure bodies were
- *  shared objects, it creates a new copy of the body object in order to
- *  make them unshared. In this case, it will modify both the bytecodes and
- *  the object table.
- *  May set the TCL result object on error.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static int CompileProcBodies(Tcl_Interp* interp, CompileEnv* compEnvPtr)
+static Tcl_Size CalculateLocArrayLength(unsigned char* bytes, Tcl_Size numCommands)
+{
+    Tcl_Size i, length = 0;
+
+    /*
+     * array is encoded as either a single byte, or a four-byte sequence
+     * preceded by the 0xff tag
+     */
+
+    for (i = 0; i < numCommands; i++)
+    {
+        if (*bytes == 0xff)
+        {
+            length += 5;
+            bytes += 5;
+        }
+        else
+        {
+            length += 1;
+            bytes += 1;
+        }
+    }
+
+    return length;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitObjArray --
+ *
+ *  Emits the object array for a ByteCode struct to a Tcl_Channel.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int EmitObjArray(Tcl_Interp* interp, ByteCode* codePtr, Tcl_Channel chan)
 {
     CompilerContext* ctxPtr = CompilerGetContext(interp);
-    PostProcessInfo* infoPtr = ctxPtr->ppi;
-    ProcBodyInfo** infoArrayPtr;
     int result = TCL_OK;
-    Tcl_Size i;
+    Tcl_Size i, numLitObjects = codePtr->numLitObjects;
+    Tcl_Obj** objArrayPtr = &codePtr->objArrayPtr[0];
+    Tcl_Obj* objPtr;
+    Tcl_HashTable litTable;
+    Tcl_HashEntry* entryPtr;
+    Tcl_Obj* listPtr;
+    int isNew;
+    Tcl_HashTable bodyTable;
+    Tcl_HashEntry* bodyEntryPtr;
+    int isNewBody;
 
-    if (!infoPtr)
+    if (EmitTclSize(interp, numLitObjects, '\n', chan) != TCL_OK)
     {
-        Tcl_Panic("CompileProcBodies: no postprocess info for interpreter");
         return TCL_ERROR;
     }
 
-    if (infoPtr->numProcs < 1)
+    Tcl_InitHashTable(&litTable, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&bodyTable, TCL_ONE_WORD_KEYS);
+
+    for (i = 0; (result == TCL_OK) && (i < numLitObjects); i++)
     {
-        return TCL_OK;
-    }
+        objPtr = objArrayPtr[i];
 
-    CreateProcBodyInfoArray(infoPtr, compEnvPtr, &infoArrayPtr);
-    LoadObjRefInfoTable(infoPtr, compEnvPtr);
+        /*
+         * In format 4, a procbody whose compiled body was already emitted
+         * for an earlier literal is emitted as a reference to that literal.
+         */
 
-    /*
-     * Before compiling, check for shared objects and, if there are any,
-     * copy them to new objects.
-     */
+        if ((ctxPtr->formatVersion >= 4) && (objPtr->typePtr == cmpProcBodyType))
+        {
+            bodyEntryPtr = Tcl_CreateHashEntry(
+                &bodyTable, (char*)((Proc*)objPtr->internalRep.twoPtrValue.ptr1)->bodyPtr, &isNewBody);
+            if (!isNewBody)
+            {
+                if ((EmitChar(interp, CMP_PROCCLONE_CODE, '\n', chan) != TCL_OK) ||
+                    (EmitTclSize(interp, PTR2SIZE(Tcl_GetHashValue(bodyEntryPtr)), '\n', chan) != TCL_OK))
+                {
+                    result = TCL_ERROR;
+                }
+                continue;
+            }
+            Tcl_SetHashValue(bodyEntryPtr, SIZE2PTR(i));
+        }
 
-    UnshareProcBodies(interp, ctxPtr, compEnvPtr);
+        /*
+         * When analyzing, name the record of a nested ByteCode after the
+         * procedure it is the body of.
+         */
 
-    /*
-     * Compile the procedure bodies.
-     */
+        if (ctxPtr->analysisPtr && ((objPtr->typePtr == cmpProcBodyType) || (objPtr->typePtr == cmpByteCodeType)))
+        {
+            Tcl_Obj* namePtr = (objPtr->typePtr == cmpProcBodyType) ? FindProcName(codePtr, i) : NULL;
 
-    infoPtr->numCompiledBodies = 0;
-    for (i = 0; i < infoPtr->numProcs; i++)
-    {
-        if (infoArrayPtr[i]->bodyNewIndex != -1)
+            ctxPtr->analysisNamePtr = namePtr ? namePtr : Tcl_ObjPrintf("literal %" TCL_SIZE_MODIFIER "d", i);
+            Tcl_IncrRefCount(ctxPtr->analysisNamePtr);
+        }
+
+        /*
+         * In format 4, a literal that is a canonical list is emitted as its
+         * elements.
+         */
+
+        listPtr = (ctxPtr->formatVersion >= 4) ? GetCanonicalList(objPtr) : NULL;
+        if (listPtr)
         {
-            result = CompileOneProcBody(interp, infoArrayPtr[i], ctxPtr, compEnvPtr);
-            if (result != TCL_OK)
+            result = EmitListObject(interp, listPtr, &litTable, chan);
+            Tcl_DecrRefCount(listPtr);
+        }
+        else
+        {
+            result = EmitObject(interp, objPtr, chan);
+        }
+
+        /*
+         * Register the literal only after it has been emitted, so that
+         * element references always point backwards in the array.
+         */
+
+        if ((ctxPtr->formatVersion >= 4) && (objPtr->typePtr != cmpProcBodyType) &&
+            (objPtr->typePtr != cmpByteCodeType))
+        {
+            entryPtr = Tcl_CreateHashEntry(&litTable, Tcl_GetString(objPtr), &isNew);
+            if (isNew)
             {
-                return result;
+                Tcl_SetHashValue(entryPtr, SIZE2PTR(i));
             }
-            infoPtr->numCompiledBodies++;
         }
     }
 
-    /*
-     * If some procedure bodies have been compiled, we need to modify the
-     * bytecodes and related data structures
-     */
-
-    UpdateByteCodes(infoPtr, compEnvPtr);
-
+    Tcl_DeleteHashTable(&litTable);
+    Tcl_DeleteHashTable(&bodyTable);
     return result;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * CreateProcBodyInfoArray --
+ * GetCanonicalList --
  *
- *  Allocate and populate an array of ProcBodyInfo structs.
- *  This is a NULL-terminated array of pointers to ProcBodyInfo, each
- *  initialized from the corresponding procedure body.
- *  The allocated array is placed in the infoArrayPtr field of locInfoPtr,
- *  and is owned by it; it will be released when locInfoPtr is freed.
+ *  Checks whether a literal can be emitted as an element vector: it must be
+ *  a pure string (not one of the types EmitObject handles specially) whose
+ *  value is a canonical list of 2 to CMP_MAX_LIST_LITERAL elements, so that
+ *  a list rebuilt from the elements regenerates exactly the same string.
+ *  The check is made on a copy of the string, to avoid shimmering the
+ *  literal itself.
  *
  * Results:
- *  None.
+ *  Returns a new list object with a reference count of 1, or NULL if the
+ *  literal must be emitted as a string.
  *
  * Side effects:
- *  Tcl_Panics on error.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static void CreateProcBodyInfoArray(PostProcessInfo* locInfoPtr, CompileEnv* compEnvPtr, ProcBodyInfo*** arrayPtrPtr)
+static Tcl_Obj* GetCanonicalList(Tcl_Obj* objPtr)
 {
-    Tcl_Size allocSize, arraySize;
-    Tcl_Size i, numProcs = locInfoPtr->numProcs;
-    char* allocPtr;
-    ProcBodyInfo** infoAryPtr;
-    ProcBodyInfo* infoPtr;
-    InstLocList* locPtr;
-
-    FreeProcBodyInfoArray(locInfoPtr);
-
-    /*
-     * allocate a single area, used for both the array of pointers and the
-     * info structs
-     */
-
-    arraySize = (numProcs + 1) * sizeof(ProcBodyInfo*);
-    arraySize += TCL_ALIGN(arraySize); /* align the info array */
-    allocSize = arraySize + (numProcs * sizeof(ProcBodyInfo));
-    allocPtr = Tcl_Alloc(allocSize);
+    const Tcl_ObjType* objTypePtr = objPtr->typePtr;
+    Tcl_Obj *strPtr, *listPtr = NULL;
+    Tcl_Obj** objv;
+    Tcl_Size objc, length, newLength;
+    const char *bytes, *newBytes;
 
-    locInfoPtr->infoArrayPtr = (ProcBodyInfo**)allocPtr;
-    infoAryPtr = locInfoPtr->infoArrayPtr;
-    for (i = 0; i <= numProcs; i++)
+    if ((objTypePtr == cmpIntType) || (objTypePtr == cmpDoubleType) || (objTypePtr == cmpByteCodeType) ||
+        (objTypePtr == cmpProcBodyType))
     {
-        *infoAryPtr = (ProcBodyInfo*)NULL;
-        infoAryPtr += 1;
+        return NULL;
     }
 
-    /*
-     * get the object indexes for the body and args objects,
-     * and the push offsets
-     */
-
-    infoPtr = (ProcBodyInfo*)(allocPtr + arraySize);
-    infoAryPtr = locInfoPtr->infoArrayPtr;
-    locPtr = locInfoPtr->procs;
-    for (i = 0; i < numProcs; i++)
+    bytes = Tcl_GetStringFromObj(objPtr, &length);
+    if (length < 3)
     {
-        *infoAryPtr = infoPtr;
-        LoadProcBodyInfo(locPtr, compEnvPtr, infoPtr);
-        infoAryPtr += 1;
-        infoPtr += 1;
-        locPtr = locPtr->next;
+        return NULL;
     }
 
-    if (arrayPtrPtr != NULL)
+    strPtr = Tcl_NewStringObj(bytes, length);
+    Tcl_IncrRefCount(strPtr);
+    if ((Tcl_ListObjGetElements(NULL, strPtr, &objc, &objv) == TCL_OK) && (objc >= 2) &&
+        (objc <= CMP_MAX_LIST_LITERAL))
     {
-        *arrayPtrPtr = locInfoPtr->infoArrayPtr;
+        listPtr = Tcl_NewListObj(objc, objv);
+        Tcl_IncrRefCount(listPtr);
+        newBytes = Tcl_GetStringFromObj(listPtr, &newLength);
+        if ((newLength != length) || (memcmp(bytes, newBytes, length) != 0))
+        {
+            Tcl_DecrRefCount(listPtr);
+            listPtr = NULL;
+        }
     }
+    Tcl_DecrRefCount(strPtr);
+
+    return listPtr;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * FreeProcBodyInfoArray --
+ * EmitListObject --
  *
- *  Frees the array of ProcBodyInfo structs in the PostProcessInfo struct.
+ *  Emits a canonical list literal to a Tcl_Channel as an element vector:
+ *  the CMP_LIST_CODE type code and the element count, followed by one entry
+ *  per element. An element whose string matches an earlier entry in the
+ *  literal array is emitted as CMP_LITREF_CODE and that entry's index;
+ *  any other element is emitted with EmitObject.
  *
  * Results:
- *  None.
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
  *
  * Side effects:
  *  None.
@@ -2269,476 +3300,3324 @@ static void CreateProcBodyInfoArray(PostProcessInfo* locInfoPtr, CompileEnv* com
  *----------------------------------------------------------------------
  */
 
-static void FreeProcBodyInfoArray(PostProcessInfo* infoPtr)
+static int EmitListObject(Tcl_Interp* interp, Tcl_Obj* listPtr, Tcl_HashTable* litTablePtr, Tcl_Channel chan)
 {
-    if (infoPtr->infoArrayPtr)
+    Tcl_HashEntry* entryPtr;
+    Tcl_Obj** objv;
+    Tcl_Size i, objc;
+
+    Tcl_ListObjGetElements(NULL, listPtr, &objc, &objv);
+
+    if ((EmitChar(interp, CMP_LIST_CODE, '\n', chan) != TCL_OK) || (EmitTclSize(interp, objc, '\n', chan) != TCL_OK))
     {
-        Tcl_Free((char*)infoPtr->infoArrayPtr);
+        return TCL_ERROR;
     }
-    infoPtr->infoArrayPtr = (ProcBodyInfo**)NULL;
+
+    for (i = 0; i < objc; i++)
+    {
+        entryPtr = Tcl_FindHashEntry(litTablePtr, Tcl_GetString(objv[i]));
+        if (entryPtr)
+        {
+            if ((EmitChar(interp, CMP_LITREF_CODE, '\n', chan) != TCL_OK) ||
+                (EmitTclSize(interp, PTR2SIZE(Tcl_GetHashValue(entryPtr)), '\n', chan) != TCL_OK))
+            {
+                return TCL_ERROR;
+            }
+        }
+        else if (EmitObject(interp, objv[i], chan) != TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+    }
+
+    return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * LoadProcBodyInfo --
+ * EmitObject --
  *
- *  Populate a ProcBodyInfo struct.  This function determines if a
- *  procedure body should be compiled or not; see the comments in
- *  the body, below, for a description of the algorithm.  A
- *  procedure body that should not be compiled has its
- *  bodyNewIndex field set to -1.
+ *  Emits a Tcl_Obj to a Tcl_Channel.
  *
  * Results:
- *  None.
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
  *
  * Side effects:
  *  None.
  *
- *---------------------------------------------------------------------- */
+ *----------------------------------------------------------------------
+ */
 
-static void LoadProcBodyInfo(InstLocList* locInfoPtr, CompileEnv* compEnvPtr, ProcBodyInfo* infoPtr)
+static int EmitObject(Tcl_Interp* interp, Tcl_Obj* objPtr, Tcl_Channel chan)
 {
-    unsigned char* pc = compEnvPtr->codeStart + locInfoPtr->bytecodeOffset;
+    const Tcl_ObjType* objTypePtr;
+    char* objBytes;
+    Tcl_Size objLength;
+    char typeCode = CMP_STRING_CODE;
+    int emitCount = 1;
 
-    /*
-     * Here is where we scan the bytecodes and figure out where the args
-     * and the procedure body are put on the stack.
-     *
-     * Currently, we only detect the simplest (and most common) case, where
-     * all arguments to proc are pushed as literals, like this:
-     *      proc a { a1 a2 } { return [list $a1 $a2] }
-     * This corresponds to an expected sequence of commands like this:
-     *      PUSH, PUSH, PUSH, PUSH, INVOKE_STK1
-     * where PUSH can be either PUSH1 or PUSH4, but INVOKE_STK1 only is
-     * expected (because there are only 4 arguments).
-     * The operand of the first PUSH is the index to the "proc" string,
-     * for the second it is the procedure name, for the third the argument
-     * list, and for the fourth the procedure body.
-     *
-     * If the args or the body are not pushed as literals, then the PUSH
-     * should be followed by different opcodes; for example, something like
-     * this
-     *      set body { return [list $a1 $a2] }
-     *      proc a { a1 a2 } $b
-     * generates a sequence like (PUSH "b"; LOAD) when the body is loaded,
-     * and we shouldn't compile "b" (of course!) and neither the object
-     * loaded as "b" (because it may not be a literal).
-     *
-     * The tough part is how do we detect stuff like this:
-     *      proc $procName { a1 a2 ] { return [list $a1 $a2] }
-     */
+    objTypePtr = objPtr->typePtr;
+    objBytes = Tcl_GetStringFromObj(objPtr, &objLength);
+    if (!objBytes)
+    {
+        objBytes = "";
+        objLength = 0;
+    }
 
-    infoPtr->commandIndex = locInfoPtr->commandIndex;
-    infoPtr->procOffset = (pc - compEnvPtr->codeStart);
-    infoPtr->nameIndex = -1;
-    infoPtr->argsIndex = -1;
-    infoPtr->bodyOrigIndex = -1;
-    infoPtr->bodyNewIndex = -1;
-    infoPtr->bodyOffset = -1; /* Bugzilla 89467 */
-
-    /*
-     * Skip the "proc" string
-     */
-
-    switch (*pc)
+    if (objTypePtr == cmpIntType)
     {
-        case INST_PUSH1:
-            pc += 2;
-            break;
-
-        case INST_PUSH4:
-            pc += 5;
-            break;
-
-        default:
-            return;
+        typeCode = CMP_INT_CODE;
+        emitCount = 0;
     }
-
-    /*
-     * get the index of the proc name
-     */
-
-    switch (*pc)
+    else if (objTypePtr == cmpDoubleType)
     {
-        case INST_PUSH1:
-            infoPtr->nameIndex = TclGetUInt1AtPtr(pc + 1);
-            pc += 2;
-            break;
-
-        case INST_PUSH4:
-            infoPtr->nameIndex = TclGetUInt4AtPtr(pc + 1);
-            pc += 5;
-            break;
-
-        default:
-            return;
+        typeCode = CMP_DOUBLE_CODE;
+        emitCount = 0;
     }
-
-    /*
-     * get the index of the argument list
-     */
-
-    switch (*pc)
+    else if (objTypePtr == cmpByteCodeType)
     {
-        case INST_PUSH1:
-            infoPtr->argsIndex = TclGetUInt1AtPtr(pc + 1);
-            pc += 2;
-            break;
-
-        case INST_PUSH4:
-            infoPtr->argsIndex = TclGetUInt4AtPtr(pc + 1);
-            pc += 5;
-            break;
-
-        default:
-            return;
+        if (EmitChar(interp, CMP_BYTECODE_CODE, '\n', chan) != TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+        return EmitByteCode(interp, (ByteCode*)objPtr->internalRep.otherValuePtr, chan);
     }
-
-    /*
-     * get the index of the procedure body, and save the offset to the
-     * push instruction.
-     */
-
-    infoPtr->bodyOffset = (pc - compEnvPtr->codeStart);
-    switch (*pc)
+    else if (objTypePtr == cmpProcBodyType)
     {
-        case INST_PUSH1:
-            infoPtr->bodyOrigIndex = TclGetUInt1AtPtr(pc + 1);
-            pc += 2;
-            break;
-
-        case INST_PUSH4:
-            infoPtr->bodyOrigIndex = TclGetUInt4AtPtr(pc + 1);
-            pc += 5;
-            break;
-
-        default:
-            return;
+        if (EmitChar(interp, CMP_PROCBODY_CODE, '\n', chan) != TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+        return EmitProcBody(interp, (Proc*)objPtr->internalRep.otherValuePtr, chan);
     }
-
-    /*
-     * (****)
-     */
-
-    infoPtr->bodyNewIndex = infoPtr->bodyOrigIndex;
-
-    /*
-     * finally, check if the following instruction is a INVOKE_STK1 with
-     * argument 4
-     */
-
-    if ((*pc != INST_INVOKE_STK1) || (TclGetUInt1AtPtr(pc + 1) != 4))
+    else
     {
-        infoPtr->nameIndex = -1;
-        infoPtr->argsIndex = -1;
-        infoPtr->bodyOrigIndex = -1;
-        infoPtr->bodyNewIndex = -1;
+        if (EmitChar(interp, CMP_XSTRING_CODE, '\n', chan) != TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+        return EmitByteSequence(interp, (unsigned char*)objBytes, objLength, chan);
     }
-
-    return;
+    if (EmitChar(interp, typeCode, '\n', chan) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+    if (emitCount && (EmitTclSize(interp, objLength, '\n', chan) != TCL_OK))
+    {
+        return TCL_ERROR;
+    }
+    return EmitString(interp, objBytes, objLength, '\n', chan);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * LoadObjRefInfoTable --
+ * EmitExcRangeArray --
  *
- *  Load the object reference table.
+ *  Emits the exception range array for a ByteCode struct to a Tcl_Channel.
  *
  * Results:
- *  None.
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
  *
  * Side effects:
- *  Populates the objTable field of the locInfoPtr struct.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static void LoadObjRefInfoTable(PostProcessInfo* locInfoPtr, CompileEnv* compEnvPtr)
+static int EmitExcRangeArray(Tcl_Interp* interp, ByteCode* codePtr, Tcl_Channel chan)
 {
-    Tcl_HashTable* objTablePtr;
-    ProcBodyInfo** infoAryPtr;
-    ProcBodyInfo* infoPtr;
-    Tcl_HashEntry* entryPtr;
-    int isNew;
-    Tcl_Size objIndex;
-    ObjRefInfo* refInfoPtr;
-    InstructionDesc* opCodesTablePtr;
-    unsigned char* pc;
-
-    CleanObjRefInfoTable(locInfoPtr);
-
-    /*
-     * count how many references to this object as a procedure body
-     */
+    Tcl_Size i, numExceptRanges = codePtr->numExceptRanges;
+    ExceptionRange* excArrayPtr = codePtr->exceptArrayPtr;
+    char excName;
 
-    objTablePtr = &locInfoPtr->objTable;
-    for (infoAryPtr = locInfoPtr->infoArrayPtr; *infoAryPtr; infoAryPtr++)
+    if (EmitTclSize(interp, numExceptRanges, '\n', chan) != TCL_OK)
     {
-        infoPtr = *infoAryPtr;
-        entryPtr = Tcl_CreateHashEntry(objTablePtr, (char*)INT2PTR(infoPtr->bodyOrigIndex), &isNew);
-        if (isNew)
-        {
-            refInfoPtr = (ObjRefInfo*)Tcl_Alloc(sizeof(ObjRefInfo));
-            refInfoPtr->numReferences = 0;
-            refInfoPtr->numProcReferences = 0;
-            refInfoPtr->numUnshares = 0;
-
-            Tcl_SetHashValue(entryPtr, (void*)refInfoPtr);
-        }
-        else
-        {
-            refInfoPtr = (ObjRefInfo*)Tcl_GetHashValue(entryPtr);
-        }
-
-        refInfoPtr->numProcReferences += 1;
+        return TCL_ERROR;
     }
 
-    /*
-     * now scan the bytecodes and count the references from the bytecodes.
-     * Note that this count includes references from the PUSH instructions
-     * in the "proc" call.
-     */
-
-    opCodesTablePtr = (InstructionDesc*)TclGetInstructionTable();
-    for (pc = compEnvPtr->codeStart; pc < compEnvPtr->codeNext;)
+    for (i = 0; i < numExceptRanges; i++)
     {
-        objIndex = GetSharedIndex(pc);
-        if (objIndex >= 0)
+        excName = NameFromExcRange(excArrayPtr->type);
+        if (excName == '\0')
         {
-            entryPtr = Tcl_FindHashEntry(objTablePtr, (char*)INT2PTR(objIndex));
-            if (entryPtr)
-            {
-                /*
-                 * this is a reference to a known procedure body
-                 */
+            return -1;
+        }
 
-                refInfoPtr = (ObjRefInfo*)Tcl_GetHashValue(entryPtr);
-                refInfoPtr->numReferences += 1;
-            }
+        if ((EmitChar(interp, excName, ' ', chan) != TCL_OK) ||
+            (EmitTclSize(interp, excArrayPtr->nestingLevel, ' ', chan) != TCL_OK) ||
+            (EmitTclSize(interp, excArrayPtr->codeOffset, ' ', chan) != TCL_OK) ||
+            (EmitTclSize(interp, excArrayPtr->numCodeBytes, ' ', chan) != TCL_OK) ||
+            (EmitTclSize(interp, excArrayPtr->breakOffset, ' ', chan) != TCL_OK) ||
+            (EmitTclSize(interp, excArrayPtr->continueOffset, ' ', chan) != TCL_OK) ||
+            (EmitTclSize(interp, excArrayPtr->catchOffset, '\n', chan) != TCL_OK))
+        {
+            return TCL_ERROR;
         }
 
-        pc += opCodesTablePtr[*pc].numBytes;
+        excArrayPtr += 1;
     }
+
+    return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * CleanObjRefInfoTable --
+ * EmitAuxDataArray --
  *
- *  Releases all entries in the object reference table.
+ *  Emits the AuxData array for a ByteCode struct to a Tcl_Channel.
  *
  * Results:
- *  None.
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
  *
  * Side effects:
- *  See above.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static void CleanObjRefInfoTable(PostProcessInfo* locInfoPtr)
+static int EmitAuxDataArray(Tcl_Interp* interp, ByteCode* codePtr, Tcl_Channel chan)
 {
-    Tcl_HashSearch iterCtx; /* the iteration context */
-    Tcl_HashEntry* entryPtr;
-    ObjRefInfo* refInfoPtr;
+    int result;
+    Tcl_Size i, numAuxDataItems = codePtr->numAuxDataItems;
+    AuxData* auxDataPtr = codePtr->auxDataArrayPtr;
+    const AuxDataType* typePtr;
 
-    for (entryPtr = Tcl_FirstHashEntry(&locInfoPtr->objTable, &iterCtx); entryPtr; entryPtr = Tcl_NextHashEntry(&iterCtx))
+    if (EmitTclSize(interp, numAuxDataItems, '\n', chan) != TCL_OK)
     {
-        refInfoPtr = (ObjRefInfo*)Tcl_GetHashValue(entryPtr);
-        Tcl_Free((char*)refInfoPtr);
+        return TCL_ERROR;
     }
-}
-
-/*
- *----------------------------------------------------------------------
- *
- * CompileOneProcBody --
- *
- *  Compiles a procedure body.
- *  Much of this code is derived from Tcl_ProcObjCmd and TclObjInterpProc.
- *
- * Results:
- *  A standard TCL error code.
- *
- * Side effects:
- *  If the call succeeds, the objects will have an internal bytecode
- *  representation. Additionally, if the object was shared, a new copy is
- *  created in order to make it unshared; in this case, the new object is
- *  added to the object table and the new index field in infoPtr is updated.
- *  May set the TCL result object on error.
- *
- *----------------------------------------------------------------------
- */
 
-static int CompileOneProcBody(Tcl_Interp* interp, ProcBodyInfo* infoPtr, CompilerContext* ctxPtr, CompileEnv* compEnvPtr)
-{
-    Interp* iPtr = (Interp*)interp;
-    Proc* procPtr = (Proc*)NULL;
-    Tcl_Command cmd = (Tcl_Command)NULL;
+    for (i = 0; i < numAuxDataItems; i++)
+    {
+        /*
+         * write out the type, then switch based on the AuxData type
+         */
+        typePtr = auxDataPtr->type;
+        if (typePtr == cmpJumptableInfoType)
+        {
+            result = EmitChar(interp, CMP_JUMPTABLE_INFO, '\n', chan);
+            if (result != TCL_OK)
+            {
+                return result;
+            }
+            result = EmitJumptableInfo(interp, (JumptableInfo*)auxDataPtr->clientData, chan);
+            if (result != TCL_OK)
+            {
+                return result;
+            }
+        }
+        else if (typePtr == cmpDictUpdateInfoType)
+        {
+            result = EmitChar(interp, CMP_DICTUPDATE_INFO, '\n', chan);
+            if (result != TCL_OK)
+            {
+                return result;
+            }
+            result = EmitDictUpdateInfo(interp, (DictUpdateInfo*)auxDataPtr->clientData, chan);
+            if (result != TCL_OK)
+            {
+                return result;
+            }
+        }
+        else if (typePtr == cmpNewForeachInfoType)
+        {
+            result = EmitChar(interp, CMP_NEW_FOREACH_INFO, '\n', chan);
+            if (result != TCL_OK)
+            {
+                return result;
+            }
+            result = EmitNewForeachInfo(interp, (ForeachInfo*)auxDataPtr->clientData, chan);
+            if (result != TCL_OK)
+            {
+                return result;
+            }
+        }
+        else
+        {
+            Tcl_Panic("EmitAuxDataArray: unknown AuxType \"%s\"", typePtr->name);
+        }
+        auxDataPtr += 1;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitSignature --
+ *
+ *  Emit a signature string to be used in the header of a compiled TCL
+ *  script. The signature is used to mark the file as a compiled TCL script.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on error.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int EmitSignature(Tcl_Interp* interp, Tcl_Channel chan)
+{
+    CompilerContext* ctxPtr = CompilerGetContext(interp);
+
+    if ((EmitString(interp, signatureHeader, -1, ' ', chan) != TCL_OK) ||
+        (EmitTclSize(interp, ctxPtr->formatVersion, ' ', chan) != TCL_OK) || (EmitString(interp, PACKAGE_VERSION, -1, ' ', chan) != TCL_OK) ||
+        (EmitString(interp, TCL_VERSION, -1, '\n', chan) != TCL_OK))
+    {
+        PrependResult(interp, "error writing signature: ");
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * NameFromExcRange --
+ *
+ *  Given an ExceptionRangeType enum, return the corresponding name.
+ *
+ * Results:
+ *  Returns the name if it was successful at converting the enum value to
+ *  a name, '\0' otherwise.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static char NameFromExcRange(ExceptionRangeType type)
+{
+    const ExcRangeMap* mapPtr;
+
+    for (mapPtr = &excRangeMap[0]; mapPtr->name != 0; mapPtr++)
+    {
+        if (mapPtr->type == type)
+        {
+            return mapPtr->name;
+        }
+    }
+
+    return '\0';
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InitTypes --
+ *
+ *  Uses Tcl_GetObjType to load pointers to known object types into static
+ *  variables, which can then be used instead of the known objects themselves.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void InitTypes()
+{
+    Tcl_MutexLock(&typesMutex);
+    if (didLoadTypes == 0)
+    {
+        cmpProcBodyType = Tcl_GetObjType("procbody");
+        if (!cmpProcBodyType)
+        {
+            Tcl_Panic("InitTypes: failed to find the procbody type");
+        }
+
+        cmpByteCodeType = Tcl_GetObjType("bytecode");
+        if (!cmpByteCodeType)
+        {
+            Tcl_Panic("InitTypes: failed to find the bytecode type");
+        }
+
+        cmpDoubleType = Tcl_GetObjType("double");
+        if (!cmpDoubleType)
+        {
+            Tcl_Panic("InitTypes: failed to find the double type");
+        }
+
+        Tcl_Obj* obj = Tcl_NewIntObj(0);
+        cmpIntType = obj->typePtr;
+        Tcl_DecrRefCount(obj);
+
+        cmpJumptableInfoType = TclGetAuxDataType("JumptableInfo");
+        if (!cmpJumptableInfoType)
+        {
+            Tcl_Panic("InitTypes: failed to find the JumptableInfo AuxData type");
+        }
+        cmpDictUpdateInfoType = TclGetAuxDataType("DictUpdateInfo");
+        if (!cmpDictUpdateInfoType)
+        {
+            Tcl_Panic("InitTypes: failed to find the DictUpdateInfo AuxData type");
+        }
+        cmpNewForeachInfoType = TclGetAuxDataType("NewForeachInfo");
+        if (!cmpNewForeachInfoType)
+        {
+            Tcl_Panic("InitTypes: failed to find the NewForeachInfo AuxData type");
+        }
+        didLoadTypes = 1;
+    }
+    Tcl_MutexUnlock(&typesMutex);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrependResult --
+ *
+ *  Prepends the string in msgPtr to the current result value. Used by error
+ *  reporting to augment a generic error string.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void PrependResult(Tcl_Interp* interp, char* msgPtr)
+{
+    Tcl_DString buf;
+    Tcl_Obj* resultPtr = Tcl_GetObjResult(interp);
+
+    Tcl_DStringInit(&buf);
+    Tcl_DStringAppend(&buf, msgPtr, -1);
+    Tcl_DStringAppend(&buf, resultPtr->bytes, resultPtr->length);
+
+    resultPtr = Tcl_NewStringObj(Tcl_DStringValue(&buf), Tcl_DStringLength(&buf));
+    Tcl_SetObjResult(interp, resultPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitScriptPreamble --
+ *
+ *  Emit the preamble for the compiled script. Writes out the TCL boilerplate
+ *  that requires the loader package and evals the bytecodes.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on error.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int EmitScriptPreamble(Tcl_Interp* interp, Tcl_Channel chan)
+{
+    char buf[256];
+    char* errMsgPtr;
+    int result = TCL_OK;
+    Tcl_Obj* errObjPtr = 0;
+
+    /*
+     * Extract the loader error message from the package itself, and if not
+     * present use the default value. This lets us modify the error message
+     * in a script.
+     */
+
+    sprintf(buf, "variable %s; set %s", errorVariable, errorVariable);
+    Tcl_Obj* script = Tcl_NewStringObj(buf, -1);
+    Tcl_IncrRefCount(script);
+    int _rc = Tcl_EvalObjEx(interp, script, 0);
+    Tcl_DecrRefCount(script);
+    if (_rc != TCL_OK)
+    {
+        errMsgPtr = errorMessage;
+    }
+    else
+    {
+        Tcl_Obj* errObjPtr = Tcl_GetObjResult(interp);
+        Tcl_IncrRefCount(errObjPtr);
+        errMsgPtr = errObjPtr->bytes;
+    }
+
+    sprintf(buf, preambleFormat, loaderName, loaderVersion, errMsgPtr);
+    if (EmitString(interp, buf, -1, '\n', chan) != TCL_OK)
+    {
+        PrependResult(interp, "error writing script preamble: ");
+        result = TCL_ERROR;
+    }
+    else
+    {
+        result = EmitScriptEval(interp, chan);
+    }
+
+    if (errObjPtr)
+    {
+        Tcl_DecrRefCount(errObjPtr);
+    }
+    Tcl_ResetResult(interp);
+
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitScriptEval --
+ *
+ *  Emit the opening of the loader command that evals the bytecodes, which
+ *  ends the script preamble and starts each further chunk of a script
+ *  compiled with -chunk.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on error.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int EmitScriptEval(Tcl_Interp* interp, Tcl_Channel chan)
+{
+    char buf[256];
+
+    sprintf(buf, evalFormat, loaderName, evalCommand);
+    if (EmitString(interp, buf, -1, '\n', chan) != TCL_OK)
+    {
+        PrependResult(interp, "error writing script preamble: ");
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitProfileRuntime --
+ *
+ *  Emits the TCL code that supports a script compiled with -profile. The
+ *  first such script to be loaded creates the counter array and arranges
+ *  for the counters to be written to the -profile file when the
+ *  application calls exit, one "unit index count" line per command, by
+ *  decreasing count. The unit is the procedure name, or the source file
+ *  name for top level code, and the index is the command number in the
+ *  unit.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on error.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int EmitProfileRuntime(Tcl_Interp* interp, Tcl_Obj* fileNamePtr, Tcl_Channel chan)
+{
+    Tcl_Obj *wordPtr, *scriptPtr;
+    Tcl_Size length;
+    char* bytes;
+    int result = TCL_OK;
+
+    wordPtr = Tcl_NewListObj(1, &fileNamePtr);
+    Tcl_IncrRefCount(wordPtr);
+    scriptPtr = Tcl_ObjPrintf(profileFormat, Tcl_GetString(wordPtr));
+    Tcl_IncrRefCount(scriptPtr);
+    bytes = Tcl_GetStringFromObj(scriptPtr, &length);
+    if (EmitString(interp, bytes, length, '\n', chan) != TCL_OK)
+    {
+        PrependResult(interp, "error writing profile support: ");
+        result = TCL_ERROR;
+    }
+    Tcl_DecrRefCount(scriptPtr);
+    Tcl_DecrRefCount(wordPtr);
+
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitScriptPostamble --
+ *
+ *  Emit the postamble for the compiled script. Writes out the TCL boilerplate
+ *  that requires the loader package and evals the bytecodes.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on error.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int EmitScriptPostamble(Tcl_Interp* interp, Tcl_Channel chan)
+{
+    char buf[256];
+
+#if USE_CATCH_WRAPPER
+    sprintf(buf, postambleFormat, errorInfoMarker);
+#else
+    strcpy(buf, postambleFormat);
+#endif
+    if (EmitString(interp, buf, -1, '\n', chan) != TCL_OK)
+    {
+        PrependResult(interp, "error writing script postamble: ");
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LocalProcCompileProc --
+ *
+ *  This procedure is registered as the CompileProc for the "proc" command,
+ *  and is used to make a record of where in the bytecodes the calls to
+ *  "proc" have been emitted. This information is used in a post-processing
+ *  pass to compile the procedure bodies.
+ *
+ * Results:
+ *  Returns TCL_OUT_LINE_COMPILE, to make the compiler create non-inline code.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int LocalProcCompileProc(Tcl_Interp* interp, Tcl_Parse* parsePtr, Command* cmdPtr, struct CompileEnv* compEnvPtr)
+{
+    AppendInstLocList(interp, compEnvPtr);
+    return TCL_ERROR;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LocalIfCompileProc --
+ *
+ *  This procedure is registered as the CompileProc for the "if" command
+ *  while compiling with -define. In each braced condition, the references
+ *  to the declared constants are replaced with their values (see
+ *  SubstituteDefines). A condition that becomes constant is evaluated now,
+ *  and is compiled as "1" or "0", so that the original CompileProc
+ *  compiles the taken arm without a test and drops the dead ones; any
+ *  other condition is compiled from the substituted text, which at least
+ *  saves the variable reads. The original CompileProc is given a private
+ *  copy of the parse, whose condition tokens point to the substituted
+ *  text; the tokens of the caller are left alone.
+ *
+ * Results:
+ *  Returns the result of the original CompileProc.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int LocalIfCompileProc(Tcl_Interp* interp, Tcl_Parse* parsePtr, Command* cmdPtr, struct CompileEnv* compEnvPtr)
+{
+    CompilerContext* ctxPtr = CompilerGetContext(interp);
+    Tcl_Parse* foldedPtr = NULL;
+    Tcl_Token *tokenPtr, *condPtr;
+    Tcl_Obj** exprObjPtr;
+    Tcl_Size wordIdx, i, length, numFolded = 0;
+    Tcl_InterpState state;
+    int boolValue, isConstant, result;
+    int expectCond = 1, expectBody = 0;
+
+    if (!ctxPtr->savedIfCompileProc)
+    {
+        return TCL_ERROR;
+    }
+
+    exprObjPtr = (Tcl_Obj**)CmpAlloc(parsePtr->numWords * sizeof(Tcl_Obj*));
+
+    /*
+     * Walk the "cond ?then? body ?elseif cond ?then? body ...?" words,
+     * stopping at "else" or at a trailing body.
+     */
+
+    tokenPtr = TokenAfter(parsePtr->tokenPtr);
+    for (wordIdx = 1; wordIdx < parsePtr->numWords; wordIdx++, tokenPtr = TokenAfter(tokenPtr))
+    {
+        int isSimple = (tokenPtr->type == TCL_TOKEN_SIMPLE_WORD);
+
+        if (expectCond)
+        {
+            if (isSimple &&
+                (SubstituteDefines(ctxPtr->definesPtr, tokenPtr[1].start, tokenPtr[1].size, &exprObjPtr[numFolded], &isConstant) > 0))
+            {
+                state = Tcl_SaveInterpState(interp, TCL_OK);
+                if (isConstant && (Tcl_ExprBooleanObj(interp, exprObjPtr[numFolded], &boolValue) == TCL_OK))
+                {
+                    Tcl_DecrRefCount(exprObjPtr[numFolded]);
+                    exprObjPtr[numFolded] = Tcl_NewStringObj(boolValue ? "1" : "0", 1);
+                    Tcl_IncrRefCount(exprObjPtr[numFolded]);
+                }
+                Tcl_RestoreInterpState(interp, state);
+
+                if (!foldedPtr)
+                {
+                    foldedPtr = (Tcl_Parse*)CmpAlloc(sizeof(Tcl_Parse));
+                    memcpy(foldedPtr, parsePtr, sizeof(Tcl_Parse));
+                    foldedPtr->tokenPtr = (Tcl_Token*)CmpAlloc(parsePtr->numTokens * sizeof(Tcl_Token));
+                    memcpy(foldedPtr->tokenPtr, parsePtr->tokenPtr, parsePtr->numTokens * sizeof(Tcl_Token));
+                    foldedPtr->tokensAvailable = parsePtr->numTokens;
+                }
+                condPtr = foldedPtr->tokenPtr + (tokenPtr - parsePtr->tokenPtr) + 1;
+                condPtr->start = Tcl_GetStringFromObj(exprObjPtr[numFolded], &length);
+                condPtr->size = length;
+                numFolded++;
+            }
+            expectCond = 0;
+            expectBody = 1;
+        }
+        else if (expectBody)
+        {
+            if (isSimple && (tokenPtr[1].size == 4) && (strncmp(tokenPtr[1].start, "then", 4) == 0))
+            {
+                continue;
+            }
+            expectBody = 0;
+        }
+        else if (isSimple && (tokenPtr[1].size == 6) && (strncmp(tokenPtr[1].start, "elseif", 6) == 0))
+        {
+            expectCond = 1;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    result = ctxPtr->savedIfCompileProc(interp, foldedPtr ? foldedPtr : parsePtr, cmdPtr, compEnvPtr);
+
+    for (i = 0; i < numFolded; i++)
+    {
+        Tcl_DecrRefCount(exprObjPtr[i]);
+    }
+    if (foldedPtr)
+    {
+        CmpFree(foldedPtr->tokenPtr);
+        CmpFree(foldedPtr);
+    }
+    CmpFree(exprObjPtr);
+
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SubstituteDefines --
+ *
+ *  Replaces every reference of the form $::NAME or ${::NAME} to a variable
+ *  declared with -define in the text of an expression with the value of
+ *  the variable. Text containing braces, brackets, quotes or backslashes is
+ *  left alone, since a reference there may not be a substitution, or may
+ *  be evaluated in a different context.
+ *  The substituted expression is constant if what is left consists solely
+ *  of numbers, whitespace and expression operators, so that evaluating it
+ *  cannot have side effects.
+ *
+ * Results:
+ *  Returns the number of references replaced. If it is greater than 0,
+ *  *exprPtrPtr holds the substituted expression with a reference count of
+ *  1 and *isConstantPtr tells whether it is constant.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int SubstituteDefines(Tcl_Obj* definesPtr, const char* bytes, Tcl_Size length, Tcl_Obj** exprPtrPtr, int* isConstantPtr)
+{
+    const char* end = bytes + length;
+    const char *p, *nameStart, *nameEnd;
+    Tcl_Obj *exprPtr, *namePtr, *valuePtr;
+    int braced, numReplaced = 0, isConstant = 1;
+
+    exprPtr = Tcl_NewObj();
+    Tcl_IncrRefCount(exprPtr);
+
+    for (p = bytes; p < end;)
+    {
+        if (*p == '$')
+        {
+            /*
+             * Find the extent of the variable name, and look it up if it is
+             * fully qualified.
+             */
+
+            braced = ((p + 1 < end) && (p[1] == '{'));
+            nameStart = p + 1 + braced;
+            for (nameEnd = nameStart; nameEnd < end; nameEnd++)
+            {
+                if (braced ? (*nameEnd == '}') : !(isalnum(UCHAR(*nameEnd)) || (*nameEnd == '_') || (*nameEnd == ':')))
+                {
+                    break;
+                }
+            }
+
+            valuePtr = NULL;
+            if ((nameEnd - nameStart > 2) && (nameStart[0] == ':') && (nameStart[1] == ':'))
+            {
+                namePtr = Tcl_NewStringObj(nameStart + 2, nameEnd - nameStart - 2);
+                Tcl_IncrRefCount(namePtr);
+                Tcl_DictObjGet(NULL, definesPtr, namePtr, &valuePtr);
+                Tcl_DecrRefCount(namePtr);
+            }
+
+            if (valuePtr)
+            {
+                Tcl_AppendToObj(exprPtr, " ", 1);
+                Tcl_AppendObjToObj(exprPtr, valuePtr);
+                Tcl_AppendToObj(exprPtr, " ", 1);
+                numReplaced++;
+            }
+            else
+            {
+                Tcl_AppendToObj(exprPtr, p, (nameEnd + braced) - p);
+                isConstant = 0;
+            }
+            p = nameEnd + braced;
+            continue;
+        }
+
+        if (strchr("{}[]\"\\", *p))
+        {
+            numReplaced = 0;
+            break;
+        }
+        if (!isdigit(UCHAR(*p)) && !isspace(UCHAR(*p)) && !strchr(".eE+-*/%!<>=&|()~^?:", *p))
+        {
+            isConstant = 0;
+        }
+        Tcl_AppendToObj(exprPtr, p, 1);
+        p++;
+    }
+
+    if (numReplaced == 0)
+    {
+        Tcl_DecrRefCount(exprPtr);
+        return 0;
+    }
+
+    *exprPtrPtr = exprPtr;
+    *isConstantPtr = isConstant;
+    return numReplaced;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LocalStripCompileProc --
+ *
+ *  This procedure is registered as the CompileProc for the commands listed
+ *  with the -strip flag. It compiles an invocation of the command to a push
+ *  of the empty string, so that neither the command nor the substitutions
+ *  in its arguments are evaluated at runtime.
+ *
+ *  The core only calls it for the invocations it compiles, with the name
+ *  of the command as a literal word. The bodies of foreach, lmap and dict
+ *  for at the top level are not compiled by Tcl 8.6 outside of a procedure
+ *  and are compiled at runtime, when the procedure is no longer registered,
+ *  and {*}log or $cmd invocations are resolved at runtime: all of these
+ *  still call the command.
+ *
+ * Results:
+ *  Returns TCL_OK.
+ *
+ * Side effects:
+ *  Emits the push instruction.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int LocalStripCompileProc(Tcl_Interp* interp, Tcl_Parse* parsePtr, Command* cmdPtr, struct CompileEnv* compEnvPtr)
+{
+    Tcl_Size index = TclRegisterLiteral(compEnvPtr, (char*)"", 0, 0);
+
+    /*
+     * The TclEmitPush macro refers to the instruction table, which is not
+     * exported by the core, so the instruction is emitted by hand.
+     */
+
+    while ((compEnvPtr->codeNext + 5) > compEnvPtr->codeEnd)
+    {
+        TclExpandCodeArray(compEnvPtr);
+    }
+    if (index <= 255)
+    {
+        *compEnvPtr->codeNext++ = INST_PUSH1;
+        *compEnvPtr->codeNext++ = (unsigned char)index;
+    }
+    else
+    {
+        *compEnvPtr->codeNext++ = INST_PUSH4;
+        TclStoreInt4AtPtr(index, compEnvPtr->codeNext);
+        compEnvPtr->codeNext += 4;
+    }
+
+    compEnvPtr->currStackDepth++;
+    if (compEnvPtr->currStackDepth > compEnvPtr->maxStackDepth)
+    {
+        compEnvPtr->maxStackDepth = compEnvPtr->currStackDepth;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * OverrideIfCommand --
+ *
+ *  Installs LocalIfCompileProc as the CompileProc of the "if" command of
+ *  interp, to fold the conditions on the constants declared with -define.
+ *  The override is recorded like those of OverrideStrippedCommands, so
+ *  that RestoreStrippedCommands undoes them all, in reverse order, even
+ *  if "if" is also listed with -strip.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Adds to the strippedPtr array of the context, and sets its
+ *  savedIfCompileProc.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void OverrideIfCommand(Tcl_Interp* interp, CompilerContext* ctxPtr)
+{
+    Command* ifCmdPtr = (Command*)Tcl_FindCommand(interp, "if", (Tcl_Namespace*)NULL, TCL_GLOBAL_ONLY);
+    StrippedCmd* strippedPtr;
+
+    if (!ifCmdPtr || !ifCmdPtr->compileProc)
+    {
+        return;
+    }
+
+    ctxPtr->strippedPtr =
+        (StrippedCmd*)Tcl_Realloc((char*)ctxPtr->strippedPtr, (ctxPtr->numStripped + 1) * sizeof(StrippedCmd));
+    strippedPtr = &ctxPtr->strippedPtr[ctxPtr->numStripped++];
+    strippedPtr->cmdPtr = ifCmdPtr;
+    strippedPtr->savedCompileProc = ifCmdPtr->compileProc;
+    strippedPtr->isTemporary = 0;
+    strippedPtr->nsNamePtr = NULL;
+
+    ctxPtr->savedIfCompileProc = ifCmdPtr->compileProc;
+    ifCmdPtr->compileProc = LocalIfCompileProc;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * OverrideStrippedCommands --
+ *
+ *  Installs LocalStripCompileProc as the CompileProc of each of the
+ *  commands listed with -strip. The commands that do not exist in the
+ *  compiling interpreter, typically because they are defined by a package
+ *  that the compiled script loads, are created for the duration of the
+ *  compilation, since the compiler only calls the CompileProc of known
+ *  commands. Unqualified names are taken as global.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Adds to the strippedPtr array of the context, which
+ *  RestoreStrippedCommands uses to undo the changes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void OverrideStrippedCommands(Tcl_Interp* interp, CompilerContext* ctxPtr)
+{
+    Tcl_Obj** elemPtrs;
+    Tcl_Size numElems, i;
+    StrippedCmd* strippedPtr;
+    Tcl_DString ds;
+    const char *name, *p;
+
+    if (Tcl_ListObjGetElements(NULL, ctxPtr->stripPtr, &numElems, &elemPtrs) != TCL_OK || (numElems == 0))
+    {
+        return;
+    }
+
+    ctxPtr->strippedPtr =
+        (StrippedCmd*)Tcl_Realloc((char*)ctxPtr->strippedPtr, (ctxPtr->numStripped + numElems) * sizeof(StrippedCmd));
+    Tcl_DStringInit(&ds);
+
+    for (i = 0; i < numElems; i++)
+    {
+        strippedPtr = &ctxPtr->strippedPtr[ctxPtr->numStripped];
+        name = Tcl_GetString(elemPtrs[i]);
+        if (*name == '\0')
+        {
+            continue;
+        }
+
+        strippedPtr->isTemporary = 0;
+        strippedPtr->nsNamePtr = NULL;
+        strippedPtr->cmdPtr = (Command*)Tcl_FindCommand(interp, name, (Tcl_Namespace*)NULL, TCL_GLOBAL_ONLY);
+
+        if (!strippedPtr->cmdPtr)
+        {
+            /*
+             * Remember the outermost namespace in the qualified name that
+             * does not exist yet, since creating the command creates it.
+             */
+
+            Tcl_DStringSetLength(&ds, 0);
+            if ((name[0] != ':') || (name[1] != ':'))
+            {
+                Tcl_DStringAppend(&ds, "::", 2);
+            }
+            Tcl_DStringAppend(&ds, name, -1);
+            name = Tcl_DStringValue(&ds);
+
+            for (p = name + 2; (p = strstr(p, "::")) != NULL; p += 2)
+            {
+                Tcl_Obj* nsNamePtr = Tcl_NewStringObj(name, p - name);
+
+                Tcl_IncrRefCount(nsNamePtr);
+                if (!Tcl_FindNamespace(interp, Tcl_GetString(nsNamePtr), (Tcl_Namespace*)NULL, TCL_GLOBAL_ONLY))
+                {
+                    strippedPtr->nsNamePtr = nsNamePtr;
+                    break;
+                }
+                Tcl_DecrRefCount(nsNamePtr);
+            }
+
+            strippedPtr->cmdPtr =
+                (Command*)Tcl_CreateObjCommand(interp, name, StripPlaceholderObjCmd, (void*)NULL, (Tcl_CmdDeleteProc*)NULL);
+            strippedPtr->isTemporary = 1;
+        }
+
+        strippedPtr->savedCompileProc = strippedPtr->cmdPtr->compileProc;
+        strippedPtr->cmdPtr->compileProc = LocalStripCompileProc;
+        ctxPtr->numStripped++;
+    }
+
+    Tcl_DStringFree(&ds);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RestoreStrippedCommands --
+ *
+ *  Undoes the changes made by OverrideIfCommand and
+ *  OverrideStrippedCommands, in reverse order so that commands overridden
+ *  more than once get their original CompileProc back.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Restores the CompileProcs, deletes the temporary commands and
+ *  namespaces, and frees the strippedPtr array of the context.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void RestoreStrippedCommands(Tcl_Interp* interp, CompilerContext* ctxPtr)
+{
+    StrippedCmd* strippedPtr;
+    Tcl_Namespace* nsPtr;
+    Tcl_Size i;
+
+    for (i = ctxPtr->numStripped - 1; i >= 0; i--)
+    {
+        strippedPtr = &ctxPtr->strippedPtr[i];
+        strippedPtr->cmdPtr->compileProc = strippedPtr->savedCompileProc;
+
+        /*
+         * The temporary commands no longer have a CompileProc when they are
+         * deleted, so that the deletion does not bump the compile epoch and
+         * invalidate the bytecodes just produced.
+         */
+
+        if (strippedPtr->isTemporary)
+        {
+            Tcl_DeleteCommandFromToken(interp, (Tcl_Command)strippedPtr->cmdPtr);
+        }
+        if (strippedPtr->nsNamePtr)
+        {
+            nsPtr = Tcl_FindNamespace(interp, Tcl_GetString(strippedPtr->nsNamePtr), (Tcl_Namespace*)NULL, TCL_GLOBAL_ONLY);
+            if (nsPtr)
+            {
+                Tcl_DeleteNamespace(nsPtr);
+            }
+            Tcl_DecrRefCount(strippedPtr->nsNamePtr);
+        }
+    }
+
+    if (ctxPtr->strippedPtr)
+    {
+        Tcl_Free((char*)ctxPtr->strippedPtr);
+    }
+    ctxPtr->strippedPtr = NULL;
+    ctxPtr->numStripped = 0;
+    ctxPtr->savedIfCompileProc = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StripPlaceholderObjCmd --
+ *
+ *  The command procedure of the temporary commands created by
+ *  OverrideStrippedCommands. It is never called, since the invocations of
+ *  these commands are compiled away.
+ *
+ * Results:
+ *  Returns TCL_OK.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int StripPlaceholderObjCmd(void* dummy, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+{
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompilerInit --
+ *
+ *  Initializes the internal structures used by the Compiler package.
+ *  Must be called before the public interfaces to the Compiler package;
+ *  this is done typically in the package registration proc (Compiler_Init).
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Initializes a number of internal data structures used by the Compiler
+ *  implementation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void CompilerInit(Tcl_Interp* interp)
+{
+    CompilerContext* ctxPtr;
+
+    /*
+     * Initialize the local copies of pointers to some built-in object types.
+     * We need to do it because the built-in types are not exported by the
+     * windows Tcl DLL.
+     */
+
+    InitTypes();
+
+    /*
+     * Create the compiler context structure and attach it to the interp
+     */
+
+    ctxPtr = (CompilerContext*)Tcl_Alloc(sizeof(CompilerContext));
+    Tcl_SetAssocData(interp, CMP_ASSOC_KEY, CleanCompilerContext, (void*)ctxPtr);
+    ctxPtr->ppi = (PostProcessInfo*)NULL;
+    ctxPtr->numProcs = 0;
+    ctxPtr->numCompiledBodies = 0;
+    ctxPtr->numUnsharedBodies = 0;
+    ctxPtr->numUnshares = 0;
+    ctxPtr->numClonedBodies = 0;
+    ctxPtr->definesPtr = NULL;
+    ctxPtr->savedIfCompileProc = NULL;
+    ctxPtr->stripPtr = NULL;
+    ctxPtr->strippedPtr = NULL;
+    ctxPtr->numStripped = 0;
+    memset(&ctxPtr->stats, 0, sizeof(CompilerStats));
+    ctxPtr->analysisPtr = NULL;
+    ctxPtr->analysisNamePtr = NULL;
+    ctxPtr->disassemblyPtr = NULL;
+    ctxPtr->profilePtr = NULL;
+    ctxPtr->scriptName = NULL;
+    ctxPtr->reportPtr = NULL;
+    ctxPtr->tracePtr = NULL;
+    ctxPtr->verifyPtr = NULL;
+    ctxPtr->chunkSize = 0;
+    ctxPtr->firstLine = 1;
+    ctxPtr->firstCommand = 0;
+    ctxPtr->costsPtr = NULL;
+    ctxPtr->numCosts = 0;
+    ctxPtr->costsSize = 0;
+    ctxPtr->dummyCounter = 1;
+    ctxPtr->channelCounter = 0;
+    ctxPtr->formatVersion = CMP_FORMAT_VERSION;
+    memset(&ctxPtr->pool, 0, sizeof(CompilerPool));
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CleanCompilerContext --
+ *
+ *  Cleans up the compiler context.
+ *  Frees the post-processing info if any is present and the buffer pool,
+ *  then frees the context struct itself.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  See above.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void CleanCompilerContext(void* clientData, Tcl_Interp* interp)
+{
+    CompilerContext* ctxPtr = (CompilerContext*)clientData;
+
+    FreePostProcessInfo(ctxPtr->ppi);
+    if (ctxPtr->definesPtr)
+    {
+        Tcl_DecrRefCount(ctxPtr->definesPtr);
+    }
+    FreeCompileCosts(ctxPtr);
+    FreeCompilerPool(&ctxPtr->pool);
+    Tcl_Free((char*)ctxPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompilerGetContext --
+ *
+ *  Returns a pointer to the CompilerContext struct for the given interp.
+ *
+ * Results:
+ *  See above.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+CompilerContext* CompilerGetContext(Tcl_Interp* interp)
+{
+    CompilerContext* ctxPtr = (CompilerContext*)Tcl_GetAssocData(interp, CMP_ASSOC_KEY, NULL);
+
+    if (!ctxPtr)
+    {
+        Tcl_Panic("unregistered compiler context!");
+    }
+
+    return ctxPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InitCompilerContext --
+ *
+ *  Initializes the compiler context for a given interpreter.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Allocates the PostProcessInfo on the first compilation; the following
+ *  ones reuse it.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void InitCompilerContext(Tcl_Interp* interp)
+{
+    CompilerContext* ctxPtr = CompilerGetContext(interp);
+
+    if (!ctxPtr->ppi)
+    {
+        ctxPtr->ppi = CreatePostProcessInfo();
+    }
+    ctxPtr->numProcs = 0;
+    ctxPtr->numCompiledBodies = 0;
+    ctxPtr->numUnsharedBodies = 0;
+    ctxPtr->numUnshares = 0;
+    ctxPtr->numClonedBodies = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReleaseCompilerContext --
+ *
+ *  Resets the post-processing info associated with the compiler context,
+ *  for the next compilation.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void ReleaseCompilerContext(Tcl_Interp* interp)
+{
+    ResetPostProcessInfo(CompilerGetContext(interp)->ppi);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CmpAlloc --
+ *
+ *  Allocates memory for the compiler's own structures and buffers, and
+ *  counts it in the MemoryCounters of the thread. The block must be freed
+ *  with CmpFree.
+ *  During a compilation, the size is rounded up to its class in the
+ *  CompilerPool of the interpreter, and a block of that class left by an
+ *  earlier CmpFree is reused if there is one.
+ *
+ * Results:
+ *  Returns the block.
+ *
+ * Side effects:
+ *  Updates the MemoryCounters.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void* CmpAlloc(size_t size)
+{
+    MemoryCounters* countersPtr = GetMemoryCounters();
+    CompilerPool* poolPtr = countersPtr->poolPtr;
+    AllocHeader* headerPtr = NULL;
+    int sizeClass;
+
+    if (poolPtr && (size <= ((size_t)1 << (CMP_POOL_MIN_SHIFT + CMP_POOL_NUM_CLASSES - 1))))
+    {
+        for (sizeClass = 0; ((size_t)1 << (CMP_POOL_MIN_SHIFT + sizeClass)) < size; sizeClass++)
+        {
+        }
+        size = (size_t)1 << (CMP_POOL_MIN_SHIFT + sizeClass);
+        headerPtr = (AllocHeader*)poolPtr->freeBlocks[sizeClass];
+        if (headerPtr)
+        {
+            poolPtr->freeBlocks[sizeClass] = *(void**)(headerPtr + 1);
+            poolPtr->pooledBytes -= size;
+            countersPtr->reused += size;
+        }
+    }
+    if (!headerPtr)
+    {
+        headerPtr = (AllocHeader*)Tcl_Alloc(sizeof(AllocHeader) + size);
+        countersPtr->allocated += size;
+    }
+
+    headerPtr->size = size;
+    countersPtr->live += size;
+    if (countersPtr->live > countersPtr->peak)
+    {
+        countersPtr->peak = countersPtr->live;
+    }
+
+    return headerPtr + 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CmpFree --
+ *
+ *  Frees a block allocated with CmpAlloc. During a compilation, a block
+ *  of one of the size classes of the CompilerPool goes to the pool instead,
+ *  as long as the pool holds less than CMP_POOL_MAX_BYTES.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Updates the MemoryCounters.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void CmpFree(void* ptr)
+{
+    MemoryCounters* countersPtr = GetMemoryCounters();
+    CompilerPool* poolPtr = countersPtr->poolPtr;
+    AllocHeader* headerPtr = (AllocHeader*)ptr - 1;
+    size_t size = headerPtr->size;
+    int sizeClass;
+
+    countersPtr->live -= size;
+    if (poolPtr && (poolPtr->pooledBytes + (Tcl_WideInt)size <= CMP_POOL_MAX_BYTES))
+    {
+        for (sizeClass = 0; sizeClass < CMP_POOL_NUM_CLASSES; sizeClass++)
+        {
+            if (size == ((size_t)1 << (CMP_POOL_MIN_SHIFT + sizeClass)))
+            {
+                *(void**)ptr = poolPtr->freeBlocks[sizeClass];
+                poolPtr->freeBlocks[sizeClass] = headerPtr;
+                poolPtr->pooledBytes += size;
+                return;
+            }
+        }
+    }
+    Tcl_Free((char*)headerPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreeCompilerPool --
+ *
+ *  Frees the buffers kept in a CompilerPool.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Empties the pool.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void FreeCompilerPool(CompilerPool* poolPtr)
+{
+    void* blockPtr;
+    int sizeClass;
+
+    for (sizeClass = 0; sizeClass < CMP_POOL_NUM_CLASSES; sizeClass++)
+    {
+        while ((blockPtr = poolPtr->freeBlocks[sizeClass]) != NULL)
+        {
+            poolPtr->freeBlocks[sizeClass] = *(void**)((AllocHeader*)blockPtr + 1);
+            Tcl_Free((char*)blockPtr);
+        }
+    }
+    poolPtr->pooledBytes = 0;
+    if (poolPtr->literalBuckets)
+    {
+        Tcl_Free((char*)poolPtr->literalBuckets);
+        poolPtr->literalBuckets = NULL;
+        poolPtr->numLiteralBuckets = 0;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetMemoryCounters --
+ *
+ *  Returns the MemoryCounters of the current thread.
+ *
+ * Results:
+ *  See above.
+ *
+ * Side effects:
+ *  Creates the counters, zeroed, on the first call in a thread.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static MemoryCounters* GetMemoryCounters(void)
+{
+    return (MemoryCounters*)Tcl_GetThreadData(&memoryCountersKey, sizeof(MemoryCounters));
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StartMemoryAccounting --
+ *
+ *  Starts the memory accounting of a compilation: saves the counters in
+ *  *markPtr, and restarts the peak. Until
+ *  FinishMemoryAccounting, CmpAlloc and CmpFree use the CompilerPool of
+ *  the context.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Resets the peak of the MemoryCounters.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void StartMemoryAccounting(CompilerContext* ctxPtr, MemoryMark* markPtr)
+{
+    MemoryCounters* countersPtr = GetMemoryCounters();
+
+    countersPtr->peak = countersPtr->live;
+    markPtr->allocated = countersPtr->allocated;
+    markPtr->reused = countersPtr->reused;
+    markPtr->live = countersPtr->live;
+    markPtr->poolPtr = countersPtr->poolPtr;
+    countersPtr->poolPtr = &ctxPtr->pool;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FinishMemoryAccounting --
+ *
+ *  Ends the memory accounting of a compilation started with
+ *  StartMemoryAccounting, and adds it to the statistics. The literal
+ *  copies made during the compilation stop being counted as live.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Updates the statistics of the compiler context.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void FinishMemoryAccounting(CompilerContext* ctxPtr, const MemoryMark* markPtr)
+{
+    MemoryCounters* countersPtr = GetMemoryCounters();
+
+    ctxPtr->stats.allocBytes += countersPtr->allocated - markPtr->allocated;
+    ctxPtr->stats.reusedBytes += countersPtr->reused - markPtr->reused;
+    if (countersPtr->peak - markPtr->live > ctxPtr->stats.peakBytes)
+    {
+        ctxPtr->stats.peakBytes = countersPtr->peak - markPtr->live;
+    }
+    countersPtr->live -= countersPtr->transient;
+    countersPtr->transient = 0;
+    countersPtr->poolPtr = markPtr->poolPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ResidentSetSize --
+ *
+ *  Returns the resident set size of the process.
+ *
+ * Results:
+ *  The size in bytes, or -1 if it cannot be obtained on this platform.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_WideInt ResidentSetSize(void)
+{
+#ifdef __linux__
+    FILE* filePtr = fopen("/proc/self/statm", "r");
+    long size, resident;
+    int numRead;
+
+    if (!filePtr)
+    {
+        return -1;
+    }
+    numRead = fscanf(filePtr, "%ld %ld", &size, &resident);
+    fclose(filePtr);
+    return (numRead == 2) ? (Tcl_WideInt)resident * sysconf(_SC_PAGESIZE) : -1;
+#else
+    return -1;
+#endif
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CreateInstLocList --
+ *
+ *  Creates a InstLocList struct.
+ *
+ * Results:
+ *  Returns a Tcl_Alloc'ed InstLocList, initialized with the next field set to
+ *  0, and the bytecodeOffset to the given value..
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static InstLocList* CreateInstLocList(CompileEnv* envPtr)
+{
+    InstLocList* listPtr = (InstLocList*)CmpAlloc(sizeof(struct InstLocList));
+    listPtr->next = (InstLocList*)NULL;
+    listPtr->bytecodeOffset = envPtr->codeNext - envPtr->codeStart;
+    listPtr->commandIndex = envPtr->numCommands - 1;
+    if ((listPtr->bytecodeOffset >= 9) && (INST_START_CMD == *(envPtr->codeNext - 9)) &&
+        (listPtr->bytecodeOffset - 9 >= envPtr->cmdMapPtr[listPtr->commandIndex].codeOffset))
+    {
+        /*
+         * Tcl 8.5 core. Did emit an INST_START_CMD instruction. This
+         * instruction goes away again due to us forcing the outline
+         * compile in our caller (LocalProcCompileProc), so we have to
+         * adjust the remembered offset. Irrelevant for the first
+         * command (offset 0).
+         * An INST_START_CMD before the start of the "proc" command belongs
+         * to an enclosing command, such as an "if" whose body starts with
+         * the "proc", and stays.
+         *
+         * 9 = 1byte ISC opcode + 2 4byte ISC operands.
+         */
+        listPtr->bytecodeOffset -= 9;
+    }
+    return listPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CreatePostProcessInfo --
+ *
+ *  Creates a PostProcessInfo struct.
+ *
+ * Results:
+ *  Returns a Tcl_Alloc'ed InstLocList, initialized with the list field set to
+ *  0, and the numProcs field set to 0.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static PostProcessInfo* CreatePostProcessInfo()
+{
+    PostProcessInfo* infoPtr = (PostProcessInfo*)CmpAlloc(sizeof(PostProcessInfo));
+    infoPtr->procs = (InstLocList*)NULL;
+    infoPtr->numProcs = 0;
+    Tcl_InitHashTable(&infoPtr->objTable, TCL_ONE_WORD_KEYS);
+    Tcl_InitHashTable(&infoPtr->bodyTable, sizeof(ProcBodyKey) / sizeof(int));
+    infoPtr->infoArrayPtr = (ProcBodyInfo**)NULL;
+    infoPtr->numUnshares = 0;
+    infoPtr->numCompiledBodies = 0;
+    infoPtr->numClonedBodies = 0;
+
+    return infoPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreePostProcessInfo --
+ *
+ *  Frees all entries in the proc location list, then the info itself.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void FreePostProcessInfo(PostProcessInfo* infoPtr)
+{
+    if (infoPtr)
+    {
+        ResetPostProcessInfo(infoPtr);
+
+        Tcl_DeleteHashTable(&infoPtr->objTable);
+        Tcl_DeleteHashTable(&infoPtr->bodyTable);
+
+        CmpFree(infoPtr);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ResetPostProcessInfo --
+ *
+ *  Empties a PostProcessInfo at the end of a compilation: frees the proc
+ *  location list, the ProcBodyInfo array and the entries of the hash
+ *  tables, which keep their buckets for the next compilation.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void ResetPostProcessInfo(PostProcessInfo* infoPtr)
+{
+    InstLocList* nextPtr;
+    InstLocList* listPtr;
+    Tcl_HashSearch search;
+    Tcl_HashEntry* entryPtr;
+
+    for (listPtr = infoPtr->procs; listPtr; listPtr = nextPtr)
+    {
+        nextPtr = listPtr->next;
+        CmpFree(listPtr);
+    }
+    infoPtr->procs = (InstLocList*)NULL;
+    infoPtr->numProcs = 0;
+
+    FreeProcBodyInfoArray(infoPtr);
+    CleanObjRefInfoTable(infoPtr);
+    for (entryPtr = Tcl_FirstHashEntry(&infoPtr->bodyTable, &search); entryPtr; entryPtr = Tcl_NextHashEntry(&search))
+    {
+        Tcl_DeleteHashEntry(entryPtr);
+    }
+
+    infoPtr->numUnshares = 0;
+    infoPtr->numCompiledBodies = 0;
+    infoPtr->numClonedBodies = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendInstLocList --
+ *
+ *  Appends the given bytecode offset to the proc location list for a given
+ *  interpreter.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void AppendInstLocList(Tcl_Interp* interp, CompileEnv* compEnvPtr)
+{
+    CompilerContext* ctxPtr = CompilerGetContext(interp);
+    PostProcessInfo* infoPtr = ctxPtr->ppi;
+    InstLocList* newPtr = CreateInstLocList(compEnvPtr);
+    InstLocList* listPtr = infoPtr->procs;
+
+    if (listPtr)
+    {
+        while (listPtr->next)
+        {
+            listPtr = listPtr->next;
+        }
+        listPtr->next = newPtr;
+    }
+    else
+    {
+        infoPtr->procs = newPtr;
+    }
+
+    infoPtr->numProcs += 1;
+    ctxPtr->numProcs += 1;
+}
+
+/*
+ *-----------------------------------------------------------------------
+ *
+ * CompileObject --
+ *
+ *  Lifted from SetByteCodeFromAny in tclCompile.c, does pretty much the
+ *  same thing, except that it postprocesses the compiled string to also
+ *  compile any procedure bodies. It needs to have access to the compile
+ *  environment, because it may have to add objects to the list that was
+ *  created by the compiler.
+ *
+ *  The rest of this comment block comes from the SetByteCodeFromAny header.
+ *
+ *  Part of the bytecode Tcl object type implementation. Attempts to
+ *  generate an byte code internal form for the Tcl object "objPtr" by
+ *  compiling its string representation.
+ *
+ * Results:
+ *  The return value is a standard Tcl object result. If an error occurs
+ *  during compilation, an error message is left in the interpreter's
+ *  result unless "interp" is NULL.
+ *
+ * Side effects:
+ *  Frees the old internal representation. If no error occurs, then the
+ *  compiled code is stored as "objPtr"s bytecode representation.
+ *  Also, if debugging, initializes the "tcl_traceCompile" Tcl variable
+ *  used to trace compilations.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int CompileObject(Tcl_Interp* interp, Tcl_Obj* objPtr)
+{
+    int result;
+    ProcInfo info;
+    CompilerContext* ctxPtr;
+    Tcl_Time start;
+    Tcl_WideInt postProcessTime, scriptTime;
+    MemoryMark memoryMark;
+
+    /*
+     * Before starting the compile, temporarily override the Command struct
+     * for the "proc" command to use our CompileProc. This lets us trap
+     * calls to "proc" during compilation, from which we can compile the
+     * procedure bodies
+     */
+
+    info.procCmdPtr = (Command*)Tcl_FindCommand(interp, "proc", (Tcl_Namespace*)NULL, 0);
+
+    if (info.procCmdPtr)
+    {
+        /*
+         * For the time being, we don't need to make sure that this is really
+         * the builtin "proc" command because we are running the compiler from
+         * our own script in our own executable, and therefore nobody has
+         * had a chance to redefine "proc"
+         */
+
+        /*
+         * EMIL we need to save the current value somewhere where
+         * LocalProcCompileProc can find it and, if it is not 0,
+         * call it.
+         * Probably a global hash table keyed by interpreter
+         *
+         * The Command struct is that of interp, not shared with other
+         * interps, and the saved value is on this stack: compilations in
+         * other interps, in this thread or others, never see the override.
+         */
+
+        info.savedCompileProc = info.procCmdPtr->compileProc;
+        info.procCmdPtr->compileProc = LocalProcCompileProc;
+    }
+
+    /*
+     * Initialize the compiler context struct. This includes the proc location
+     * list for this interpreter; this list will be populated by the local
+     * compile proc and used later to compile the procedure bodies
+     */
+
+    ctxPtr = CompilerGetContext(interp);
+    StartMemoryAccounting(ctxPtr, &memoryMark);
+    InitCompilerContext(interp);
+
+    /*
+     * With -define, also override the CompileProc of "if" to fold the
+     * conditions that test the constants. Unlike the "proc" override, this
+     * one stays in place while the procedure bodies are compiled.
+     */
+
+    if (ctxPtr->definesPtr)
+    {
+        OverrideIfCommand(interp, ctxPtr);
+    }
+
+    if (ctxPtr->stripPtr)
+    {
+        OverrideStrippedCommands(interp, ctxPtr);
+    }
+
+    /*
+     * The time spent in PostProcessCompile is accounted separately.
+     */
+
+    postProcessTime = ctxPtr->stats.procBodyTime + ctxPtr->stats.rewriteTime;
+    Tcl_GetTime(&start);
+    result = TclSetByteCodeFromAny(interp, objPtr, PostProcessCompile, (void*)&info);
+    TraceSpan(ctxPtr, "compile", "phase", &start);
+    scriptTime = ElapsedTime(&start) - (ctxPtr->stats.procBodyTime + ctxPtr->stats.rewriteTime - postProcessTime);
+    ctxPtr->stats.compileTime += scriptTime;
+    if (result == TCL_OK)
+    {
+        RecordCompileCost(ctxPtr,
+                          ctxPtr->scriptName ? ctxPtr->scriptName : "script",
+                          0,
+                          scriptTime,
+                          (ByteCode*)objPtr->internalRep.otherValuePtr);
+    }
+
+    RestoreStrippedCommands(interp, ctxPtr);
+
+    /*
+     * Restore the "proc" command compile procedure.  This may be unnecessary
+     * since PostProcessCompile will normally restore the function, but in
+     * error cases it may never be called.
+     */
+
+    if (info.procCmdPtr)
+    {
+        info.procCmdPtr->compileProc = info.savedCompileProc;
+    }
+
+    ctxPtr->stats.numCompiles++;
+    ctxPtr->stats.numProcs += ctxPtr->numProcs;
+    ctxPtr->stats.numCompiledBodies += ctxPtr->numCompiledBodies;
+    ctxPtr->stats.numClonedBodies += ctxPtr->numClonedBodies;
+    ctxPtr->stats.numUnsharedBodies += ctxPtr->numUnsharedBodies;
+    ctxPtr->stats.numUnshares += ctxPtr->numUnshares;
+
+    ReleaseCompilerContext(interp);
+    FinishMemoryAccounting(ctxPtr, &memoryMark);
+
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PostProcessCompile --
+ *
+ *  Runs the postprocessing step on a compilation environment.
+ *
+ * Results:
+ *  A standard TCL error code.
+ *
+ * Side effects:
+ *  The various postprocessing steps may have side effects.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int PostProcessCompile(Tcl_Interp* interp, struct CompileEnv* compEnvPtr, void* clientData)
+{
+    int result;
+    ProcInfo* infoPtr = (ProcInfo*)clientData;
+    CompilerContext* ctxPtr = CompilerGetContext(interp);
+    Tcl_Time start;
+
+    /*
+     * restore the original compile proc for "proc" before we postprocess
+     * the compiled environment. If we don't, and there are procedures that
+     * call "proc" in their bodies, the numProc field in the post
+     * process info gets corrupted (it is bumped up, which makes it
+     * inconsistent with the number of process info struct stored).
+     */
+
+    if (infoPtr->procCmdPtr)
+    {
+        infoPtr->procCmdPtr->compileProc = infoPtr->savedCompileProc;
+    }
+
+    /*
+     * Compile the procedure bodies, then renumber the literals of the
+     * (possibly rewritten) top level bytecodes.
+     */
+
+    result = CompileProcBodies(interp, compEnvPtr);
+    if (result != TCL_OK)
+    {
+        return result;
+    }
+    if (ctxPtr->reportPtr)
+    {
+        ReportProcDefinitions(ctxPtr, compEnvPtr);
+    }
+
+    Tcl_GetTime(&start);
+    if (ctxPtr->profilePtr)
+    {
+        AddProfileCounters(compEnvPtr, ctxPtr->scriptName ? ctxPtr->scriptName : "script", ctxPtr->firstCommand);
+    }
+    RenumberLiterals(compEnvPtr);
+    ctxPtr->stats.rewriteTime += ElapsedTime(&start);
+    TraceSpan(ctxPtr, "rewrite", "phase", &start);
+
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PostProcessProcBody --
+ *
+ *  Runs the postprocessing step on the compilation environment of a
+ *  procedure body. This is the subset of PostProcessCompile that applies
+ *  to bodies: they contain no "proc" calls of their own to rewrite.
+ *  clientData is the name of the procedure.
+ *
+ * Results:
+ *  A standard TCL error code.
+ *
+ * Side effects:
+ *  See AddProfileCounters and RenumberLiterals.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int PostProcessProcBody(Tcl_Interp* interp, struct CompileEnv* compEnvPtr, void* clientData)
+{
+    if (CompilerGetContext(interp)->profilePtr)
+    {
+        AddProfileCounters(compEnvPtr, (const char*)clientData, 0);
+    }
+    RenumberLiterals(compEnvPtr);
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReportProcDefinitions --
+ *
+ *  Adds to the -report list the procedure definition sites of the script
+ *  being compiled, in source order. Each entry is a list of the line
+ *  number, the procedure name (empty if it is computed) and the reason
+ *  why the body was not compiled ahead of time, empty if it was.
+ *  The sites come from two sources: the "proc" calls that the compiler saw
+ *  (see LoadProcBodyInfo), and a scan of the source that also finds the
+ *  definitions in scripts that are only evaluated at run time, such as
+ *  "namespace eval" scripts and procedure bodies (see
+ *  FindProcDefinitions).
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Appends to ctxPtr->reportPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void ReportProcDefinitions(CompilerContext* ctxPtr, CompileEnv* compEnvPtr)
+{
+    const char* source = compEnvPtr->source;
+    Tcl_HashTable siteTable;
+    Tcl_HashSearch search;
+    Tcl_HashEntry* entryPtr;
+    ProcBodyInfo** infoArrayPtr;
+    ProcSite **sitesPtr, *sitePtr;
+    Tcl_Size numSites, offset, i, line;
+    Tcl_Obj* recordPtr;
+    const char* p;
+    int isNew;
+
+    Tcl_InitHashTable(&siteTable, TCL_ONE_WORD_KEYS);
+    FindProcDefinitions(&siteTable, source, source, compEnvPtr->numSrcBytes, NULL, 0, 0);
+
+    /*
+     * The compiler's verdict replaces the one of the scan.
+     */
+
+    if (ctxPtr->ppi && ctxPtr->ppi->infoArrayPtr)
+    {
+        for (infoArrayPtr = ctxPtr->ppi->infoArrayPtr; *infoArrayPtr; infoArrayPtr++)
+        {
+            offset = compEnvPtr->cmdMapPtr[(*infoArrayPtr)->commandIndex].srcOffset;
+            entryPtr = Tcl_CreateHashEntry(&siteTable, (char*)SIZE2PTR(offset), &isNew);
+            if (isNew)
+            {
+                sitePtr = (ProcSite*)CmpAlloc(sizeof(ProcSite));
+                sitePtr->offset = offset;
+                sitePtr->namePtr = NULL;
+                Tcl_SetHashValue(entryPtr, sitePtr);
+            }
+            else
+            {
+                sitePtr = (ProcSite*)Tcl_GetHashValue(entryPtr);
+                Tcl_DecrRefCount(sitePtr->namePtr);
+            }
+            sitePtr->namePtr = ParseProcCall(source + offset,
+                                             compEnvPtr->cmdMapPtr[(*infoArrayPtr)->commandIndex].numSrcBytes,
+                                             &sitePtr->reason);
+            Tcl_IncrRefCount(sitePtr->namePtr);
+            if ((*infoArrayPtr)->bodyNewIndex != -1)
+            {
+                sitePtr->reason = NULL;
+            }
+            else if (!sitePtr->reason)
+            {
+                sitePtr->reason = "the call does not have the expected form";
+            }
+        }
+    }
+
+    /*
+     * Sort the sites by offset, and convert the offsets to line numbers.
+     */
+
+    numSites = siteTable.numEntries;
+    sitesPtr = (ProcSite**)CmpAlloc((numSites + 1) * sizeof(ProcSite*));
+    for (i = 0, entryPtr = Tcl_FirstHashEntry(&siteTable, &search); entryPtr; entryPtr = Tcl_NextHashEntry(&search))
+    {
+        sitesPtr[i++] = (ProcSite*)Tcl_GetHashValue(entryPtr);
+    }
+    qsort(sitesPtr, numSites, sizeof(ProcSite*), CompareProcSites);
+
+    line = ctxPtr->firstLine;
+    p = source;
+    for (i = 0; i < numSites; i++)
+    {
+        sitePtr = sitesPtr[i];
+        for (; p < source + sitePtr->offset; p++)
+        {
+            if (*p == '\n')
+            {
+                line++;
+            }
+        }
+        recordPtr = Tcl_NewListObj(0, NULL);
+        Tcl_ListObjAppendElement(NULL, recordPtr, Tcl_NewWideIntObj(line));
+        Tcl_ListObjAppendElement(NULL, recordPtr, sitePtr->namePtr);
+        Tcl_ListObjAppendElement(NULL, recordPtr, Tcl_NewStringObj(sitePtr->reason ? sitePtr->reason : "", -1));
+        Tcl_ListObjAppendElement(NULL, ctxPtr->reportPtr, recordPtr);
+
+        Tcl_DecrRefCount(sitePtr->namePtr);
+        CmpFree(sitePtr);
+    }
+
+    CmpFree(sitesPtr);
+    Tcl_DeleteHashTable(&siteTable);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FindProcDefinitions --
+ *
+ *  Scans a script for "proc" commands, and adds a ProcSite for each of
+ *  them to sitesPtr, keyed by its offset in source. The scan descends
+ *  into the literal words of the commands that take scripts: those that
+ *  are compiled inline, which keep the context of the enclosing script,
+ *  and those whose scripts are only evaluated at run time ("eval",
+ *  "namespace eval", "time", "uplevel" and procedure bodies), whose name
+ *  becomes the context. If descendAll is 1, the literal words of all the
+ *  other commands are scanned too; this is used for the pattern and body
+ *  lists of "switch".
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Adds entries to sitesPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void FindProcDefinitions(Tcl_HashTable* sitesPtr,
+                                const char* source,
+                                const char* script,
+                                Tcl_Size length,
+                                const char* context,
+                                int descendAll,
+                                int depth)
+{
+    static const char* inlineCommands[] = {
+        "catch", "dict", "for", "foreach", "if", "lmap", "switch", "try", "while", NULL};
+    static const char* runtimeCommands[] = {"eval", "time", "uplevel", NULL};
+    const char *p = script, *end = script + length;
+    const char *name, *wordContext;
+    Tcl_Token *tokenPtr, *wordPtr;
+    Tcl_HashEntry* entryPtr;
+    ProcSite* sitePtr;
+    Tcl_Parse parse;
+    Tcl_Size i, nameLength, firstWord;
+    int index, isNew, wordDescendAll;
+
+    if (depth > CMP_MAX_SCAN_DEPTH)
+    {
+        return;
+    }
+
+    while (p < end)
+    {
+        if (Tcl_ParseCommand(NULL, p, end - p, 0, &parse) != TCL_OK)
+        {
+            return;
+        }
+        p = parse.commandStart + parse.commandSize;
+        if (parse.numWords < 1)
+        {
+            Tcl_FreeParse(&parse);
+            continue;
+        }
+
+        /*
+         * Decide which words to scan, and in what context.
+         */
+
+        tokenPtr = parse.tokenPtr;
+        name = NULL;
+        nameLength = 0;
+        if (tokenPtr->type == TCL_TOKEN_SIMPLE_WORD)
+        {
+            name = tokenPtr[1].start;
+            nameLength = tokenPtr[1].size;
+            while ((nameLength > 0) && (*name == ':'))
+            {
+                name++;
+                nameLength--;
+            }
+        }
+
+        firstWord = parse.numWords;
+        wordContext = context;
+        wordDescendAll = 0;
+        if (name && (nameLength == 4) && (strncmp(name, "proc", 4) == 0))
+        {
+            entryPtr = Tcl_CreateHashEntry(sitesPtr, (char*)SIZE2PTR(parse.commandStart - source), &isNew);
+            if (isNew)
+            {
+                sitePtr = (ProcSite*)CmpAlloc(sizeof(ProcSite));
+                sitePtr->offset = parse.commandStart - source;
+                sitePtr->namePtr = ParseProcCall(parse.commandStart, parse.commandSize, &sitePtr->reason);
+                Tcl_IncrRefCount(sitePtr->namePtr);
+                if (context)
+                {
+                    sitePtr->reason = context;
+                }
+                else if (!sitePtr->reason)
+                {
+                    sitePtr->reason = "it is not compiled ahead of time";
+                }
+                Tcl_SetHashValue(entryPtr, sitePtr);
+            }
+            if (parse.numWords == 4)
+            {
+                firstWord = 3;
+                wordContext = "it is defined in a procedure body, which is compiled at run time";
+            }
+        }
+        else if (name && ((index = MatchCommandName(name, nameLength, inlineCommands)) >= 0))
+        {
+            firstWord = 1;
+            wordDescendAll = (strcmp(inlineCommands[index], "switch") == 0);
+        }
+        else if (name && (MatchCommandName(name, nameLength, runtimeCommands) >= 0))
+        {
+            firstWord = 1;
+            wordContext = "it is defined in a script that is only evaluated at run time";
+        }
+        else if (name && (nameLength == 9) && (strncmp(name, "namespace", 9) == 0) && (parse.numWords > 3))
+        {
+            wordPtr = tokenPtr + tokenPtr->numComponents + 1;
+            if ((wordPtr->type == TCL_TOKEN_SIMPLE_WORD) && (wordPtr[1].size == 4) &&
+                (strncmp(wordPtr[1].start, "eval", 4) == 0))
+            {
+                firstWord = 3;
+                wordContext = "it is defined in a \"namespace eval\" script, which is only evaluated at run time";
+            }
+        }
+        else if (descendAll)
+        {
+            firstWord = 0;
+        }
+
+        /*
+         * Scan the literal words.
+         */
+
+        for (i = 0, wordPtr = tokenPtr; i < parse.numWords; i++, wordPtr += wordPtr->numComponents + 1)
+        {
+            if ((i >= firstWord) && (wordPtr->type == TCL_TOKEN_SIMPLE_WORD))
+            {
+                FindProcDefinitions(sitesPtr,
+                                    source,
+                                    wordPtr[1].start,
+                                    wordPtr[1].size,
+                                    wordContext,
+                                    wordDescendAll,
+                                    depth + 1);
+            }
+        }
+        Tcl_FreeParse(&parse);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseProcCall --
+ *
+ *  Parses the "proc" command at the start of script, and checks that it
+ *  has the form that CompileProcBodies can precompile: three literal
+ *  arguments.
+ *
+ * Results:
+ *  Returns a new object holding the procedure name, or an empty string if
+ *  the name is not a literal. *reasonPtr is set to the reason why the call
+ *  does not have the expected form, or to NULL if it does.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj* ParseProcCall(const char* script, Tcl_Size length, const char** reasonPtr)
+{
+    static const char* computedReasons[] = {NULL,
+                                            "its name is computed at run time",
+                                            "its argument list is computed at run time",
+                                            "its body is computed at run time"};
+    Tcl_Obj* namePtr;
+    Tcl_Token* wordPtr;
+    Tcl_Parse parse;
+    Tcl_Size i;
+
+    if (Tcl_ParseCommand(NULL, script, length, 0, &parse) != TCL_OK)
+    {
+        *reasonPtr = "the command cannot be parsed";
+        return Tcl_NewObj();
+    }
+
+    *reasonPtr = NULL;
+    namePtr = NULL;
+    for (i = 0, wordPtr = parse.tokenPtr; i < parse.numWords; i++, wordPtr += wordPtr->numComponents + 1)
+    {
+        if (wordPtr->type == TCL_TOKEN_EXPAND_WORD)
+        {
+            *reasonPtr = "its arguments are expanded at run time";
+        }
+        else if (wordPtr->type == TCL_TOKEN_SIMPLE_WORD)
+        {
+            if (i == 1)
+            {
+                namePtr = Tcl_NewStringObj(wordPtr[1].start, wordPtr[1].size);
+            }
+        }
+        else if ((i < 4) && !*reasonPtr)
+        {
+            *reasonPtr = computedReasons[i];
+        }
+    }
+    if (!*reasonPtr && (parse.numWords != 4))
+    {
+        *reasonPtr = "it is not called with 3 arguments";
+    }
+    Tcl_FreeParse(&parse);
+
+    return namePtr ? namePtr : Tcl_NewObj();
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MatchCommandName --
+ *
+ *  Looks up a command name in a NULL-terminated table.
+ *
+ * Results:
+ *  Returns the index of the name in the table, or -1.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int MatchCommandName(const char* name, Tcl_Size length, const char* const* table)
+{
+    int i;
+
+    for (i = 0; table[i]; i++)
+    {
+        if ((strncmp(table[i], name, length) == 0) && (table[i][length] == '\0'))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompileProcBodies --
+ *
+ *  Compiles the procedure bodies present in a compilation environment.
+ *
+ * Results:
+ *  A standard TCL error code.
+ *
+ * Side effects:
+ *  Compiles procedure bodies if any; the objects will have an internal
+ *  bytecode representation. Additionally, if the procedure bodies were
+ *  shared objects, it creates a new copy of the body object in order to
+ *  make them unshared. In this case, it will modify both the bytecodes and
+ *  the object table.
+ *  May set the TCL result object on error.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int CompileProcBodies(Tcl_Interp* interp, CompileEnv* compEnvPtr)
+{
+    CompilerContext* ctxPtr = CompilerGetContext(interp);
+    PostProcessInfo* infoPtr = ctxPtr->ppi;
+    ProcBodyInfo** infoArrayPtr;
+    Tcl_HashEntry* entryPtr;
+    ProcBodyKey key;
+    int isNew, result = TCL_OK;
+    Tcl_Size i;
+    Tcl_Time start;
+
+    if (!infoPtr)
+    {
+        Tcl_Panic("CompileProcBodies: no postprocess info for interpreter");
+        return TCL_ERROR;
+    }
+
+    if (infoPtr->numProcs < 1)
+    {
+        return TCL_OK;
+    }
+
+    Tcl_GetTime(&start);
+    CreateProcBodyInfoArray(infoPtr, compEnvPtr, &infoArrayPtr);
+    LoadObjRefInfoTable(infoPtr, compEnvPtr);
+
+    /*
+     * Before compiling, check for shared objects and, if there are any,
+     * copy them to new objects.
+     */
+
+    UnshareProcBodies(interp, ctxPtr, compEnvPtr);
+
+    /*
+     * Compile the procedure bodies. A definition with the same argument
+     * list and body as an earlier one reuses the earlier compiled code,
+     * except with -profile, which counts the commands of each procedure
+     * separately.
+     */
+
+    memset(&key, 0, sizeof(key));
+
+    infoPtr->numCompiledBodies = 0;
+    infoPtr->numClonedBodies = 0;
+    for (i = 0; i < infoPtr->numProcs; i++)
+    {
+        if (infoArrayPtr[i]->bodyNewIndex != -1)
+        {
+            key.argsIndex = infoArrayPtr[i]->argsIndex;
+            key.bodyIndex = infoArrayPtr[i]->bodyOrigIndex;
+            entryPtr = Tcl_CreateHashEntry(&infoPtr->bodyTable, (char*)&key, &isNew);
+            if (isNew || ctxPtr->profilePtr)
+            {
+                result = CompileOneProcBody(interp, infoArrayPtr[i], ctxPtr, compEnvPtr);
+                Tcl_SetHashValue(entryPtr, infoArrayPtr[i]);
+                infoPtr->numCompiledBodies++;
+            }
+            else
+            {
+                result = CloneProcBody((ProcBodyInfo*)Tcl_GetHashValue(entryPtr), infoArrayPtr[i], ctxPtr, compEnvPtr);
+                infoPtr->numClonedBodies++;
+            }
+            if (result != TCL_OK)
+            {
+                ctxPtr->stats.procBodyTime += ElapsedTime(&start);
+                TraceSpan(ctxPtr, "proc bodies", "phase", &start);
+                return result;
+            }
+        }
+    }
+
+    ctxPtr->stats.procBodyTime += ElapsedTime(&start);
+    TraceSpan(ctxPtr, "proc bodies", "phase", &start);
+
+    /*
+     * If some procedure bodies have been compiled, we need to modify the
+     * bytecodes and related data structures
+     */
+
+    Tcl_GetTime(&start);
+    CMP_PROBE1(rewrite__start, infoPtr->numProcs);
+    result = UpdateByteCodes(interp, infoPtr, compEnvPtr);
+    CMP_PROBE1(rewrite__end, infoPtr->numProcs);
+    ctxPtr->stats.rewriteTime += ElapsedTime(&start);
+    TraceSpan(ctxPtr, "rewrite", "phase", &start);
+
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CreateProcBodyInfoArray --
+ *
+ *  Allocate and populate an array of ProcBodyInfo structs.
+ *  This is a NULL-terminated array of pointers to ProcBodyInfo, each
+ *  initialized from the corresponding procedure body.
+ *  The allocated array is placed in the infoArrayPtr field of locInfoPtr,
+ *  and is owned by it; it will be released when locInfoPtr is freed.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Tcl_Panics on error.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void CreateProcBodyInfoArray(PostProcessInfo* locInfoPtr, CompileEnv* compEnvPtr, ProcBodyInfo*** arrayPtrPtr)
+{
+    Tcl_Size allocSize, arraySize;
+    Tcl_Size i, numProcs = locInfoPtr->numProcs;
+    char* allocPtr;
+    ProcBodyInfo** infoAryPtr;
+    ProcBodyInfo* infoPtr;
+    InstLocList* locPtr;
+
+    FreeProcBodyInfoArray(locInfoPtr);
+
+    /*
+     * allocate a single area, used for both the array of pointers and the
+     * info structs
+     */
+
+    arraySize = (numProcs + 1) * sizeof(ProcBodyInfo*);
+    arraySize += TCL_ALIGN(arraySize); /* align the info array */
+    allocSize = arraySize + (numProcs * sizeof(ProcBodyInfo));
+    allocPtr = CmpAlloc(allocSize);
+
+    locInfoPtr->infoArrayPtr = (ProcBodyInfo**)allocPtr;
+    infoAryPtr = locInfoPtr->infoArrayPtr;
+    for (i = 0; i <= numProcs; i++)
+    {
+        *infoAryPtr = (ProcBodyInfo*)NULL;
+        infoAryPtr += 1;
+    }
+
+    /*
+     * get the object indexes for the body and args objects,
+     * and the push offsets
+     */
+
+    infoPtr = (ProcBodyInfo*)(allocPtr + arraySize);
+    infoAryPtr = locInfoPtr->infoArrayPtr;
+    locPtr = locInfoPtr->procs;
+    for (i = 0; i < numProcs; i++)
+    {
+        *infoAryPtr = infoPtr;
+        LoadProcBodyInfo(locPtr, compEnvPtr, infoPtr);
+        infoAryPtr += 1;
+        infoPtr += 1;
+        locPtr = locPtr->next;
+    }
+
+    if (arrayPtrPtr != NULL)
+    {
+        *arrayPtrPtr = locInfoPtr->infoArrayPtr;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreeProcBodyInfoArray --
+ *
+ *  Frees the array of ProcBodyInfo structs in the PostProcessInfo struct.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void FreeProcBodyInfoArray(PostProcessInfo* infoPtr)
+{
+    if (infoPtr->infoArrayPtr)
+    {
+        CmpFree(infoPtr->infoArrayPtr);
+    }
+    infoPtr->infoArrayPtr = (ProcBodyInfo**)NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoadProcBodyInfo --
+ *
+ *  Populate a ProcBodyInfo struct.  This function determines if a
+ *  procedure body should be compiled or not; see the comments in
+ *  the body, below, for a description of the algorithm.  A
+ *  procedure body that should not be compiled has its
+ *  bodyNewIndex field set to -1.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *---------------------------------------------------------------------- */
+
+static void LoadProcBodyInfo(InstLocList* locInfoPtr, CompileEnv* compEnvPtr, ProcBodyInfo* infoPtr)
+{
+    unsigned char* pc = compEnvPtr->codeStart + locInfoPtr->bytecodeOffset;
+
+    /*
+     * Here is where we scan the bytecodes and figure out where the args
+     * and the procedure body are put on the stack.
+     *
+     * Currently, we only detect the simplest (and most common) case, where
+     * all arguments to proc are pushed as literals, like this:
+     *      proc a { a1 a2 } { return [list $a1 $a2] }
+     * This corresponds to an expected sequence of commands like this:
+     *      PUSH, PUSH, PUSH, PUSH, INVOKE_STK1
+     * where PUSH can be either PUSH1 or PUSH4, but INVOKE_STK1 only is
+     * expected (because there are only 4 arguments).
+     * The operand of the first PUSH is the index to the "proc" string,
+     * for the second it is the procedure name, for the third the argument
+     * list, and for the fourth the procedure body.
+     *
+     * If the args or the body are not pushed as literals, then the PUSH
+     * should be followed by different opcodes; for example, something like
+     * this
+     *      set body { return [list $a1 $a2] }
+     *      proc a { a1 a2 } $b
+     * generates a sequence like (PUSH "b"; LOAD) when the body is loaded,
+     * and we shouldn't compile "b" (of course!) and neither the object
+     * loaded as "b" (because it may not be a literal).
+     *
+     * The tough part is how do we detect stuff like this:
+     *      proc $procName { a1 a2 ] { return [list $a1 $a2] }
+     */
+
+    infoPtr->commandIndex = locInfoPtr->commandIndex;
+    infoPtr->procOffset = (pc - compEnvPtr->codeStart);
+    infoPtr->nameIndex = -1;
+    infoPtr->argsIndex = -1;
+    infoPtr->bodyOrigIndex = -1;
+    infoPtr->bodyNewIndex = -1;
+    infoPtr->bodyOffset = -1; /* Bugzilla 89467 */
+
+    /*
+     * Skip the "proc" string
+     */
+
+    switch (*pc)
+    {
+        case INST_PUSH1:
+            pc += 2;
+            break;
+
+        case INST_PUSH4:
+            pc += 5;
+            break;
+
+        default:
+            return;
+    }
+
+    /*
+     * get the index of the proc name
+     */
+
+    switch (*pc)
+    {
+        case INST_PUSH1:
+            infoPtr->nameIndex = TclGetUInt1AtPtr(pc + 1);
+            pc += 2;
+            break;
+
+        case INST_PUSH4:
+            infoPtr->nameIndex = TclGetUInt4AtPtr(pc + 1);
+            pc += 5;
+            break;
+
+        default:
+            return;
+    }
+
+    /*
+     * get the index of the argument list
+     */
+
+    switch (*pc)
+    {
+        case INST_PUSH1:
+            infoPtr->argsIndex = TclGetUInt1AtPtr(pc + 1);
+            pc += 2;
+            break;
+
+        case INST_PUSH4:
+            infoPtr->argsIndex = TclGetUInt4AtPtr(pc + 1);
+            pc += 5;
+            break;
+
+        default:
+            return;
+    }
+
+    /*
+     * get the index of the procedure body, and save the offset to the
+     * push instruction.
+     */
+
+    infoPtr->bodyOffset = (pc - compEnvPtr->codeStart);
+    switch (*pc)
+    {
+        case INST_PUSH1:
+            infoPtr->bodyOrigIndex = TclGetUInt1AtPtr(pc + 1);
+            pc += 2;
+            break;
+
+        case INST_PUSH4:
+            infoPtr->bodyOrigIndex = TclGetUInt4AtPtr(pc + 1);
+            pc += 5;
+            break;
+
+        default:
+            return;
+    }
+
+    /*
+     * (****)
+     */
+
+    infoPtr->bodyNewIndex = infoPtr->bodyOrigIndex;
+
+    /*
+     * finally, check if the following instruction is a INVOKE_STK1 with
+     * argument 4
+     */
+
+    if ((*pc != INST_INVOKE_STK1) || (TclGetUInt1AtPtr(pc + 1) != 4))
+    {
+        infoPtr->nameIndex = -1;
+        infoPtr->argsIndex = -1;
+        infoPtr->bodyOrigIndex = -1;
+        infoPtr->bodyNewIndex = -1;
+    }
+
+    return;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoadObjRefInfoTable --
+ *
+ *  Load the object reference table.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Populates the objTable field of the locInfoPtr struct.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void LoadObjRefInfoTable(PostProcessInfo* locInfoPtr, CompileEnv* compEnvPtr)
+{
+    Tcl_HashTable* objTablePtr;
+    ProcBodyInfo** infoAryPtr;
+    ProcBodyInfo* infoPtr;
+    Tcl_HashEntry* entryPtr;
+    int isNew;
+    Tcl_Size objIndex;
+    ObjRefInfo* refInfoPtr;
+    InstructionDesc* opCodesTablePtr;
+    unsigned char* pc;
+
+    CleanObjRefInfoTable(locInfoPtr);
+
+    /*
+     * count how many references to this object as a procedure body
+     */
+
+    objTablePtr = &locInfoPtr->objTable;
+    for (infoAryPtr = locInfoPtr->infoArrayPtr; *infoAryPtr; infoAryPtr++)
+    {
+        infoPtr = *infoAryPtr;
+        entryPtr = Tcl_CreateHashEntry(objTablePtr, (char*)SIZE2PTR(infoPtr->bodyOrigIndex), &isNew);
+        if (isNew)
+        {
+            refInfoPtr = (ObjRefInfo*)CmpAlloc(sizeof(ObjRefInfo));
+            refInfoPtr->numReferences = 0;
+            refInfoPtr->numProcReferences = 0;
+            refInfoPtr->numUnshares = 0;
+
+            Tcl_SetHashValue(entryPtr, (void*)refInfoPtr);
+        }
+        else
+        {
+            refInfoPtr = (ObjRefInfo*)Tcl_GetHashValue(entryPtr);
+        }
+
+        refInfoPtr->numProcReferences += 1;
+    }
+
+    /*
+     * now scan the bytecodes and count the references from the bytecodes.
+     * Note that this count includes references from the PUSH instructions
+     * in the "proc" call.
+     */
+
+    opCodesTablePtr = (InstructionDesc*)TclGetInstructionTable();
+    for (pc = compEnvPtr->codeStart; pc < compEnvPtr->codeNext;)
+    {
+        objIndex = GetSharedIndex(pc);
+        if (objIndex >= 0)
+        {
+            entryPtr = Tcl_FindHashEntry(objTablePtr, (char*)SIZE2PTR(objIndex));
+            if (entryPtr)
+            {
+                /*
+                 * this is a reference to a known procedure body
+                 */
+
+                refInfoPtr = (ObjRefInfo*)Tcl_GetHashValue(entryPtr);
+                refInfoPtr->numReferences += 1;
+            }
+        }
+
+        pc += opCodesTablePtr[*pc].numBytes;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CleanObjRefInfoTable --
+ *
+ *  Releases all entries in the object reference table.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  See above.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void CleanObjRefInfoTable(PostProcessInfo* locInfoPtr)
+{
+    Tcl_HashSearch iterCtx; /* the iteration context */
+    Tcl_HashEntry* entryPtr;
+    ObjRefInfo* refInfoPtr;
+
+    for (entryPtr = Tcl_FirstHashEntry(&locInfoPtr->objTable, &iterCtx); entryPtr; entryPtr = Tcl_NextHashEntry(&iterCtx))
+    {
+        refInfoPtr = (ObjRefInfo*)Tcl_GetHashValue(entryPtr);
+        CmpFree(refInfoPtr);
+        Tcl_DeleteHashEntry(entryPtr);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompileOneProcBody --
+ *
+ *  Compiles a procedure body.
+ *  Much of this code is derived from Tcl_ProcObjCmd and TclObjInterpProc.
+ *
+ * Results:
+ *  A standard TCL error code.
+ *
+ * Side effects:
+ *  If the call succeeds, the objects will have an internal bytecode
+ *  representation. Additionally, if the object was shared, a new copy is
+ *  created in order to make it unshared; in this case, the new object is
+ *  added to the object table and the new index field in infoPtr is updated.
+ *  May set the TCL result object on error.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int CompileOneProcBody(Tcl_Interp* interp, ProcBodyInfo* infoPtr, CompilerContext* ctxPtr, CompileEnv* compEnvPtr)
+{
+    Interp* iPtr = (Interp*)interp;
+    Proc* procPtr = (Proc*)NULL;
+    Tcl_Command cmd = (Tcl_Command)NULL;
+
+    CompiledLocal* localPtr;
+    Proc* saveProcPtr;
+    Tcl_Obj* bodyPtr;
+    Tcl_Obj* procObjPtr;
+    Tcl_Size numArgs, i;
+    char* fullName;
+    char cmdNameBuf[64];
+    const char** argArray = NULL;
+    const char* p;
+    Tcl_Time start;
+    int result = TCL_OK;
+
+    if (infoPtr->bodyNewIndex == -1)
+    {
+        return TCL_OK;
+    }
+
+    /*
+     * Here we get the current namespace. We have to do it differently
+     * than Tcl_ProcObjCmd does, because the current namespace is NOT the one
+     * that is current at the time this proc is executed (we are compiling the
+     * file).
+     *
+     * For the time being, the full name is the one that was pushed.
+     */
+
+    fullName = Tcl_GetString(compEnvPtr->literalArrayPtr[infoPtr->nameIndex].objPtr);
+
+    /*
+     * the newIndex is the one of the unshared object, so there is no need
+     * to do any shared checks here
+     */
+
+    bodyPtr = compEnvPtr->literalArrayPtr[infoPtr->bodyNewIndex].objPtr;
+
+    /*
+     * Create and initialize a Proc structure for the procedure. Note that
+     * we initialize its cmdPtr field below after we've created the command
+     * for the procedure. HOWEVER, differently from Tcl_ProcObjCmd, the
+     * command we create is just a dummy for use by the compiler code; it will
+     * be deleted after the compilation.
+     * We increment the ref count of the procedure's body object since there
+     * will be a reference to it in the Proc structure.
+     */
+
+    Tcl_IncrRefCount(bodyPtr);
+
+    procPtr = (Proc*)Tcl_Alloc(sizeof(Proc));
+    procPtr->iPtr = iPtr;
+    procPtr->refCount = 1;
+    procPtr->bodyPtr = bodyPtr;
+    procPtr->firstLocalPtr = NULL;
+    procPtr->lastLocalPtr = NULL;
+
+    /*
+     * Break up the argument list into argument specifiers, then process
+     * each argument specifier.
+     */
+
+    result = Tcl_SplitList(interp, Tcl_GetString(compEnvPtr->literalArrayPtr[infoPtr->argsIndex].objPtr), &numArgs, &argArray);
+    if (result != TCL_OK)
+    {
+        Tcl_DecrRefCount(bodyPtr);
+        Tcl_Free((char*)procPtr);
+        return result;
+    }
+
+    procPtr->numArgs = numArgs;
+    procPtr->numCompiledLocals = numArgs;
+
+    for (i = 0; i < numArgs; i++)
+    {
+        Tcl_Size fieldCount;
+        Tcl_Size nameLength, valueLength;
+        const char** fieldValues;
+
+        /*
+         * Now divide the specifier up into name and default.
+         */
+
+        result = Tcl_SplitList(interp, argArray[i], &fieldCount, &fieldValues);
+        if (result != TCL_OK)
+        {
+            result = TCL_ERROR;
+            break;
+        }
+        if (fieldCount > 2)
+        {
+            Tcl_Free((char*)fieldValues);
+            Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+                                   "compilation of procedure \"",
+                                   fullName,
+                                   "\" failed: too many fields in argument specifier \"",
+                                   argArray[i],
+                                   "\"",
+                                   (char*)NULL);
+            result = TCL_ERROR;
+            break;
+        }
 
-    CompiledLocal* localPtr;
-    Proc* saveProcPtr;
-    Tcl_Obj* bodyPtr;
-    Tcl_Obj* procObjPtr;
-    Tcl_Size numArgs, i;
-    char* fullName;
-    char cmdNameBuf[64];
-    const char** argArray = NULL;
-    const char* p;
-    int result = TCL_OK;
+        if ((fieldCount == 0) || (*fieldValues[0] == 0))
+        {
+            Tcl_Free((char*)fieldValues);
+            Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+                                   "compilation of procedure \"",
+                                   fullName,
+                                   "\" failed: argument with no name",
+                                   (char*)NULL);
+            result = TCL_ERROR;
+            break;
+        }
 
-    if (infoPtr->bodyNewIndex == -1)
+        nameLength = strlen(fieldValues[0]);
+        if (fieldCount == 2)
+        {
+            valueLength = strlen(fieldValues[1]);
+        }
+        else
+        {
+            valueLength = 0;
+        }
+
+        /*
+         * Check that the formal parameter name is a scalar.
+         */
+
+        p = fieldValues[0];
+        while (*p != '\0')
+        {
+            if (*p == '(')
+            {
+                const char* q = p;
+                do
+                {
+                    q++;
+                } while (*q != '\0');
+                q--;
+                if (*q == ')')
+                { /* we have an array element */
+                    Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+                                           "compilation of procedure \"",
+                                           fullName,
+                                           "\" failed: formal parameter \"",
+                                           fieldValues[0],
+                                           "\" is an array element",
+                                           (char*)NULL);
+                    Tcl_Free((char*)fieldValues);
+                    Tcl_DecrRefCount(bodyPtr);
+                    Tcl_Free((char*)procPtr);
+                    return result;
+                }
+            }
+            p++;
+        }
+
+        /*
+         * Allocate an entry in the runtime procedure frame's array of local
+         * variables for the argument.
+         */
+        localPtr = (CompiledLocal*)Tcl_Alloc(offsetof(CompiledLocal, name) + 1U + nameLength);
+
+        if (procPtr->firstLocalPtr == NULL)
+        {
+            procPtr->firstLocalPtr = procPtr->lastLocalPtr = localPtr;
+        }
+        else
+        {
+            procPtr->lastLocalPtr->nextPtr = localPtr;
+            procPtr->lastLocalPtr = localPtr;
+        }
+        localPtr->nextPtr = NULL;
+        localPtr->nameLength = nameLength;
+        localPtr->frameIndex = i;
+        localPtr->flags = VAR_ARGUMENT;
+        localPtr->resolveInfo = NULL;
+
+        if (fieldCount == 2)
+        {
+            localPtr->defValuePtr = Tcl_NewStringObj(fieldValues[1], valueLength);
+            Tcl_IncrRefCount(localPtr->defValuePtr);
+        }
+        else
+        {
+            localPtr->defValuePtr = NULL;
+        }
+        strcpy(localPtr->name, fieldValues[0]);
+
+        Tcl_Free((char*)fieldValues);
+    }
+
+    if (result != TCL_OK)
     {
-        return TCL_OK;
+        for (localPtr = procPtr->firstLocalPtr; localPtr;)
+        {
+            CompiledLocal* next = localPtr->nextPtr;
+            if (localPtr->defValuePtr)
+                Tcl_DecrRefCount(localPtr->defValuePtr);
+            Tcl_Free((void*)localPtr);
+            localPtr = next;
+        }
+        Tcl_DecrRefCount(bodyPtr);
+        Tcl_Free((char*)procPtr);
+        Tcl_Free((char*)argArray);
+        return result;
     }
 
     /*
-     * Here we get the current namespace. We have to do it differently
-     * than Tcl_ProcObjCmd does, because the current namespace is NOT the one
-     * that is current at the time this proc is executed (we are compiling the
-     * file).
-     *
-     * For the time being, the full name is the one that was pushed.
+     * Now create a command for the procedure. This will initially be in
+     * the current namespace unless the procedure's name included namespace
+     * qualifiers. To create the new command in the right namespace, we
+     * generate a fully qualified name for it.
      */
 
-    fullName = Tcl_GetString(compEnvPtr->literalArrayPtr[infoPtr->nameIndex].objPtr);
+    /*
+     * Make sure that the temporary name is not already used
+     */
+
+    do
+    {
+        sprintf(cmdNameBuf, dummyCommandName, ctxPtr->dummyCounter);
+        cmd = Tcl_FindCommand(interp, cmdNameBuf, (Tcl_Namespace*)NULL, TCL_GLOBAL_ONLY);
+        ctxPtr->dummyCounter += 1;
+    } while (cmd != (Tcl_Command)NULL);
+
+    cmd = Tcl_CreateObjCommand(interp, cmdNameBuf, DummyObjInterpProc, (void*)procPtr, CmpDeleteProc);
+
+    if (cmd == (Tcl_Command)NULL)
+    {
+        for (localPtr = procPtr->firstLocalPtr; localPtr;)
+        {
+            CompiledLocal* next = localPtr->nextPtr;
+            if (localPtr->defValuePtr)
+                Tcl_DecrRefCount(localPtr->defValuePtr);
+            Tcl_Free((char*)localPtr);
+            localPtr = next;
+        }
+        Tcl_DecrRefCount(bodyPtr);
+        Tcl_Free((char*)procPtr);
+        Tcl_Free((char*)argArray);
+        return TCL_ERROR;
+    }
 
     /*
-     * the newIndex is the one of the unshared object, so there is no need
-     * to do any shared checks here
+     * Now initialize the new procedure's cmdPtr field. This will be used
+     * later when the procedure is called to determine what namespace the
+     * procedure will run in. This will be different than the current
+     * namespace if the proc was renamed into a different namespace.
      */
 
-    bodyPtr = compEnvPtr->literalArrayPtr[infoPtr->bodyNewIndex].objPtr;
+    procPtr->cmdPtr = (Command*)cmd;
 
     /*
-     * Create and initialize a Proc structure for the procedure. Note that
-     * we initialize its cmdPtr field below after we've created the command
-     * for the procedure. HOWEVER, differently from Tcl_ProcObjCmd, the
-     * command we create is just a dummy for use by the compiler code; it will
-     * be deleted after the compilation.
-     * We increment the ref count of the procedure's body object since there
-     * will be a reference to it in the Proc structure.
+     * At this stage, we are ready to compile the procedure body.
+     * Much of this code is derived from TclObjInterpProc.
+     *
+     * We force a recompilation of the body, even if the body is already
+     * of bytecode type.
+     */
+
+    if (bodyPtr->typePtr)
+    {
+        bodyPtr->typePtr->freeIntRepProc(bodyPtr);
+        bodyPtr->typePtr = (Tcl_ObjType*)NULL;
+    }
+
+    saveProcPtr = iPtr->compiledProcPtr;
+    iPtr->compiledProcPtr = procPtr;
+    CMP_PROBE1(proc__start, fullName);
+    Tcl_GetTime(&start);
+    result = TclSetByteCodeFromAny(interp, bodyPtr, PostProcessProcBody, (void*)fullName);
+    iPtr->compiledProcPtr = saveProcPtr;
+    CMP_PROBE2(proc__end, fullName, result);
+
+    if (result != TCL_OK)
+    {
+        if (result == TCL_ERROR)
+        {
+            char buf[100];
+            Tcl_Size numChars;
+            char* ellipsis;
+
+            /*
+             * Prepend the procedure name to the error object
+             */
+
+            sprintf(buf, "compilation of procedure \"%s\" failed: ", fullName);
+            PrependResult(interp, buf);
+
+            numChars = strlen(fullName);
+            ellipsis = "";
+            if (numChars > 50)
+            {
+                numChars = 50;
+                ellipsis = "...";
+            }
+            sprintf(buf,
+                    "\n    (compiling body of proc \"%.*s%s\", line %d)",
+                    (int)numChars,
+                    fullName,
+                    ellipsis,
+                    Tcl_GetErrorLine(interp));
+            Tcl_AppendObjToErrorInfo(interp, Tcl_NewStringObj(buf, -1));
+        }
+        Tcl_DeleteCommandFromToken(interp, cmd);
+        Tcl_Free((char*)argArray);
+        return result;
+    }
+
+    ctxPtr->numCompiledBodies += 1;
+    RecordCompileCost(ctxPtr, fullName, 1, ElapsedTime(&start), (ByteCode*)bodyPtr->internalRep.otherValuePtr);
+    TraceSpan(ctxPtr, fullName, "proc", &start);
+
+    /*
+     * Now that we have compiled the procedure, create a new TCL object
+     * containing both the bytecodes and the info stored in the Proc struct.
+     * this info is usually generated at run time during the compilation of
+     * the procedure body, but of course this won't be possible in our case
+     * (the body is already compiled). So, we use this strategy:
+     *   1. compile the body, then save the relevant parts of Proc into a
+     *      procbody object. This object replaces the proc body object
+     *      in the object table.
+     *   2. tweak the name of the command to call from "proc" to
+     *      "loader::bcproc". This is our version of "proc" that knows how
+     *      to reconstruct the Proc struct from the TclProProcBody object.
      */
 
-    Tcl_IncrRefCount(bodyPtr);
+    procObjPtr = TclNewProcBodyObj(procPtr);
+    Tcl_IncrRefCount(procObjPtr);
+    compEnvPtr->literalArrayPtr[infoPtr->bodyNewIndex].objPtr = procObjPtr;
+    Tcl_DecrRefCount(bodyPtr);
+    Tcl_Free((char*)argArray);
+    if (cmd)
+    {
+        Tcl_DeleteCommandFromToken(interp, cmd);
+    }
+    else
+    {
+        TclProcCleanupProc(procPtr);
+    }
+
+    return result;
+}
 
-    procPtr = (Proc*)Tcl_Alloc(sizeof(Proc));
-    procPtr->iPtr = iPtr;
-    procPtr->refCount = 1;
-    procPtr->bodyPtr = bodyPtr;
-    procPtr->firstLocalPtr = NULL;
-    procPtr->lastLocalPtr = NULL;
+/*
+ *----------------------------------------------------------------------
+ *
+ * RecordCompileCost --
+ *
+ *  Appends a CompileCost for a ByteCode that was just compiled to the
+ *  array of the compiler context, growing it as needed.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  May reallocate ctxPtr->costsPtr.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    /*
-     * Break up the argument list into argument specifiers, then process
-     * each argument specifier.
-     */
+static void RecordCompileCost(CompilerContext* ctxPtr, const char* name, int isProcBody, Tcl_WideInt time, ByteCode* codePtr)
+{
+    CompileCost* costPtr;
 
-    result = Tcl_SplitList(interp, Tcl_GetString(compEnvPtr->literalArrayPtr[infoPtr->argsIndex].objPtr), &numArgs, &argArray);
-    if (result != TCL_OK)
+    if (ctxPtr->numCosts == ctxPtr->costsSize)
     {
-        Tcl_DecrRefCount(bodyPtr);
-        Tcl_Free((char*)procPtr);
-        return result;
+        ctxPtr->costsSize = ctxPtr->costsSize ? 2 * ctxPtr->costsSize : 64;
+        ctxPtr->costsPtr = (CompileCost*)Tcl_Realloc((char*)ctxPtr->costsPtr, ctxPtr->costsSize * sizeof(CompileCost));
     }
 
-    procPtr->numArgs = numArgs;
-    procPtr->numCompiledLocals = numArgs;
+    costPtr = &ctxPtr->costsPtr[ctxPtr->numCosts++];
+    costPtr->namePtr = Tcl_NewStringObj(name, -1);
+    Tcl_IncrRefCount(costPtr->namePtr);
+    costPtr->filePtr = Tcl_NewStringObj(ctxPtr->scriptName ? ctxPtr->scriptName : "", -1);
+    Tcl_IncrRefCount(costPtr->filePtr);
+    costPtr->isProcBody = isProcBody;
+    costPtr->time = time;
+    costPtr->codeBytes = codePtr->numCodeBytes;
+    costPtr->numLiterals = codePtr->numLitObjects;
+}
 
-    for (i = 0; i < numArgs; i++)
-    {
-        Tcl_Size fieldCount;
-        Tcl_Size nameLength, valueLength;
-        const char** fieldValues;
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreeCompileCosts --
+ *
+ *  Frees the CompileCost array of the compiler context.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Empties the array.
+ *
+ *----------------------------------------------------------------------
+ */
 
-        /*
-         * Now divide the specifier up into name and default.
-         */
+static void FreeCompileCosts(CompilerContext* ctxPtr)
+{
+    Tcl_Size i;
 
-        result = Tcl_SplitList(interp, argArray[i], &fieldCount, &fieldValues);
-        if (result != TCL_OK)
-        {
-            result = TCL_ERROR;
-            break;
-        }
-        if (fieldCount > 2)
-        {
-            Tcl_Free((char*)fieldValues);
-            Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
-                                   "compilation of procedure \"",
-                                   fullName,
-                                   "\" failed: too many fields in argument specifier \"",
-                                   argArray[i],
-                                   "\"",
-                                   (char*)NULL);
-            result = TCL_ERROR;
-            break;
-        }
+    for (i = 0; i < ctxPtr->numCosts; i++)
+    {
+        Tcl_DecrRefCount(ctxPtr->costsPtr[i].namePtr);
+        Tcl_DecrRefCount(ctxPtr->costsPtr[i].filePtr);
+    }
+    if (ctxPtr->costsPtr)
+    {
+        Tcl_Free((char*)ctxPtr->costsPtr);
+    }
+    ctxPtr->costsPtr = NULL;
+    ctxPtr->numCosts = 0;
+    ctxPtr->costsSize = 0;
+}
 
-        if ((fieldCount == 0) || (*fieldValues[0] == 0))
-        {
-            Tcl_Free((char*)fieldValues);
-            Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
-                                   "compilation of procedure \"",
-                                   fullName,
-                                   "\" failed: argument with no name",
-                                   (char*)NULL);
-            result = TCL_ERROR;
-            break;
-        }
+/*
+ *----------------------------------------------------------------------
+ *
+ * CloneProcBody --
+ *
+ *  Creates the procbody object for a procedure definition whose argument
+ *  list and body are identical to those of an earlier definition, which
+ *  has already been compiled by CompileOneProcBody. The new Proc shares
+ *  the compiled body of the earlier one, and gets its own copy of the
+ *  compiled locals; each definition must still have a Proc of its own,
+ *  since a Proc is bound to the command created from it at load time.
+ *
+ * Results:
+ *  Returns TCL_OK.
+ *
+ * Side effects:
+ *  Replaces the body object in the object table with the new procbody
+ *  object.
+ *
+ *----------------------------------------------------------------------
+ */
 
-        nameLength = strlen(fieldValues[0]);
-        if (fieldCount == 2)
-        {
-            valueLength = strlen(fieldValues[1]);
-        }
-        else
-        {
-            valueLength = 0;
-        }
+static int CloneProcBody(ProcBodyInfo* firstPtr, ProcBodyInfo* infoPtr, CompilerContext* ctxPtr, CompileEnv* compEnvPtr)
+{
+    Tcl_Obj* firstObjPtr = compEnvPtr->literalArrayPtr[firstPtr->bodyNewIndex].objPtr;
+    Proc* firstProcPtr;
+    Proc* procPtr;
+    CompiledLocal *firstLocalPtr, *localPtr;
+    Tcl_Obj* procObjPtr;
+    size_t localSize;
 
-        /*
-         * Check that the formal parameter name is a scalar.
-         */
+    if (firstObjPtr->typePtr != cmpProcBodyType)
+    {
+        Tcl_Panic("CloneProcBody: first body is not compiled");
+    }
+    firstProcPtr = (Proc*)firstObjPtr->internalRep.twoPtrValue.ptr1;
 
-        p = fieldValues[0];
-        while (*p != '\0')
+    procPtr = (Proc*)Tcl_Alloc(sizeof(Proc));
+    procPtr->iPtr = firstProcPtr->iPtr;
+    procPtr->refCount = 1;
+    procPtr->cmdPtr = (Command*)NULL;
+    procPtr->bodyPtr = firstProcPtr->bodyPtr;
+    Tcl_IncrRefCount(procPtr->bodyPtr);
+    procPtr->numArgs = firstProcPtr->numArgs;
+    procPtr->numCompiledLocals = firstProcPtr->numCompiledLocals;
+    procPtr->firstLocalPtr = NULL;
+    procPtr->lastLocalPtr = NULL;
+
+    for (firstLocalPtr = firstProcPtr->firstLocalPtr; firstLocalPtr; firstLocalPtr = firstLocalPtr->nextPtr)
+    {
+        localSize = offsetof(CompiledLocal, name) + 1U + firstLocalPtr->nameLength;
+        localPtr = (CompiledLocal*)Tcl_Alloc(localSize);
+        memcpy(localPtr, firstLocalPtr, localSize);
+        localPtr->nextPtr = NULL;
+        localPtr->resolveInfo = NULL;
+        if (localPtr->defValuePtr)
         {
-            if (*p == '(')
-            {
-                const char* q = p;
-                do
-                {
-                    q++;
-                } while (*q != '\0');
-                q--;
-                if (*q == ')')
-                { /* we have an array element */
-                    Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
-                                           "compilation of procedure \"",
-                                           fullName,
-                                           "\" failed: formal parameter \"",
-                                           fieldValues[0],
-                                           "\" is an array element",
-                                           (char*)NULL);
-                    Tcl_Free((char*)fieldValues);
-                    Tcl_DecrRefCount(bodyPtr);
-                    Tcl_Free((char*)procPtr);
-                    return result;
-                }
-            }
-            p++;
+            Tcl_IncrRefCount(localPtr->defValuePtr);
         }
 
-        /*
-         * Allocate an entry in the runtime procedure frame's array of local
-         * variables for the argument.
-         */
-        localPtr = (CompiledLocal*)Tcl_Alloc(offsetof(CompiledLocal, name) + 1U + nameLength);
-
         if (procPtr->firstLocalPtr == NULL)
         {
             procPtr->firstLocalPtr = procPtr->lastLocalPtr = localPtr;
@@ -2748,183 +6627,321 @@ static int CompileOneProcBody(Tcl_Interp* interp, ProcBodyInfo* infoPtr, Compile
             procPtr->lastLocalPtr->nextPtr = localPtr;
             procPtr->lastLocalPtr = localPtr;
         }
-        localPtr->nextPtr = NULL;
-        localPtr->nameLength = nameLength;
-        localPtr->frameIndex = i;
-        localPtr->flags = VAR_ARGUMENT;
-        localPtr->resolveInfo = NULL;
+    }
+
+    /*
+     * The procbody object takes its own reference to the Proc; drop ours.
+     */
+
+    procObjPtr = TclNewProcBodyObj(procPtr);
+    Tcl_IncrRefCount(procObjPtr);
+    procPtr->refCount--;
+
+    Tcl_DecrRefCount(compEnvPtr->literalArrayPtr[infoPtr->bodyNewIndex].objPtr);
+    compEnvPtr->literalArrayPtr[infoPtr->bodyNewIndex].objPtr = procObjPtr;
+
+    ctxPtr->numClonedBodies += 1;
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DummyObjInterpProc --
+ *
+ *  Dummy, used to supply a nonzero value to the dummyCommand object.
+ *
+ * Results:
+ *  Returns TCL_OK.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DummyObjInterpProc(void* clientData, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+{
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CmpDeleteProc --
+ *
+ *  From ProcDeleteProc in tclProc.c; the rest of the header is the one for
+ *  ProcDeleteProc.
+ *
+ *  This procedure is invoked just before a command procedure is
+ *  removed from an interpreter.  Its job is to release all the
+ *  resources allocated to the procedure.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Memory gets freed, unless the procedure is actively being
+ *  executed.  In this case the cleanup is delayed until the
+ *  last call to the current procedure completes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void CmpDeleteProc(void* clientData)
+{
+    Proc* procPtr = (Proc*)clientData;
+
+    procPtr->refCount--;
+    if (procPtr->refCount <= 0)
+    {
+        TclProcCleanupProc(procPtr);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * UnshareProcBodies --
+ *
+ *  If any of the procedure bodies are shared, create duplicate objects so
+ *  that they are no longer shared. The index to the new object is stored in
+ *  the info structs for later use by the compilation procedure.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  May add objects to the object table for the compilation environment.
+ *  Tcl_Panics on error.
+ *
+ *----------------------------------------------------------------------
+ */
 
-        if (fieldCount == 2)
-        {
-            localPtr->defValuePtr = Tcl_NewStringObj(fieldValues[1], valueLength);
-            Tcl_IncrRefCount(localPtr->defValuePtr);
-        }
-        else
-        {
-            localPtr->defValuePtr = NULL;
-        }
-        strcpy(localPtr->name, fieldValues[0]);
+static void UnshareProcBodies(Tcl_Interp* interp, CompilerContext* ctxPtr, CompileEnv* compEnvPtr)
+{
+    PostProcessInfo* infoPtr = ctxPtr->ppi;
+    ProcBodyInfo** infoArrayPtr;
+    ProcBodyInfo* bodyInfoPtr;
+    Tcl_Size origIndex;
+    Tcl_HashTable* objTablePtr;
+    Tcl_HashEntry* entryPtr;
+    ObjRefInfo* refInfoPtr;
 
-        Tcl_Free((char*)fieldValues);
+    infoPtr->numUnshares = 0;
+
+    if (infoPtr->numProcs < 1)
+    {
+        return;
     }
 
-    if (result != TCL_OK)
+    objTablePtr = &infoPtr->objTable;
+    for (infoArrayPtr = infoPtr->infoArrayPtr; *infoArrayPtr; infoArrayPtr++)
     {
-        for (localPtr = procPtr->firstLocalPtr; localPtr;)
+        bodyInfoPtr = *infoArrayPtr;
+        origIndex = bodyInfoPtr->bodyOrigIndex;
+        if (origIndex != -1)
         {
-            CompiledLocal* next = localPtr->nextPtr;
-            if (localPtr->defValuePtr)
-                Tcl_DecrRefCount(localPtr->defValuePtr);
-            Tcl_Free((void*)localPtr);
-            localPtr = next;
-        }
-        Tcl_DecrRefCount(bodyPtr);
-        Tcl_Free((char*)procPtr);
-        Tcl_Free((char*)argArray);
-        return result;
-    }
+            entryPtr = Tcl_FindHashEntry(objTablePtr, (char*)SIZE2PTR(origIndex));
+            if (!entryPtr)
+            {
+                Tcl_Panic("UnshareProcBodies: no ObjRefInfo entry in objTable!");
+            }
+            refInfoPtr = (ObjRefInfo*)Tcl_GetHashValue(entryPtr);
 
-    /*
-     * Now create a command for the procedure. This will initially be in
-     * the current namespace unless the procedure's name included namespace
-     * qualifiers. To create the new command in the right namespace, we
-     * generate a fully qualified name for it.
-     */
+            if (refInfoPtr->numReferences < 2)
+            {
+                /*
+                 * Not a shared object, but we still need to remove
+                 * the object from the literal hash table so it
+                 * doesn't show up as a local literal without a global.
+                 */
 
-    /*
-     * Make sure that the temporary name is not already used
-     */
+                TclHideLiteral(interp, compEnvPtr, bodyInfoPtr->bodyNewIndex);
 
-    do
-    {
-        sprintf(cmdNameBuf, dummyCommandName, dummyCommandCounter);
-        cmd = Tcl_FindCommand(interp, dummyCommandName, (Tcl_Namespace*)NULL, TCL_GLOBAL_ONLY);
-        dummyCommandCounter += 1;
-    } while (cmd != (Tcl_Command)NULL);
+                continue;
+            }
 
-    cmd = Tcl_CreateObjCommand(interp, cmdNameBuf, DummyObjInterpProc, (void*)procPtr, CmpDeleteProc);
+            /*
+             * If the only sharing is among procedure bodies, then we can
+             * copy N - 1 objects, and compile one in place.
+             * But if at least one other entity is sharing, then we must
+             * unshare all the procedure bodies.
+             */
 
-    if (cmd == (Tcl_Command)NULL)
-    {
-        for (localPtr = procPtr->firstLocalPtr; localPtr;)
-        {
-            CompiledLocal* next = localPtr->nextPtr;
-            if (localPtr->defValuePtr)
-                Tcl_DecrRefCount(localPtr->defValuePtr);
-            Tcl_Free((char*)localPtr);
-            localPtr = next;
+            if ((refInfoPtr->numReferences == refInfoPtr->numProcReferences) && (refInfoPtr->numUnshares < 1))
+            {
+                /*
+                 * do not copy the first occurrence, just remove it from
+                 * the global and local literal hash tables
+                 */
+
+                TclHideLiteral(interp, compEnvPtr, bodyInfoPtr->bodyNewIndex);
+                refInfoPtr->numUnshares = 1;
+            }
+            else
+            {
+                /* (xxxx) */
+
+                bodyInfoPtr->bodyNewIndex = UnshareObject(origIndex, compEnvPtr);
+                refInfoPtr->numUnshares += 1;
+                infoPtr->numUnshares += 1;
+                ctxPtr->numUnshares += 1;
+            }
+
+            if (refInfoPtr->numUnshares == 1)
+            {
+                ctxPtr->numUnsharedBodies += 1;
+            }
         }
-        Tcl_DecrRefCount(bodyPtr);
-        Tcl_Free((char*)procPtr);
-        Tcl_Free((char*)argArray);
-        return TCL_ERROR;
     }
+}
 
-    /*
-     * Now initialize the new procedure's cmdPtr field. This will be used
-     * later when the procedure is called to determine what namespace the
-     * procedure will run in. This will be different than the current
-     * namespace if the proc was renamed into a different namespace.
-     */
-
-    procPtr->cmdPtr = (Command*)cmd;
+/*
+ *----------------------------------------------------------------------
+ *
+ * UnshareObject --
+ *
+ *  Creates a copy of an object, and adds it to the object table for the
+ *  compilation environment.
+ *
+ * Results:
+ *  Returns the index to the newly created object.
+ *
+ * Side effects:
+ *  The copy is counted in the memory statistics.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    /*
-     * At this stage, we are ready to compile the procedure body.
-     * Much of this code is derived from TclObjInterpProc.
-     *
-     * We force a recompilation of the body, even if the body is already
-     * of bytecode type.
-     */
+static Tcl_Size UnshareObject(Tcl_Size origIndex, CompileEnv* compEnvPtr)
+{
+    MemoryCounters* countersPtr = GetMemoryCounters();
+    Tcl_Obj* objPtr = Tcl_DuplicateObj(compEnvPtr->literalArrayPtr[origIndex].objPtr);
+    Tcl_Size length;
 
-    if (bodyPtr->typePtr)
+    Tcl_GetStringFromObj(objPtr, &length);
+    countersPtr->allocated += sizeof(Tcl_Obj) + length + 1;
+    countersPtr->live += sizeof(Tcl_Obj) + length + 1;
+    countersPtr->transient += sizeof(Tcl_Obj) + length + 1;
+    if (countersPtr->live > countersPtr->peak)
     {
-        bodyPtr->typePtr->freeIntRepProc(bodyPtr);
-        bodyPtr->typePtr = (Tcl_ObjType*)NULL;
+        countersPtr->peak = countersPtr->live;
     }
 
-    saveProcPtr = iPtr->compiledProcPtr;
-    iPtr->compiledProcPtr = procPtr;
-    result = cmpByteCodeType->setFromAnyProc(interp, bodyPtr);
-    iPtr->compiledProcPtr = saveProcPtr;
-
-    if (result != TCL_OK)
-    {
-        if (result == TCL_ERROR)
-        {
-            char buf[100];
-            Tcl_Size numChars;
-            char* ellipsis;
+    return TclAddLiteralObj(compEnvPtr, objPtr, NULL);
+}
 
-            /*
-             * Prepend the procedure name to the error object
-             */
+/*
+ *----------------------------------------------------------------------
+ *
+ * UpdateByteCodes --
+ *
+ *  If any of the procedure bodies have been compiled, or have been unshared
+ *  (if they are unshared then they also were compiled), we need to modify the
+ *  bytecodes so that the correct object index is pushed on the stack.
+ *  There are two cases where we need to modify the bytecodes:
+ *    1. A procedure body that has been compiled is stored as a TclProBodyType
+ *       Tcl_Obj; this is an object that contains the ByteCode, and also some
+ *       fields from the Proc struct, which need to be loaded at runtime
+ *       (they cannot be regenerated at runtime because the body is already
+ *       compiled, and the compiler does that work at runtime). In this case,
+ *       we need to push the name of the loader package's bcproc command,
+ *       which is a modified version of proc which knows how to handle the
+ *       TclProBodyType object.
+ *    2. If the body has been unshared, we have to make sure the the correct
+ *       index in the object table is used; the original one refers to the
+ *       shared object.
+ *
+ * Results:
+ *  A standard TCL result code. The bytecodes cannot be rewritten if a
+ *  jump that cannot be widened no longer fits, or if the code would grow
+ *  past the 32 bit code offsets (see RelayoutByteCodes); the compilation
+ *  then fails with an error message in interp.
+ *
+ * Side effects:
+ *  May modify the bytecodes, possibly reallocating the bytecode array; may
+ *  also modify support data structures in the compilation environment.
+ *
+ *----------------------------------------------------------------------
+ */
 
-            sprintf(buf, "compilation of procedure \"%s\" failed: ", fullName);
-            PrependResult(interp, buf);
+static int UpdateByteCodes(Tcl_Interp* interp, PostProcessInfo* infoPtr, CompileEnv* compEnvPtr)
+{
+    ProcBodyInfo** infoArrayPtr;
+    ProcBodyInfo* bodyInfoPtr;
+    Tcl_Size procNameObjIndex;
+    Tcl_HashTable operandTable;
+    Tcl_HashEntry* entryPtr;
+    Tcl_Obj* objPtr;
+    int isNew, result;
 
-            numChars = strlen(fullName);
-            ellipsis = "";
-            if (numChars > 50)
-            {
-                numChars = 50;
-                ellipsis = "...";
-            }
-            sprintf(buf,
-                    "\n    (compiling body of proc \"%.*s%s\", line %d)",
-                    (int)numChars,
-                    fullName,
-                    ellipsis,
-                    Tcl_GetErrorLine(interp));
-            Tcl_AppendObjToErrorInfo(interp, Tcl_NewStringObj(buf, -1));
-        }
-        Tcl_DeleteCommandFromToken(interp, cmd);
-        Tcl_Free((char*)argArray);
-        return result;
+    if ((infoPtr->numCompiledBodies == 0) && (infoPtr->numClonedBodies == 0))
+    {
+        return TCL_OK;
     }
 
-    ctxPtr->numCompiledBodies += 1;
+    /*
+     * Some bodies were compiled: create a new string object containing the
+     * name of the loader package's proc command, add it to the object table,
+     * and use its index as the operand to the first PUSH instruction.
+     */
+
+    objPtr = Tcl_NewObj();
+    Tcl_IncrRefCount(objPtr);
+    Tcl_AppendStringsToObj(objPtr, loaderName, "::", procCommand, NULL);
+    procNameObjIndex = TclAddLiteralObj(compEnvPtr, objPtr, NULL);
+    Tcl_DecrRefCount(objPtr);
 
     /*
-     * Now that we have compiled the procedure, create a new TCL object
-     * containing both the bytecodes and the info stored in the Proc struct.
-     * this info is usually generated at run time during the compilation of
-     * the procedure body, but of course this won't be possible in our case
-     * (the body is already compiled). So, we use this strategy:
-     *   1. compile the body, then save the relevant parts of Proc into a
-     *      procbody object. This object replaces the proc body object
-     *      in the object table.
-     *   2. tweak the name of the command to call from "proc" to
-     *      "loader::bcproc". This is our version of "proc" that knows how
-     *      to reconstruct the Proc struct from the TclProProcBody object.
+     * Record the new operands of the PUSH instructions by their offset,
+     * then rewrite the bytecodes in one go. If an operand no longer fits in
+     * a PUSH1 (in particular, if the bcproc name landed at index 256 or
+     * above), RelayoutByteCodes widens the instruction and corrects every
+     * offset affected by the growth.
      */
 
-    procObjPtr = TclNewProcBodyObj(procPtr);
-    Tcl_IncrRefCount(procObjPtr);
-    compEnvPtr->literalArrayPtr[infoPtr->bodyNewIndex].objPtr = procObjPtr;
-    Tcl_DecrRefCount(bodyPtr);
-    Tcl_Free((char*)argArray);
-    if (cmd)
-    {
-        Tcl_DeleteCommandFromToken(interp, cmd);
-    }
-    else
+    Tcl_InitHashTable(&operandTable, TCL_ONE_WORD_KEYS);
+    for (infoArrayPtr = infoPtr->infoArrayPtr; *infoArrayPtr; infoArrayPtr++)
     {
-        TclProcCleanupProc(procPtr);
+        bodyInfoPtr = *infoArrayPtr;
+        if (bodyInfoPtr->bodyNewIndex != -1)
+        {
+            entryPtr = Tcl_CreateHashEntry(&operandTable, (char*)SIZE2PTR(bodyInfoPtr->procOffset), &isNew);
+            Tcl_SetHashValue(entryPtr, SIZE2PTR(procNameObjIndex));
+            if (bodyInfoPtr->bodyNewIndex != bodyInfoPtr->bodyOrigIndex)
+            {
+                entryPtr = Tcl_CreateHashEntry(&operandTable, (char*)SIZE2PTR(bodyInfoPtr->bodyOffset), &isNew);
+                Tcl_SetHashValue(entryPtr, SIZE2PTR(bodyInfoPtr->bodyNewIndex));
+            }
+        }
     }
 
+    result = RelayoutByteCodes(compEnvPtr, NULL, &operandTable, NULL, 0, NULL);
+    Tcl_DeleteHashTable(&operandTable);
+    if (result != TCL_OK)
+    {
+        Tcl_SetObjResult(interp,
+                         Tcl_NewStringObj("cannot rewrite the bytecodes of the procedure definitions: "
+                                          "a jump or the code size no longer fits",
+                                          -1));
+    }
     return result;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * DummyObjInterpProc --
+ * GetSharedIndex --
  *
- *  Dummy, used to supply a nonzero value to the dummyCommand object.
+ *  Looks at the bytecode instruction at *pc, if the instruction is one
+ *  that makes a reference to an object in the object table extract the
+ *  index operand and return it.
  *
  * Results:
- *  Returns TCL_OK.
+ *  Returns an index into the object table, or -1 if this instruction is
+ *  not on the list of instructions that make index references.
  *
  * Side effects:
  *  None.
@@ -2932,153 +6949,338 @@ static int CompileOneProcBody(Tcl_Interp* interp, ProcBodyInfo* infoPtr, Compile
  *----------------------------------------------------------------------
  */
 
-static int DummyObjInterpProc(void* clientData, Tcl_Interp* interp, int objc, Tcl_Obj* const objv[])
+static Tcl_Size GetSharedIndex(unsigned char* pc)
 {
-    return TCL_OK;
+    unsigned int objIndex;
+
+    switch (*pc)
+    {
+        case INST_PUSH1:
+            objIndex = TclGetUInt1AtPtr(pc + 1);
+            break;
+
+        case INST_PUSH4:
+            objIndex = TclGetUInt4AtPtr(pc + 1);
+            break;
+
+        default:
+            return -1;
+    }
+
+    return (Tcl_Size)objIndex;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * CmpDeleteProc --
- *
- *  From ProcDeleteProc in tclProc.c; the rest of the header is the one for
- *  ProcDeleteProc.
+ * AddProfileCounters --
  *
- *  This procedure is invoked just before a command procedure is
- *  removed from an interpreter.  Its job is to release all the
- *  resources allocated to the procedure.
+ *  Instruments the bytecodes of a compilation environment for -profile:
+ *  the start of each command of the command location map is prefixed with
+ *  code that increments the element "unitName index" of the global array
+ *  CMP_PROFILE_VARIABLE, where index is the command number plus firstIndex,
+ *  the number of commands in the earlier chunks of a script compiled with
+ *  -chunk. The counters are dumped by the code emitted by
+ *  EmitProfileRuntime.
  *
  * Results:
  *  None.
  *
  * Side effects:
- *  Memory gets freed, unless the procedure is actively being
- *  executed.  In this case the cleanup is delayed until the
- *  last call to the current procedure completes.
+ *  Registers the array name and the element names as literals, and
+ *  rewrites the bytecodes (see RelayoutByteCodes). If they cannot be
+ *  rewritten, the commands are not counted.
  *
  *----------------------------------------------------------------------
  */
 
-static void CmpDeleteProc(void* clientData)
+static void AddProfileCounters(CompileEnv* compEnvPtr, const char* unitName, Tcl_Size firstIndex)
 {
-    Proc* procPtr = (Proc*)clientData;
+    InstructionDesc* opCodesTablePtr = (InstructionDesc*)TclGetInstructionTable();
+    Tcl_Size codeSize = compEnvPtr->codeNext - compEnvPtr->codeStart;
+    Tcl_Size numCommands = compEnvPtr->numCommands;
+    Tcl_Size* keyIndex;
+    Tcl_Size i, j, offset, arrayIndex, numBytes, numSites, numPrefixes;
+    RelayoutPrefix *sites, *prefixPtr;
+    unsigned char *prefixBytes, *p, *pc;
+    Tcl_Obj* keyPtr;
+    const char* bytes;
+    Tcl_Size length;
+
+    if (numCommands < 1)
+    {
+        return;
+    }
 
-    procPtr->refCount--;
-    if (procPtr->refCount <= 0)
+    /*
+     * The work arrays have an entry per command rather than per code byte.
+     * The sites, first holding the offset and number of each command, are
+     * sorted by offset so that a single walk of the instructions finds the
+     * commands that start on one: only those can take a prefix.
+     */
+
+    sites = (RelayoutPrefix*)CmpAlloc(numCommands * sizeof(RelayoutPrefix));
+    keyIndex = (Tcl_Size*)CmpAlloc(numCommands * sizeof(Tcl_Size));
+    numSites = 0;
+    for (i = 0; i < numCommands; i++)
     {
-        TclProcCleanupProc(procPtr);
+        keyIndex[i] = -1;
+        offset = compEnvPtr->cmdMapPtr[i].codeOffset;
+        if ((offset >= 0) && (offset < codeSize))
+        {
+            sites[numSites].offset = offset;
+            sites[numSites].start = i;
+            sites[numSites].length = 0;
+            numSites++;
+        }
+    }
+    qsort(sites, numSites, sizeof(RelayoutPrefix), CompareRelayoutPrefixes);
+
+    j = 0;
+    for (pc = compEnvPtr->codeStart; (pc < compEnvPtr->codeNext) && (j < numSites); pc += opCodesTablePtr[*pc].numBytes)
+    {
+        offset = pc - compEnvPtr->codeStart;
+        while ((j < numSites) && (sites[j].offset < offset))
+        {
+            j++;
+        }
+        for (; (j < numSites) && (sites[j].offset == offset); j++)
+        {
+            keyIndex[sites[j].start] = 0;
+        }
+    }
+
+    /*
+     * Register the literals, in command order, and size the prefix of each
+     * command: push the array name, push the element name, incrArrayStkImm
+     * +1, pop.
+     */
+
+    arrayIndex = TclRegisterLiteral(compEnvPtr, (char*)CMP_PROFILE_VARIABLE, -1, 0);
+    numBytes = 0;
+    for (i = 0; i < numCommands; i++)
+    {
+        if (keyIndex[i] == -1)
+        {
+            continue;
+        }
+        keyPtr = Tcl_NewListObj(0, NULL);
+        Tcl_ListObjAppendElement(NULL, keyPtr, Tcl_NewStringObj(unitName, -1));
+        Tcl_ListObjAppendElement(NULL, keyPtr, Tcl_NewWideIntObj(firstIndex + i));
+        bytes = Tcl_GetStringFromObj(keyPtr, &length);
+        keyIndex[i] = TclRegisterLiteral(compEnvPtr, (char*)bytes, length, 0);
+        Tcl_DecrRefCount(keyPtr);
+
+        numBytes += ((arrayIndex > 255) ? 5 : 2) + ((keyIndex[i] > 255) ? 5 : 2) + 3;
+    }
+
+    /*
+     * Fill in the prefixes in offset order, the commands that start at the
+     * same offset in command order, and merge the sites of each offset
+     * into one prefix, in place.
+     */
+
+    prefixBytes = (unsigned char*)CmpAlloc(numBytes + 1);
+    p = prefixBytes;
+    numPrefixes = 0;
+    prefixPtr = NULL;
+    for (j = 0; j < numSites; j++)
+    {
+        i = sites[j].start;
+        if (keyIndex[i] == -1)
+        {
+            continue;
+        }
+        if (!prefixPtr || (prefixPtr->offset != sites[j].offset))
+        {
+            prefixPtr = &sites[numPrefixes++];
+            prefixPtr->offset = sites[j].offset;
+            prefixPtr->start = p - prefixBytes;
+        }
+        if (arrayIndex > 255)
+        {
+            TclUpdateInstInt4AtPc(INST_PUSH4, arrayIndex, p);
+            p += 5;
+        }
+        else
+        {
+            TclUpdateInstInt1AtPc(INST_PUSH1, arrayIndex, p);
+            p += 2;
+        }
+        if (keyIndex[i] > 255)
+        {
+            TclUpdateInstInt4AtPc(INST_PUSH4, keyIndex[i], p);
+            p += 5;
+        }
+        else
+        {
+            TclUpdateInstInt1AtPc(INST_PUSH1, keyIndex[i], p);
+            p += 2;
+        }
+        TclUpdateInstInt1AtPc(INST_INCR_ARRAY_STK_IMM, 1, p);
+        p += 2;
+        *p++ = INST_POP;
+        prefixPtr->length = (p - prefixBytes) - prefixPtr->start;
+    }
+
+    /*
+     * A prefix pushes two values over the stack of the instruction it
+     * precedes.
+     */
+
+    if (RelayoutByteCodes(compEnvPtr, NULL, NULL, sites, numPrefixes, prefixBytes) == TCL_OK)
+    {
+        compEnvPtr->maxStackDepth += 2;
     }
+
+    CmpFree(prefixBytes);
+    CmpFree(keyIndex);
+    CmpFree(sites);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * UnshareProcBodies --
+ * RenumberLiterals --
  *
- *  If any of the procedure bodies are shared, create duplicate objects so
- *  that they are no longer shared. The index to the new object is stored in
- *  the info structs for later use by the compilation procedure.
+ *  Reorders the literal table of a compilation environment so that the
+ *  literals pushed most often get indices below 256, and can therefore
+ *  be pushed with the 2-byte INST_PUSH1 rather than the 5-byte INST_PUSH4.
+ *  Each push counts with a weight of 8 per level of loop nesting, taken
+ *  from the LOOP exception ranges that cover it. Hot literals above 255
+ *  are swapped with the coldest literals below 256; the order of all other
+ *  literals is preserved.
  *
  * Results:
  *  None.
  *
  * Side effects:
- *  May add objects to the object table for the compilation environment.
- *  Tcl_Panics on error.
+ *  May rewrite the bytecodes (see RelayoutByteCodes) and reorder the
+ *  literal array and local literal table.
  *
  *----------------------------------------------------------------------
  */
 
-static void UnshareProcBodies(Tcl_Interp* interp, CompilerContext* ctxPtr, CompileEnv* compEnvPtr)
+static void RenumberLiterals(CompileEnv* compEnvPtr)
 {
-    PostProcessInfo* infoPtr = ctxPtr->ppi;
-    ProcBodyInfo** infoArrayPtr;
-    ProcBodyInfo* bodyInfoPtr;
-    Tcl_Size origIndex;
-    Tcl_HashTable* objTablePtr;
-    Tcl_HashEntry* entryPtr;
-    ObjRefInfo* refInfoPtr;
-
-    infoPtr->numUnshares = 0;
+    InstructionDesc* opCodesTablePtr = (InstructionDesc*)TclGetInstructionTable();
+    Tcl_Size numLiterals = compEnvPtr->literalArrayNext;
+    Tcl_Size i, index, offset, level, numLoops, numStarted, numEnded, numHot, numCold, numSwaps;
+    Tcl_Size *loopStarts, *loopEnds, *weight, *litMap;
+    LitWeight *hotPtr, *coldPtr;
+    ExceptionRange* excPtr;
+    unsigned char* pc;
 
-    if (infoPtr->numProcs < 1)
+    if (numLiterals <= 256)
     {
         return;
     }
 
-    objTablePtr = &infoPtr->objTable;
-    for (infoArrayPtr = infoPtr->infoArrayPtr; *infoArrayPtr; infoArrayPtr++)
+    /*
+     * Compute the weighted push count of each literal. The loop nesting
+     * depth at each instruction is the number of LOOP ranges started at or
+     * before it minus the number ended, tracked by walking the sorted range
+     * bounds along with the code.
+     */
+
+    loopStarts = (Tcl_Size*)CmpAlloc((compEnvPtr->exceptArrayNext + 1) * sizeof(Tcl_Size));
+    loopEnds = (Tcl_Size*)CmpAlloc((compEnvPtr->exceptArrayNext + 1) * sizeof(Tcl_Size));
+    numLoops = 0;
+    excPtr = compEnvPtr->exceptArrayPtr;
+    for (i = 0; i < compEnvPtr->exceptArrayNext; i++, excPtr++)
     {
-        bodyInfoPtr = *infoArrayPtr;
-        origIndex = bodyInfoPtr->bodyOrigIndex;
-        if (origIndex != -1)
+        if (excPtr->type == LOOP_EXCEPTION_RANGE)
         {
-            entryPtr = Tcl_FindHashEntry(objTablePtr, (char*)INT2PTR(origIndex));
-            if (!entryPtr)
-            {
-                Tcl_Panic("UnshareProcBodies: no ObjRefInfo entry in objTable!");
-            }
-            refInfoPtr = (ObjRefInfo*)Tcl_GetHashValue(entryPtr);
-
-            if (refInfoPtr->numReferences < 2)
-            {
-                /*
-                 * Not a shared object, but we still need to remove
-                 * the object from the literal hash table so it
-                 * doesn't show up as a local literal without a global.
-                 */
-
-                TclHideLiteral(interp, compEnvPtr, bodyInfoPtr->bodyNewIndex);
+            loopStarts[numLoops] = excPtr->codeOffset;
+            loopEnds[numLoops++] = excPtr->codeOffset + excPtr->numCodeBytes;
+        }
+    }
+    qsort(loopStarts, numLoops, sizeof(Tcl_Size), CompareSizes);
+    qsort(loopEnds, numLoops, sizeof(Tcl_Size), CompareSizes);
 
-                continue;
-            }
+    weight = (Tcl_Size*)CmpAlloc(numLiterals * sizeof(Tcl_Size));
+    memset(weight, 0, numLiterals * sizeof(Tcl_Size));
+    numStarted = numEnded = 0;
+    for (pc = compEnvPtr->codeStart; pc < compEnvPtr->codeNext; pc += opCodesTablePtr[*pc].numBytes)
+    {
+        offset = pc - compEnvPtr->codeStart;
+        while ((numStarted < numLoops) && (loopStarts[numStarted] <= offset))
+        {
+            numStarted++;
+        }
+        while ((numEnded < numLoops) && (loopEnds[numEnded] <= offset))
+        {
+            numEnded++;
+        }
+        index = GetSharedIndex(pc);
+        if (index >= 0)
+        {
+            level = numStarted - numEnded;
+            weight[index] += (Tcl_Size)1 << (3 * ((level > 6) ? 6 : level));
+        }
+    }
+    CmpFree(loopStarts);
+    CmpFree(loopEnds);
 
-            /*
-             * If the only sharing is among procedure bodies, then we can
-             * copy N - 1 objects, and compile one in place.
-             * But if at least one other entity is sharing, then we must
-             * unshare all the procedure bodies.
-             */
+    /*
+     * Pair the hottest literals above 255 with the coldest ones below 256,
+     * for as long as the swap is a gain.
+     */
 
-            if ((refInfoPtr->numReferences == refInfoPtr->numProcReferences) && (refInfoPtr->numUnshares < 1))
-            {
-                /*
-                 * do not copy the first occurrence, just remove it from
-                 * the global and local literal hash tables
-                 */
+    hotPtr = (LitWeight*)CmpAlloc(numLiterals * sizeof(LitWeight));
+    coldPtr = (LitWeight*)CmpAlloc(256 * sizeof(LitWeight));
+    numHot = numCold = 0;
+    for (i = 0; i < numLiterals; i++)
+    {
+        if (i < 256)
+        {
+            coldPtr[numCold].index = i;
+            coldPtr[numCold++].weight = weight[i];
+        }
+        else if (weight[i] > 0)
+        {
+            hotPtr[numHot].index = i;
+            hotPtr[numHot++].weight = weight[i];
+        }
+    }
+    CmpFree(weight);
 
-                TclHideLiteral(interp, compEnvPtr, bodyInfoPtr->bodyNewIndex);
-                refInfoPtr->numUnshares = 1;
-            }
-            else
-            {
-                /* (xxxx) */
+    qsort(hotPtr, numHot, sizeof(LitWeight), CompareLitWeights);
+    qsort(coldPtr, numCold, sizeof(LitWeight), CompareLitWeights);
 
-                bodyInfoPtr->bodyNewIndex = UnshareObject(origIndex, compEnvPtr);
-                refInfoPtr->numUnshares += 1;
-                infoPtr->numUnshares += 1;
-                ctxPtr->numUnshares += 1;
-            }
+    litMap = (Tcl_Size*)CmpAlloc(numLiterals * sizeof(Tcl_Size));
+    for (i = 0; i < numLiterals; i++)
+    {
+        litMap[i] = i;
+    }
+    numSwaps = 0;
+    while ((numSwaps < numHot) && (numSwaps < numCold) &&
+           (hotPtr[numSwaps].weight > coldPtr[numCold - 1 - numSwaps].weight))
+    {
+        litMap[hotPtr[numSwaps].index] = coldPtr[numCold - 1 - numSwaps].index;
+        litMap[coldPtr[numCold - 1 - numSwaps].index] = hotPtr[numSwaps].index;
+        numSwaps++;
+    }
+    CmpFree(hotPtr);
+    CmpFree(coldPtr);
 
-            if (refInfoPtr->numUnshares == 1)
-            {
-                ctxPtr->numUnsharedBodies += 1;
-            }
-        }
+    if ((numSwaps > 0) && (RelayoutByteCodes(compEnvPtr, litMap, NULL, NULL, 0, NULL) == TCL_OK))
+    {
+        PermuteLiterals(compEnvPtr, litMap);
     }
+    CmpFree(litMap);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * UnshareObject --
+ * CompareLitWeights --
  *
- *  Creates a copy of an object, and adds it to the object table for the
- *  compilation environment.
+ *  qsort comparison function for LitWeight structs: orders by decreasing
+ *  weight, then by increasing literal index.
  *
  * Results:
- *  Returns the index to the newly created object.
+ *  Returns a negative, zero, or positive value.
  *
  * Side effects:
  *  None.
@@ -3086,754 +7288,777 @@ static void UnshareProcBodies(Tcl_Interp* interp, CompilerContext* ctxPtr, Compi
  *----------------------------------------------------------------------
  */
 
-static int UnshareObject(Tcl_Size origIndex, CompileEnv* compEnvPtr)
+static int CompareLitWeights(const void* first, const void* second)
 {
-    return TclAddLiteralObj(compEnvPtr, Tcl_DuplicateObj(compEnvPtr->literalArrayPtr[origIndex].objPtr), NULL);
+    const LitWeight* firstPtr = (const LitWeight*)first;
+    const LitWeight* secondPtr = (const LitWeight*)second;
+
+    if (firstPtr->weight != secondPtr->weight)
+    {
+        return (firstPtr->weight > secondPtr->weight) ? -1 : 1;
+    }
+    return (firstPtr->index < secondPtr->index) ? -1 : (firstPtr->index > secondPtr->index);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * UpdateByteCodes --
+ * CompareSizes --
  *
- *  If any of the procedure bodies have been compiled, or have been unshared
- *  (if they are unshared then they also were compiled), we need to modify the
- *  bytecodes so that the correct object index is pushed on the stack.
- *  There are two cases where we need to modify the bytecodes:
- *    1. A procedure body that has been compiled is stored as a TclProBodyType
- *       Tcl_Obj; this is an object that contains the ByteCode, and also some
- *       fields from the Proc struct, which need to be loaded at runtime
- *       (they cannot be regenerated at runtime because the body is already
- *       compiled, and the compiler does that work at runtime). In this case,
- *       we need to push the name of the loader package's bcproc command,
- *       which is a modified version of proc which knows how to handle the
- *       TclProBodyType object.
- *    2. If the body has been unshared, we have to make sure the the correct
- *       index in the object table is used; the original one refers to the
- *       shared object.
+ *  qsort comparison function for Tcl_Size values, in increasing order.
  *
  * Results:
+ *  Returns a negative, zero, or positive value.
+ *
+ * Side effects:
  *  None.
  *
+ *----------------------------------------------------------------------
+ */
+
+static int CompareSizes(const void* first, const void* second)
+{
+    Tcl_Size firstSize = *(const Tcl_Size*)first;
+    Tcl_Size secondSize = *(const Tcl_Size*)second;
+
+    return (firstSize < secondSize) ? -1 : (firstSize > secondSize);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RelayoutByteCodes --
+ *
+ *  Rewrites the bytecodes in a compilation environment, renumbering the
+ *  operands of the PUSH instructions through litMap and choosing the 1 or
+ *  4 byte form of each PUSH to fit its new operand. If operandTablePtr is
+ *  not NULL, it maps code offsets (TCL_ONE_WORD_KEYS) to a value that
+ *  replaces the operand of the PUSH at that offset (litMap is not applied
+ *  to it).
+ *  For each of the numPrefixes entries of prefixes, which are sorted by
+ *  increasing offset with at most one entry per offset, the bytes of
+ *  prefixBytes that the entry designates are inserted before the
+ *  instruction at its offset; they are copied as is, and jumps to that
+ *  instruction, as well as the command location map and exception ranges,
+ *  then point at the inserted code. JUMP1 instructions are widened to
+ *  JUMP4 as needed (iterating until the layout is stable); all PC-relative
+ *  data is then corrected: jump offsets, INST_START_CMD lengths, jump
+ *  tables, foreach loop offsets, the command location map and the
+ *  exception ranges.
+ *  INST_RETURN_CODE_BRANCH jumps 1, 3, 5, 7 or 9 bytes past itself, so
+ *  the instructions in between (INST_RETURN_STK, INST_NOP and three JUMP1
+ *  in the code compiled by [subst]) keep their size. When one of those
+ *  JUMP1 no longer reaches its target, an island of JUMP4 is inserted
+ *  before the instruction 9 bytes past the branch, behind a JUMP1 that
+ *  skips it, and each JUMP1 of the table jumps to its own JUMP4 instead.
+ *  The bytecodes are left alone if the table does not have that shape and
+ *  needs the island, or if the new code would exceed the 32 bit code
+ *  offsets.
+ *
+ * Results:
+ *  Returns TCL_OK if the bytecodes were rewritten, TCL_ERROR if they
+ *  could not be.
+ *
  * Side effects:
- *  May modify the bytecodes, possibly reallocating the bytecode array; may
- *  also modify support data structures in the compilation environment.
- *  Tcl_Panics on error.
+ *  Replaces the bytecode array and modifies the AuxData items mentioned
+ *  above.
  *
  *----------------------------------------------------------------------
  */
 
-static void UpdateByteCodes(PostProcessInfo* infoPtr, CompileEnv* compEnvPtr)
+#define RELAYOUT_WIDE 1
+#define RELAYOUT_PINNED 2
+#define RELAYOUT_BRANCH 4
+#define RELAYOUT_ISLAND 8
+
+#define RELAYOUT_TABLE_SIZE 9
+
+#define PREFIX_LENGTH(offset) RelayoutPrefixLength(prefixes, numPrefixes, (offset), NULL)
+#define INSERTED_LENGTH(offset) (RelayoutIslandLength(codeStart, flags, (offset)) + PREFIX_LENGTH(offset))
+#define NEW_OFFSET(offset) RelayoutNewOffset(shifts, numShifts, (offset))
+
+static int RelayoutByteCodes(CompileEnv* compEnvPtr,
+                             const Tcl_Size* litMap,
+                             Tcl_HashTable* operandTablePtr,
+                             const RelayoutPrefix* prefixes,
+                             Tcl_Size numPrefixes,
+                             const unsigned char* prefixBytes)
 {
-    ProcBodyInfo** infoArrayPtr;
-    ProcBodyInfo* bodyInfoPtr;
-    Tcl_Size newIndex;
-    unsigned char* pc;
-    Tcl_Size offset, delta;
-    Tcl_Size procNameObjIndex;
-    Tcl_Obj* objPtr;
+    InstructionDesc* opCodesTablePtr = (InstructionDesc*)TclGetInstructionTable();
+    unsigned char* codeStart = compEnvPtr->codeStart;
+    Tcl_Size codeSize = compEnvPtr->codeNext - codeStart;
+    Tcl_Size newSize, offset, target, jumpOffset, index, length, prefixStart, i;
+    Tcl_Size numShifts = 0, maxShifts = 64;
+    Tcl_WideInt growth;
+    RelayoutShift *shifts, *newShifts;
+    unsigned char *flags, *newCode, *pc, *newPc;
+    Tcl_Size branch = -1;
+    int changed, result = TCL_OK;
+    CmdLocation* locPtr;
+    ExceptionRange* excPtr;
+    AuxData* auxDataPtr;
+    Tcl_HashSearch search;
+    Tcl_HashEntry* hPtr;
+    ForeachInfo* foreachPtr;
 
-    if (infoPtr->numCompiledBodies == 0)
-    {
-        return;
-    }
+    shifts = (RelayoutShift*)CmpAlloc(maxShifts * sizeof(RelayoutShift));
+    flags = (unsigned char*)CmpAlloc(codeSize + 1);
+    memset(flags, 0, codeSize + 1);
 
     /*
-     * Some bodies were compiled: create a new string object containing the
-     * name of the loader package's proc command, add it to the object table,
-     * and use its index as the operand to the first PUSH instruction.
+     * Decide the initial form of each instruction. PUSH takes the form that
+     * fits its new operand, JUMP4 stays wide, JUMP1 starts narrow.
      */
 
-    objPtr = Tcl_NewObj();
-    Tcl_IncrRefCount(objPtr);
-    Tcl_AppendStringsToObj(objPtr, loaderName, "::", procCommand, NULL);
-    procNameObjIndex = TclAddLiteralObj(compEnvPtr, objPtr, NULL);
-    Tcl_DecrRefCount(objPtr);
-
-#ifdef DEBUG_REWRITE
-    fprintf(stdout, "tbcload::bcproc @ %ld\n", procNameObjIndex);
-    fflush(stdout);
-#endif
-    if (procNameObjIndex >= 255)
+    for (pc = codeStart; pc < compEnvPtr->codeNext; pc += opCodesTablePtr[*pc].numBytes)
     {
-        /*
-         * This literal index signals that all the primary INST_PUSH
-         * instructions (for the proc command name) will be rewritten from
-         * push1 to push4, growing the bytecode (by 3 bytes per compiled
-         * procedure). This means that any JUMP instructions around procedure
-         * definitions require updates to their offsets to avoid having them
-         * jumping into the middle of an instruction. Assuming that there are
-         * jump instructions.
-         *
-         * The easiest way of doing that is to not only record where all jump
-         * instructions are, but to rewrite them all to jump4. Otherwise we
-         * would have to do some iterative rewriting where changing the offset
-         * of a jump makes it larger, forcing more jump instructions to be
-         * rewritten. It is likely easier to simply convert them all to the
-         * large form.
-         *
-         * First we have to scan the bytecode and check if there are jump
-         * instructions. If not then there is no need to run the complex jump
-         * compensation code and the regular rewrite below (at %%%%) is fine.
-         *
-         * If jump instructions are present we have to scan a second time,
-         * recording where all instructions are, and how much they are shifted
-         * by instruction expansion, applied to _ALL_ jump and push
-         * instructions. Then we scan a third time and build the expanded
-         * bytecode, compensating for the shift in all jump instructions. This
-         * includes updating all the auxiliary structures recording
-         * instruction offsets and size.
-         *
-         * At last the expanded bytecode goes into the regular rewrite at
-         * (%%%%). There no expansion will happen any longer, as all the
-         * relevant instructions are already in their push4 forms, and any
-         * jump offsets are corrected already as well.
-         */
+        offset = pc - codeStart;
+        switch (*pc)
+        {
+            case INST_PUSH1:
+            case INST_PUSH4:
+                if (RelayoutPushOperand(pc, offset, litMap, operandTablePtr) > 255)
+                {
+                    flags[offset] |= RELAYOUT_WIDE;
+                }
+                break;
 
-        int jumps = 0;
-        InstructionDesc* opCodesTablePtr = (InstructionDesc*)TclGetInstructionTable();
+            case INST_JUMP4:
+            case INST_JUMP_TRUE4:
+            case INST_JUMP_FALSE4:
+                flags[offset] |= RELAYOUT_WIDE;
+                break;
+
+            case INST_RETURN_CODE_BRANCH:
+                branch = offset;
+                break;
+        }
 
         /*
-         * Scan for jumps.
+         * Pin the instructions inside the table of the last
+         * INST_RETURN_CODE_BRANCH. The table can hold an island only if an
+         * instruction starts right past it.
          */
 
-        for (pc = compEnvPtr->codeStart; pc < compEnvPtr->codeNext;)
+        if ((branch >= 0) && (offset > branch) && (offset < branch + RELAYOUT_TABLE_SIZE))
         {
-            if ((*pc >= INST_JUMP1) && (*pc <= INST_JUMP_FALSE4))
-            {
-                jumps++;
-            }
-            pc += opCodesTablePtr[*pc].numBytes;
+            flags[offset] |= RELAYOUT_PINNED;
         }
-
-        if (jumps)
+        else if ((branch >= 0) && (offset == branch + RELAYOUT_TABLE_SIZE))
         {
-            Tcl_Size codesize = compEnvPtr->codeNext - compEnvPtr->codeStart;
-            Tcl_Size* delta = (Tcl_Size*)Tcl_Alloc(codesize * sizeof(Tcl_Size));
-            Tcl_Size offset = 0;
+            flags[branch] |= RELAYOUT_BRANCH;
+        }
+    }
+
+    /*
+     * Compute the new layout, widening every JUMP1 whose new jump offset
+     * does not fit in a byte, until no more widening is needed. The layout
+     * is kept as the list of the instructions that change size, with the
+     * growth of the code up to each of them, rather than as a map of every
+     * offset, so that its size does not depend on the size of the code.
+     */
 
-#ifdef DEBUG_REWRITE
-            fprintf(stderr, "=== BEFORE START ===\n");
+    do
+    {
+        changed = 0;
+        numShifts = 0;
+        growth = 0;
+        for (pc = codeStart; pc < compEnvPtr->codeNext; pc += opCodesTablePtr[*pc].numBytes)
+        {
+            offset = pc - codeStart;
+            length = INSERTED_LENGTH(offset);
+            switch (*pc)
             {
-                Tcl_Size i, numExceptRanges = compEnvPtr->exceptArrayNext;
-                ExceptionRange* excPtr = compEnvPtr->exceptArrayPtr;
-                for (i = 0; i < numExceptRanges; i++)
-                {
-                    switch (excPtr->type)
-                    {
-                        case CATCH_EXCEPTION_RANGE:
-                            fprintf(stderr,
-                                    "EC [%8ld] @%4ld /%4ld : %4ld\n",
-                                    i,
-                                    excPtr->codeOffset,
-                                    excPtr->numCodeBytes,
-                                    excPtr->catchOffset);
-                            break;
-                        case LOOP_EXCEPTION_RANGE:
-                            fprintf(stderr,
-                                    "EL [%8ld] @%4ld /%4ld : %4ld %4ld\n",
-                                    i,
-                                    excPtr->codeOffset,
-                                    excPtr->numCodeBytes,
-                                    excPtr->breakOffset,
-                                    excPtr->continueOffset);
-                            break;
-                        default:
-                            fprintf(stderr, "E? [%8ld] @%4ld /%4ld\n", i, excPtr->codeOffset, excPtr->numCodeBytes);
-                    }
-                    excPtr += 1;
-                }
+                case INST_PUSH1:
+                case INST_PUSH4:
+                case INST_JUMP1:
+                case INST_JUMP_TRUE1:
+                case INST_JUMP_FALSE1:
+                case INST_JUMP4:
+                case INST_JUMP_TRUE4:
+                case INST_JUMP_FALSE4:
+                    length += (flags[offset] & RELAYOUT_WIDE) ? 5 : 2;
+                    break;
+                default:
+                    length += opCodesTablePtr[*pc].numBytes;
+                    break;
+            }
+            if (length == opCodesTablePtr[*pc].numBytes)
+            {
+                continue;
             }
-            for (pc = compEnvPtr->codeStart; pc < compEnvPtr->codeNext;)
+            if (flags[offset] & RELAYOUT_PINNED)
             {
-                FormatInstruction(compEnvPtr, pc);
-                pc += opCodesTablePtr[*pc].numBytes;
+                result = TCL_ERROR;
+                goto done;
             }
-            fprintf(stderr, "=== BEFORE END =====\n");
-            fflush(stderr);
-#endif
+
             /*
-             * Compute per-instruction shift offsets under the assumption that
-             * all jump1 and push1 instructions are expanded. The value of
-             * 'offset' after this loop is the total amount of expansion
-             * required. This may be nothing if all instructions are already
-             * in *4 form. In that case we can skip the expansion-rewrite.
+             * The operands that hold code offsets are 32 bit signed, in
+             * every Tcl version: refuse a layout that does not fit.
              */
 
-            for (pc = compEnvPtr->codeStart; pc < compEnvPtr->codeNext;)
+            growth += length - opCodesTablePtr[*pc].numBytes;
+            if (codeSize + growth > INT_MAX)
             {
-                delta[pc - compEnvPtr->codeStart] = offset;
-                switch (*pc)
-                {
-                    case INST_JUMP1:
-                    case INST_JUMP_TRUE1:
-                    case INST_JUMP_FALSE1:
-                    case INST_PUSH1:
-                        offset += 3;
-                        break;
-                    default:
-                        break;
-                }
-                pc += opCodesTablePtr[*pc].numBytes;
+                result = TCL_ERROR;
+                goto done;
             }
-
-            if (offset)
+            if (numShifts == maxShifts)
             {
-                /*
-                 * We use a helper array for the expanded bytecode to avoid
-                 * lots of shifting. We basically copy instructions from the
-                 * original array over to the expanded one, expanding them as
-                 * we go, and when we are done we expand the compilation
-                 * environment proper and copy things back.
-                 */
-
-                Tcl_Size newcodesize = codesize + offset;
-                unsigned char* newbc = (unsigned char*)Tcl_Alloc(newcodesize * sizeof(unsigned char));
-                unsigned char* pcnew = newbc;
-                Tcl_Size isize;
+                newShifts = (RelayoutShift*)CmpAlloc(2 * maxShifts * sizeof(RelayoutShift));
+                memcpy(newShifts, shifts, maxShifts * sizeof(RelayoutShift));
+                CmpFree(shifts);
+                shifts = newShifts;
+                maxShifts *= 2;
+            }
+            shifts[numShifts].offset = offset;
+            shifts[numShifts].growth = (Tcl_Size)growth;
+            numShifts++;
+        }
+        newSize = codeSize + (Tcl_Size)growth;
 
-                for (pc = compEnvPtr->codeStart; pc < compEnvPtr->codeNext;)
+        for (pc = codeStart; pc < compEnvPtr->codeNext; pc += opCodesTablePtr[*pc].numBytes)
+        {
+            offset = pc - codeStart;
+            if (((*pc == INST_JUMP1) || (*pc == INST_JUMP_TRUE1) || (*pc == INST_JUMP_FALSE1)) &&
+                !(flags[offset] & RELAYOUT_WIDE))
+            {
+                branch = -1;
+                if ((flags[offset] & RELAYOUT_PINNED) && (*pc == INST_JUMP1))
                 {
-                    isize = opCodesTablePtr[*pc].numBytes;
-#ifdef DEBUG_REWRITE
-                    fprintf(stderr,
-                            "[%8ld] d%4ld s%2ld %s\n",
-                            pc - compEnvPtr->codeStart,
-                            delta[(pc - compEnvPtr->codeStart)],
-                            isize,
-                            opCodesTablePtr[*pc].name);
-                    fflush(stderr);
-#endif
-                    switch (*pc)
+                    branch = RelayoutTableBranch(flags, offset);
+                }
+                if ((branch >= 0) && (flags[branch] & RELAYOUT_ISLAND))
+                {
+                    continue;
+                }
+                target = offset + TclGetInt1AtPtr(pc + 1);
+                jumpOffset = NEW_OFFSET(target) - (NEW_OFFSET(offset) + INSERTED_LENGTH(offset));
+                if ((jumpOffset < -128) || (jumpOffset > 127))
+                {
+                    if (!(flags[offset] & RELAYOUT_PINNED))
                     {
-                        case INST_JUMP1:
-                        case INST_JUMP_TRUE1:
-                        case INST_JUMP_FALSE1:
-                        {
-                            /*
-                             * These instructions expand to *4 form, and may have
-                             * to change their jump offset to compensate for
-                             * differences in shift for this instruction and at
-                             * the jump destination.
-                             */
-
-                            int jmpdelta = TclGetInt1AtPtr(pc + 1);
-                            int jmpshift = delta[(pc - compEnvPtr->codeStart)];
-                            int dstshift = delta[(pc - compEnvPtr->codeStart) + jmpdelta];
-
-                            if (jmpshift != dstshift)
-                            {
-#ifdef DEBUG_REWRITE
-                                fprintf(stderr,
-                                        "           JUMP1 change %4d (%4d/%4d) by %4d, now %4d\n",
-                                        jmpdelta,
-                                        jmpshift,
-                                        dstshift,
-                                        dstshift - jmpshift,
-                                        jmpdelta + (dstshift - jmpshift));
-                                fflush(stderr);
-#endif
-                                jmpdelta += (dstshift - jmpshift);
-                            }
-
-                            /*
-                             * Instruction change!
-                             * HACK :: Assumes that the *1 and *4 forms
-                             * are paired, with *4 one higher than *1.
-                             * See tclCompile.h
-                             */
-                            TclUpdateInstInt4AtPc((*pc) + 1, jmpdelta, pcnew);
-                            pcnew += 5;
-                        };
-                        break;
-                        case INST_JUMP4:
-                        case INST_JUMP_TRUE4:
-                        case INST_JUMP_FALSE4:
-                        {
-                            /*
-                             * While these instructions do not expand we still may
-                             * have to change their jump offset to compensate for
-                             * differences in shift for this instruction and at
-                             * the jump destination. If there is no difference no
-                             * change is needed. Otherwise the jump offset has to
-                             * be modified.
-                             */
-
-                            int jmpdelta = TclGetInt4AtPtr(pc + 1);
-                            int jmpshift = delta[(pc - compEnvPtr->codeStart)];
-                            int dstshift = delta[(pc - compEnvPtr->codeStart) + jmpdelta];
-
-                            if (jmpshift != dstshift)
-                            {
-#ifdef DEBUG_REWRITE
-                                fprintf(stderr,
-                                        "           JUMP4 change %4d (%4d/%4d) by %4d, now %4d\n",
-                                        jmpdelta,
-                                        jmpshift,
-                                        dstshift,
-                                        dstshift - jmpshift,
-                                        jmpdelta + (dstshift - jmpshift));
-                                fflush(stderr);
-#endif
-                                jmpdelta += (dstshift - jmpshift);
-
-                                TclUpdateInstInt4AtPc((*pc), jmpdelta, pcnew);
-                                pcnew += 5;
-                            }
-                            else
-                                goto copy;
-                        };
-                        break;
-                        case INST_PUSH1:
-                        {
-                            /*
-                             * All push1 instructions expand to push4. This code
-                             * copied from ReplacePushIndex, except that growing
-                             * is not necessary at this point.
-                             */
-
-                            int literal = TclGetUInt1AtPtr(pc + 1);
-
-                            TclUpdateInstInt4AtPc(INST_PUSH4, literal, pcnew);
-                            pcnew += 5;
-                        };
-                        break;
-                        default:
-                        {
-                        copy:
-                            /*
-                             * All other instruction are copied as they are
-                             */
-                            memcpy(pcnew, pc, isize);
-                            pcnew += isize;
-                        };
-                        break;
+                        flags[offset] |= RELAYOUT_WIDE;
+                    }
+                    else if (branch >= 0)
+                    {
+                        flags[branch] |= RELAYOUT_ISLAND;
+                    }
+                    else
+                    {
+                        result = TCL_ERROR;
+                        goto done;
                     }
-                    pc += isize;
+                    changed = 1;
                 }
+            }
+        }
+    } while (changed);
 
-                /*
-                 * At last copy the expanded byte code sequence back into the
-                 * compile environment and fix the auxiliary data structures.
-                 */
+    /*
+     * Build the new bytecodes. The AuxData items holding PC-relative
+     * offsets are fixed as their owning instruction is copied. Offsets
+     * relative to an instruction are taken from the instruction itself,
+     * past its inserted prefix.
+     */
 
-                while ((compEnvPtr->codeStart + newcodesize) > compEnvPtr->codeEnd)
+    newCode = (unsigned char*)Tcl_Alloc(newSize ? newSize : 1);
+    newPc = newCode;
+    for (pc = codeStart; pc < compEnvPtr->codeNext; pc += opCodesTablePtr[*pc].numBytes)
+    {
+        offset = pc - codeStart;
+        if (RelayoutIslandLength(codeStart, flags, offset) > 0)
+        {
+            newPc = RelayoutCopyIsland(codeStart, flags, offset - RELAYOUT_TABLE_SIZE, shifts, numShifts, newCode, newPc);
+        }
+        length = RelayoutPrefixLength(prefixes, numPrefixes, offset, &prefixStart);
+        if (length > 0)
+        {
+            memcpy(newPc, prefixBytes + prefixStart, length);
+            newPc += length;
+        }
+        switch (*pc)
+        {
+            case INST_PUSH1:
+            case INST_PUSH4:
+                index = RelayoutPushOperand(pc, offset, litMap, operandTablePtr);
+                if (flags[offset] & RELAYOUT_WIDE)
                 {
-                    TclExpandCodeArray(compEnvPtr);
+                    TclUpdateInstInt4AtPc(INST_PUSH4, index, newPc);
+                    newPc += 5;
                 }
+                else
+                {
+                    TclUpdateInstInt1AtPc(INST_PUSH1, index, newPc);
+                    newPc += 2;
+                }
+                continue;
 
-                memcpy(compEnvPtr->codeStart, newbc, newcodesize);
-                compEnvPtr->codeNext = compEnvPtr->codeStart + newcodesize;
-                Tcl_Free((char*)newbc);
-
+            case INST_JUMP1:
+            case INST_JUMP_TRUE1:
+            case INST_JUMP_FALSE1:
+            case INST_JUMP4:
+            case INST_JUMP_TRUE4:
+            case INST_JUMP_FALSE4:
+            {
                 /*
-                 * Fix the auxiliary data structures containing instruction
-                 * sizes and offsets.
+                 * HACK :: Assumes that the *1 and *4 forms are paired, with
+                 * *4 one higher than *1. See tclCompile.h
                  */
 
-                /*
-                 * Fix command location array. We have it easier because we
-                 * know for each place in the old code how much it was shifted
-                 * (-> delta array).
-                 */
+                int isShort = ((*pc == INST_JUMP1) || (*pc == INST_JUMP_TRUE1) || (*pc == INST_JUMP_FALSE1));
+                int op1 = isShort ? *pc : *pc - 1;
 
+                target = offset + (isShort ? TclGetInt1AtPtr(pc + 1) : TclGetInt4AtPtr(pc + 1));
+                jumpOffset = NEW_OFFSET(target) - (newPc - newCode);
+                branch = -1;
+                if ((flags[offset] & RELAYOUT_PINNED) && (*pc == INST_JUMP1))
+                {
+                    branch = RelayoutTableBranch(flags, offset);
+                }
+                if ((branch >= 0) && (flags[branch] & RELAYOUT_ISLAND))
                 {
-                    Tcl_Size i;
-                    CmdLocation* locPtr;
+                    /*
+                     * Jump to the JUMP4 of this table entry in the island.
+                     */
 
-                    for (i = 0; i < compEnvPtr->numCommands; i++)
-                    {
-                        locPtr = &compEnvPtr->cmdMapPtr[i];
-                        locPtr->codeOffset += delta[locPtr->codeOffset];
-                        locPtr->numCodeBytes = opCodesTablePtr[*(compEnvPtr->codeStart + locPtr->codeOffset)].numBytes;
-                    }
+                    jumpOffset = NEW_OFFSET(branch + RELAYOUT_TABLE_SIZE) + 2 +
+                                 5 * RelayoutIslandSlot(codeStart, flags, branch, offset) - (newPc - newCode);
+                }
+                if (flags[offset] & RELAYOUT_WIDE)
+                {
+                    TclUpdateInstInt4AtPc(op1 + 1, jumpOffset, newPc);
+                    newPc += 5;
+                }
+                else
+                {
+                    TclUpdateInstInt1AtPc(op1, jumpOffset, newPc);
+                    newPc += 2;
                 }
+            }
+                continue;
 
-                /*
-                 * Fix exception ranges. See also ShiftByteCodes. We have it
-                 * easier because we know for each place in the old code how
-                 * much it was shifted (-> delta array).
-                 */
+            case INST_START_CMD:
+                memcpy(newPc, pc, opCodesTablePtr[*pc].numBytes);
+                target = offset + TclGetInt4AtPtr(pc + 1);
+                TclStoreInt4AtPtr(NEW_OFFSET(target) - (newPc - newCode), newPc + 1);
+                break;
 
+            case INST_JUMP_TABLE:
+                memcpy(newPc, pc, opCodesTablePtr[*pc].numBytes);
+                auxDataPtr = &compEnvPtr->auxDataArrayPtr[TclGetUInt4AtPtr(pc + 1)];
+                if (auxDataPtr->type == cmpJumptableInfoType)
                 {
-                    Tcl_Size i, numExceptRanges = compEnvPtr->exceptArrayNext;
-                    ExceptionRange* excPtr = compEnvPtr->exceptArrayPtr;
+                    JumptableInfo* jtPtr = (JumptableInfo*)auxDataPtr->clientData;
 
-                    for (i = 0; i < numExceptRanges; i++)
+                    for (hPtr = Tcl_FirstHashEntry(&jtPtr->hashTable, &search); hPtr; hPtr = Tcl_NextHashEntry(&search))
                     {
-                        excPtr->numCodeBytes += delta[excPtr->codeOffset + excPtr->numCodeBytes];
-                        excPtr->codeOffset += delta[excPtr->codeOffset];
-
-                        switch (excPtr->type)
-                        {
-                            case CATCH_EXCEPTION_RANGE:
-                                excPtr->catchOffset += delta[excPtr->catchOffset];
-                                break;
-                            case LOOP_EXCEPTION_RANGE:
-                                excPtr->breakOffset += delta[excPtr->breakOffset];
-                                excPtr->continueOffset += delta[excPtr->continueOffset];
-                                break;
-                        }
-
-                        excPtr += 1;
+                        target = offset + PTR2SIZE(Tcl_GetHashValue(hPtr));
+                        Tcl_SetHashValue(hPtr, SIZE2PTR(NEW_OFFSET(target) - (newPc - newCode)));
                     }
                 }
+                break;
 
-                /*
-                 * Fix the local infoPtr->infoArrayPtr structures where we
-                 * recorded the locations of the compiled proc commands.
-                 */
-
+            case INST_FOREACH_START:
+                memcpy(newPc, pc, opCodesTablePtr[*pc].numBytes);
+                auxDataPtr = &compEnvPtr->auxDataArrayPtr[TclGetUInt4AtPtr(pc + 1)];
+                if (auxDataPtr->type == cmpNewForeachInfoType)
                 {
-                    for (infoArrayPtr = infoPtr->infoArrayPtr; *infoArrayPtr; infoArrayPtr++)
-                    {
-                        bodyInfoPtr = *infoArrayPtr;
-                        bodyInfoPtr->procOffset += delta[bodyInfoPtr->procOffset];
-                        bodyInfoPtr->bodyOffset += delta[bodyInfoPtr->bodyOffset];
-                    }
+                    /*
+                     * loopCtTemp holds the offset from the INST_FOREACH_STEP
+                     * back to the start of the loop body, which is the
+                     * instruction right after INST_FOREACH_START.
+                     */
+
+                    foreachPtr = (ForeachInfo*)auxDataPtr->clientData;
+                    target = offset + 5 - foreachPtr->loopCtTemp;
+                    foreachPtr->loopCtTemp = ((newPc - newCode) + 5) - NEW_OFFSET(target);
                 }
-            }
+                break;
 
-            Tcl_Free((char*)delta);
+            default:
+                memcpy(newPc, pc, opCodesTablePtr[*pc].numBytes);
+                break;
+        }
+        newPc += opCodesTablePtr[*pc].numBytes;
+    }
 
-#ifdef DEBUG_REWRITE
-            fprintf(stderr, "=== AFTER_ START ===\n");
-            {
-                Tcl_Size i, numExceptRanges = compEnvPtr->exceptArrayNext;
-                ExceptionRange* excPtr = compEnvPtr->exceptArrayPtr;
-                for (i = 0; i < numExceptRanges; i++)
+    /*
+     * Fix the command location map and the exception ranges.
+     */
+
+    for (i = 0; i < compEnvPtr->numCommands; i++)
+    {
+        locPtr = &compEnvPtr->cmdMapPtr[i];
+        target = locPtr->codeOffset + locPtr->numCodeBytes;
+        locPtr->codeOffset = NEW_OFFSET(locPtr->codeOffset);
+        locPtr->numCodeBytes = NEW_OFFSET(target) - locPtr->codeOffset;
+    }
+
+    excPtr = compEnvPtr->exceptArrayPtr;
+    for (i = 0; i < compEnvPtr->exceptArrayNext; i++, excPtr++)
+    {
+        target = excPtr->codeOffset + excPtr->numCodeBytes;
+        excPtr->codeOffset = NEW_OFFSET(excPtr->codeOffset);
+        excPtr->numCodeBytes = NEW_OFFSET(target) - excPtr->codeOffset;
+
+        switch (excPtr->type)
+        {
+            case CATCH_EXCEPTION_RANGE:
+                if (excPtr->catchOffset >= 0)
                 {
-                    switch (excPtr->type)
-                    {
-                        case CATCH_EXCEPTION_RANGE:
-                            fprintf(stderr,
-                                    "EC [%8ld] @%4ld /%4ld : %4ld\n",
-                                    i,
-                                    excPtr->codeOffset,
-                                    excPtr->numCodeBytes,
-                                    excPtr->catchOffset);
-                            break;
-                        case LOOP_EXCEPTION_RANGE:
-                            fprintf(stderr,
-                                    "EL [%8ld] @%4ld /%4ld : %4ld %4ld\n",
-                                    i,
-                                    excPtr->codeOffset,
-                                    excPtr->numCodeBytes,
-                                    excPtr->breakOffset,
-                                    excPtr->continueOffset);
-                            break;
-                        default:
-                            fprintf(stderr, "E? [%8ld] @%4ld /%4ld\n", i, excPtr->codeOffset, excPtr->numCodeBytes);
-                    }
-                    excPtr += 1;
+                    excPtr->catchOffset = NEW_OFFSET(excPtr->catchOffset);
                 }
-            }
-            for (pc = compEnvPtr->codeStart; pc < compEnvPtr->codeNext;)
-            {
-                FormatInstruction(compEnvPtr, pc);
-                pc += opCodesTablePtr[*pc].numBytes;
-            }
-            fprintf(stderr, "=== AFTER_ END =====\n");
-            fflush(stderr);
-#endif
+                break;
+            case LOOP_EXCEPTION_RANGE:
+                if (excPtr->breakOffset >= 0)
+                {
+                    excPtr->breakOffset = NEW_OFFSET(excPtr->breakOffset);
+                }
+                if (excPtr->continueOffset >= 0)
+                {
+                    excPtr->continueOffset = NEW_OFFSET(excPtr->continueOffset);
+                }
+                break;
         }
     }
 
     /*
-     * (%%%%)
-     * offset is the sum of all shifts we have done; it is used to correct
-     * the original offsets as saved in the ProcBodyInfo structs so that
-     * they correspond to the new bytecodes.
-     * Note that this assumes that the ProcBodyInfo structs are ordered,
-     * which they are because they are built in the compile proc.
+     * Install the new bytecodes in place of the old ones, rather than
+     * copying them into the code array, which would double it whenever
+     * they grew.
      */
 
-    offset = 0;
+    if (compEnvPtr->mallocedCodeArray)
+    {
+        Tcl_Free((char*)compEnvPtr->codeStart);
+    }
+    compEnvPtr->codeStart = newCode;
+    compEnvPtr->codeNext = newCode + newSize;
+    compEnvPtr->codeEnd = newCode + (newSize ? newSize : 1);
+    compEnvPtr->mallocedCodeArray = 1;
+
+done:
+    CmpFree(flags);
+    CmpFree(shifts);
+    return result;
+}
+
+#undef NEW_OFFSET
+#undef INSERTED_LENGTH
+#undef PREFIX_LENGTH
 
-    for (infoArrayPtr = infoPtr->infoArrayPtr; *infoArrayPtr; infoArrayPtr++)
+/*
+ *----------------------------------------------------------------------
+ *
+ * RelayoutCopyIsland --
+ *
+ *  Copies the island of the INST_RETURN_CODE_BRANCH at offset branch into
+ *  the new code at newPc: a JUMP1 past the island, then a JUMP4 to the
+ *  new target of each JUMP1 of the table, in order. See
+ *  RelayoutByteCodes.
+ *
+ * Results:
+ *  Returns the position past the island.
+ *
+ * Side effects:
+ *  Stores the island at newPc.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned char* RelayoutCopyIsland(const unsigned char* codeStart,
+                                         const unsigned char* flags,
+                                         Tcl_Size branch,
+                                         const RelayoutShift* shifts,
+                                         Tcl_Size numShifts,
+                                         unsigned char* newCode,
+                                         unsigned char* newPc)
+{
+    Tcl_Size offset, target;
+
+    offset = branch + RELAYOUT_TABLE_SIZE;
+    TclUpdateInstInt1AtPc(INST_JUMP1, RelayoutIslandLength(codeStart, flags, offset), newPc);
+    newPc += 2;
+    for (offset = branch + 1; offset < branch + RELAYOUT_TABLE_SIZE; offset++)
     {
-        bodyInfoPtr = *infoArrayPtr;
-        newIndex = bodyInfoPtr->bodyNewIndex;
+        if ((flags[offset] & RELAYOUT_PINNED) && (codeStart[offset] == INST_JUMP1))
+        {
+            target = offset + TclGetInt1AtPtr(codeStart + offset + 1);
+            TclUpdateInstInt4AtPc(INST_JUMP4,
+                                  RelayoutNewOffset(shifts, numShifts, target) - (newPc - newCode),
+                                  newPc);
+            newPc += 5;
+        }
+    }
+    return newPc;
+}
 
-        /*
-         * correct the offsets to the new bytecodes
-         */
+/*
+ *----------------------------------------------------------------------
+ *
+ * RelayoutIslandLength --
+ *
+ *  Returns the length of the island that RelayoutByteCodes inserts before
+ *  the instruction at offset, if that instruction follows the table of an
+ *  INST_RETURN_CODE_BRANCH whose JUMP1 go through an island.
+ *
+ * Results:
+ *  The length of the island, 0 if there is none.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Size RelayoutIslandLength(const unsigned char* codeStart, const unsigned char* flags, Tcl_Size offset)
+{
+    Tcl_Size branch = offset - RELAYOUT_TABLE_SIZE;
+
+    if ((branch < 0) || !(flags[branch] & RELAYOUT_ISLAND))
+    {
+        return 0;
+    }
+    return 2 + 5 * RelayoutIslandSlot(codeStart, flags, branch, offset);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RelayoutIslandSlot --
+ *
+ *  Counts the JUMP1 of the table of the INST_RETURN_CODE_BRANCH at offset
+ *  branch that come before offset, which is the index of the JUMP4 of the
+ *  island that the JUMP1 at offset jumps to.
+ *
+ * Results:
+ *  The number of JUMP1.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-        bodyInfoPtr->procOffset += offset;
-        bodyInfoPtr->bodyOffset += offset;
+static Tcl_Size RelayoutIslandSlot(const unsigned char* codeStart,
+                                   const unsigned char* flags,
+                                   Tcl_Size branch,
+                                   Tcl_Size offset)
+{
+    Tcl_Size slot = 0, i;
 
-        if (newIndex != -1)
+    for (i = branch + 1; i < offset; i++)
+    {
+        if ((flags[i] & RELAYOUT_PINNED) && (codeStart[i] == INST_JUMP1))
         {
-            /*
-             * Replace the index for the command name object. This is done for
-             * all compiled procedure bodies
-             */
+            slot++;
+        }
+    }
+    return slot;
+}
 
-            pc = compEnvPtr->codeStart + bodyInfoPtr->procOffset;
-            delta = ReplacePushIndex(bodyInfoPtr->commandIndex, pc, procNameObjIndex, compEnvPtr);
-            offset += delta;
-            bodyInfoPtr->bodyOffset += delta;
+/*
+ *----------------------------------------------------------------------
+ *
+ * RelayoutNewOffset --
+ *
+ *  Maps an offset in the old code to the new code, as laid out by
+ *  RelayoutByteCodes: the offset moves by the growth of the code before
+ *  it, found by binary search in the shifts of the instructions that
+ *  changed size, which are in increasing offset order.
+ *
+ * Results:
+ *  The new offset.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-            if (newIndex != bodyInfoPtr->bodyOrigIndex)
-            {
-                /*
-                 * replace the index of the body with the unshared index
-                 */
+static Tcl_Size RelayoutNewOffset(const RelayoutShift* shifts, Tcl_Size numShifts, Tcl_Size offset)
+{
+    Tcl_Size low = 0, high = numShifts, middle;
 
-                pc = compEnvPtr->codeStart + bodyInfoPtr->bodyOffset;
-                delta = ReplacePushIndex(bodyInfoPtr->commandIndex, pc, newIndex, compEnvPtr);
+    /*
+     * Find the first shift at or after offset; the one before it, if any,
+     * holds the growth up to offset.
+     */
 
-                /*
-                 * According to (****) the newIndex is the original index,
-                 * thus this replacement should not require growth. Ah. But
-                 * (xxxx) in UnshareProcBodies allows differently. Therefore,
-                 * don't panic! (You have a towel with you, don't you ? ;)
-                 */
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        if (shifts[middle].offset < offset)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return offset + ((low > 0) ? shifts[low - 1].growth : 0);
+}
 
-                offset += delta;
-            }
+/*
+ *----------------------------------------------------------------------
+ *
+ * RelayoutPrefixLength --
+ *
+ *  Finds the code that RelayoutByteCodes inserts before the instruction
+ *  at an offset of the old code, by binary search in the prefixes, which
+ *  are in increasing offset order.
+ *
+ * Results:
+ *  The number of bytes inserted, 0 if none. If startPtr is not NULL, the
+ *  index of the first one in the prefix buffer is stored there.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Size RelayoutPrefixLength(const RelayoutPrefix* prefixes,
+                                     Tcl_Size numPrefixes,
+                                     Tcl_Size offset,
+                                     Tcl_Size* startPtr)
+{
+    Tcl_Size low = 0, high = numPrefixes, middle;
+
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        if (prefixes[middle].offset < offset)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
         }
     }
+    if ((low == numPrefixes) || (prefixes[low].offset != offset))
+    {
+        return 0;
+    }
+    if (startPtr)
+    {
+        *startPtr = prefixes[low].start;
+    }
+    return prefixes[low].length;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * ReplacePushIndex --
+ * RelayoutPushOperand --
  *
- *  Replaces the operand to a PUSH operation with the new index value.
+ *  Returns the new operand for the PUSH instruction at pc, as described
+ *  in RelayoutByteCodes.
  *
  * Results:
- *  Returns the number of bytes by which the bytecodes were shifted in
- *  order to make room for the new operand.
+ *  The new literal index.
  *
  * Side effects:
- *  May modify the bytecodes, possibly reallocating the bytecode array; may
- *  also modify support data structures in the compilation environment.
- *  Tcl_Panics on error.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static int ReplacePushIndex(Tcl_Size commandIndex, unsigned char* pc, Tcl_Size newIndex, CompileEnv* compEnvPtr)
+static Tcl_Size RelayoutPushOperand(unsigned char* pc, Tcl_Size offset, const Tcl_Size* litMap, Tcl_HashTable* operandTablePtr)
 {
-    Tcl_Size offset = 0;
+    Tcl_HashEntry* entryPtr;
+    Tcl_Size index;
 
-    switch (*pc)
+    if (operandTablePtr && (entryPtr = Tcl_FindHashEntry(operandTablePtr, (char*)SIZE2PTR(offset))))
     {
-        case INST_PUSH1:
-            if (newIndex < 255)
-            {
-                pc += 1;
-                *pc = (unsigned char)newIndex;
-            }
-            else
-            {
-                int savedOffset = pc - compEnvPtr->codeStart;
-                ShiftByteCodes(commandIndex, savedOffset, 3, compEnvPtr);
-                pc = compEnvPtr->codeStart + savedOffset;
-                *pc++ = INST_PUSH4;
-                *pc++ = (unsigned char)((unsigned int)newIndex >> 24);
-                *pc++ = (unsigned char)((unsigned int)newIndex >> 16);
-                *pc++ = (unsigned char)((unsigned int)newIndex >> 8);
-                *pc++ = (unsigned char)((unsigned int)newIndex);
-
-                /*
-                 * we shifted everything right by 3 bytes
-                 */
-
-                offset += 3;
-            }
-            break;
-
-        case INST_PUSH4:
-            /*
-             * Because a 4 byte PUSH supports a single byte, we don't
-             * bother shrinking the bytecodes, just fit the new
-             * index in. It is unlikely that this will happen anyway, because
-             * we add new objects at the end of the object array anyway.
-             */
-
-            pc += 1;
-            *pc++ = (unsigned char)((unsigned int)newIndex >> 24);
-            *pc++ = (unsigned char)((unsigned int)newIndex >> 16);
-            *pc++ = (unsigned char)((unsigned int)newIndex >> 8);
-            *pc++ = (unsigned char)((unsigned int)newIndex);
-            break;
-
-        default:
-            Tcl_Panic("ReplacePushIndex: expected a push opcode");
-            break;
+        return PTR2SIZE(Tcl_GetHashValue(entryPtr));
     }
-
-    return offset;
+    index = GetSharedIndex(pc);
+    return litMap ? litMap[index] : index;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * ShiftByteCodes --
+ * RelayoutTableBranch --
  *
- *  Moves all bytecodes past a given offset to the right by 'shiftCount'
- *  bytes. This opens up 'shiftCount' bytes in the bytecodes at startOffset.
+ *  Finds the INST_RETURN_CODE_BRANCH whose table holds the instruction at
+ *  offset, if an instruction starts right past that table.
  *
  * Results:
- *  None.
+ *  The offset of the INST_RETURN_CODE_BRANCH, or -1.
  *
  * Side effects:
- *  May grow the bytecode array. After the shift, it also modifies the
- *  various data structures in the compile environment so that they are
- *  corrected for the shift amount.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static void ShiftByteCodes(Tcl_Size commandIndex, Tcl_Size startOffset, Tcl_Size shiftCount, CompileEnv* compEnvPtr)
+static Tcl_Size RelayoutTableBranch(const unsigned char* flags, Tcl_Size offset)
 {
-    unsigned char *fromPtr, *toPtr;
-    Tcl_Size currBytes, numCmds, i;
-    CmdLocation* locPtr;
-    Tcl_Size numExceptRanges, start, end;
-    ExceptionRange* excPtr;
-
-    /*
-     * Grow the array if necessary
-     */
-
-    if ((compEnvPtr->codeNext + shiftCount) > compEnvPtr->codeEnd)
-    {
-        TclExpandCodeArray(compEnvPtr);
-    }
-
-    /*
-     * the bytes from 0 to (startOffset-1) are fine where they are.
-     * The others need to be moved up by shiftCount bytes.
-     * Use memmove, which guarantees that the copy is correct even with
-     * overlapping source and destination.
-     */
-
-    fromPtr = compEnvPtr->codeStart + startOffset;
-    toPtr = fromPtr + shiftCount;
-    currBytes = compEnvPtr->codeNext - compEnvPtr->codeStart;
-    memmove(toPtr, fromPtr, currBytes - startOffset);
+    Tcl_Size branch;
 
-    /*
-     * Now we need to fix up the data structures.
-     *
-     * First the command location arrays.
-     * We only need to modify entries past the commandIndex.
-     * The entry at commandIndex needs to have its size bumped.
-     */
-
-    compEnvPtr->codeNext += shiftCount;
-
-    locPtr = &compEnvPtr->cmdMapPtr[commandIndex];
-    locPtr->numCodeBytes += shiftCount;
-    locPtr += 1;
-
-    numCmds = compEnvPtr->numCommands;
-    for (i = commandIndex + 1; i < numCmds; i++)
-    {
-        locPtr->codeOffset += shiftCount;
-        locPtr += 1;
-    }
-
-    /*
-     * Now the exception ranges.
-     * We need to slide their offsets, so that the range covers the same
-     * sequence of bytecodes as before the shift.
-     *
-     * For catch ranges, we also need to slide the catchOffset
-     * For loop ranges, we need to slide the break and continue Offsets
-     */
-
-    numExceptRanges = compEnvPtr->exceptArrayNext;
-    excPtr = compEnvPtr->exceptArrayPtr;
-    for (i = 0; i < numExceptRanges; i++)
+    for (branch = offset - 1; (branch >= 0) && (branch > offset - RELAYOUT_TABLE_SIZE); branch--)
     {
-        start = excPtr->codeOffset;
-        if (start > startOffset)
-        {
-            excPtr->codeOffset += shiftCount;
-        }
-        else
-        {
-            end = start + excPtr->numCodeBytes;
-            if (end > startOffset)
-            {
-                /*
-                 * the starting offset for the bytecodes shift was inside the
-                 * range, so in this case we don't bump the code offset,
-                 * but we do bump the number of bytes in the range
-                 */
-
-                excPtr->numCodeBytes += shiftCount;
-            }
-        }
-
-        switch (excPtr->type)
+        if (flags[branch] & RELAYOUT_BRANCH)
         {
-            case CATCH_EXCEPTION_RANGE:
-                if (excPtr->catchOffset > startOffset)
-                {
-                    excPtr->catchOffset += shiftCount;
-                }
-                break;
-
-            case LOOP_EXCEPTION_RANGE:
-                if (excPtr->breakOffset > startOffset)
-                {
-                    excPtr->breakOffset += shiftCount;
-                }
-                if (excPtr->continueOffset > startOffset)
-                {
-                    excPtr->continueOffset += shiftCount;
-                }
-                break;
+            return branch;
         }
-
-        excPtr += 1;
     }
+    return -1;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * GetSharedIndex --
+ * PermuteLiterals --
  *
- *  Looks at the bytecode instruction at *pc, if the instruction is one
- *  that makes a reference to an object in the object table extract the
- *  index operand and return it.
+ *  Moves each entry of the literal array of a compilation environment from
+ *  index i to index litMap[i], keeping the hash chains of the local literal
+ *  table (which point into the literal array) consistent.
  *
  * Results:
- *  Returns an index into the object table, or -1 if this instruction is
- *  not on the list of instructions that make index references.
+ *  None.
  *
  * Side effects:
- *  None.
+ *  Reorders the literal array.
  *
  *----------------------------------------------------------------------
  */
 
-static Tcl_Size GetSharedIndex(unsigned char* pc)
+static void PermuteLiterals(CompileEnv* compEnvPtr, const Tcl_Size* litMap)
 {
-    unsigned int objIndex;
-
-    switch (*pc)
-    {
-        case INST_PUSH1:
-            objIndex = TclGetUInt1AtPtr(pc + 1);
-            break;
+    LiteralEntry* litArrayPtr = compEnvPtr->literalArrayPtr;
+    LiteralTable* tablePtr = &compEnvPtr->localLitTable;
+    Tcl_Size i, numLiterals = compEnvPtr->literalArrayNext;
+    LiteralEntry* savedArrayPtr;
+    LiteralEntry* entryPtr;
 
-        case INST_PUSH4:
-            objIndex = TclGetUInt4AtPtr(pc + 1);
-            break;
+    savedArrayPtr = (LiteralEntry*)CmpAlloc(numLiterals * sizeof(LiteralEntry));
+    memcpy(savedArrayPtr, litArrayPtr, numLiterals * sizeof(LiteralEntry));
 
-        default:
-            return -1;
+    for (i = 0; i < numLiterals; i++)
+    {
+        entryPtr = &litArrayPtr[litMap[i]];
+        *entryPtr = savedArrayPtr[i];
+        if (entryPtr->nextPtr)
+        {
+            entryPtr->nextPtr = &litArrayPtr[litMap[entryPtr->nextPtr - litArrayPtr]];
+        }
+    }
+    for (i = 0; i < tablePtr->numBuckets; i++)
+    {
+        if (tablePtr->buckets[i])
+        {
+            tablePtr->buckets[i] = &litArrayPtr[litMap[tablePtr->buckets[i] - litArrayPtr]];
+        }
     }
 
-    return (Tcl_Size)objIndex;
+    CmpFree(savedArrayPtr);
 }
 
 /*
@@ -3950,7 +8175,7 @@ static int EmitJumptableInfo(Tcl_Interp* interp, JumptableInfo* infoPtr, Tcl_Cha
     jmpHashEntry = Tcl_FirstHashEntry(&infoPtr->hashTable, &jmpHashSearch);
     while (jmpHashEntry)
     {
-        result = EmitTclSize(interp, PTR2INT(Tcl_GetHashValue(jmpHashEntry)), '\n', chan);
+        result = EmitTclSize(interp, PTR2SIZE(Tcl_GetHashValue(jmpHashEntry)), '\n', chan);
         if (result != TCL_OK)
         {
             return result;
@@ -4259,112 +8484,383 @@ static int A85EmitChar(Tcl_Interp* interp, int toEmit, A85EncodeContext* ctxPtr)
         return A85Flush(interp, ctxPtr);
     }
 
-    return TCL_OK;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * A85Flush --
+ *
+ *  Flush the encoded buffer.
+ *
+ * Results:
+ *  Returns a Tcl standard result code.
+ *
+ * Side effects:
+ *  Modifies the error result in the interpreter in case of error.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int A85Flush(Tcl_Interp* interp, A85EncodeContext* ctxPtr)
+{
+    Tcl_Size toWrite = ctxPtr->curPtr - ctxPtr->basePtr;
+
+    if (Tcl_Write(ctxPtr->target, ctxPtr->basePtr, toWrite) < 0)
+    {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Tcl_Write: %s", Tcl_PosixError(interp)));
+        return TCL_ERROR;
+    }
+
+    ctxPtr->curPtr = ctxPtr->basePtr;
+
+    if (ctxPtr->separator != '\0')
+    {
+        if (Tcl_Write(ctxPtr->target, &ctxPtr->separator, 1) < 0)
+        {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Tcl_Write: %s", Tcl_PosixError(interp)));
+            return TCL_ERROR;
+        }
+    }
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DisassembleObject --
+ *
+ *  Adds a compiled script and the procedure bodies in its literals to a
+ *  disassembly: to the listing, if one is being built, and to the opcode
+ *  and instruction size histograms.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Updates the DisassemblyInfo.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DisassembleObject(DisassemblyInfo* infoPtr, Tcl_Obj* objPtr, const char* name)
+{
+    Tcl_HashTable visitedTable;
+    Tcl_Obj* namePtr = Tcl_NewStringObj(name, -1);
+
+    Tcl_IncrRefCount(namePtr);
+    Tcl_InitHashTable(&visitedTable, TCL_ONE_WORD_KEYS);
+    DisassembleByteCode(infoPtr, (ByteCode*)objPtr->internalRep.otherValuePtr, "script", namePtr, NULL, &visitedTable);
+    Tcl_DeleteHashTable(&visitedTable);
+    Tcl_DecrRefCount(namePtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DisassembleByteCode --
+ *
+ *  Adds a ByteCode to a disassembly. The listing shows a summary line, the
+ *  local variables of procedure bodies, the literals, exception ranges and
+ *  AuxData items, and the instructions; the ByteCodes found among the
+ *  literals follow. A body shared by several procedures (see
+ *  CloneProcBody) is listed and counted once.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Updates the DisassemblyInfo, and adds the ByteCode to visitedPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DisassembleByteCode(DisassemblyInfo* infoPtr,
+                                ByteCode* codePtr,
+                                const char* kind,
+                                Tcl_Obj* namePtr,
+                                Proc* procPtr,
+                                Tcl_HashTable* visitedPtr)
+{
+    InstructionDesc* opCodesTablePtr = (InstructionDesc*)TclGetInstructionTable();
+    Tcl_Obj* bufPtr = infoPtr->listingPtr;
+    Tcl_Obj *objPtr, *childNamePtr;
+    ExceptionRange* excPtr;
+    CompiledLocal* localPtr;
+    Proc* childProcPtr;
+    ByteCode* childCodePtr;
+    unsigned char *pc, *codeEnd;
+    const char* bytes;
+    Tcl_Size i, length;
+    int isNew, numBytes;
+
+    Tcl_CreateHashEntry(visitedPtr, (char*)codePtr, &isNew);
+
+    if (bufPtr)
+    {
+        Tcl_AppendPrintfToObj(bufPtr, "%s \"%s\"", kind, Tcl_GetString(namePtr));
+        if (!isNew)
+        {
+            Tcl_AppendToObj(bufPtr, ": same body as an earlier procedure\n\n", -1);
+            return;
+        }
+        Tcl_AppendPrintfToObj(bufPtr,
+                              ": %" TCL_SIZE_MODIFIER "d commands, %" TCL_SIZE_MODIFIER "d code bytes, %" TCL_SIZE_MODIFIER
+                              "d literals, %" TCL_SIZE_MODIFIER "d exception ranges, %" TCL_SIZE_MODIFIER
+                              "d aux data, stack depth %" TCL_SIZE_MODIFIER "d\n",
+                              (Tcl_Size)codePtr->numCommands,
+                              (Tcl_Size)codePtr->numCodeBytes,
+                              (Tcl_Size)codePtr->numLitObjects,
+                              (Tcl_Size)codePtr->numExceptRanges,
+                              (Tcl_Size)codePtr->numAuxDataItems,
+                              (Tcl_Size)codePtr->maxStackDepth);
+
+        if (procPtr && procPtr->firstLocalPtr)
+        {
+            Tcl_AppendToObj(bufPtr, "  locals:", -1);
+            for (localPtr = procPtr->firstLocalPtr; localPtr; localPtr = localPtr->nextPtr)
+            {
+                Tcl_AppendPrintfToObj(bufPtr,
+                                      " %%v%" TCL_SIZE_MODIFIER "d %s%s",
+                                      (Tcl_Size)localPtr->frameIndex,
+                                      localPtr->name[0] ? localPtr->name : "(temp)",
+                                      TclIsVarArgument(localPtr) ? " (arg)" : "");
+            }
+            Tcl_AppendToObj(bufPtr, "\n", 1);
+        }
+
+        if (codePtr->numLitObjects > 0)
+        {
+            Tcl_AppendToObj(bufPtr, "  literals:\n", -1);
+            for (i = 0; i < codePtr->numLitObjects; i++)
+            {
+                objPtr = codePtr->objArrayPtr[i];
+                Tcl_AppendPrintfToObj(bufPtr, "    %" TCL_SIZE_MODIFIER "d: ", i);
+                if (objPtr->typePtr == cmpProcBodyType)
+                {
+                    Tcl_AppendToObj(bufPtr, "(procedure body)", -1);
+                }
+                else if (objPtr->typePtr == cmpByteCodeType)
+                {
+                    Tcl_AppendToObj(bufPtr, "(bytecode)", -1);
+                }
+                else
+                {
+                    bytes = Tcl_GetStringFromObj(objPtr, &length);
+                    AppendSource(bufPtr, bytes, length, 60);
+                }
+                Tcl_AppendToObj(bufPtr, "\n", 1);
+            }
+        }
+
+        if (codePtr->numExceptRanges > 0)
+        {
+            Tcl_AppendToObj(bufPtr, "  exception ranges:\n", -1);
+            for (i = 0, excPtr = codePtr->exceptArrayPtr; i < codePtr->numExceptRanges; i++, excPtr++)
+            {
+                Tcl_AppendPrintfToObj(bufPtr,
+                                      "    %" TCL_SIZE_MODIFIER "d: %s level %" TCL_SIZE_MODIFIER "d, pc %" TCL_SIZE_MODIFIER
+                                      "d-%" TCL_SIZE_MODIFIER "d, ",
+                                      i,
+                                      (excPtr->type == LOOP_EXCEPTION_RANGE) ? "loop" : "catch",
+                                      (Tcl_Size)excPtr->nestingLevel,
+                                      (Tcl_Size)excPtr->codeOffset,
+                                      (Tcl_Size)(excPtr->codeOffset + excPtr->numCodeBytes - 1));
+                if (excPtr->type == LOOP_EXCEPTION_RANGE)
+                {
+                    Tcl_AppendPrintfToObj(
+                        bufPtr,
+                        "continue %" TCL_SIZE_MODIFIER "d, break %" TCL_SIZE_MODIFIER "d\n",
+                        (Tcl_Size)excPtr->continueOffset,
+                        (Tcl_Size)excPtr->breakOffset);
+                }
+                else
+                {
+                    Tcl_AppendPrintfToObj(bufPtr, "catch %" TCL_SIZE_MODIFIER "d\n", (Tcl_Size)excPtr->catchOffset);
+                }
+            }
+        }
+
+        if (codePtr->numAuxDataItems > 0)
+        {
+            Tcl_AppendToObj(bufPtr, "  aux data:\n", -1);
+            for (i = 0; i < codePtr->numAuxDataItems; i++)
+            {
+                Tcl_AppendPrintfToObj(bufPtr, "    %" TCL_SIZE_MODIFIER "d: ", i);
+                FormatAuxData(bufPtr, &codePtr->auxDataArrayPtr[i]);
+                Tcl_AppendToObj(bufPtr, "\n", 1);
+            }
+        }
+
+        Tcl_AppendToObj(bufPtr, "  instructions:\n", -1);
+    }
+    else if (!isNew)
+    {
+        return;
+    }
+
+    codeEnd = codePtr->codeStart + codePtr->numCodeBytes;
+    for (pc = codePtr->codeStart; pc < codeEnd; pc += numBytes)
+    {
+        if (bufPtr)
+        {
+            Tcl_AppendToObj(bufPtr, "    ", 4);
+            numBytes = FormatInstruction(codePtr, pc, procPtr, bufPtr);
+        }
+        else
+        {
+            numBytes = opCodesTablePtr[*pc].numBytes;
+        }
+        infoPtr->opCounts[*pc]++;
+        infoPtr->sizeCounts[(numBytes < CMP_MAX_INST_SIZE) ? numBytes : CMP_MAX_INST_SIZE]++;
+    }
+    if (bufPtr)
+    {
+        Tcl_AppendToObj(bufPtr, "\n", 1);
+    }
+
+    /*
+     * Now the nested ByteCodes.
+     */
+
+    for (i = 0; i < codePtr->numLitObjects; i++)
+    {
+        objPtr = codePtr->objArrayPtr[i];
+        if (objPtr->typePtr == cmpProcBodyType)
+        {
+            childProcPtr = (Proc*)objPtr->internalRep.otherValuePtr;
+            childCodePtr = (ByteCode*)childProcPtr->bodyPtr->internalRep.otherValuePtr;
+            childNamePtr = FindProcName(codePtr, i);
+            kind = "proc";
+        }
+        else if (objPtr->typePtr == cmpByteCodeType)
+        {
+            childProcPtr = NULL;
+            childCodePtr = (ByteCode*)objPtr->internalRep.otherValuePtr;
+            childNamePtr = NULL;
+            kind = "script";
+        }
+        else
+        {
+            continue;
+        }
+
+        if (!childNamePtr)
+        {
+            childNamePtr = Tcl_ObjPrintf("literal %" TCL_SIZE_MODIFIER "d of %s", i, Tcl_GetString(namePtr));
+        }
+        Tcl_IncrRefCount(childNamePtr);
+        DisassembleByteCode(infoPtr, childCodePtr, kind, childNamePtr, childProcPtr, visitedPtr);
+        Tcl_DecrRefCount(childNamePtr);
+    }
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * A85Flush --
+ * FormatAuxData --
  *
- *  Flush the encoded buffer.
+ *  Appends a description of an AuxData item to a disassembly listing.
+ *  Jump table targets are shown relative to the jumpTable instruction.
  *
  * Results:
- *  Returns a Tcl standard result code.
+ *  None.
  *
  * Side effects:
- *  Modifies the error result in the interpreter in case of error.
+ *  Appends to bufPtr.
  *
  *----------------------------------------------------------------------
  */
 
-static int A85Flush(Tcl_Interp* interp, A85EncodeContext* ctxPtr)
+static void FormatAuxData(Tcl_Obj* bufPtr, AuxData* auxDataPtr)
 {
-    int toWrite = ctxPtr->curPtr - ctxPtr->basePtr;
+    Tcl_HashSearch search;
+    Tcl_HashEntry* entryPtr;
+    const char* key;
+    Tcl_Size i, j;
 
-    if (Tcl_Write(ctxPtr->target, ctxPtr->basePtr, toWrite) < 0)
+    if (auxDataPtr->type == cmpJumptableInfoType)
     {
-        Tcl_SetObjResult(interp, Tcl_ObjPrintf("Tcl_Write: %s", Tcl_PosixError(interp)));
-        return TCL_ERROR;
-    }
-
-    ctxPtr->curPtr = ctxPtr->basePtr;
+        JumptableInfo* infoPtr = (JumptableInfo*)auxDataPtr->clientData;
 
-    if (ctxPtr->separator != '\0')
-    {
-        if (Tcl_Write(ctxPtr->target, &ctxPtr->separator, 1) < 0)
+        Tcl_AppendToObj(bufPtr, "jump table", -1);
+        for (entryPtr = Tcl_FirstHashEntry(&infoPtr->hashTable, &search); entryPtr; entryPtr = Tcl_NextHashEntry(&search))
         {
-            Tcl_SetObjResult(interp, Tcl_ObjPrintf("Tcl_Write: %s", Tcl_PosixError(interp)));
-            return TCL_ERROR;
+            key = (const char*)Tcl_GetHashKey(&infoPtr->hashTable, entryPtr);
+            Tcl_AppendToObj(bufPtr, " ", 1);
+            AppendSource(bufPtr, key, strlen(key), 20);
+            Tcl_AppendPrintfToObj(bufPtr, " %+" TCL_SIZE_MODIFIER "d", PTR2SIZE(Tcl_GetHashValue(entryPtr)));
         }
     }
-
-    return TCL_OK;
-}
-
-#ifdef DEBUG_REWRITE
-/*
- * Snarfed from tclCompile.c and modified for our environment.
- * Prints directly to stderr.
- */
-static void PrintSource(const char* stringPtr, int maxChars)
-{
-    const char* p;
-    int i = 0;
-
-    if (stringPtr == NULL)
+    else if (auxDataPtr->type == cmpNewForeachInfoType)
     {
-        fprintf(stderr, "%s", "\"\"");
-        return;
-    }
+        ForeachInfo* infoPtr = (ForeachInfo*)auxDataPtr->clientData;
 
-    fprintf(stderr, "%s", "\"");
-    p = stringPtr;
-    for (; (*p != '\0') && (i < maxChars); p++, i++)
+        Tcl_AppendToObj(bufPtr, "foreach vars", -1);
+        for (i = 0; i < infoPtr->numLists; i++)
+        {
+            Tcl_AppendToObj(bufPtr, " {", 2);
+            for (j = 0; j < infoPtr->varLists[i]->numVars; j++)
+            {
+                Tcl_AppendPrintfToObj(
+                    bufPtr, "%s%%v%" TCL_SIZE_MODIFIER "d", j ? " " : "", (Tcl_Size)infoPtr->varLists[i]->varIndexes[j]);
+            }
+            Tcl_AppendToObj(bufPtr, "}", 1);
+        }
+    }
+    else if (auxDataPtr->type == cmpDictUpdateInfoType)
     {
-        switch (*p)
+        DictUpdateInfo* infoPtr = (DictUpdateInfo*)auxDataPtr->clientData;
+
+        Tcl_AppendToObj(bufPtr, "dict update vars {", -1);
+        for (i = 0; i < infoPtr->length; i++)
         {
-            case '"':
-                fprintf(stderr, "%s", "\\\"");
-                continue;
-            case '\f':
-                fprintf(stderr, "%s", "\\f");
-                continue;
-            case '\n':
-                fprintf(stderr, "%s", "\\n");
-                continue;
-            case '\r':
-                fprintf(stderr, "%s", "\\r");
-                continue;
-            case '\t':
-                fprintf(stderr, "%s", "\\t");
-                continue;
-            case '\v':
-                fprintf(stderr, "%s", "\\v");
-                continue;
-            default:
-                fprintf(stderr, "%c", *p);
-                continue;
+            Tcl_AppendPrintfToObj(bufPtr, "%s%%v%" TCL_SIZE_MODIFIER "d", i ? " " : "", (Tcl_Size)infoPtr->varIndices[i]);
         }
+        Tcl_AppendToObj(bufPtr, "}", 1);
+    }
+    else
+    {
+        Tcl_AppendToObj(bufPtr, auxDataPtr->type->name, -1);
     }
-    fprintf(stderr, "%s", "\"");
 }
 
-static void FormatInstruction(CompileEnv* compEnvPtr, unsigned char* pc)
+/*
+ *----------------------------------------------------------------------
+ *
+ * FormatInstruction --
+ *
+ *  Appends the disassembly of the instruction at pc to a listing, in the
+ *  format of the core disassembler: the offset, the instruction name and
+ *  the operands, followed by a comment with the pushed literal, the
+ *  variable name or the jump target.
+ *  Snarfed from tclCompile.c and modified for our environment.
+ *
+ * Results:
+ *  Returns the length of the instruction in bytes.
+ *
+ * Side effects:
+ *  Appends to bufPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int FormatInstruction(ByteCode* codePtr, unsigned char* pc, Proc* procPtr, Tcl_Obj* bufPtr)
 {
     unsigned char opCode = *pc;
     InstructionDesc* opCodesTablePtr = (InstructionDesc*)TclGetInstructionTable();
     InstructionDesc* instDesc = &opCodesTablePtr[opCode];
-    unsigned char* codeStart = compEnvPtr->codeStart;
-    unsigned pcOffset = pc - codeStart;
+    unsigned pcOffset = pc - codePtr->codeStart;
     int opnd = 0, i, numBytes = 1;
     char suffixBuffer[128]; /* Additional info to print after main opcode
                              * and immediates. */
-    char* suffixSrc = NULL;
+    const char* varName = NULL;
     Tcl_Obj* suffixObj = NULL;
 
     suffixBuffer[0] = '\0';
-    fprintf(stderr, "(%u) %s ", pcOffset, instDesc->name);
+    Tcl_AppendPrintfToObj(bufPtr, "(%u) %s", pcOffset, instDesc->name);
     for (i = 0; i < instDesc->numOperands; i++)
     {
         switch (instDesc->opTypes[i])
@@ -4372,62 +8868,78 @@ static void FormatInstruction(CompileEnv* compEnvPtr, unsigned char* pc)
             case OPERAND_INT1:
                 opnd = TclGetInt1AtPtr(pc + numBytes);
                 numBytes++;
-                if (opCode == INST_JUMP1 || opCode == INST_JUMP_TRUE1 || opCode == INST_JUMP_FALSE1)
-                {
-                    sprintf(suffixBuffer, "pc %u", pcOffset + opnd);
-                }
-                fprintf(stderr, "%+d ", opnd);
+                Tcl_AppendPrintfToObj(bufPtr, " %+d", opnd);
                 break;
             case OPERAND_INT4:
                 opnd = TclGetInt4AtPtr(pc + numBytes);
                 numBytes += 4;
-                if (opCode == INST_JUMP4 || opCode == INST_JUMP_TRUE4 || opCode == INST_JUMP_FALSE4)
-                {
-                    sprintf(suffixBuffer, "pc %u", pcOffset + opnd);
-                }
-                else if (opCode == INST_START_CMD)
-                {
-                    sprintf(suffixBuffer, "next cmd at pc %u", pcOffset + opnd);
-                }
-                fprintf(stderr, "%+d ", opnd);
+                Tcl_AppendPrintfToObj(bufPtr, " %+d", opnd);
                 break;
             case OPERAND_UINT1:
                 opnd = TclGetUInt1AtPtr(pc + numBytes);
                 numBytes++;
-                if (opCode == INST_PUSH1)
-                {
-                    suffixObj = compEnvPtr->literalArrayPtr[opnd].objPtr;
-                }
-                fprintf(stderr, "%u ", (unsigned)opnd);
+                Tcl_AppendPrintfToObj(bufPtr, " %u", (unsigned)opnd);
                 break;
-            case OPERAND_AUX4:
             case OPERAND_UINT4:
                 opnd = TclGetUInt4AtPtr(pc + numBytes);
                 numBytes += 4;
-                if (opCode == INST_PUSH4)
+                if (opCode == INST_START_CMD && opnd != 1)
+                {
+                    sprintf(suffixBuffer + strlen(suffixBuffer), ", %u cmds start here", opnd);
+                }
+                Tcl_AppendPrintfToObj(bufPtr, " %u", (unsigned)opnd);
+                break;
+            case OPERAND_OFFSET1:
+                opnd = TclGetInt1AtPtr(pc + numBytes);
+                numBytes++;
+                sprintf(suffixBuffer, "pc %u", pcOffset + opnd);
+                Tcl_AppendPrintfToObj(bufPtr, " %+d", opnd);
+                break;
+            case OPERAND_OFFSET4:
+                opnd = TclGetInt4AtPtr(pc + numBytes);
+                numBytes += 4;
+                if (opCode == INST_START_CMD)
                 {
-                    suffixObj = compEnvPtr->literalArrayPtr[opnd].objPtr;
+                    sprintf(suffixBuffer, "next cmd at pc %u", pcOffset + opnd);
                 }
-                else if (opCode == INST_START_CMD && opnd != 1)
+                else
                 {
-                    sprintf(suffixBuffer + strlen(suffixBuffer), ", %u cmds start here", opnd);
+                    sprintf(suffixBuffer, "pc %u", pcOffset + opnd);
                 }
-                fprintf(stderr, "%u ", (unsigned)opnd);
+                Tcl_AppendPrintfToObj(bufPtr, " %+d", opnd);
+                break;
+            case OPERAND_LIT1:
+                opnd = TclGetUInt1AtPtr(pc + numBytes);
+                numBytes++;
+                suffixObj = codePtr->objArrayPtr[opnd];
+                Tcl_AppendPrintfToObj(bufPtr, " %u", (unsigned)opnd);
+                break;
+            case OPERAND_LIT4:
+                opnd = TclGetUInt4AtPtr(pc + numBytes);
+                numBytes += 4;
+                suffixObj = codePtr->objArrayPtr[opnd];
+                Tcl_AppendPrintfToObj(bufPtr, " %u", (unsigned)opnd);
+                break;
+            case OPERAND_AUX4:
+                opnd = TclGetUInt4AtPtr(pc + numBytes);
+                numBytes += 4;
+                Tcl_AppendPrintfToObj(bufPtr, " %u", (unsigned)opnd);
+                sprintf(suffixBuffer, "aux data %u", (unsigned)opnd);
                 break;
             case OPERAND_IDX4:
                 opnd = TclGetInt4AtPtr(pc + numBytes);
                 numBytes += 4;
                 if (opnd >= -1)
                 {
-                    fprintf(stderr, "%d ", opnd);
+                    Tcl_AppendPrintfToObj(bufPtr, " %d", opnd);
                 }
                 else if (opnd == -2)
                 {
-                    fprintf(stderr, "end ");
+                    Tcl_AppendToObj(bufPtr, " end", -1);
                 }
                 else
                 {
-                    fprintf(stderr, "end-%d ", -2 - opnd);
+                    Tcl_AppendPrintfToObj(bufPtr, " end-%d", -2 - opnd);
                 }
                 break;
             case OPERAND_LVT1:
@@ -4438,7 +8950,13 @@ static void FormatInstruction(CompileEnv* compEnvPtr, unsigned char* pc)
                 opnd = TclGetUInt4AtPtr(pc + numBytes);
                 numBytes += 4;
             printLVTindex:
-                fprintf(stderr, "%%v%u ", (unsigned)opnd);
+                Tcl_AppendPrintfToObj(bufPtr, " %%v%u", (unsigned)opnd);
+                varName = LocalVarName(procPtr, opnd);
+                break;
+            case OPERAND_SCLS1:
+                opnd = TclGetUInt1AtPtr(pc + numBytes);
+                numBytes++;
+                Tcl_AppendPrintfToObj(bufPtr, " %u", (unsigned)opnd);
                 break;
             case OPERAND_NONE:
             default:
@@ -4447,25 +8965,240 @@ static void FormatInstruction(CompileEnv* compEnvPtr, unsigned char* pc)
     }
     if (suffixObj)
     {
-        char* bytes;
+        const char* bytes;
         Tcl_Size length;
 
-        fprintf(stderr, "\t# ");
-        bytes = Tcl_GetStringFromObj(compEnvPtr->literalArrayPtr[opnd].objPtr, &length);
-
-        PrintSource(bytes, (length < 40 ? length : 40));
+        Tcl_AppendToObj(bufPtr, "\t# ", -1);
+        if (suffixObj->typePtr == cmpProcBodyType)
+        {
+            Tcl_AppendToObj(bufPtr, "(procedure body)", -1);
+        }
+        else if (suffixObj->typePtr == cmpByteCodeType)
+        {
+            Tcl_AppendToObj(bufPtr, "(bytecode)", -1);
+        }
+        else
+        {
+            bytes = Tcl_GetStringFromObj(suffixObj, &length);
+            AppendSource(bufPtr, bytes, length, 40);
+        }
+    }
+    else if (varName)
+    {
+        Tcl_AppendPrintfToObj(bufPtr, "\t# var \"%s\"", varName);
     }
     else if (suffixBuffer[0])
     {
-        fprintf(stderr, "\t# %s", suffixBuffer);
-        if (suffixSrc)
+        Tcl_AppendPrintfToObj(bufPtr, "\t# %s", suffixBuffer);
+    }
+    Tcl_AppendToObj(bufPtr, "\n", 1);
+
+    return instDesc->numBytes;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LocalVarName --
+ *
+ *  Returns the name of the local variable in the given frame slot of a
+ *  procedure.
+ *
+ * Results:
+ *  The name, or NULL if there is no procedure or the variable is a
+ *  temporary.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char* LocalVarName(Proc* procPtr, int index)
+{
+    CompiledLocal* localPtr;
+
+    if (!procPtr)
+    {
+        return NULL;
+    }
+    for (localPtr = procPtr->firstLocalPtr; localPtr; localPtr = localPtr->nextPtr)
+    {
+        if (localPtr->frameIndex == index)
         {
-            PrintSource(suffixSrc, 40);
+            return localPtr->name[0] ? localPtr->name : NULL;
         }
     }
-    fprintf(stderr, "\n");
+    return NULL;
 }
-#endif
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendSource --
+ *
+ *  Appends a string to a disassembly listing in double quotes, with the
+ *  special characters escaped. Strings longer than maxChars characters
+ *  are truncated and followed by "...".
+ *  Snarfed from tclCompile.c and modified for our environment.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Appends to bufPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void AppendSource(Tcl_Obj* bufPtr, const char* stringPtr, Tcl_Size length, int maxChars)
+{
+    const char* p;
+    Tcl_Size i;
+
+    Tcl_AppendToObj(bufPtr, "\"", 1);
+    for (p = stringPtr, i = 0; (i < length) && (i < maxChars); p++, i++)
+    {
+        switch (*p)
+        {
+            case '"':
+                Tcl_AppendToObj(bufPtr, "\\\"", 2);
+                continue;
+            case '\f':
+                Tcl_AppendToObj(bufPtr, "\\f", 2);
+                continue;
+            case '\n':
+                Tcl_AppendToObj(bufPtr, "\\n", 2);
+                continue;
+            case '\r':
+                Tcl_AppendToObj(bufPtr, "\\r", 2);
+                continue;
+            case '\t':
+                Tcl_AppendToObj(bufPtr, "\\t", 2);
+                continue;
+            case '\v':
+                Tcl_AppendToObj(bufPtr, "\\v", 2);
+                continue;
+            default:
+                Tcl_AppendToObj(bufPtr, p, 1);
+                continue;
+        }
+    }
+    Tcl_AppendToObj(bufPtr, (i < length) ? "\"..." : "\"", -1);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompareOpcodeCounts --
+ *
+ *  The qsort comparison function used by Compiler_DisassembleObjCmd to
+ *  sort the opcode histogram by decreasing count.
+ *
+ * Results:
+ *  Negative, zero or positive, as required by qsort.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int CompareOpcodeCounts(const void* first, const void* second)
+{
+    const OpcodeCount* firstPtr = (const OpcodeCount*)first;
+    const OpcodeCount* secondPtr = (const OpcodeCount*)second;
+
+    if (firstPtr->count != secondPtr->count)
+    {
+        return (firstPtr->count > secondPtr->count) ? -1 : 1;
+    }
+    return firstPtr->opCode - secondPtr->opCode;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompareProcSites --
+ *
+ *  The qsort comparison function used by ReportProcDefinitions to sort the
+ *  procedure definitions by source offset.
+ *
+ * Results:
+ *  Negative, zero or positive, as required by qsort.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int CompareProcSites(const void* first, const void* second)
+{
+    const ProcSite* firstPtr = *(const ProcSite* const*)first;
+    const ProcSite* secondPtr = *(const ProcSite* const*)second;
+
+    return (firstPtr->offset < secondPtr->offset) ? -1 : (firstPtr->offset > secondPtr->offset);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompareRelayoutPrefixes --
+ *
+ *  qsort comparison function for RelayoutPrefix structs: orders by
+ *  increasing offset, then by increasing start.
+ *
+ * Results:
+ *  Returns a negative, zero, or positive value.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int CompareRelayoutPrefixes(const void* first, const void* second)
+{
+    const RelayoutPrefix* firstPtr = (const RelayoutPrefix*)first;
+    const RelayoutPrefix* secondPtr = (const RelayoutPrefix*)second;
+
+    if (firstPtr->offset != secondPtr->offset)
+    {
+        return (firstPtr->offset < secondPtr->offset) ? -1 : 1;
+    }
+    return (firstPtr->start < secondPtr->start) ? -1 : (firstPtr->start > secondPtr->start);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompareCostRanks --
+ *
+ *  The qsort comparison function used by Compiler_StatsObjCmd to sort the
+ *  compiled units by decreasing cost, then in compilation order.
+ *
+ * Results:
+ *  Negative, zero or positive, as required by qsort.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int CompareCostRanks(const void* first, const void* second)
+{
+    const CostRank* firstPtr = (const CostRank*)first;
+    const CostRank* secondPtr = (const CostRank*)second;
+
+    if (firstPtr->key != secondPtr->key)
+    {
+        return (firstPtr->key > secondPtr->key) ? -1 : 1;
+    }
+    return (firstPtr->index < secondPtr->index) ? -1 : (firstPtr->index > secondPtr->index);
+}
+
 /*
  * Local Variables:
  * mode: c
@@ -37,10 +37,17 @@
 #define TCL_STORAGE_CLASS DLLIMPORT
 #endif
 
+EXTERN Tcl_ObjCmdProc Compiler_AnalyzeObjCmd;
+EXTERN Tcl_ObjCmdProc Compiler_BcevalObjCmd;
 EXTERN Tcl_ObjCmdProc Compiler_CompileObjCmd;
 EXTERN int Compiler_CompileFile(Tcl_Interp* interp, char* inFilePtr, char* outFilePtr, char* preamblePtr);
 EXTERN int Compiler_CompileObj(Tcl_Interp* interp, Tcl_Obj* objPtr);
+EXTERN Tcl_ObjCmdProc Compiler_DecodeObjCmd;
+EXTERN Tcl_ObjCmdProc Compiler_DisassembleObjCmd;
 EXTERN Tcl_ObjCmdProc Compiler_GetBytecodeExtensionObjCmd;
+EXTERN Tcl_ObjCmdProc Compiler_ServeObjCmd;
+EXTERN Tcl_ObjCmdProc Compiler_StatsObjCmd;
+EXTERN Tcl_ObjCmdProc Compiler_VerifyObjCmd;
 
 EXTERN const char* CompilerGetPackageName(void);
 EXTERN int Compiler_Init(Tcl_Interp* interp);